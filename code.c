@@ -1,5 +1,5 @@
 /*
- * rag_simulator.c
+ * code.c
  *
  * Graphical Simulator for Resource Allocation Graphs (RAG)
  * CLI-based, C (GCC) on Ubuntu
@@ -12,41 +12,134 @@
  *  - Detect deadlocks: Build Wait-For Graph (P -> P) and find cycles
  *    If cycle found, prints the process-cycle and reconstructs the
  *    R->P edges that create the waits (P -> R -> P ...)
+ *  - No fixed limits: processes, resources and edges live in growable
+ *    per-node adjacency lists, so memory scales with the edge count
+ *    drawn from per-graph size-class pools with free lists
+ *  - Online detection: each new wait edge is checked against an incrementally
+ *    maintained topological order (Pearce-Kelly) as soon as it is added
+ *  - Dense engine: bit-packed req/alloc/WFG rows with word-parallel
+ *    (AVX2/NEON when available) row ORs and ctz neighbour scans
+ *  - SCC engine: iterative Tarjan reports every deadlocked process set at once
+ *    and, after one full pass, re-searches only the dirty region
+ *  - Small-graph kernel: up to 64 processes, one machine word per WFG row;
+ *    bit-parallel Kosaraju (AND + ctz neighbour scans), picked automatically
+ *  - Binary snapshots: versioned CSR file, loaded by mmap without copying
+ *  - Parallel SCC engine: forward-backward with trimming on a
+ *    work-stealing thread pool
+ *  - Locality renumbering: reverse Cuthill-McKee layout of processes and
+ *    resources, rebuilt so adjacency blocks follow traversal order
+ *  - Sharded SCC engine: per-shard Tarjan, then a coordinator over the
+ *    condensed graph of cross-shard edges (distributed detection model)
+ *  - Multi-instance resources (pools) with Available/Allocation/Request
+ *    matrix reduction driven by a worklist
+ *  - Live monitor API: application threads post request/acquire/release
+ *    events into per-thread lock-free rings; a detector thread applies
+ *    them in batches and re-runs detection
+ *  - Detection scheduler: every N ms or K mutations, skipped while the
+ *    graph epoch is unchanged
+ *  - Avoidance mode: a request or grant that would close a wait cycle is
+ *    refused, checked against the incremental topological order and a
+ *    GRAIL-style interval index that rules out most non-reachable pairs
+ *  - Deadlock resolution: greedily preempts low-cost victims (units held,
+ *    priority, age) until no wait cycle is left, then re-searches only
+ *    the broken sets
+ *  - Metrics: per-thread counters and rdtsc timers around build_wfg, DFS,
+ *    detection and ingestion, exported as Prometheus text or JSON lines
+ *  - Trace replay: streams JSONL or compact binary lock-event logs through
+ *    a fixed read window, running detection at periodic checkpoints
+ *  - Simulation: discrete-event runs of per-process lock/hold/unlock
+ *    scripts with random hold times, checked inline (detect or avoid),
+ *    repeated to estimate how often a fixed lock order deadlocks
+ *  - Embeddable library: the graph and its engines live in rag.c behind
+ *    rag.h (opaque handle, no console I/O); this file is the CLI on top
+ *    and uses nothing but rag.h
+ *  - Version history: copy-on-write versions of the graph for post-mortems,
+ *    checked out by number or time stamp and bisected for the first deadlock
+ *  - Structured output: the graph and deadlock reports as JSON, CSV, DOT
+ *    or a one-line summary, written through a large buffer
+ *  - Lock-order analysis: lockdep-style order graph over resources that
+ *    reports order inversions (potential deadlocks) before any cycle forms
  *
  * Compile:
- *   gcc -std=c11 -O2 -Wall -Wextra rag_simulator.c -o rag
+ *   gcc -std=c11 -O2 -Wall -Wextra -pthread rag.c code.c -o rag
+ *   (add -march=native or -mavx2 to vectorise the dense engine)
  *
  * Run:
- *   ./rag
+ *   ./rag                 interactive menu
+ *   ./rag -b script.txt   batch mode (see "Batch / script mode" below)
+ *   ./rag --bench         synthetic scaling benchmarks (see "Benchmark harness")
+ *   ./rag --replay t.jsonl 10000   replay a lock trace (see "Trace replay")
+ *   ./rag --replay t.jsonl 0 --history   ... and bisect for the first deadlock
+ *   ./rag --sim s.txt 100000   deadlock rate under random hold times (see "Discrete-event simulation")
  *
  * Author: Rojer Hein (and team)
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <stdint.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "rag.h"
+
+/* ---- The CLI's graph ---- */
+static rag_graph *G;
+
+static void avoid_print_refusal(const rag_graph *g, const char *what, int p, int r);
 
-#define MAX_PROC 20
-#define MAX_RES  20
-#define NAMELEN  32
+/* The library reports running out of memory as RAG_ENOMEM and refuses
+   the graph from then on; the CLI gives up, as it always has */
+static void check_memory(const rag_graph *g) {
+    if (rag_error(g) != RAG_ENOMEM) return;
+    fprintf(stderr, "Out of memory.\n");
+    exit(1);
+}
+
+static void *xrealloc(void *ptr, size_t sz) {
+    void *p = realloc(ptr, sz ? sz : 1);
+    if (p == NULL) {
+        fprintf(stderr, "Out of memory (%zu bytes).\n", sz);
+        exit(1);
+    }
+    return p;
+}
 
-/* ---- Data model ---- */
-int n_proc = 0;
-int n_res = 0;
+/* A growable int array (trace ids, script steps per process) */
+struct int_vec {
+    int *v;
+    int n;
+    int cap;
+};
 
-/* req[p][r] == 1 means Process p requests Resource r (P -> R) */
-int req[MAX_PROC][MAX_RES];
-/* alloc[r][p] == 1 means Resource r is allocated to Process p (R -> P) */
-int alloc_[MAX_RES][MAX_PROC];
+static void vec_push(struct int_vec *l, int x) {
+    if (l->n == l->cap) {
+        l->cap = l->cap ? l->cap * 2 : 16;
+        l->v = xrealloc(l->v, (size_t)l->cap * sizeof(int));
+    }
+    l->v[l->n++] = x;
+}
 
-/* Names */
-char P[MAX_PROC][NAMELEN];
-char R[MAX_RES][NAMELEN];
+static void vec_free(struct int_vec *l) {
+    free(l->v);
+    memset(l, 0, sizeof(*l));
+}
 
-/* Wait-For Graph: wfg[p1][p2] == 1 means p1 waits for p2 */
-int wfg[MAX_PROC][MAX_PROC];
+static uint64_t rng_next(uint64_t *s) {
+    /* xorshift64* */
+    uint64_t x = *s;
+    x ^= x >> 12; x ^= x << 25; x ^= x >> 27;
+    *s = x;
+    return x * 2685821657736338717ULL;
+}
 
-/* ---- Utility ---- */
+/* ---- Console input ---- */
 static void flush_stdin(void) {
     int c;
     while ((c = getchar()) != '\n' && c != EOF) { /* discard */ }
@@ -81,123 +174,515 @@ static void read_string(const char *prompt, char *buf, size_t bufsz) {
     if (nl) *nl = '\0';
 }
 
-/* ---- Core operations ---- */
-void add_process(void) {
-    if (n_proc >= MAX_PROC) {
-        printf("Max processes reached (%d).\n", MAX_PROC);
-        return;
+/* ---- Metrics export ---- */
+/* Periodic JSON export (rag_metrics_json), driven by metrics_tick from
+   the batch loop and trace replay */
+static struct metrics_export {
+    FILE *f;            /* NULL: off */
+    int period_ms;
+    double last_ms;
+} mexp;
+
+static void metrics_every(FILE *f, int period_ms) {
+    if (mexp.f != NULL && mexp.f != stdout && mexp.f != f) fclose(mexp.f);
+    mexp.f = f;
+    mexp.period_ms = period_ms;
+    mexp.last_ms = 0;
+}
+
+static void metrics_tick(const rag_graph *g) {
+    if (mexp.f == NULL) return;
+    double now = rag_now_ms();
+    if (now - mexp.last_ms < mexp.period_ms) return;
+    mexp.last_ms = now;
+    rag_metrics_json(mexp.f, g);
+}
+
+/* ---- Buffered output ----
+   A printf per edge spends most of its time parsing the format string,
+   so dumping a graph with millions of edges was bound by the formatting
+   and not by the disk. The writers below append to one large buffer,
+   format integers by hand two digits at a time, and pass the buffer to
+   stdio in 1 MB pieces. A report starts with out_begin and ends with
+   out_end, which flushes, so it interleaves correctly with plain printf
+   output on the same stream. There is only one buffer, so only one thread
+   may write a report at a time.
+*/
+#define OUT_BUFSZ (1 << 20)
+
+struct out_buf {
+    FILE *f;
+    size_t len;
+    char buf[OUT_BUFSZ];
+};
+
+static struct out_buf out_main;
+
+static struct out_buf *out_begin(FILE *f) {
+    out_main.f = f;
+    out_main.len = 0;
+    return &out_main;
+}
+
+static void out_flush(struct out_buf *o) {
+    if (o->len) fwrite(o->buf, 1, o->len, o->f);
+    o->len = 0;
+}
+
+static void out_end(struct out_buf *o) { out_flush(o); }
+
+static void out_mem(struct out_buf *o, const char *s, size_t n) {
+    if (o->len + n > OUT_BUFSZ) {
+        out_flush(o);
+        if (n > OUT_BUFSZ) { fwrite(s, 1, n, o->f); return; }
+    }
+    memcpy(o->buf + o->len, s, n);
+    o->len += n;
+}
+
+static void out_str(struct out_buf *o, const char *s) { out_mem(o, s, strlen(s)); }
+
+static void out_ch(struct out_buf *o, char c) {
+    if (o->len == OUT_BUFSZ) out_flush(o);
+    o->buf[o->len++] = c;
+}
+
+static const char out_digits[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+/* Decimal v: two digits per division, written back to front */
+static void out_int(struct out_buf *o, long long v) {
+    char tmp[24], *end = tmp + sizeof(tmp), *s = end;
+    unsigned long long u = v < 0 ? 0 - (unsigned long long)v : (unsigned long long)v;
+    while (u >= 100) {
+        const char *d = out_digits + 2 * (u % 100);
+        u /= 100;
+        s -= 2;
+        s[0] = d[0];
+        s[1] = d[1];
+    }
+    if (u >= 10) {
+        s -= 2;
+        s[0] = out_digits[2 * u];
+        s[1] = out_digits[2 * u + 1];
+    } else *--s = (char)('0' + u);
+    if (v < 0) *--s = '-';
+    out_mem(o, s, (size_t)(end - s));
+}
+
+/* s with quotes, backslashes and control characters escaped, as JSON and
+   DOT quoted strings both read them */
+static void out_escaped(struct out_buf *o, const char *s) {
+    for (; *s; ++s) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') { out_ch(o, '\\'); out_ch(o, (char)c); }
+        else if (c < 0x20) {
+            out_str(o, "\\u00");
+            out_ch(o, "0123456789abcdef"[c >> 4]);
+            out_ch(o, "0123456789abcdef"[c & 15]);
+        } else out_ch(o, (char)c);
+    }
+}
+
+static void out_json(struct out_buf *o, const char *s) {
+    out_ch(o, '"');
+    out_escaped(o, s);
+    out_ch(o, '"');
+}
+
+/* A CSV field: quoted (quotes doubled) only if it needs to be */
+static void out_csv(struct out_buf *o, const char *s) {
+    if (strpbrk(s, ",\"\r\n") == NULL) { out_str(o, s); return; }
+    out_ch(o, '"');
+    for (; *s; ++s) {
+        if (*s == '"') out_ch(o, '"');
+        out_ch(o, *s);
+    }
+    out_ch(o, '"');
+}
+
+/* Report formats for "show" and "detect" (batch "format", --format).
+   Text is the human-readable layout; json is one object per report on
+   one line; csv is one row per node or edge under a header; dot is a
+   Graphviz digraph; summary prints only the counts and skips per-edge
+   output entirely. */
+enum out_format { OUT_TEXT, OUT_JSON, OUT_CSV, OUT_DOT, OUT_SUMMARY, OUT_FORMATS };
+
+static const char *const out_format_names[OUT_FORMATS] = { "text", "json", "csv", "dot", "summary" };
+
+static int out_format = OUT_TEXT;
+
+static int out_format_parse(const char *s) {
+    for (int i = 0; i < OUT_FORMATS; ++i) {
+        if (!strcmp(s, out_format_names[i])) return i;
+    }
+    return -1;
+}
+
+/* The graph in format fmt: every node, request edge and allocation edge */
+static void graph_dump(FILE *f, const rag_graph *g, int fmt) {
+    struct out_buf *o = out_begin(f);
+    struct rag_counts c;
+    rag_counts(g, &c);
+    const int *res, *units, *procs;
+    if (fmt == OUT_SUMMARY) {
+        out_str(o, "graph: ");
+        out_int(o, c.processes);
+        out_str(o, " process(es), ");
+        out_int(o, c.resources);
+        out_str(o, " resource(s), ");
+        out_int(o, c.requests);
+        out_str(o, " request edge(s), ");
+        out_int(o, c.allocations);
+        out_str(o, " allocation edge(s)\n");
+    } else if (fmt == OUT_JSON) {
+        out_str(o, "{\"processes\":[");
+        for (int p = 0; p < c.processes; ++p) {
+            out_str(o, p ? ",{\"id\":" : "{\"id\":");
+            out_int(o, p);
+            out_str(o, ",\"name\":");
+            out_json(o, rag_process_name(g, p));
+            out_ch(o, '}');
+        }
+        out_str(o, "],\"resources\":[");
+        for (int r = 0; r < c.resources; ++r) {
+            out_str(o, r ? ",{\"id\":" : "{\"id\":");
+            out_int(o, r);
+            out_str(o, ",\"name\":");
+            out_json(o, rag_resource_name(g, r));
+            out_str(o, ",\"units\":");
+            out_int(o, rag_units(g, r));
+            out_str(o, ",\"in_use\":");
+            out_int(o, rag_in_use(g, r));
+            out_ch(o, '}');
+        }
+        out_str(o, "],\"requests\":[");
+        int any = 0;
+        for (int p = 0; p < c.processes; ++p) {
+            int n = rag_requests(g, p, &res, &units);
+            for (int i = 0; i < n; ++i) {
+                out_str(o, any++ ? ",{\"process\":" : "{\"process\":");
+                out_int(o, p);
+                out_str(o, ",\"resource\":");
+                out_int(o, res[i]);
+                out_str(o, ",\"units\":");
+                out_int(o, units[i]);
+                out_ch(o, '}');
+            }
+        }
+        out_str(o, "],\"allocations\":[");
+        any = 0;
+        for (int p = 0; p < c.processes; ++p) {
+            int n = rag_holdings(g, p, &res, &units);
+            for (int i = 0; i < n; ++i) {
+                out_str(o, any++ ? ",{\"resource\":" : "{\"resource\":");
+                out_int(o, res[i]);
+                out_str(o, ",\"process\":");
+                out_int(o, p);
+                out_str(o, ",\"units\":");
+                out_int(o, units[i]);
+                out_ch(o, '}');
+            }
+        }
+        out_str(o, "]}\n");
+    } else if (fmt == OUT_CSV) {
+        out_str(o, "kind,from,to,units\n");
+        for (int p = 0; p < c.processes; ++p) {
+            out_str(o, "process,");
+            out_csv(o, rag_process_name(g, p));
+            out_str(o, ",,\n");
+        }
+        for (int r = 0; r < c.resources; ++r) {
+            out_str(o, "resource,");
+            out_csv(o, rag_resource_name(g, r));
+            out_str(o, ",,");
+            out_int(o, rag_units(g, r));
+            out_ch(o, '\n');
+        }
+        for (int p = 0; p < c.processes; ++p) {
+            int n = rag_requests(g, p, &res, &units);
+            for (int i = 0; i < n; ++i) {
+                out_str(o, "request,");
+                out_csv(o, rag_process_name(g, p));
+                out_ch(o, ',');
+                out_csv(o, rag_resource_name(g, res[i]));
+                out_ch(o, ',');
+                out_int(o, units[i]);
+                out_ch(o, '\n');
+            }
+        }
+        for (int p = 0; p < c.processes; ++p) {
+            int n = rag_holdings(g, p, &res, &units);
+            for (int i = 0; i < n; ++i) {
+                out_str(o, "allocation,");
+                out_csv(o, rag_resource_name(g, res[i]));
+                out_ch(o, ',');
+                out_csv(o, rag_process_name(g, p));
+                out_ch(o, ',');
+                out_int(o, units[i]);
+                out_ch(o, '\n');
+            }
+        }
+    } else if (fmt == OUT_DOT) {
+        /* nodes by index (process and resource names may collide), named by label;
+           requests dashed, unit counts above one as edge labels */
+        out_str(o, "digraph rag {\n");
+        for (int p = 0; p < c.processes; ++p) {
+            out_str(o, "  P");
+            out_int(o, p);
+            out_str(o, " [label=");
+            out_json(o, rag_process_name(g, p));
+            out_str(o, "];\n");
+        }
+        for (int r = 0; r < c.resources; ++r) {
+            out_str(o, "  R");
+            out_int(o, r);
+            out_str(o, " [shape=box, label=\"");
+            out_escaped(o, rag_resource_name(g, r));
+            if (rag_units(g, r) > 1) {
+                out_str(o, " (");
+                out_int(o, rag_units(g, r));
+                out_ch(o, ')');
+            }
+            out_str(o, "\"];\n");
+        }
+        for (int p = 0; p < c.processes; ++p) {
+            int n = rag_requests(g, p, &res, &units);
+            for (int i = 0; i < n; ++i) {
+                out_str(o, "  P");
+                out_int(o, p);
+                out_str(o, " -> R");
+                out_int(o, res[i]);
+                out_str(o, " [style=dashed");
+                if (units[i] > 1) {
+                    out_str(o, ", label=");
+                    out_int(o, units[i]);
+                }
+                out_str(o, "];\n");
+            }
+            n = rag_holdings(g, p, &res, &units);
+            for (int i = 0; i < n; ++i) {
+                out_str(o, "  R");
+                out_int(o, res[i]);
+                out_str(o, " -> P");
+                out_int(o, p);
+                if (units[i] > 1) {
+                    out_str(o, " [label=");
+                    out_int(o, units[i]);
+                    out_ch(o, ']');
+                }
+                out_str(o, ";\n");
+            }
+        }
+        out_str(o, "}\n");
+    } else {
+        out_str(o, "\n=== Current RAG State ===\nProcesses (");
+        out_int(o, c.processes);
+        out_str(o, "):\n");
+        for (int p = 0; p < c.processes; ++p) {
+            out_str(o, "  P");
+            out_int(o, p);
+            out_str(o, ": ");
+            out_str(o, rag_process_name(g, p));
+            out_ch(o, '\n');
+        }
+        out_str(o, "Resources (");
+        out_int(o, c.resources);
+        out_str(o, "):\n");
+        for (int r = 0; r < c.resources; ++r) {
+            int total = rag_units(g, r);
+            out_str(o, "  R");
+            out_int(o, r);
+            out_str(o, ": ");
+            out_str(o, rag_resource_name(g, r));
+            if (total > 1) {
+                out_str(o, " (");
+                out_int(o, total);
+                out_str(o, " instances, ");
+                out_int(o, total - rag_in_use(g, r));
+                out_str(o, " free)");
+            }
+            out_ch(o, '\n');
+        }
+        out_str(o, "\nRequest Edges (P -> R):\n");
+        for (int p = 0; p < c.processes; ++p) {
+            int n = rag_requests(g, p, &res, &units);
+            for (int i = 0; i < n; ++i) {
+                out_str(o, "  ");
+                out_str(o, rag_process_name(g, p));
+                out_str(o, " -> ");
+                out_str(o, rag_resource_name(g, res[i]));
+                if (units[i] > 1) {
+                    out_str(o, " (x");
+                    out_int(o, units[i]);
+                    out_ch(o, ')');
+                }
+                out_ch(o, '\n');
+            }
+        }
+        if (c.requests == 0) out_str(o, "  (none)\n");
+        out_str(o, "\nAllocation Edges (R -> P):\n");
+        for (int r = 0; r < c.resources; ++r) {
+            int n = rag_holders(g, r, &procs);
+            for (int i = 0; i < n; ++i) {
+                int p = procs[i], k = rag_held(g, p, r);
+                out_str(o, "  ");
+                out_str(o, rag_resource_name(g, r));
+                out_str(o, " -> ");
+                out_str(o, rag_process_name(g, p));
+                if (k > 1) {
+                    out_str(o, " (x");
+                    out_int(o, k);
+                    out_ch(o, ')');
+                }
+                out_ch(o, '\n');
+            }
+        }
+        if (c.allocations == 0) out_str(o, "  (none)\n");
+        out_str(o, "=========================\n");
     }
-    char name[NAMELEN];
+    out_end(o);
+}
+
+/* ---- Menu operations ---- */
+void add_process(void) {
+    char name[RAG_NAME_MAX];
     read_string("Enter process name: ", name, sizeof(name));
     if (strlen(name) == 0) {
         printf("Empty name. Aborted.\n");
         return;
     }
     /* check duplicates */
-    for (int i = 0; i < n_proc; ++i) {
-        if (strcmp(P[i], name) == 0) {
-            printf("Process with this name already exists.\n");
-            return;
-        }
+    if (rag_find_process(G, name) >= 0) {
+        printf("Process with this name already exists.\n");
+        return;
     }
-    strncpy(P[n_proc], name, NAMELEN-1);
-    P[n_proc][NAMELEN-1] = '\0';
-    /* clear req column for safety */
-    for (int r = 0; r < MAX_RES; ++r) req[n_proc][r] = 0;
-    printf("Added Process P%d: %s\n", n_proc, P[n_proc]);
-    n_proc++;
+    int p = rag_process(G, name);
+    check_memory(G);
+    printf("Added Process P%d: %s\n", p, rag_process_name(G, p));
 }
 
 void add_resource(void) {
-    if (n_res >= MAX_RES) {
-        printf("Max resources reached (%d).\n", MAX_RES);
-        return;
-    }
-    char name[NAMELEN];
+    char name[RAG_NAME_MAX];
     read_string("Enter resource name: ", name, sizeof(name));
     if (strlen(name) == 0) {
         printf("Empty name. Aborted.\n");
         return;
     }
     /* check duplicates */
-    for (int i = 0; i < n_res; ++i) {
-        if (strcmp(R[i], name) == 0) {
-            printf("Resource with this name already exists.\n");
-            return;
-        }
+    if (rag_find_resource(G, name) >= 0) {
+        printf("Resource with this name already exists.\n");
+        return;
     }
-    strncpy(R[n_res], name, NAMELEN-1);
-    R[n_res][NAMELEN-1] = '\0';
-    /* clear alloc row for safety */
-    for (int p = 0; p < MAX_PROC; ++p) alloc_[n_res][p] = 0;
-    printf("Added Resource R%d: %s\n", n_res, R[n_res]);
-    n_res++;
+    int r = rag_resource(G, name);
+    check_memory(G);
+    printf("Added Resource R%d: %s\n", r, rag_resource_name(G, r));
+}
+
+static void list_processes(const char *fmt) {
+    for (int i = 0; i < rag_process_count(G); ++i) printf(fmt, i, rag_process_name(G, i));
+}
+
+static void list_resources(const char *fmt) {
+    for (int j = 0; j < rag_resource_count(G); ++j) printf(fmt, j, rag_resource_name(G, j));
 }
 
 void add_request_edge(void) {
-    if (n_proc == 0 || n_res == 0) {
+    int np = rag_process_count(G), nr = rag_resource_count(G);
+    if (np == 0 || nr == 0) {
         printf("Need at least one process and one resource.\n");
         return;
     }
     printf("Processes:\n");
-    for (int i = 0; i < n_proc; ++i) printf("  %d: %s\n", i, P[i]);
+    list_processes("  %d: %s\n");
     printf("Resources:\n");
-    for (int j = 0; j < n_res; ++j) printf("  %d: %s\n", j, R[j]);
-    int p = read_int("Enter process index -> ", 0, n_proc-1);
-    int r = read_int("Enter resource index -> ", 0, n_res-1);
-    if (req[p][r]) {
+    list_resources("  %d: %s\n");
+    int p = read_int("Enter process index -> ", 0, np-1);
+    int r = read_int("Enter resource index -> ", 0, nr-1);
+    if (rag_requested(G, p, r) > 0) {
         printf("Request edge already exists (P%d -> R%d).\n", p, r);
         return;
     }
-    req[p][r] = 1;
-    printf("Added request edge: %s -> %s\n", P[p], R[r]);
+    if (rag_check_request(G, p, r) > 0) {
+        avoid_print_refusal(G, "request", p, r);
+        return;
+    }
+    int k = 1;
+    if (rag_units(G, r) > 1) k = read_int("Units requested -> ", 1, rag_units(G, r));
+    rag_request(G, p, r, k);
+    check_memory(G);
+    if (k > 1) printf("Added request edge: %s -> %s (x%d)\n", rag_process_name(G, p), rag_resource_name(G, r), k);
+    else printf("Added request edge: %s -> %s\n", rag_process_name(G, p), rag_resource_name(G, r));
 }
 
 void add_allocation_edge(void) {
-    if (n_proc == 0 || n_res == 0) {
+    int np = rag_process_count(G), nr = rag_resource_count(G);
+    if (np == 0 || nr == 0) {
         printf("Need at least one process and one resource.\n");
         return;
     }
     printf("Resources:\n");
-    for (int j = 0; j < n_res; ++j) printf("  %d: %s\n", j, R[j]);
+    list_resources("  %d: %s\n");
     printf("Processes:\n");
-    for (int i = 0; i < n_proc; ++i) printf("  %d: %s\n", i, P[i]);
-    int r = read_int("Enter resource index -> ", 0, n_res-1);
-    int p = read_int("Enter process index -> ", 0, n_proc-1);
-    if (alloc_[r][p]) {
+    list_processes("  %d: %s\n");
+    int r = read_int("Enter resource index -> ", 0, nr-1);
+    int p = read_int("Enter process index -> ", 0, np-1);
+    if (rag_check_grant(G, r, p) > 0) {
+        avoid_print_refusal(G, "grant", p, r);
+        return;
+    }
+    int units = rag_units(G, r);
+    if (units > 1) {
+        /* multi-instance: grant from the free units, never override */
+        int avail = units - rag_in_use(G, r);
+        if (avail == 0) {
+            printf("No free instances of %s (all %d allocated).\n", rag_resource_name(G, r), units);
+            return;
+        }
+        int k = read_int("Units to allocate -> ", 1, avail);
+        rag_grant(G, r, p, k);
+        check_memory(G);
+        printf("Allocated %d unit(s): %s -> %s (%d of %d in use)\n", k, rag_resource_name(G, r),
+               rag_process_name(G, p), rag_in_use(G, r), units);
+        return;
+    }
+    if (rag_held(G, p, r) > 0) {
         printf("Allocation edge already exists (R%d -> P%d).\n", r, p);
         return;
     }
     /* enforce single-owner per resource in this simple model:
        if resource already allocated to another process, warn and override */
-    for (int pp = 0; pp < n_proc; ++pp) {
-        if (alloc_[r][pp]) {
-            printf("Warning: Resource %s was allocated to %s. Overriding allocation.\n", R[r], P[pp]);
-            alloc_[r][pp] = 0;
-        }
+    const int *owner;
+    if (rag_holders(G, r, &owner) > 0) {
+        printf("Warning: Resource %s was allocated to %s. Overriding allocation.\n", rag_resource_name(G, r),
+               rag_process_name(G, owner[0]));
     }
-    alloc_[r][p] = 1;
-    printf("Added allocation edge: %s -> %s\n", R[r], P[p]);
+    rag_assign(G, r, p);
+    check_memory(G);
+    printf("Added allocation edge: %s -> %s\n", rag_resource_name(G, r), rag_process_name(G, p));
 }
 
 void remove_edges_menu(void) {
+    int np = rag_process_count(G), nr = rag_resource_count(G);
     printf("1) Remove Request Edge (P -> R)\n2) Remove Allocation Edge (R -> P)\n3) Cancel\n");
     int ch = read_int("Choice: ", 1, 3);
     if (ch == 1) {
-        if (n_proc == 0 || n_res == 0) { printf("Empty.\n"); return; }
-        for (int i=0;i<n_proc;i++) printf("P%d: %s\n", i, P[i]);
-        for (int j=0;j<n_res;j++) printf("R%d: %s\n", j, R[j]);
-        int p = read_int("Process index: ", 0, n_proc-1);
-        int r = read_int("Resource index: ", 0, n_res-1);
-        if (req[p][r]) { req[p][r] = 0; printf("Removed request edge.\n"); }
+        if (np == 0 || nr == 0) { printf("Empty.\n"); return; }
+        list_processes("P%d: %s\n");
+        list_resources("R%d: %s\n");
+        int p = read_int("Process index: ", 0, np-1);
+        int r = read_int("Resource index: ", 0, nr-1);
+        if (rag_cancel(G, p, r) > 0) printf("Removed request edge.\n");
         else printf("Request edge did not exist.\n");
     } else if (ch == 2) {
-        if (n_proc == 0 || n_res == 0) { printf("Empty.\n"); return; }
-        for (int j=0;j<n_res;j++) printf("R%d: %s\n", j, R[j]);
-        for (int i=0;i<n_proc;i++) printf("P%d: %s\n", i, P[i]);
-        int r = read_int("Resource index: ", 0, n_res-1);
-        int p = read_int("Process index: ", 0, n_proc-1);
-        if (alloc_[r][p]) { alloc_[r][p] = 0; printf("Removed allocation edge.\n"); }
+        if (np == 0 || nr == 0) { printf("Empty.\n"); return; }
+        list_resources("R%d: %s\n");
+        list_processes("P%d: %s\n");
+        int r = read_int("Resource index: ", 0, nr-1);
+        int p = read_int("Process index: ", 0, np-1);
+        if (rag_release(G, r, p, 0) > 0) printf("Removed allocation edge.\n");
         else printf("Allocation edge did not exist.\n");
     } else {
         printf("Cancelled.\n");
@@ -205,194 +690,2501 @@ void remove_edges_menu(void) {
 }
 
 void reset_graph(void) {
-    memset(req, 0, sizeof(req));
-    memset(alloc_, 0, sizeof(alloc_));
-    memset(P, 0, sizeof(P));
-    memset(R, 0, sizeof(R));
-    n_proc = 0;
-    n_res = 0;
+    rag_clear(G);
     printf("Graph reset.\n");
 }
 
 void print_rag(void) {
-    printf("\n=== Current RAG State ===\n");
-    printf("Processes (%d):\n", n_proc);
-    for (int i = 0; i < n_proc; ++i) printf("  P%d: %s\n", i, P[i]);
-    printf("Resources (%d):\n", n_res);
-    for (int j = 0; j < n_res; ++j) printf("  R%d: %s\n", j, R[j]);
+    graph_dump(stdout, G, out_format);
+}
 
-    printf("\nRequest Edges (P -> R):\n");
-    int any = 0;
-    for (int p = 0; p < n_proc; ++p) {
-        for (int r = 0; r < n_res; ++r) {
-            if (req[p][r]) { printf("  %s -> %s\n", P[p], R[r]); any = 1; }
-        }
-    }
-    if (!any) printf("  (none)\n");
+/* ---- Reports ---- */
+/* Batch keys of the detection engines, also the "engine" of JSON reports */
+static const char *const engine_keys[RAG_ENGINES] = { "auto", "dfs", "dense", "scc", "banker", "parallel",
+                                                      "sharded", "small" };
 
-    printf("\nAllocation Edges (R -> P):\n");
-    any = 0;
-    for (int r = 0; r < n_res; ++r) {
-        for (int p = 0; p < n_proc; ++p) {
-            if (alloc_[r][p]) { printf("  %s -> %s\n", R[r], P[p]); any = 1; }
-        }
-    }
-    if (!any) printf("  (none)\n");
-    printf("=========================\n");
+/* Engines whose result is a list of deadlocked sets (otherwise one cycle,
+   or the matrix reduction's stuck processes) */
+static int engine_finds_sets(int engine) {
+    return engine == RAG_ENGINE_SCC || engine == RAG_ENGINE_PARALLEL || engine == RAG_ENGINE_SHARDED ||
+           engine == RAG_ENGINE_SMALL;
 }
 
-/* ---- Build Wait-For Graph (P -> P) ----
-   For every request edge P -> R, if R is allocated to P2, add edge P -> P2 in WFG.
-*/
-void build_wfg(void) {
-    memset(wfg, 0, sizeof(wfg));
-    for (int p = 0; p < n_proc; ++p) {
-        for (int r = 0; r < n_res; ++r) {
-            if (req[p][r]) {
-                for (int p2 = 0; p2 < n_proc; ++p2) {
-                    if (alloc_[r][p2]) {
-                        wfg[p][p2] = 1;
-                    }
-                }
-            }
+/* Writer for one wait link p -> r -> p2 (r = -1 if no blocking resource
+   was found), the k-th of deadlocked set 'set' */
+typedef void (*link_fn)(struct out_buf *o, const rag_graph *g, int set, int p, int r, int p2, int k);
+
+/* Every wait link of deadlocked set 'set' with members m[0..n): with 'scc'
+   the wait edges between members of SCC 'set', otherwise the cycle
+   m[0] -> m[1] -> ... -> m[0] */
+static void report_links(struct out_buf *o, const rag_graph *g, int set, const int *m, int n, int scc,
+                         link_fn fn) {
+    int k = 0;
+    for (int i = 0; i < n; ++i) {
+        int p = m[i];
+        if (!scc) {
+            int p2 = m[i + 1 < n ? i + 1 : 0]; /* close the cycle */
+            fn(o, g, set, p, rag_blocker(g, p, p2), p2, k++);
+            continue;
+        }
+        const int *out;
+        int n_out = rag_wait_edges(g, p, &out);
+        for (int j = 0; j < n_out; ++j) {
+            int p2 = out[j];
+            if (rag_deadlocked(g, p2) == set) fn(o, g, set, p, rag_blocker(g, p, p2), p2, k++);
         }
     }
 }
 
-/* For reconstructing full P->R->P link for a pair (p -> p2),
-   find a resource r such that req[p][r] && alloc_[r][p2].
-   Returns index r or -1 if none found.
-*/
-int find_blocking_resource(int p, int p2) {
-    for (int r = 0; r < n_res; ++r) {
-        if (req[p][r] && alloc_[r][p2]) return r;
+static void link_text(struct out_buf *o, const rag_graph *g, int set, int p, int r, int p2, int k) {
+    (void)set, (void)k;
+    out_str(o, "  ");
+    out_str(o, rag_process_name(g, p));
+    out_str(o, " (P");
+    out_int(o, p);
+    out_str(o, ")  ->  ");
+    if (r >= 0) {
+        out_str(o, rag_resource_name(g, r));
+        out_str(o, " (R");
+        out_int(o, r);
+        out_str(o, ")  ->  ");
     }
-    return -1;
+    out_str(o, rag_process_name(g, p2));
+    out_str(o, " (P");
+    out_int(o, p2);
+    out_str(o, r >= 0 ? ")\n" : ")   [resource unknown]\n");
 }
 
-/* DFS cycle detection on wfg with stack to reconstruct cycle */
-int visited[MAX_PROC];
-int in_stack[MAX_PROC];
-int stack_nodes[MAX_PROC];
-int stack_top;
+static void link_json(struct out_buf *o, const rag_graph *g, int set, int p, int r, int p2, int k) {
+    (void)set;
+    out_str(o, k ? ",{\"process\":" : "{\"process\":");
+    out_json(o, rag_process_name(g, p));
+    out_str(o, ",\"resource\":");
+    if (r >= 0) out_json(o, rag_resource_name(g, r));
+    else out_str(o, "null");
+    out_str(o, ",\"holder\":");
+    out_json(o, rag_process_name(g, p2));
+    out_ch(o, '}');
+}
 
-/* When a cycle back-edge to 'to' is found (to is in_stack), this prints the cycle
-   by collecting nodes from the stack. It prints the process-only cycle and also
-   reconstructs each P->R->P link using a blocking resource when possible.
-*/
-void print_cycle_from_stack(int to) {
-    int idx = -1;
-    for (int i = 0; i <= stack_top; ++i) {
-        if (stack_nodes[i] == to) { idx = i; break; }
+static void link_csv(struct out_buf *o, const rag_graph *g, int set, int p, int r, int p2, int k) {
+    (void)k;
+    out_int(o, set + 1);
+    out_ch(o, ',');
+    out_csv(o, rag_process_name(g, p));
+    out_ch(o, ',');
+    if (r >= 0) out_csv(o, rag_resource_name(g, r));
+    out_ch(o, ',');
+    out_csv(o, rag_process_name(g, p2));
+    out_ch(o, '\n');
+}
+
+static void link_dot(struct out_buf *o, const rag_graph *g, int set, int p, int r, int p2, int k) {
+    (void)set, (void)k;
+    out_str(o, "  P");
+    out_int(o, p);
+    out_str(o, " -> P");
+    out_int(o, p2);
+    if (r >= 0) {
+        out_str(o, " [label=");
+        out_json(o, rag_resource_name(g, r));
+        out_ch(o, ']');
     }
-    if (idx == -1) {
+    out_str(o, ";\n");
+}
+
+/* Print the last cycle reported (rag_cycle), with the P -> R -> P link
+   behind each wait edge where a blocking resource can be found */
+void print_cycle(const rag_graph *g) {
+    int n;
+    const int *m = rag_cycle(g, &n);
+    if (m == NULL) {
         printf("Cycle start not found in stack (internal error).\n");
         return;
     }
-    int len = stack_top - idx + 1;
-    printf("\nDetected cycle of %d process(es):\n", len);
-    /* print cycle as P -> R -> P -> R -> ... */
-    for (int i = idx; i <= stack_top; ++i) {
-        int p = stack_nodes[i];
-        int nextp;
-        if (i < stack_top) nextp = stack_nodes[i+1];
-        else nextp = stack_nodes[idx]; /* close the cycle */
-        int r = find_blocking_resource(p, nextp);
-        if (r >= 0) {
-            printf("  %s (P%d)  ->  %s (R%d)  ->  %s (P%d)\n", P[p], p, R[r], r, P[nextp], nextp);
-        } else {
-            /* Fallback: print P -> P if no exact resource mapping found */
-            printf("  %s (P%d)  ->  %s (P%d)   [resource unknown]\n", P[p], p, P[nextp], nextp);
+    struct out_buf *o = out_begin(stdout);
+    out_str(o, "\nDetected cycle of ");
+    out_int(o, n);
+    out_str(o, " process(es):\n");
+    report_links(o, g, 0, m, n, 0, link_text);
+    out_ch(o, '\n');
+    out_end(o);
+}
+
+/* Print every deadlocked set with the P -> R -> P links inside it */
+void print_scc_report(const rag_graph *g) {
+    struct out_buf *o = out_begin(stdout);
+    for (int c = 0; c < rag_set_count(g); ++c) {
+        int n;
+        const int *m = rag_set_members(g, c, &n);
+        out_str(o, "\nDeadlocked set ");
+        out_int(o, c + 1);
+        out_str(o, " (");
+        out_int(o, n);
+        out_str(o, " process(es)):");
+        for (int i = 0; i < n; ++i) {
+            out_str(o, i == 0 ? " " : ", ");
+            out_str(o, rag_process_name(g, m[i]));
         }
+        out_ch(o, '\n');
+        report_links(o, g, c, m, n, 1, link_text);
     }
-    printf("\n");
+    out_ch(o, '\n');
+    out_end(o);
 }
 
-/* return 1 if any cycle found, 0 otherwise */
-int dfs_cycle(int u) {
-    visited[u] = 1;
-    in_stack[u] = 1;
-    stack_nodes[++stack_top] = u;
+void print_shard_report(const rag_graph *g) {
+    const struct rag_shard_stats *st = rag_shard_stats(g);
+    printf("Sharded run: %d shard(s), %lld cross-shard wait edge(s); shards sent %lld record(s) "
+           "(%lld cross, %lld entry, %lld summary), coordinator sent %lld back.\n",
+           st->shards, st->cross, st->cross + st->entries + st->summary, st->cross, st->entries,
+           st->summary, st->announced);
+}
 
-    for (int v = 0; v < n_proc; ++v) {
-        if (!wfg[u][v]) continue;
-        if (!visited[v]) {
-            if (dfs_cycle(v)) return 1; /* early exit on first cycle */
-        } else if (in_stack[v]) {
-            /* found back-edge u -> v; reconstruct cycle starting at v */
-            print_cycle_from_stack(v);
-            return 1;
+/* List every process that cannot finish with its unsatisfiable requests */
+void print_banker_report(const rag_graph *g) {
+    printf("\nDeadlocked processes (matrix reduction):\n");
+    for (int p = 0; p < rag_process_count(g); ++p) {
+        if (rag_deadlocked(g, p) < 0) continue;
+        const int *res, *units;
+        int n = rag_holdings(g, p, &res, &units);
+        printf("  %s (P%d)", rag_process_name(g, p), p);
+        for (int i = 0; i < n; ++i) {
+            printf("%s %d x %s", i ? "," : "  holds", units[i], rag_resource_name(g, res[i]));
+        }
+        printf("\n");
+        n = rag_requests(g, p, &res, &units);
+        for (int i = 0; i < n; ++i) {
+            int r = res[i], avail = rag_available(g, r);
+            if (units[i] <= avail) continue;
+            printf("      waits for %d x %s (R%d): %d of %d available\n",
+                   units[i], rag_resource_name(g, r), r, avail, rag_units(g, r));
         }
     }
+    printf("\n");
+}
 
-    in_stack[u] = 0;
-    --stack_top;
-    return 0;
+/* The outcome of the last detection run, by 'engine', in a structured
+   format (not text): the deadlocked sets with their wait links, the one
+   cycle DFS/dense found, or the stuck processes of the matrix reduction
+   with the requests they cannot get */
+static void report_write(FILE *f, const rag_graph *g, int engine, int found, int fmt) {
+    int banker = engine == RAG_ENGINE_BANKER, scc = engine_finds_sets(engine), n_sets = 0, n_members = 0;
+    const int *cycle = NULL;
+    if (found && !banker && !scc) {
+        cycle = rag_cycle(g, &n_members);
+        n_sets = cycle != NULL;
+    } else if (found && scc) {
+        n_sets = rag_set_count(g);
+        for (int c = 0, n; c < n_sets; ++c) {
+            rag_set_members(g, c, &n);
+            n_members += n;
+        }
+    }
+    struct out_buf *o = out_begin(f);
+    if (fmt == OUT_SUMMARY) {
+        out_str(o, "deadlock: ");
+        if (!found) out_str(o, "none");
+        else if (banker) {
+            out_int(o, found);
+            out_str(o, " stuck process(es)");
+        } else if (cycle != NULL) {
+            out_str(o, "cycle of ");
+            out_int(o, n_members);
+            out_str(o, " process(es)");
+        } else {
+            out_int(o, n_sets);
+            out_str(o, " set(s), ");
+            out_int(o, n_members);
+            out_str(o, " process(es)");
+        }
+        out_str(o, " (");
+        out_str(o, engine_keys[engine]);
+        out_str(o, ")\n");
+        out_end(o);
+        return;
+    }
+    if (fmt == OUT_JSON) {
+        out_str(o, "{\"engine\":\"");
+        out_str(o, engine_keys[engine]);
+        out_str(o, found ? "\",\"deadlock\":true" : "\",\"deadlock\":false");
+        out_str(o, banker ? ",\"stuck\":[" : ",\"sets\":[");
+    } else if (fmt == OUT_CSV) {
+        out_str(o, banker ? "process,resource,units,available\n" : "set,process,resource,holder\n");
+    } else {
+        out_str(o, "digraph deadlock {\n");
+    }
+    for (int c = 0; c < n_sets; ++c) {
+        int n = n_members;
+        const int *m = cycle != NULL ? cycle : rag_set_members(g, c, &n);
+        if (fmt == OUT_JSON) {
+            out_str(o, c ? ",{\"processes\":[" : "{\"processes\":[");
+            for (int i = 0; i < n; ++i) {
+                if (i) out_ch(o, ',');
+                out_json(o, rag_process_name(g, m[i]));
+            }
+            out_str(o, "],\"waits\":[");
+            report_links(o, g, c, m, n, scc, link_json);
+            out_str(o, "]}");
+        } else if (fmt == OUT_CSV) {
+            report_links(o, g, c, m, n, scc, link_csv);
+        } else {
+            out_str(o, "  subgraph cluster_");
+            out_int(o, c + 1);
+            out_str(o, " {\n    label=\"set ");
+            out_int(o, c + 1);
+            out_str(o, "\";\n");
+            for (int i = 0; i < n; ++i) {
+                out_str(o, "    P");
+                out_int(o, m[i]);
+                out_str(o, " [label=");
+                out_json(o, rag_process_name(g, m[i]));
+                out_str(o, "];\n");
+            }
+            out_str(o, "  }\n");
+            report_links(o, g, c, m, n, scc, link_dot);
+        }
+    }
+    for (int p = 0, k = 0; banker && found && p < rag_process_count(g); ++p) {
+        if (rag_deadlocked(g, p) < 0) continue;
+        const int *res, *units;
+        if (fmt == OUT_JSON) {
+            out_str(o, k++ ? ",{\"process\":" : "{\"process\":");
+            out_json(o, rag_process_name(g, p));
+            out_str(o, ",\"holds\":[");
+            int n = rag_holdings(g, p, &res, &units);
+            for (int i = 0; i < n; ++i) {
+                out_str(o, i ? ",{\"resource\":" : "{\"resource\":");
+                out_json(o, rag_resource_name(g, res[i]));
+                out_str(o, ",\"units\":");
+                out_int(o, units[i]);
+                out_ch(o, '}');
+            }
+            out_str(o, "],\"waits\":[");
+        } else if (fmt == OUT_DOT) {
+            out_str(o, "  P");
+            out_int(o, p);
+            out_str(o, " [label=");
+            out_json(o, rag_process_name(g, p));
+            out_str(o, "];\n");
+        }
+        int n = rag_requests(g, p, &res, &units);
+        for (int i = 0, w = 0; i < n; ++i) {
+            int r = res[i], avail = rag_available(g, r);
+            if (units[i] <= avail) continue;
+            if (fmt == OUT_JSON) {
+                out_str(o, w++ ? ",{\"resource\":" : "{\"resource\":");
+                out_json(o, rag_resource_name(g, r));
+                out_str(o, ",\"units\":");
+                out_int(o, units[i]);
+                out_str(o, ",\"available\":");
+                out_int(o, avail);
+                out_ch(o, '}');
+            } else if (fmt == OUT_CSV) {
+                out_csv(o, rag_process_name(g, p));
+                out_ch(o, ',');
+                out_csv(o, rag_resource_name(g, r));
+                out_ch(o, ',');
+                out_int(o, units[i]);
+                out_ch(o, ',');
+                out_int(o, avail);
+                out_ch(o, '\n');
+            } else {
+                out_str(o, "  R");
+                out_int(o, r);
+                out_str(o, " [shape=box, label=");
+                out_json(o, rag_resource_name(g, r));
+                out_str(o, "];\n  P");
+                out_int(o, p);
+                out_str(o, " -> R");
+                out_int(o, r);
+                out_str(o, " [style=dashed, label=\"needs ");
+                out_int(o, units[i]);
+                out_str(o, ", ");
+                out_int(o, avail);
+                out_str(o, " free\"];\n");
+            }
+        }
+        if (fmt == OUT_JSON) out_str(o, "]}");
+    }
+    out_str(o, fmt == OUT_JSON ? "]}\n" : fmt == OUT_DOT ? "}\n" : "");
+    out_end(o);
 }
 
-void detect_deadlock(void) {
-    if (n_proc == 0) { printf("No processes present.\n"); return; }
-    build_wfg();
-    memset(visited, 0, sizeof(visited));
-    memset(in_stack, 0, sizeof(in_stack));
-    stack_top = -1;
-    int found = 0;
-    for (int i = 0; i < n_proc; ++i) {
-        if (!visited[i]) {
-            if (dfs_cycle(i)) { found = 1; break; } /* report first cycle only */
+/* ---- Detection engine selection ---- */
+/* Print the outcome of the last detection run, by 'engine' */
+static void detect_print(const rag_graph *g, int engine, int found) {
+    if (out_format != OUT_TEXT) {
+        report_write(stdout, g, engine, found, out_format);
+        return;
+    }
+    if (engine == RAG_ENGINE_BANKER) {
+        if (!found) {
+            printf("\n✔ No deadlock detected (every process can run to completion).\n\n");
+            return;
         }
+        print_banker_report(g);
+        printf("❌ Deadlock exists in the system: %d process(es) can never finish (see above).\n\n", found);
+        return;
     }
+    if (engine == RAG_ENGINE_SHARDED) print_shard_report(g);
     if (!found) {
         printf("\n✔ No deadlock detected (no cycles in Wait-For Graph).\n\n");
+        return;
+    }
+    if (engine_finds_sets(engine)) {
+        print_scc_report(g);
+        printf("❌ Deadlock exists in the system: %d deadlocked set(s) (see above).\n\n", found);
+        return;
+    }
+    print_cycle(g);
+    printf("❌ Deadlock exists in the system (see above cycle).\n\n");
+}
+
+/* Run the configured engine on g and print the result */
+static void detect_and_print(rag_graph *g) {
+    int found = rag_detect(g);
+    check_memory(g);
+    detect_print(g, rag_last_engine(g), found);
+}
+
+void detect_deadlock(void) {
+    if (rag_process_count(G) == 0) { printf("No processes present.\n"); return; }
+    detect_and_print(G);
+}
+
+/* ---- Deadlock resolution ---- */
+static struct rag_cost vpolicy = { 1.0, 1.0, 0.01 };  /* set by "cost" */
+
+/* rag_resolve's victim callback; arg sums the cost */
+static void resolve_print(const rag_graph *g, int p, double c, void *arg) {
+    if (p < 0) {
+        int members = 0;
+        for (int s = 0, n; s < rag_set_count(g); ++s) {
+            rag_set_members(g, s, &n);
+            members += n;
+        }
+        printf("Resolution: %d deadlocked set(s), %d process(es)\n", rag_set_count(g), members);
+        return;
+    }
+    *(double *)arg += c;
+    printf("  set %d: preempt %s (P%d), cost %.2f, priority %d, releases", rag_deadlocked(g, p) + 1,
+           rag_process_name(g, p), p, c, rag_priority(g, p));
+    const int *res, *units;
+    int n = rag_holdings(g, p, &res, &units);
+    for (int j = 0; j < n; ++j) {
+        printf("%s %s", j ? "," : "", rag_resource_name(g, res[j]));
+        if (units[j] > 1) printf(" x%d", units[j]);
+    }
+    printf("\n");
+}
+
+/* Resolve with the configured policy, printing each victim */
+static int resolve_verbose(rag_graph *g) {
+    double spent = 0;
+    int total = rag_resolve(g, &vpolicy, resolve_print, &spent);
+    check_memory(g);
+    if (total == 0) printf("No wait cycles: nothing to resolve.\n");
+    else printf("Resolved: %d victim(s), total cost %.2f; no wait cycles remain.\n", total, spent);
+    return total;
+}
+
+void resolve_menu(void) {
+    int np = rag_process_count(G);
+    if (np == 0) { printf("No processes present.\n"); return; }
+    printf("Victim cost: %.2f x units held + %.2f x priority + %.2f x age (mutations)\n",
+           vpolicy.held, vpolicy.prio, vpolicy.age);
+    if (read_int("Set a process priority first? (1 = yes, 0 = no): ", 0, 1)) {
+        for (int i = 0; i < np; ++i) printf("  %d: %s (priority %d)\n", i, rag_process_name(G, i), rag_priority(G, i));
+        int p = read_int("Process index -> ", 0, np - 1);
+        rag_set_priority(G, p, read_int("Priority (higher = costlier to preempt) -> ", 0, INT_MAX));
+    }
+    resolve_verbose(G);
+}
+
+/* ---- Detection scheduler ----
+   Runs detection every period_ms, or once 'mutations' graph changes have
+   piled up, whichever comes first. Every change bumps the graph's change
+   count (rag_counts); while it still equals the count the last run saw, a
+   tick costs one comparison, so an idle graph never re-runs an engine.
+   Batch and menu mode tick after every command once a schedule is
+   enabled, so the period is checked between commands. (The live monitor
+   has triggers of its own, see rag_monitor_start.)
+*/
+struct detect_schedule {
+    int enabled;
+    int period_ms;          /* 0: no time trigger */
+    int mutations;          /* 0: no count trigger */
+    unsigned long runs;
+    unsigned long idle;     /* triggers that found the graph unchanged */
+    int ran;                /* a scheduled run happened */
+    unsigned long changes;  /* ... at this change count */
+    double last_ms;         /* ... and time */
+    int found;              /* ... with this result */
+};
+
+static struct detect_schedule sched = { 0, 0, 1, 0, 0, 0, 0, 0, 0 };
+
+/* Run detection on g if a trigger is due and the graph changed since the
+   last scheduled run; print a result that differs from the previous one
+   and shows a deadlock. Returns 1 if an engine ran. */
+static int sched_tick(rag_graph *g) {
+    struct rag_counts c;
+    struct rag_settings set;
+    rag_counts(g, &c);
+    double now = rag_now_ms();
+    int timed = sched.period_ms > 0 && now - sched.last_ms >= sched.period_ms;
+    if (sched.ran && c.changes == sched.changes) {
+        if (timed) { sched.idle++; sched.last_ms = now; }
+        return 0;
+    }
+    int counted = sched.mutations > 0 && c.changes - sched.changes >= (unsigned long)sched.mutations;
+    if (!timed && !counted && sched.ran) return 0;
+    sched.ran = 1;
+    sched.changes = c.changes;
+    sched.last_ms = now;
+    sched.runs++;
+    int prev = sched.found, found = 0;
+    /* online mode already reports the closing edge as it is added */
+    rag_settings(g, &set);
+    if (c.processes > 0 && !set.online) {
+        found = rag_detect(g);
+        check_memory(g);
+        if (found && found != prev) detect_print(g, rag_last_engine(g), found);
+    }
+    sched.found = found;
+    return 1;
+}
+
+static void print_schedule(void) {
+    printf("Detection schedule: %s, every %d ms, after %d mutation(s)"
+           " (%lu run(s), %lu idle trigger(s))\n",
+           sched.enabled ? "on" : "off", sched.period_ms, sched.mutations,
+           sched.runs, sched.idle);
+}
+
+void schedule_menu(void) {
+    print_schedule();
+    sched.period_ms = read_int("Period in ms (0 = no time trigger): ", 0, INT_MAX);
+    sched.mutations = read_int("Mutations per run (0 = no count trigger): ", 0, INT_MAX);
+    sched.enabled = sched.period_ms > 0 || sched.mutations > 0;
+    print_schedule();
+}
+
+/* ---- Online detection and engine menus ---- */
+/* rag_set_online callback for the CLI's graph */
+static void online_print_cycle(rag_graph *g, int x, int y, void *arg) {
+    (void)arg;
+    printf("\nOnline check: wait edge %s (P%d) -> %s (P%d) closes a cycle.\n",
+           rag_process_name(g, x), x, rag_process_name(g, y), y);
+    print_cycle(g);
+}
+
+static int set_online(rag_graph *g, int on) {
+    int ok = rag_set_online(g, on, online_print_cycle, NULL);
+    check_memory(g);
+    return ok;
+}
+
+static int set_avoid(rag_graph *g, int on) {
+    int ok = rag_set_avoidance(g, on);
+    check_memory(g);
+    return ok;
+}
+
+void toggle_online_detection(void) {
+    struct rag_settings set;
+    rag_settings(G, &set);
+    if (set.online) {
+        set_online(G, 0);
+        printf("Online detection disabled.\n");
+        return;
+    }
+    if (set_online(G, 1)) {
+        printf("Online detection enabled: each new wait edge is checked as it is added.\n");
+    } else {
+        printf("Online detection enabled. The Wait-For Graph already has a cycle;\n"
+               "new wait edges fall back to a reachability search until it is broken.\n");
+    }
+}
+
+void select_engine_menu(void) {
+    struct rag_settings set;
+    rag_settings(G, &set);
+    printf("Detection engine (current: %s):\n", rag_engine_name(set.engine));
+    printf("1) Auto (matrix reduction with multi-instance resources, else the small-graph\n"
+           "   kernel up to %d processes, dense bitset for small dense graphs,\n"
+           "   Tarjan SCC otherwise)\n", RAG_SMALL_MAX);
+    printf("2) Sparse DFS over adjacency lists (first cycle only)\n");
+    printf("3) Dense bitset (%d processes max recommended)\n", RAG_DENSE_MAX);
+    printf("4) Tarjan SCC (every deadlocked set in one pass)\n");
+    printf("5) Matrix reduction (multi-instance resources)\n");
+    printf("6) Parallel SCC (forward-backward, %d thread(s))\n", rag_thread_count(G));
+    printf("7) Sharded SCC (%d shard(s) and a coordinator over cross-shard edges)\n",
+           set.shards > 0 ? set.shards : RAG_SHARDS_DEFAULT);
+    printf("8) Small-graph kernel (bit-parallel SCC on one word per row, %d processes max)\n",
+           RAG_SMALL_MAX);
+    int engine = read_int("Choice: ", 1, 8) - 1;
+    rag_set_engine(G, engine);
+    if (engine == RAG_ENGINE_SHARDED) rag_set_shards(G, read_int("Shards (1 - 4096): ", 1, 4096));
+    printf("Detection engine set to %s.\n", rag_engine_name(engine));
+}
+
+/* ---- Avoidance menu ---- */
+/* Print the cycle a refusal left on rag_cycle; the one link without a
+   blocking resource yet is the refused edge through r */
+static void avoid_print_refusal(const rag_graph *g, const char *what, int p, int r) {
+    int n;
+    const int *cyc = rag_cycle(g, &n);
+    printf("Avoidance: %s %s / %s refused, it would close this wait cycle:\n",
+           what, rag_process_name(g, p), rag_resource_name(g, r));
+    for (int i = 0; i < n; ++i) {
+        int a = cyc[i], b = cyc[i + 1 < n ? i + 1 : 0];
+        int via = rag_blocker(g, a, b);
+        if (via < 0) via = r;
+        printf("  %s (P%d)  ->  %s (R%d)  ->  %s (P%d)\n", rag_process_name(g, a), a, rag_resource_name(g, via), via,
+               rag_process_name(g, b), b);
+    }
+}
+
+void toggle_avoidance(void) {
+    struct rag_settings set;
+    rag_settings(G, &set);
+    if (set.avoidance) {
+        set_avoid(G, 0);
+        printf("Avoidance mode disabled.\n");
+        return;
+    }
+    if (set_avoid(G, 1)) {
+        printf("Avoidance mode enabled: requests and grants that would close a wait cycle are refused.\n");
+    } else {
+        printf("Avoidance mode enabled. The Wait-For Graph already has a cycle;\n"
+               "checks fall back to an unbounded search until it is broken.\n");
+    }
+}
+
+/* ---- Lock-order analysis menu and reports ---- */
+/* rag_set_lockdep callback: p holds 'held' and wants 'wanted', against
+   the order on rag_lockdep_path. JSON reports are one line each; csv, dot
+   and summary print nothing per inversion (lockdep_status counts them). */
+static void lockdep_print_inversion(rag_graph *g, int p, int held, int wanted, void *arg) {
+    (void)arg;
+    if (out_format != OUT_TEXT && out_format != OUT_JSON) return;
+    int n;
+    const int *path = rag_lockdep_path(g, &n);
+    struct out_buf *o = out_begin(stdout);
+    if (out_format == OUT_JSON) {
+        out_str(o, "{\"inversion\":{\"process\":");
+        out_json(o, rag_process_name(g, p));
+        out_str(o, ",\"holds\":");
+        out_json(o, rag_resource_name(g, held));
+        out_str(o, ",\"wants\":");
+        out_json(o, rag_resource_name(g, wanted));
+        out_str(o, ",\"order\":[");
     } else {
-        printf("❌ Deadlock exists in the system (see above cycle).\n\n");
+        out_str(o, "\nPotential deadlock (lock order inversion): ");
+        out_str(o, rag_process_name(g, p));
+        out_str(o, " (P");
+        out_int(o, p);
+        out_str(o, ") holds ");
+        out_str(o, rag_resource_name(g, held));
+        out_str(o, " and wants ");
+        out_str(o, rag_resource_name(g, wanted));
+        out_str(o, ", but the opposite order was seen:\n");
+    }
+    for (int i = 0; i + 1 < n; ++i) {
+        int a = path[i], b = path[i + 1], q = rag_lockdep_witness(g, a, b);
+        if (out_format == OUT_JSON) {
+            out_str(o, i ? ",{\"holding\":" : "{\"holding\":");
+            out_json(o, rag_resource_name(g, a));
+            out_str(o, ",\"took\":");
+            out_json(o, rag_resource_name(g, b));
+            out_str(o, ",\"by\":");
+            out_json(o, rag_process_name(g, q));
+            out_ch(o, '}');
+        } else {
+            out_str(o, "  ");
+            out_str(o, rag_process_name(g, q));
+            out_str(o, " (P");
+            out_int(o, q);
+            out_str(o, ") took ");
+            out_str(o, rag_resource_name(g, b));
+            out_str(o, " (R");
+            out_int(o, b);
+            out_str(o, ") while holding ");
+            out_str(o, rag_resource_name(g, a));
+            out_str(o, " (R");
+            out_int(o, a);
+            out_str(o, ")\n");
+        }
+    }
+    out_str(o, out_format == OUT_JSON ? "]}}\n" : "");
+    out_end(o);
+}
+
+static void set_lockdep(rag_graph *g, int on) {
+    rag_set_lockdep(g, on, lockdep_print_inversion, NULL);
+    check_memory(g);
+}
+
+static void lockdep_status(const rag_graph *g) {
+    const struct rag_lockdep_stats *st = rag_lockdep_stats(g);
+    if (st == NULL) { printf("lockdep: off\n"); return; }
+    printf("lockdep: %d order edge(s) over %d resource(s), %lld inversion(s); "
+           "%lld pair check(s), %lld cached, %lld order search(es)\n",
+           st->edges, st->resources, st->inversions, st->checks, st->hits, st->searches);
+}
+
+void toggle_lockdep(void) {
+    if (rag_lockdep_stats(G) != NULL) {
+        lockdep_status(G);
+        set_lockdep(G, 0);
+        printf("Lock-order analysis disabled.\n");
+        return;
     }
+    set_lockdep(G, 1);
+    printf("Lock-order analysis enabled: taking resources against an order seen before is reported.\n");
+}
+
+/* ---- Renumbering menu ---- */
+void renumber_menu(void) {
+    if (rag_process_count(G) + rag_resource_count(G) == 0) { printf("Graph is empty.\n"); return; }
+    double before = rag_edge_span(G), t0 = rag_now_ms();
+    rag_renumber(G);
+    check_memory(G);
+    printf("Renumbered %d process(es) and %d resource(s) in %.1f ms; "
+           "mean edge span %.1f -> %.1f rows.\n",
+           rag_process_count(G), rag_resource_count(G), rag_now_ms() - t0, before, rag_edge_span(G));
 }
 
 /* ---- Sample prefill to quickly test (optional helper) ---- */
-void sample_prefill(void) {
-    reset_graph();
+static void load_sample(rag_graph *g) {
+    struct rag_settings set;
+    rag_settings(g, &set);
+    rag_clear(g);
+    rag_set_avoidance(g, 0);    /* the sample is deadlocked on purpose */
     /* processes */
-    strncpy(P[0], "P0", NAMELEN); strncpy(P[1], "P1", NAMELEN);
-    strncpy(P[2], "P2", NAMELEN);
-    n_proc = 3;
+    rag_process(g, "P0"); rag_process(g, "P1");
+    rag_process(g, "P2");
     /* resources */
-    strncpy(R[0], "R0", NAMELEN); strncpy(R[1], "R1", NAMELEN);
-    n_res = 2;
+    rag_resource(g, "R0"); rag_resource(g, "R1");
     /* edges forming cycle: P0 -> R0 (req), R0 -> P1 (alloc)
                              P1 -> R1 (req), R1 -> P0 (alloc) */
-    memset(req,0,sizeof(req)); memset(alloc_,0,sizeof(alloc_));
-    req[0][0] = 1; alloc_[0][1] = 1;
-    req[1][1] = 1; alloc_[1][0] = 1;
+    rag_request(g, 0, 0, 1); rag_grant(g, 0, 1, 1);
+    rag_request(g, 1, 1, 1); rag_grant(g, 1, 0, 1);
+    rag_set_avoidance(g, set.avoidance);
+    check_memory(g);
+}
+
+void sample_prefill(void) {
+    printf("Graph reset.\n");
+    load_sample(G);
     printf("Sample graph loaded (P0<->P1 cycle). Use Detect Deadlock to test.\n");
 }
 
-/* ---- Main menu ---- */
-void print_menu(void) {
-    printf("\n===== RAG SIMULATOR (C) =====\n");
-    printf("1) Add Process\n");
-    printf("2) Add Resource\n");
-    printf("3) Add Request Edge (P -> R)\n");
-    printf("4) Add Allocation Edge (R -> P)\n");
-    printf("5) Remove an Edge\n");
-    printf("6) Display Graph\n");
-    printf("7) Detect Deadlock\n");
-    printf("8) Reset Graph\n");
-    printf("9) Load Sample Example (quick test)\n");
-    printf("0) Exit\n");
-    printf("=============================\n");
+/* ---- Snapshot menus ---- */
+void set_units_menu(void) {
+    int nr = rag_resource_count(G);
+    if (nr == 0) { printf("No resources present.\n"); return; }
+    for (int j = 0; j < nr; ++j) {
+        printf("  %d: %s (%d instance(s), %d in use)\n", j, rag_resource_name(G, j), rag_units(G, j),
+               rag_in_use(G, j));
+    }
+    int r = read_int("Enter resource index -> ", 0, nr-1);
+    int n = read_int("Number of instances -> ", 1, INT_MAX);
+    int rc = rag_set_units(G, r, n);
+    check_memory(G);
+    if (rc < 0) {
+        printf("Cannot go below the %d unit(s) currently allocated.\n", rag_in_use(G, r));
+        return;
+    }
+    printf("Resource %s now has %d instance(s).\n", rag_resource_name(G, r), n);
+}
+
+void save_snapshot_menu(void) {
+    char path[256];
+    read_string("Snapshot file to write: ", path, sizeof(path));
+    if (strlen(path) == 0) { printf("Empty path. Aborted.\n"); return; }
+    const char *why = rag_save(G, path);
+    if (why) printf("Could not save snapshot: %s.\n", why);
+    else printf("Saved %d processes, %d resources to %s.\n", rag_process_count(G), rag_resource_count(G), path);
+}
+
+void load_snapshot_menu(void) {
+    char path[256];
+    read_string("Snapshot file to load: ", path, sizeof(path));
+    if (strlen(path) == 0) { printf("Empty path. Aborted.\n"); return; }
+    const char *why = rag_load(G, path);
+    check_memory(G);
+    if (why) printf("Could not load snapshot: %s.\n", why);
+    else printf("Loaded %d processes, %d resources from %s.\n", rag_process_count(G), rag_resource_count(G), path);
 }
 
-int main(void) {
-    /* initialize */
-    memset(req, 0, sizeof(req));
-    memset(alloc_, 0, sizeof(alloc_));
-    memset(P, 0, sizeof(P));
-    memset(R, 0, sizeof(R));
+/* ---- Version history queries ----
+   Post-mortem views of a recorded history (batch "history", replay
+   --history). A version is checked out into a scratch graph that takes
+   the engine settings of the graph it came from, so these never disturb
+   the live graph. Versions are stamped with the script line or trace
+   event that produced them, and a time (ms since "history on", or the
+   trace's "ts").
+*/
+static rag_graph *hist_view;
 
+static void history_status(const rag_graph *g) {
+    int n = rag_history_count(g);
+    double ts0 = 0, ts1 = 0;
+    long long tag;
+    if (!rag_history_version(g, 0, &ts0, &tag)) { printf("history: off\n"); return; }
+    rag_history_version(g, n - 1, &ts1, &tag);
+    size_t bytes = rag_history_bytes(g);
+    printf("history: %d version(s) from ts %g to %g, %zu KB (%.0f bytes/version)\n", n, ts0, ts1,
+           bytes / 1024, n ? (double)bytes / n : 0.0);
+}
+
+/* The scratch graph, with the engine settings of g */
+static rag_graph *history_scratch(const rag_graph *g) {
+    struct rag_settings set;
+    if (hist_view == NULL && (hist_view = rag_create()) == NULL) { fprintf(stderr, "Out of memory.\n"); exit(1); }
+    rag_settings(g, &set);
+    rag_set_engine(hist_view, set.engine);
+    rag_set_threads(hist_view, set.threads);
+    rag_set_shards(hist_view, set.shards);
+    return hist_view;
+}
+
+/* Run the configured engine on version v and print the result */
+static void history_show(const rag_graph *g, int v, const char *tag_name) {
+    double ts;
+    long long tag;
+    if (!rag_history_version(g, v, &ts, &tag)) return;
+    rag_graph *view = history_scratch(g);
+    rag_history_checkout(g, v, view);
+    check_memory(view);
+    struct rag_counts c;
+    rag_counts(view, &c);
+    int found = c.processes > 0 ? rag_detect(view) : 0;
+    check_memory(view);
+    printf("version %d (%s %lld, ts %g): %d processes, %d resources, %d wait edges\n", v, tag_name, tag, ts,
+           c.processes, c.resources, c.wait_edges);
+    detect_print(view, rag_pick_engine(view), found);
+}
+
+/* Bisect for the first version with a deadlock (involving proc) */
+static void history_report_first(const rag_graph *g, const char *proc, const char *tag_name) {
+    int v = rag_history_bisect(g, proc, history_scratch(g));
+    check_memory(hist_view);
+    if (v < 0) {
+        printf("history: no deadlock%s%s in the latest version\n", proc ? " involving " : "", proc ? proc : "");
+        return;
+    }
+    printf("history: first deadlock%s%s at version %d%s\n", proc ? " involving " : "", proc ? proc : "", v,
+           v == 0 ? " (already in the first version)" : "");
+    history_show(g, v, tag_name);
+}
+
+/* ---- Batch / script mode ----
+   One command per line, whitespace separated, '#' starts a comment:
+     proc NAME            add a process
+     res NAME             add a resource
+     units R N            give resource R N instances
+     req P R [N]          request edge P -> R (N units, default 1)
+     alloc R P [N]        allocation edge R -> P: a single-instance resource
+                          is overridden, a pool grants N free units
+     unreq P R            remove a request edge
+     free R P [N]         release N units (default: all of them)
+     detect               run deadlock detection
+     resolve              preempt the cheapest victims until no wait cycle is left
+     renumber             lay nodes out in RCM order for traversal locality
+     prio P N             priority of P for victim selection (default 0)
+     cost H P A           victim cost weights: units held, priority, age
+     show [FILE]          print the RAG (to FILE, overwritten)
+     format text|json|csv|dot|summary
+                          layout of show and of deadlock reports (see
+                          "Buffered output"); summary prints counts only
+     reset | sample       clear the graph / load the sample
+     online on|off        online detection
+     avoid on|off         refuse req/alloc that would close a wait cycle
+     lockdep [on|off]     lock-order analysis: report resources taken against
+                          an order seen before; no argument prints its counters
+     engine auto|dfs|dense|scc|banker|parallel|sharded|small
+     threads N            worker threads for the parallel engine (0: all CPUs)
+     shards N             shards for the sharded engine (HOST:THREAD names by HOST)
+     schedule [off | MS K] detect every MS ms or every K mutations (0: never);
+                          no arguments prints the schedule and its counters
+     metrics [json | off | every MS FILE|-]
+                          print counters (Prometheus text, or one JSON line),
+                          or append a JSON line to FILE every MS ms
+     save FILE | load FILE   binary snapshot
+     history on|off       record a version of the graph after every command
+                          that changes it (off drops the versions)
+     history [detect V | at MS | bisect [P] | checkout V]
+                          summary; detection on version V, or on the version
+                          current MS ms after "history on"; bisect for the
+                          first version with a deadlock (involving P); make
+                          version V the current graph
+   Names used in req/alloc that do not exist yet are created on the fly,
+   so a lock trace can be replayed without declaring every node. Input is
+   read through a large buffer; nothing is printed except command output
+   and errors (on stderr, with the line number).
+*/
+#define BATCH_BUFSZ  (1 << 16)
+#define BATCH_LINEMAX 512
+#define BATCH_MAXTOK  8
+
+struct batch_reader {
+    FILE *f;
+    char buf[BATCH_BUFSZ];
+    size_t pos;
+    size_t len;
+    long line;
+};
+
+/* Read the next line into 'line' (NUL-terminated, truncated to fit).
+   Returns 0 at end of input. */
+static int batch_read_line(struct batch_reader *br, char *line, size_t linesz) {
+    size_t n = 0;
+    int got = 0;
+    for (;;) {
+        if (br->pos == br->len) {
+            br->len = fread(br->buf, 1, sizeof(br->buf), br->f);
+            br->pos = 0;
+            if (br->len == 0) break;
+        }
+        got = 1;
+        char *start = br->buf + br->pos;
+        char *nl = memchr(start, '\n', br->len - br->pos);
+        size_t chunk = nl ? (size_t)(nl - start) : br->len - br->pos;
+        size_t keep = chunk < linesz - 1 - n ? chunk : linesz - 1 - n;
+        memcpy(line + n, start, keep);
+        n += keep;
+        br->pos += chunk;
+        if (nl) { br->pos++; break; }
+    }
+    line[n] = '\0';
+    if (got) br->line++;
+    return got;
+}
+
+/* Split in place; returns the token count (comments stripped) */
+static int batch_tokenize(char *line, char **tok, int maxtok) {
+    int n = 0;
+    char *s = line;
+    while (*s && n < maxtok) {
+        while (*s == ' ' || *s == '\t' || *s == '\r') s++;
+        if (*s == '\0' || *s == '#') break;
+        tok[n++] = s;
+        while (*s && *s != ' ' && *s != '\t' && *s != '\r' && *s != '#') s++;
+        if (*s == '#') { *s = '\0'; break; }
+        if (*s) *s++ = '\0';
+    }
+    return n;
+}
+
+static int batch_valid_name(const char *name) {
+    return name[0] != '\0' && strlen(name) < RAG_NAME_MAX;
+}
+
+static int batch_process(rag_graph *g, const char *name) {
+    int p = rag_find_process(g, name);
+    return p >= 0 ? p : rag_process(g, name);
+}
+
+static int batch_resource(rag_graph *g, const char *name) {
+    int r = rag_find_resource(g, name);
+    return r >= 0 ? r : rag_resource(g, name);
+}
+
+static void batch_error(const struct batch_reader *br, const char *msg, const char *arg) {
+    fprintf(stderr, "line %ld: %s%s%s\n", br->line, msg, arg ? ": " : "", arg ? arg : "");
+}
+
+static double hist_t0;  /* batch history time stamps count from "history on" */
+
+/* Run a script from 'f'. Returns the number of lines that failed. */
+int run_batch(FILE *f) {
+    static struct batch_reader br;
+    rag_graph *g = G;
+    char line[BATCH_LINEMAX];
+    char *tok[BATCH_MAXTOK];
+    int errors = 0;
+    br.f = f;
+    br.pos = br.len = 0;
+    br.line = 0;
+    while (batch_read_line(&br, line, sizeof(line))) {
+        int nt = batch_tokenize(line, tok, BATCH_MAXTOK);
+        if (nt == 0) continue;
+        const char *cmd = tok[0];
+        int want = -1; /* argument count */
+        int opt = 0;  /* trailing optional unit count */
+        if (!strcmp(cmd, "proc") || !strcmp(cmd, "res") || !strcmp(cmd, "online") || !strcmp(cmd, "avoid") ||
+            !strcmp(cmd, "engine") || !strcmp(cmd, "save") || !strcmp(cmd, "load") ||
+            !strcmp(cmd, "format")) want = 1;
+        else if (!strcmp(cmd, "req") || !strcmp(cmd, "alloc") || !strcmp(cmd, "free")) want = 2, opt = 1;
+        else if (!strcmp(cmd, "unreq") || !strcmp(cmd, "units") || !strcmp(cmd, "prio")) want = 2;
+        else if (!strcmp(cmd, "cost")) want = 3;
+        else if (!strcmp(cmd, "threads") || !strcmp(cmd, "shards")) want = 1;
+        else if (!strcmp(cmd, "schedule") && nt <= 3) want = nt - 1;
+        else if (!strcmp(cmd, "metrics") && nt <= 4) want = nt - 1;
+        else if (!strcmp(cmd, "history") && nt <= 3) want = nt - 1;
+        else if (!strcmp(cmd, "lockdep") && nt <= 2) want = nt - 1;
+        else if (!strcmp(cmd, "show") && nt <= 2) want = nt - 1;
+        else if (!strcmp(cmd, "detect") || !strcmp(cmd, "reset") ||
+                 !strcmp(cmd, "sample") || !strcmp(cmd, "resolve") || !strcmp(cmd, "renumber")) want = 0;
+        if (want < 0) { batch_error(&br, "unknown command", cmd); errors++; continue; }
+        if (nt - 1 != want && nt - 1 != want + opt) {
+            batch_error(&br, "wrong number of arguments for", cmd); errors++; continue;
+        }
+        if (want == 2 && (!batch_valid_name(tok[1]) ||
+                          (strcmp(cmd, "units") && strcmp(cmd, "prio") && !batch_valid_name(tok[2])))) {
+            batch_error(&br, "name too long", cmd); errors++; continue;
+        }
+        int k = 1;
+        const char *num = !strcmp(cmd, "units") ? tok[2] : (nt - 1 > want ? tok[want + 1] : NULL);
+        if (num) {
+            char *end;
+            long v = strtol(num, &end, 10);
+            if (*end != '\0' || v < 1 || v > INT_MAX) { batch_error(&br, "bad unit count", num); errors++; continue; }
+            k = (int)v;
+        }
+        struct rag_settings set;
+        rag_settings(g, &set);
+
+        if (!strcmp(cmd, "proc") || !strcmp(cmd, "res")) {
+            int is_proc = cmd[0] == 'p';
+            if (!batch_valid_name(tok[1])) { batch_error(&br, "name too long", tok[1]); errors++; continue; }
+            if ((is_proc ? rag_find_process(g, tok[1]) : rag_find_resource(g, tok[1])) >= 0) {
+                batch_error(&br, "duplicate name", tok[1]); errors++; continue;
+            }
+            if (is_proc) rag_process(g, tok[1]);
+            else rag_resource(g, tok[1]);
+        } else if (!strcmp(cmd, "units")) {
+            int r = batch_resource(g, tok[1]);
+            if (rag_set_units(g, r, k) == RAG_EINVAL) {
+                batch_error(&br, "fewer units than allocated", tok[1]); errors++;
+            }
+        } else if (!strcmp(cmd, "req")) {
+            int p = batch_process(g, tok[1]), r = batch_resource(g, tok[2]);
+            int rc = rag_request(g, p, r, k);
+            if (rc == RAG_EUNSAFE) avoid_print_refusal(g, "request", p, r);
+            else if (rc == RAG_EINVAL) { batch_error(&br, "more units than the resource has", tok[2]); errors++; }
+        } else if (!strcmp(cmd, "alloc")) {
+            int r = batch_resource(g, tok[1]), p = batch_process(g, tok[2]);
+            int rc = rag_units(g, r) == 1 && k == 1 ? rag_assign(g, r, p) : rag_grant(g, r, p, k);
+            if (rc == RAG_EUNSAFE) avoid_print_refusal(g, "grant", p, r);
+            else if (rc == RAG_EINVAL) { batch_error(&br, "not enough free units", tok[1]); errors++; }
+        } else if (!strcmp(cmd, "unreq")) {
+            int p = rag_find_process(g, tok[1]), r = rag_find_resource(g, tok[2]);
+            if (p < 0 || r < 0 || rag_cancel(g, p, r) <= 0) {
+                batch_error(&br, "no such request edge", tok[1]); errors++;
+            }
+        } else if (!strcmp(cmd, "free")) {
+            int r = rag_find_resource(g, tok[1]), p = rag_find_process(g, tok[2]);
+            if (p < 0 || r < 0 || rag_release(g, r, p, num ? k : 0) <= 0) {
+                batch_error(&br, "no such allocation edge", tok[1]); errors++;
+            }
+        } else if (!strcmp(cmd, "prio")) {
+            char *end;
+            long v = strtol(tok[2], &end, 10);
+            if (*end != '\0' || v < 0 || v > INT_MAX) { batch_error(&br, "bad priority", tok[2]); errors++; }
+            else rag_set_priority(g, batch_process(g, tok[1]), (int)v);
+        } else if (!strcmp(cmd, "cost")) {
+            char *e1, *e2, *e3;
+            double h = strtod(tok[1], &e1), pr = strtod(tok[2], &e2), a = strtod(tok[3], &e3);
+            if (*e1 || *e2 || *e3 || !(h >= 0) || !(pr >= 0) || !(a >= 0)) {
+                batch_error(&br, "expected HELD PRIO AGE weights >= 0", tok[1]); errors++;
+            } else {
+                vpolicy.held = h;
+                vpolicy.prio = pr;
+                vpolicy.age = a;
+            }
+        } else if (!strcmp(cmd, "resolve")) {
+            if (rag_process_count(g) > 0) resolve_verbose(g);
+        } else if (!strcmp(cmd, "renumber")) {
+            rag_renumber(g);
+        } else if (!strcmp(cmd, "detect")) {
+            detect_deadlock();
+        } else if (!strcmp(cmd, "show")) {
+            FILE *out = nt == 2 ? fopen(tok[1], "w") : stdout;
+            if (out == NULL) { batch_error(&br, "cannot open", tok[1]); errors++; }
+            else {
+                graph_dump(out, g, out_format);
+                if (out != stdout && fclose(out) != 0) { batch_error(&br, "write failed", tok[1]); errors++; }
+            }
+        } else if (!strcmp(cmd, "format")) {
+            int fmt = out_format_parse(tok[1]);
+            if (fmt < 0) { batch_error(&br, "expected text, json, csv, dot or summary", tok[1]); errors++; }
+            else out_format = fmt;
+        } else if (!strcmp(cmd, "reset")) {
+            rag_clear(g);
+        } else if (!strcmp(cmd, "sample")) {
+            load_sample(g);
+        } else if (!strcmp(cmd, "online")) {
+            if (!strcmp(tok[1], "on")) set_online(g, 1);
+            else if (!strcmp(tok[1], "off")) set_online(g, 0);
+            else { batch_error(&br, "expected on|off", tok[1]); errors++; }
+        } else if (!strcmp(cmd, "avoid")) {
+            if (!strcmp(tok[1], "on")) set_avoid(g, 1);
+            else if (!strcmp(tok[1], "off")) set_avoid(g, 0);
+            else { batch_error(&br, "expected on|off", tok[1]); errors++; }
+        } else if (!strcmp(cmd, "lockdep")) {
+            if (nt == 1) lockdep_status(g);
+            else if (!strcmp(tok[1], "on")) set_lockdep(g, 1);
+            else if (!strcmp(tok[1], "off")) set_lockdep(g, 0);
+            else { batch_error(&br, "expected on|off", tok[1]); errors++; }
+        } else if (!strcmp(cmd, "engine")) {
+            int e = -1;
+            for (int i = 0; i < RAG_ENGINES; ++i) {
+                if (!strcmp(tok[1], engine_keys[i])) e = i;
+            }
+            if (e < 0) { batch_error(&br, "unknown engine", tok[1]); errors++; }
+            else rag_set_engine(g, e);
+        } else if (!strcmp(cmd, "threads")) {
+            char *end;
+            long v = strtol(tok[1], &end, 10);
+            if (*end != '\0' || v < 0 || v > 1024) { batch_error(&br, "bad thread count", tok[1]); errors++; }
+            else rag_set_threads(g, (int)v);
+        } else if (!strcmp(cmd, "shards")) {
+            char *end;
+            long v = strtol(tok[1], &end, 10);
+            if (*end != '\0' || v < 1 || v > 4096) { batch_error(&br, "bad shard count", tok[1]); errors++; }
+            else rag_set_shards(g, (int)v);
+        } else if (!strcmp(cmd, "save") || !strcmp(cmd, "load")) {
+            const char *why = cmd[0] == 's' ? rag_save(g, tok[1]) : rag_load(g, tok[1]);
+            if (why) { batch_error(&br, why, tok[1]); errors++; }
+        } else if (!strcmp(cmd, "schedule")) {
+            if (nt == 1) print_schedule();
+            else if (nt == 2 && !strcmp(tok[1], "off")) sched.enabled = 0;
+            else if (nt == 3) {
+                char *e1, *e2;
+                long ms = strtol(tok[1], &e1, 10), muts = strtol(tok[2], &e2, 10);
+                if (*e1 || *e2 || ms < 0 || muts < 0 || ms > INT_MAX || muts > INT_MAX) {
+                    batch_error(&br, "expected PERIOD_MS MUTATIONS", tok[1]); errors++;
+                } else {
+                    sched.period_ms = (int)ms;
+                    sched.mutations = (int)muts;
+                    sched.enabled = ms > 0 || muts > 0;
+                }
+            } else { batch_error(&br, "expected off or PERIOD_MS MUTATIONS", tok[1]); errors++; }
+        } else if (!strcmp(cmd, "metrics")) {
+            if (nt == 1) rag_metrics_prometheus(stdout, g);
+            else if (nt == 2 && !strcmp(tok[1], "json")) rag_metrics_json(stdout, g);
+            else if (nt == 2 && !strcmp(tok[1], "off")) metrics_every(NULL, 0);
+            else if (nt == 4 && !strcmp(tok[1], "every")) {
+                char *end;
+                long ms = strtol(tok[2], &end, 10);
+                FILE *out = NULL;
+                if (*end || ms < 0 || ms > INT_MAX) { batch_error(&br, "bad period", tok[2]); errors++; }
+                else if ((out = strcmp(tok[3], "-") ? fopen(tok[3], "a") : stdout) == NULL) {
+                    batch_error(&br, "cannot open", tok[3]); errors++;
+                }
+                else metrics_every(out, (int)ms);
+            } else { batch_error(&br, "expected json, off or every MS FILE|-", tok[1]); errors++; }
+        } else if (!strcmp(cmd, "history")) {
+            char *end = NULL;
+            long v = nt == 3 ? strtol(tok[2], &end, 10) : -1;
+            if (nt == 1) history_status(g);
+            else if (nt == 2 && !strcmp(tok[1], "on")) {
+                if (!set.history) hist_t0 = rag_now_ms();
+                rag_set_history(g, 1);
+                rag_history_commit(g, 0, br.line);
+            } else if (nt == 2 && !strcmp(tok[1], "off")) rag_set_history(g, 0);
+            else if (!set.history) { batch_error(&br, "history is off", tok[1]); errors++; }
+            else if (!strcmp(tok[1], "bisect")) history_report_first(g, nt == 3 ? tok[2] : NULL, "line");
+            else if (nt == 3 && !strcmp(tok[1], "at")) {
+                double ms = strtod(tok[2], &end);
+                int at = *end || !(ms >= 0) ? -1 : rag_history_at(g, ms);
+                if (at < 0) { batch_error(&br, "no version at", tok[2]); errors++; }
+                else history_show(g, at, "line");
+            } else if (nt == 3 && (!strcmp(tok[1], "detect") || !strcmp(tok[1], "checkout"))) {
+                if (*end || v < 0 || v >= rag_history_count(g)) {
+                    batch_error(&br, "no such version", tok[2]); errors++;
+                }
+                else if (tok[1][0] == 'd') history_show(g, (int)v, "line");
+                else rag_history_checkout(g, (int)v, g);
+            } else { batch_error(&br, "expected on, off, detect V, at MS, bisect [P] or checkout V", tok[1]); errors++; }
+        }
+        rag_history_commit(g, rag_now_ms() - hist_t0, br.line);   /* RAG_EINVAL while history is off */
+        check_memory(g);
+        if (sched.enabled) sched_tick(g);
+        metrics_tick(g);
+    }
+    return errors;
+}
+
+/* ---- Benchmark harness ----
+   ./rag --bench [KIND|all] [N] [SEED] builds synthetic RAGs and times graph
+   construction, a full build_wfg and each applicable detection engine
+   separately. Kinds (single-instance resources, one held per process):
+     sparse  each process waits on DEG random others
+     dense   each process waits on a quarter of all processes (N <= 4096)
+     chain   p0 -> p1 -> ... -> pN-1, acyclic and as deep as possible
+     cycles  N/3 disjoint 3-process cycles
+     giant   the chain closed into one N-process SCC
+     dag     each process waits on DEG random higher-numbered ones (acyclic)
+     mesh    a torus where every process waits on its right and lower
+             neighbours, numbered in random order (one SCC, good locality
+             hidden by the numbering: the case renumbering is for)
+*/
+#define BENCH_DEG       4
+#define BENCH_DENSE_MAX 4096
+#define BENCH_AVOID_CHECKS 10000
+#define BENCH_SMALL_RUNS   100000   /* small-graph kernel: runs per timing */
+
+static long peak_rss_kb(void) {
+    struct rusage ru;
+    return getrusage(RUSAGE_SELF, &ru) == 0 ? ru.ru_maxrss : -1;
+}
+
+/* Process i holds resource i; a wait i -> j is the request i -> Rj */
+static void bench_generate(rag_graph *g, const char *kind, int n, uint64_t seed) {
+    char name[RAG_NAME_MAX];
+    rag_clear(g);
+    for (int i = 0; i < n; ++i) {
+        snprintf(name, sizeof(name), "t%d", i);
+        rag_process(g, name);
+        snprintf(name, sizeof(name), "m%d", i);
+        rag_resource(g, name);
+        rag_grant(g, i, i, 1);
+    }
+    if (!strcmp(kind, "sparse") || !strcmp(kind, "dense")) {
+        int deg = kind[0] == 's' ? BENCH_DEG : n / 4;
+        for (int i = 0; i < n; ++i) {
+            for (int k = 0; k < deg; ++k) rag_request(g, i, (int)(rng_next(&seed) % (uint64_t)n), 1);
+        }
+    } else if (!strcmp(kind, "chain") || !strcmp(kind, "giant")) {
+        for (int i = 0; i + 1 < n; ++i) rag_request(g, i, i + 1, 1);
+        if (kind[0] == 'g' && n > 1) rag_request(g, n - 1, 0, 1);
+    } else if (!strcmp(kind, "dag")) {
+        for (int i = 0; i + 1 < n; ++i) {
+            for (int k = 0; k < BENCH_DEG; ++k) {
+                rag_request(g, i, i + 1 + (int)(rng_next(&seed) % (uint64_t)(n - 1 - i)), 1);
+            }
+        }
+    } else if (!strcmp(kind, "mesh")) {
+        int side = 1;
+        while ((long long)(side + 1) * (side + 1) <= n) side++;
+        int cells = side * side;
+        int *at = xrealloc(NULL, (size_t)cells * sizeof(int)); /* cell -> process */
+        for (int i = 0; i < cells; ++i) at[i] = i;
+        for (int i = cells - 1; i > 0; --i) {
+            int j = (int)(rng_next(&seed) % (uint64_t)(i + 1)), t = at[i];
+            at[i] = at[j];
+            at[j] = t;
+        }
+        for (int y = 0; y < side; ++y) {
+            for (int x = 0; x < side; ++x) {
+                int p = at[y * side + x];
+                rag_request(g, p, at[y * side + (x + 1) % side], 1);
+                rag_request(g, p, at[(y + 1) % side * side + x], 1);
+            }
+        }
+        free(at);
+    } else if (!strcmp(kind, "cycles")) {
+        for (int i = 0; i + 2 < n; i += 3) {
+            rag_request(g, i, i + 1, 1);
+            rag_request(g, i + 1, i + 2, 1);
+            rag_request(g, i + 2, i, 1);
+        }
+    }
+    check_memory(g);
+}
+
+static void bench_line(const char *what, double ms, long long edges, const char *note) {
+    printf("  %-14s %10.3f ms", what, ms);
+    if (edges > 0 && ms > 0) printf("  %8.2f M edges/s", edges / ms / 1e3);
+    else printf("  %17s", "");
+    printf("  %s\n", note);
+}
+
+static void bench_skip(const char *what, const char *why) {
+    printf("  %-14s %13s  %17s  skipped (%s)\n", what, "-", "", why);
+}
+
+/* One timed run of engine on b */
+static int bench_detect(rag_graph *b, int engine, double *ms) {
+    rag_set_engine(b, engine);
+    double t0 = rag_now_ms();
+    int found = rag_detect(b);
+    *ms = rag_now_ms() - t0;
+    check_memory(b);
+    return found;
+}
+
+static void bench_kind(const char *kind, int n, uint64_t seed) {
+    rag_graph *b = rag_create();
+    if (b == NULL) { fprintf(stderr, "Out of memory.\n"); exit(1); }
+    if (!strcmp(kind, "dense") && n > BENCH_DENSE_MAX) n = BENCH_DENSE_MAX;
+    rag_set_incremental(b, 0);  /* time full passes; "detect dirty" below is the exception */
+
+    double t0 = rag_now_ms(), ms;
+    bench_generate(b, kind, n, seed);
+    double t_build = rag_now_ms() - t0;
+    struct rag_counts c;
+    rag_counts(b, &c);
+    long long rag_edges = (long long)c.requests + c.allocations;
+    printf("== %s: %d processes, %d resources, %d request / %d allocation edges\n",
+           kind, c.processes, c.resources, c.requests, c.allocations);
+    bench_line("construct", t_build, rag_edges, "(incremental WFG included)");
+
+    char note[96];
+    t0 = rag_now_ms();
+    long long we = rag_rebuild(b);
+    check_memory(b);
+    snprintf(note, sizeof(note), "%lld wait edges", we);
+    bench_line("build_wfg", rag_now_ms() - t0, rag_edges, note);
+
+    int found = bench_detect(b, RAG_ENGINE_DFS, &ms);
+    bench_line("detect dfs", ms, we, found ? "deadlock" : "no deadlock");
+    if (c.processes <= RAG_DENSE_MAX) {
+        int found = bench_detect(b, RAG_ENGINE_DENSE, &ms);
+        snprintf(note, sizeof(note), "%s, incl. packing", found ? "deadlock" : "no deadlock");
+        bench_line("detect dense", ms, we, note);
+    } else {
+        bench_skip("detect dense", "too many processes");
+    }
+    int sets = bench_detect(b, RAG_ENGINE_SCC, &ms);
+    snprintf(note, sizeof(note), "%d deadlocked set(s)", sets);
+    bench_line("detect scc", ms, we, note);
+    /* a single run is below the timer resolution: time a batch of each */
+    if (c.processes <= RAG_SMALL_MAX) {
+        rag_set_engine(b, RAG_ENGINE_SMALL);
+        t0 = rag_now_ms();
+        for (int i = 0; i < BENCH_SMALL_RUNS; ++i) sets = rag_detect(b);
+        double small_ms = rag_now_ms() - t0;
+        rag_set_engine(b, RAG_ENGINE_SCC);
+        t0 = rag_now_ms();
+        for (int i = 0; i < BENCH_SMALL_RUNS; ++i) rag_detect(b);
+        double scc_ms = rag_now_ms() - t0;
+        snprintf(note, sizeof(note), "%d deadlocked set(s), %.0f ns/run vs %.0f ns Tarjan",
+                 sets, small_ms * 1e6 / BENCH_SMALL_RUNS, scc_ms * 1e6 / BENCH_SMALL_RUNS);
+        bench_line("detect small", small_ms, we * BENCH_SMALL_RUNS, note);
+    } else {
+        bench_skip("detect small", "too many processes");
+    }
+    /* one request withdrawn and re-issued in the middle of the graph */
+    int mid = c.processes / 2;
+    const int *res, *units;
+    if (rag_requests(b, mid, &res, &units) > 0) {
+        int r = res[0], k = units[0];
+        rag_cancel(b, mid, r);
+        rag_request(b, mid, r, k);
+        rag_set_incremental(b, 1);
+        int dsets = bench_detect(b, RAG_ENGINE_SCC, &ms);
+        rag_set_incremental(b, 0);
+        snprintf(note, sizeof(note), "%d deadlocked set(s) after 1 local change", dsets);
+        bench_line("detect dirty", ms, 0, note);
+    }
+    int psets = bench_detect(b, RAG_ENGINE_PARALLEL, &ms);
+    snprintf(note, sizeof(note), "%d deadlocked set(s), %d thread(s)", psets, rag_thread_count(b));
+    bench_line("detect parallel", ms, we, note);
+    int ssets = bench_detect(b, RAG_ENGINE_SHARDED, &ms);
+    snprintf(note, sizeof(note), "%d deadlocked set(s), %d shards, %lld of %lld edges cross",
+             ssets, rag_shard_stats(b)->shards, rag_shard_stats(b)->cross, we);
+    bench_line("detect sharded", ms, we, note);
+    int stuck = bench_detect(b, RAG_ENGINE_BANKER, &ms);
+    snprintf(note, sizeof(note), "%d stuck process(es)", stuck);
+    bench_line("detect banker", ms, rag_edges, note);
+    /* the same graph laid out in RCM order */
+    double span = rag_edge_span(b);
+    t0 = rag_now_ms();
+    rag_renumber(b);
+    check_memory(b);
+    snprintf(note, sizeof(note), "mean edge span %.0f -> %.0f rows", span, rag_edge_span(b));
+    bench_line("renumber", rag_now_ms() - t0, rag_edges, note);
+    sets = bench_detect(b, RAG_ENGINE_SCC, &ms);
+    snprintf(note, sizeof(note), "%d deadlocked set(s), RCM order", sets);
+    bench_line("detect scc", ms, we, note);
+    /* random pre-request avoidance checks against a fresh order */
+    if (rag_set_avoidance(b, 1) > 0) {
+        int refused = 0;
+        unsigned long long searched = rag_metric(b, "rag_avoid_searches_total");
+        t0 = rag_now_ms();
+        for (int i = 0; i < BENCH_AVOID_CHECKS; ++i) {
+            int p = (int)(rng_next(&seed) % (uint64_t)n), r = (int)(rng_next(&seed) % (uint64_t)n);
+            refused += rag_check_request(b, p, r) > 0;
+        }
+        ms = rag_now_ms() - t0;
+        searched = rag_metric(b, "rag_avoid_searches_total") - searched;
+        snprintf(note, sizeof(note), "%.0f ns/check, %d of %d refused, %llu searched",
+                 ms * 1e6 / BENCH_AVOID_CHECKS, refused, BENCH_AVOID_CHECKS, searched);
+        bench_line("avoid check", ms, 0, note);
+    } else {
+        bench_skip("avoid check", "WFG already cyclic");
+    }
+    rag_set_avoidance(b, 0);
+    check_memory(b);
+    /* last: preempting victims changes the graph */
+    t0 = rag_now_ms();
+    int victims = rag_resolve(b, NULL, NULL, NULL);
+    snprintf(note, sizeof(note), "%d victim(s), then %d deadlocked set(s)", victims, rag_detect(b));
+    check_memory(b);
+    bench_line("resolve", rag_now_ms() - t0, 0, note);
+    rag_destroy(b);
+    printf("  peak RSS so far %ld KB\n", peak_rss_kb());
+}
+
+/* Live monitor throughput: producer threads take shared locks in a fixed
+   global order (so no deadlock), posting 6 events per round. */
+#define BENCH_LOCKS 16
+
+struct bench_producer {
+    pthread_t tid;
+    rag_monitor *mon;
+    int p;
+    int rounds;
+    int *locks;
+    uint64_t seed;
+    double ms;
+};
+
+static void *bench_producer_main(void *arg) {
+    struct bench_producer *b = arg;
+    double t0 = rag_now_ms();
+    for (int i = 0; i < b->rounds; ++i) {
+        int a = (int)(rng_next(&b->seed) % (BENCH_LOCKS - 1));
+        int c = a + 1 + (int)(rng_next(&b->seed) % (uint64_t)(BENCH_LOCKS - 1 - a));
+        rag_monitor_request(b->mon, b->p, b->locks[a], 1);
+        rag_monitor_acquire(b->mon, b->locks[a], b->p, 1);
+        rag_monitor_request(b->mon, b->p, b->locks[c], 1);
+        rag_monitor_acquire(b->mon, b->locks[c], b->p, 1);
+        rag_monitor_release(b->mon, b->locks[c], b->p, 1);
+        rag_monitor_release(b->mon, b->locks[a], b->p, 1);
+    }
+    b->ms = rag_now_ms() - t0;
+    return NULL;
+}
+
+static void bench_ingest(int n, uint64_t seed) {
+    int threads = rag_thread_count(G) < 2 ? 2 : rag_thread_count(G);
+    if (threads > 64) threads = 64;
+    int rounds = n / (6 * threads) > 0 ? n / (6 * threads) : 1;
+    long long events = 6LL * rounds * threads;
+    printf("== ingest: %d producer thread(s), %d locks, %lld events\n", threads, BENCH_LOCKS, events);
+
+    int locks[BENCH_LOCKS];
+    struct bench_producer prod[64];
+    char name[RAG_NAME_MAX];
+    rag_graph *b = rag_create();
+    rag_monitor *mon = b ? rag_monitor_start(b, 0, 1, NULL, NULL) : NULL;
+    if (mon == NULL) {
+        printf("  cannot start the monitor thread\n");
+        rag_destroy(b);
+        return;
+    }
+    for (int i = 0; i < BENCH_LOCKS; ++i) {
+        snprintf(name, sizeof(name), "L%d", i);
+        locks[i] = rag_monitor_resource(mon, name, 1);
+    }
+    for (int i = 0; i < threads; ++i) {
+        snprintf(name, sizeof(name), "T%d", i);
+        prod[i].mon = mon;
+        prod[i].p = rag_monitor_process(mon, name);
+        prod[i].rounds = rounds;
+        prod[i].locks = locks;
+        prod[i].seed = seed + (uint64_t)i * 0x9e3779b97f4a7c15ULL;
+        if (prod[i].seed == 0) prod[i].seed = 42;
+    }
+    double t0 = rag_now_ms();
+    for (int i = 0; i < threads; ++i) pthread_create(&prod[i].tid, NULL, bench_producer_main, &prod[i]);
+    double post_ms = 0;
+    for (int i = 0; i < threads; ++i) {
+        pthread_join(prod[i].tid, NULL);
+        if (prod[i].ms > post_ms) post_ms = prod[i].ms;
+    }
+    rag_monitor_flush(mon);
+    double total_ms = rag_now_ms() - t0;
+
+    char note[96];
+    struct rag_monitor_stats st;
+    rag_monitor_stats(mon, &st);
+    snprintf(note, sizeof(note), "%.1f ns/event per producer, %llu ring-full stall(s)",
+             post_ms * 1e6 / ((double)events / threads), st.stalls);
+    bench_line("post", post_ms, 0, note);
+    snprintf(note, sizeof(note), "%.2f M events/s applied, %d deadlock(s)",
+             events / total_ms / 1e3, rag_monitor_deadlocks(mon));
+    bench_line("apply+detect", total_ms, 0, note);
+    rag_monitor_free(mon);
+    check_memory(b);
+    rag_destroy(b);
+    printf("  peak RSS so far %ld KB\n", peak_rss_kb());
+}
+
+int run_bench(int argc, char **argv) {
+    static const char *kinds[] = { "sparse", "dense", "chain", "cycles", "giant", "dag", "mesh" };
+    const char *kind = argc > 0 ? argv[0] : "all";
+    int n = argc > 1 ? atoi(argv[1]) : 100000;
+    uint64_t seed = argc > 2 ? strtoull(argv[2], NULL, 10) : 42;
+    if (n < 1) { fprintf(stderr, "bench: size must be positive\n"); return 2; }
+    if (seed == 0) seed = 42; /* xorshift needs a non-zero state */
+    int ran = 0;
+    for (int i = 0; i < (int)(sizeof(kinds) / sizeof(kinds[0])); ++i) {
+        if (strcmp(kind, "all") && strcmp(kind, kinds[i])) continue;
+        bench_kind(kinds[i], n, seed);
+        ran = 1;
+    }
+    if (!strcmp(kind, "all") || !strcmp(kind, "ingest")) {
+        bench_ingest(n, seed);
+        ran = 1;
+    }
+    if (!ran) {
+        fprintf(stderr, "bench: unknown kind '%s' (sparse, dense, chain, cycles, giant, dag, mesh, ingest, all)\n", kind);
+        return 2;
+    }
+    return 0;
+}
+
+/* ---- Trace replay ----
+   Replays a recorded lock trace event by event through the same fixed
+   batch_reader window, so memory depends on the number of distinct
+   threads, locks and live edges, never on the length of the trace.
+
+   JSONL, one flat object per line (other keys are ignored):
+     {"ts":12.5,"op":"request","proc":"T1","res":"db","units":1}
+     op    request | acquire | release | cancel, or units to size a pool
+     proc  (or thread / tid) and res (or lock): names or bare numbers
+     units optional count (default 1); a release of 0 frees all proc holds
+     ts    optional time stamp for --history (default: the event number)
+
+   Binary (written by --convert), after the 8-byte magic "RAGTRC1\n":
+     'P' len name                 the next process id
+     'R' len name units           the next resource id
+     'U' res units                resize a resource
+     'q'|'a'|'f'|'c' proc res k   request / acquire / free (k 0: all) / cancel
+   Every number is an unsigned LEB128 varint; ids count up from 0 in the
+   order they were defined.
+
+   Detection runs at a checkpoint every N events and at the end (unless
+   the last one ran there); a report is printed whenever a checkpoint
+   finds a different non-zero result.
+   With --history every event that changes the graph is committed as a
+   version, and a deadlock at the end is bisected back to the event that
+   first closed one. With --lockdep the lock order of every request and
+   acquisition is checked, reporting inversions that have not deadlocked
+   (yet).
+*/
+#define TRACE_MAGIC   "RAGTRC1\n"
+#define TRACE_MAXKEYS 16
+
+static int reader_byte(struct batch_reader *br) {
+    if (br->pos == br->len) {
+        br->len = fread(br->buf, 1, sizeof(br->buf), br->f);
+        br->pos = 0;
+        if (br->len == 0) return -1;
+    }
+    return (unsigned char)br->buf[br->pos++];
+}
+
+static int reader_varint(struct batch_reader *br, uint64_t *out) {
+    uint64_t v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int c = reader_byte(br);
+        if (c < 0) return 0;
+        v |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80)) { *out = v; return 1; }
+    }
+    return 0;
+}
+
+static void put_varint(FILE *f, uint64_t v) {
+    while (v >= 0x80) {
+        fputc((int)(v & 0x7f) | 0x80, f);
+        v >>= 7;
+    }
+    fputc((int)v, f);
+}
+
+static void put_name(FILE *f, int tag, const char *name) {
+    size_t len = strlen(name);
+    fputc(tag, f);
+    put_varint(f, len);
+    fwrite(name, 1, len, f);
+}
+
+/* Cut the next JSON string (\" \\ \/ escapes) or bare token out of *sp in
+   place. *next gets the first non-blank character after it, which is
+   consumed. Returns NULL on malformed input. */
+static char *json_value(char **sp, char *next, int want_string) {
+    char *s = *sp, *out, *end;
+    while (*s == ' ' || *s == '\t') s++;
+    if (*s == '"') {
+        out = end = ++s;
+        while (*s != '"') {
+            if (*s == '\0') return NULL;
+            if (*s == '\\' && *++s != '"' && *s != '\\' && *s != '/') return NULL;
+            *end++ = *s++;
+        }
+        s++;
+    } else {
+        if (want_string) return NULL;
+        out = s;
+        while (*s && !strchr(",}: \t\r", *s)) s++;
+        if (s == out) return NULL;
+        end = s;
+    }
+    while (*s == ' ' || *s == '\t' || *s == '\r') s++;
+    *next = *s;
+    if (*s) s++;
+    *end = '\0';
+    *sp = s;
+    return out;
+}
+
+/* Split a flat JSON object into key/value pointers (at most 'max' kept).
+   Returns the pair count, or -1 if the line is not such an object. */
+static int json_flat_parse(char *s, char **key, char **val, int max) {
+    int n = 0;
+    char sep;
+    while (*s == ' ' || *s == '\t') s++;
+    if (*s++ != '{') return -1;
+    while (*s == ' ' || *s == '\t') s++;
+    if (*s == '}') return 0;
+    for (;;) {
+        char *k = json_value(&s, &sep, 1);
+        if (k == NULL || sep != ':') return -1;
+        char *v = json_value(&s, &sep, 0);
+        if (v == NULL) return -1;
+        if (n < max) { key[n] = k; val[n] = v; n++; }
+        if (sep == '}') return n;
+        if (sep != ',') return -1;
+    }
+}
+
+static const char *json_get(char **key, char **val, int n, const char *a, const char *b, const char *c) {
+    for (int i = 0; i < n; ++i) {
+        if (!strcmp(key[i], a) || (b && !strcmp(key[i], b)) || (c && !strcmp(key[i], c))) return val[i];
+    }
+    return NULL;
+}
+
+/* One JSONL record: kind is a rag_event, or -1 to size a pool */
+struct trace_rec {
+    int kind;
+    const char *proc;
+    const char *res;
+    int k;
+    double ts;      /* -1 if the record has none */
+};
+
+/* Returns NULL, or why the line cannot be used */
+static const char *trace_parse_json(char *line, struct trace_rec *t) {
+    char *key[TRACE_MAXKEYS], *val[TRACE_MAXKEYS];
+    int n = json_flat_parse(line, key, val, TRACE_MAXKEYS);
+    if (n < 0) return "not a flat JSON object";
+    const char *op = json_get(key, val, n, "op", "event", NULL);
+    const char *units = json_get(key, val, n, "units", "n", NULL);
+    const char *ts = json_get(key, val, n, "ts", "time", NULL);
+    t->proc = json_get(key, val, n, "proc", "thread", "tid");
+    t->res = json_get(key, val, n, "res", "lock", NULL);
+    if (op == NULL) return "missing \"op\"";
+    if (!strcmp(op, "request")) t->kind = RAG_EV_REQUEST;
+    else if (!strcmp(op, "acquire")) t->kind = RAG_EV_ACQUIRE;
+    else if (!strcmp(op, "release")) t->kind = RAG_EV_RELEASE;
+    else if (!strcmp(op, "cancel")) t->kind = RAG_EV_CANCEL;
+    else if (!strcmp(op, "units")) t->kind = -1;
+    else return "unknown op";
+    if (t->res == NULL || !batch_valid_name(t->res)) return "missing or bad \"res\"";
+    if (t->kind >= 0 && (t->proc == NULL || !batch_valid_name(t->proc))) return "missing or bad \"proc\"";
+    t->k = 1;
+    if (units) {
+        char *end;
+        long v = strtol(units, &end, 10);
+        if (*end != '\0' || v < (t->kind == RAG_EV_RELEASE ? 0 : 1) || v > INT_MAX) return "bad unit count";
+        t->k = (int)v;
+    }
+    t->ts = -1;
+    if (ts) {
+        char *end;
+        double v = strtod(ts, &end);
+        if (*end != '\0' || !(v >= 0)) return "bad time stamp";
+        t->ts = v;
+    }
+    return NULL;
+}
+
+/* Skip blank and '#' lines; returns the record text or NULL */
+static char *trace_line(char *line) {
+    while (*line == ' ' || *line == '\t' || *line == '\r') line++;
+    return *line == '\0' || *line == '#' ? NULL : line;
+}
+
+struct replay_stats {
+    long long events;
+    long long applied;      /* events that changed the graph */
+    long long rejected;     /* well-formed but inconsistent with the graph */
+    long long bad;          /* malformed records */
+    int checkpoints;
+    long long checked;      /* events at the last checkpoint, -1 if resized since */
+    int found;              /* result of the previous checkpoint */
+};
+
+/* Commit a history version, if recording (rag_history_commit refuses
+   otherwise); ts < 0 stamps it with the event number */
+static void replay_commit(rag_graph *g, const struct replay_stats *st, double ts) {
+    rag_history_commit(g, ts < 0 ? (double)st->events : ts, st->events);
+    check_memory(g);
+}
+
+/* A pool size from the trace; not an event, but the final checkpoint
+   must still see it */
+static void replay_resize(rag_graph *g, struct replay_stats *st, int r, int units, double ts) {
+    if (rag_set_units(g, r, units) < 0) st->rejected++;
+    st->checked = -1;
+    replay_commit(g, st, ts);
+}
+
+/* rag_apply counts the event in the ingest metrics */
+static void replay_event(rag_graph *g, struct replay_stats *st, int kind, int p, int r, int k, double ts) {
+    int rc = rag_apply(g, kind, p, r, k);
+    check_memory(g);
+    st->events++;
+    if (rc < 0) st->rejected++;
+    else st->applied += rc;
+    if (rc > 0) replay_commit(g, st, ts);
+}
+
+static void replay_checkpoint(rag_graph *g, struct replay_stats *st) {
+    struct rag_counts c;
+    rag_counts(g, &c);
+    int engine = rag_pick_engine(g);
+    int found = c.processes > 0 ? rag_detect(g) : 0;
+    check_memory(g);
+    rag_counts(g, &c);
+    st->checkpoints++;
+    printf("checkpoint %d @ event %lld: %d processes, %d wait edges, ",
+           st->checkpoints, st->events, c.processes, c.wait_edges);
+    if (!found) printf("no deadlock\n");
+    else if (engine == RAG_ENGINE_BANKER) printf("%d stuck process(es)\n", found);
+    else if (engine_finds_sets(engine)) printf("%d deadlocked set(s)\n", found);
+    else printf("deadlock\n");
+    if (found && found != st->found) detect_print(g, engine, found);
+    st->found = found;
+    st->checked = st->events;
+    metrics_tick(g);
+}
+
+static void replay_binary(rag_graph *g, struct batch_reader *br, struct replay_stats *st, long long every) {
+    struct int_vec pmap = { 0 }, rmap = { 0 };   /* trace id -> graph index */
+    char name[RAG_NAME_MAX];
+    int c;
+    br->pos += 8;
+    while ((c = reader_byte(br)) >= 0) {
+        uint64_t a, b, k;
+        if (c == 'P' || c == 'R') {
+            int ok = reader_varint(br, &a) && a > 0 && a < RAG_NAME_MAX;
+            for (uint64_t i = 0; ok && i < a; ++i) {
+                int ch = reader_byte(br);
+                ok = ch > 0;
+                name[i] = (char)ch;
+            }
+            if (ok) name[a] = '\0';
+            if (ok && c == 'R') ok = reader_varint(br, &k) && k >= 1 && k <= INT_MAX;
+            if (!ok) break;
+            if (c == 'P') {
+                vec_push(&pmap, batch_process(g, name));
+            } else {
+                int r = batch_resource(g, name);
+                vec_push(&rmap, r);
+                if (k > 1) replay_resize(g, st, r, (int)k, -1);
+                else replay_commit(g, st, -1);
+            }
+            continue;
+        }
+        if (c == 'U') {
+            if (!reader_varint(br, &a) || !reader_varint(br, &k) || a >= (uint64_t)rmap.n || k > INT_MAX) break;
+            replay_resize(g, st, rmap.v[a], (int)k, -1);
+            continue;
+        }
+        if ((c != 'q' && c != 'a' && c != 'f' && c != 'c') ||
+            !reader_varint(br, &a) || !reader_varint(br, &b) || !reader_varint(br, &k) ||
+            a >= (uint64_t)pmap.n || b >= (uint64_t)rmap.n || k > INT_MAX) break;
+        int kind = c == 'q' ? RAG_EV_REQUEST : c == 'a' ? RAG_EV_ACQUIRE : c == 'f' ? RAG_EV_RELEASE : RAG_EV_CANCEL;
+        replay_event(g, st, kind, pmap.v[a], rmap.v[b], (int)k, -1);
+        if (every > 0 && st->events % every == 0) replay_checkpoint(g, st);
+    }
+    if (c >= 0) {
+        /* the framing is lost after a bad record, so stop there */
+        fprintf(stderr, "replay: malformed binary record after event %lld\n", st->events);
+        st->bad++;
+    }
+    vec_free(&pmap);
+    vec_free(&rmap);
+}
+
+static void replay_jsonl(rag_graph *g, struct batch_reader *br, struct replay_stats *st, long long every) {
+    char line[BATCH_LINEMAX], *s;
+    while (batch_read_line(br, line, sizeof(line))) {
+        if ((s = trace_line(line)) == NULL) continue;
+        struct trace_rec t;
+        const char *why = trace_parse_json(s, &t);
+        if (why) {
+            batch_error(br, why, NULL);
+            st->bad++;
+            continue;
+        }
+        int r = batch_resource(g, t.res);
+        if (t.kind < 0) {
+            replay_resize(g, st, r, t.k, t.ts);
+            continue;
+        }
+        replay_event(g, st, t.kind, batch_process(g, t.proc), r, t.k, t.ts);
+        if (every > 0 && st->events % every == 0) replay_checkpoint(g, st);
+    }
+}
+
+/* Replay a JSONL or binary trace into G, checkpointing every 'every'
+   events (0: only at the end), recording versions if 'history'. Returns
+   the number of malformed records. */
+long long run_replay(FILE *f, long long every, int history, int lockdep) {
+    static struct batch_reader br;
+    struct replay_stats st;
+    memset(&st, 0, sizeof(st));
+    br.f = f;
+    br.pos = 0;
+    br.line = 0;
+    if (history) {
+        rag_set_history(G, 1);
+        rag_history_commit(G, 0, 0);
+        check_memory(G);
+    }
+    if (lockdep) set_lockdep(G, 1);
+    double t0 = rag_now_ms();
+    br.len = fread(br.buf, 1, sizeof(br.buf), f);
+    if (br.len >= 8 && memcmp(br.buf, TRACE_MAGIC, 8) == 0) replay_binary(G, &br, &st, every);
+    else replay_jsonl(G, &br, &st, every);
+    if (st.checkpoints == 0 || st.events != st.checked) replay_checkpoint(G, &st);
+    double ms = rag_now_ms() - t0;
+    printf("== replay: %lld event(s) in %.1f ms (%.2f M events/s), %lld changed the graph, "
+           "%lld rejected, %lld malformed; peak RSS %ld KB\n",
+           st.events, ms, ms > 0 ? st.events / ms / 1e3 : 0.0, st.applied, st.rejected, st.bad,
+           peak_rss_kb());
+    if (history) {
+        history_status(G);
+        if (st.found) history_report_first(G, NULL, "event");
+    }
+    if (lockdep) lockdep_status(G);
+    return st.bad;
+}
+
+/* Re-encode a JSONL trace in the binary format. Returns the number of
+   lines skipped as malformed. */
+long long run_convert(FILE *in, FILE *out) {
+    static struct batch_reader br;
+    rag_graph *ids = rag_create();   /* numbers the names; never holds edges */
+    if (ids == NULL) { fprintf(stderr, "Out of memory.\n"); exit(1); }
+    br.f = in;
+    br.pos = br.len = 0;
+    br.line = 0;
+    long long bad = 0;
+    char line[BATCH_LINEMAX], *s;
+    fwrite(TRACE_MAGIC, 1, 8, out);
+    while (batch_read_line(&br, line, sizeof(line))) {
+        if ((s = trace_line(line)) == NULL) continue;
+        struct trace_rec t;
+        const char *why = trace_parse_json(s, &t);
+        if (why) {
+            batch_error(&br, why, NULL);
+            bad++;
+            continue;
+        }
+        int r = rag_find_resource(ids, t.res);
+        if (r < 0) {
+            r = rag_resource(ids, t.res);
+            check_memory(ids);
+            put_name(out, 'R', t.res);
+            put_varint(out, t.kind < 0 ? (uint64_t)t.k : 1);
+            if (t.kind < 0) continue;
+        } else if (t.kind < 0) {
+            fputc('U', out);
+            put_varint(out, (uint64_t)r);
+            put_varint(out, (uint64_t)t.k);
+            continue;
+        }
+        int p = rag_find_process(ids, t.proc);
+        if (p < 0) {
+            p = rag_process(ids, t.proc);
+            check_memory(ids);
+            put_name(out, 'P', t.proc);
+        }
+        fputc("qafc"[t.kind], out);
+        put_varint(out, (uint64_t)p);
+        put_varint(out, (uint64_t)r);
+        put_varint(out, (uint64_t)t.k);
+    }
+    rag_destroy(ids);
+    return bad;
+}
+
+/* ---- Discrete-event simulation ----
+   ./rag --sim SCRIPT [TRIALS] [SEED] [--avoid] [--threads N] runs every
+   process of a script through its steps on a simulated clock, TRIALS
+   times with fresh random hold times, and reports how often a run
+   deadlocks (see "Parallel Monte Carlo sweep"). The script uses the batch
+   reader and tokenizer:
+
+     units R N           pool size of R (default 1)
+     proc NAME           start the steps of NAME, which follow:
+     lock R [N]          wait until N units of R are free, then take them
+     hold T | LO-HI      keep running for T ticks (uniform in LO..HI)
+     unlock R [N]        give back N units of R (default: all held)
+     loop N              after the last step, run the steps N more times
+     limit E             give up a trial after E steps (default 1000000)
+     backoff T           avoidance: restart after a refused lock in 1..T ticks
+
+   A binary min-heap of (time, sequence) wake-ups drives the clock. Each
+   process has at most one wake-up pending, so the heap, the steps and the
+   per-process state are sized once when the script is loaded, and a trial
+   allocates nothing: edges come and go through the graph's own pool.
+
+   A process waits for one lock at a time, so only a blocking lock can
+   close a wait cycle (a grant goes to a process without wait edges, which
+   reaches nobody). The request is checked before its edge is added, with
+   the order and index kept for avoidance, so the WFG stays acyclic. By
+   default a cycle ends the trial as deadlocked; with --avoid the lock is
+   refused and the process backs off, as after a failed trylock: it
+   releases everything it holds and restarts its current pass after 1..T
+   ticks. The trial then completes or hits the step limit (livelock;
+   processes can keep refusing each other). A finished process releases
+   whatever it still holds.
+
+   With pools a wait cycle need not be a deadlock: another holder of the
+   pooled resource may still give a unit back. The cycle check is then
+   only used to refuse locks under --avoid (conservatively, as in
+   avoidance mode). Without --avoid the blocking lock is simply added and
+   the matrix reduction decides: its stuck processes wait only on units
+   other stuck processes hold, which is a deadlock whatever the others do
+   later; anything it misses is caught when nobody is left to wake.
+
+   Ties are broken by sequence number and released units go to waiters in
+   waiters[] order, so a trial depends only on its own xorshift stream,
+   seeded from (SEED, trial index).
+*/
+#define SIM_LIMIT   1000000LL   /* default step limit per trial */
+#define SIM_BACKOFF 4           /* default back-off range in ticks */
+
+enum sim_op { SIM_LOCK, SIM_HOLD, SIM_UNLOCK };
+
+struct sim_step {
+    int op;
+    int r;          /* lock / unlock: the resource */
+    int k;          /* units; 0 for unlock means all held */
+    int lo, hi;     /* hold: tick range */
+};
+
+struct sim_proc {
+    int first, end; /* its steps: [first, end) */
+    int loops;      /* extra passes over the steps */
+    int pc;         /* next step of the current trial */
+    int left;       /* passes still to run */
+};
+
+struct sim_wake {
+    uint64_t t;
+    uint64_t seq;
+    int p;
+};
+
+struct sim_model {
+    rag_graph *g;           /* processes and resources of the script */
+    int pools;              /* resources with more than one unit */
+    struct sim_step *steps;
+    int n_steps;
+    int steps_cap;
+    struct sim_proc *procs; /* one per process of g */
+    struct sim_wake *heap;  /* ... and a slot each */
+    int heap_n;
+    uint64_t seq;
+    long long limit;
+    int backoff;
+    int avoid;
+    int borrowed;           /* steps belong to the model this was forked from */
+};
+
+struct sim_trial {
+    int deadlocked;
+    int livelocked;
+    int finished;       /* processes that ran to the end */
+    uint64_t t;         /* clock when the trial ended */
+    long long steps;
+    long long refusals;
+    uint64_t rng;
+};
+
+static struct sim_step *sim_new_step(struct sim_model *m, int op) {
+    if (m->n_steps == m->steps_cap) {
+        m->steps_cap = m->steps_cap ? m->steps_cap * 2 : 64;
+        m->steps = xrealloc(m->steps, (size_t)m->steps_cap * sizeof(*m->steps));
+    }
+    struct sim_step *s = &m->steps[m->n_steps++];
+    memset(s, 0, sizeof(*s));
+    s->op = op;
+    return s;
+}
+
+static int sim_number(const char *s, long lo, long hi, long *out) {
+    char *end;
+    long v = strtol(s, &end, 10);
+    if (end == s || *end != '\0' || v < lo || v > hi) return 0;
+    *out = v;
+    return 1;
+}
+
+/* Parse a script into m. Returns the number of lines that failed. */
+static int sim_load(struct sim_model *m, FILE *f) {
+    static struct batch_reader br;
+    rag_graph *g = m->g = rag_create();
+    char line[BATCH_LINEMAX];
+    char *tok[BATCH_MAXTOK];
+    int errors = 0, cur = -1;
+    struct int_vec first = { 0 }, loops = { 0 };
+    if (g == NULL) { fprintf(stderr, "Out of memory.\n"); exit(1); }
+    m->limit = SIM_LIMIT;
+    m->backoff = SIM_BACKOFF;
+    br.f = f;
+    br.pos = br.len = 0;
+    br.line = 0;
+    while (batch_read_line(&br, line, sizeof(line))) {
+        int nt = batch_tokenize(line, tok, BATCH_MAXTOK);
+        if (nt == 0) continue;
+        const char *cmd = tok[0];
+        long a = 1, b;
+        if (!strcmp(cmd, "proc")) {
+            if (nt != 2 || !batch_valid_name(tok[1]) || rag_find_process(g, tok[1]) >= 0) {
+                batch_error(&br, "expected a new process name", nt > 1 ? tok[1] : NULL); errors++; continue;
+            }
+            cur = rag_process(g, tok[1]);
+            vec_push(&first, m->n_steps);
+            vec_push(&loops, 0);
+        } else if (nt == 3 && !strcmp(cmd, "units")) {
+            if (!batch_valid_name(tok[1]) || !sim_number(tok[2], 1, INT_MAX, &a)) {
+                batch_error(&br, "expected units R N", tok[1]); errors++; continue;
+            }
+            rag_set_units(g, batch_resource(g, tok[1]), (int)a);
+        } else if (nt == 2 && (!strcmp(cmd, "limit") || !strcmp(cmd, "backoff"))) {
+            if (!sim_number(tok[1], 1, cmd[0] == 'l' ? LONG_MAX : INT_MAX, &a)) {
+                batch_error(&br, "bad number", tok[1]); errors++; continue;
+            }
+            if (cmd[0] == 'l') m->limit = a;
+            else m->backoff = (int)a;
+        } else if (cur < 0 && (!strcmp(cmd, "lock") || !strcmp(cmd, "unlock") ||
+                               !strcmp(cmd, "hold") || !strcmp(cmd, "loop"))) {
+            batch_error(&br, "step before the first proc", cmd); errors++;
+        } else if ((nt == 2 || nt == 3) && (!strcmp(cmd, "lock") || !strcmp(cmd, "unlock"))) {
+            if (!batch_valid_name(tok[1]) || (nt == 3 && !sim_number(tok[2], 1, INT_MAX, &a))) {
+                batch_error(&br, "expected RESOURCE [UNITS]", tok[1]); errors++; continue;
+            }
+            struct sim_step *s = sim_new_step(m, cmd[0] == 'l' ? SIM_LOCK : SIM_UNLOCK);
+            s->r = batch_resource(g, tok[1]);
+            s->k = nt == 3 || s->op == SIM_LOCK ? (int)a : 0;
+        } else if (nt == 2 && !strcmp(cmd, "hold")) {
+            char *dash = strchr(tok[1], '-');
+            if (dash) *dash = '\0';
+            if (!sim_number(tok[1], 0, INT_MAX, &a) || !sim_number(dash ? dash + 1 : tok[1], a, INT_MAX, &b)) {
+                batch_error(&br, "expected hold T or LO-HI", tok[1]); errors++; continue;
+            }
+            struct sim_step *s = sim_new_step(m, SIM_HOLD);
+            s->lo = (int)a;
+            s->hi = (int)b;
+        } else if (nt == 2 && !strcmp(cmd, "loop")) {
+            if (!sim_number(tok[1], 0, INT_MAX, &a)) { batch_error(&br, "bad loop count", tok[1]); errors++; continue; }
+            loops.v[cur] = (int)a;
+        } else {
+            batch_error(&br, "unknown command or wrong arguments", cmd); errors++;
+        }
+    }
+    check_memory(g);
+    for (int i = 0; i < m->n_steps; ++i) {
+        const struct sim_step *s = &m->steps[i];
+        if (s->op == SIM_LOCK && s->k > rag_units(g, s->r)) {
+            fprintf(stderr, "sim: lock %s %d asks for more units than exist\n", rag_resource_name(g, s->r), s->k);
+            errors++;
+        }
+    }
+    struct rag_counts c;
+    rag_counts(g, &c);
+    m->pools = c.pools;
+    m->procs = xrealloc(NULL, (size_t)c.processes * sizeof(*m->procs));
+    m->heap = xrealloc(NULL, (size_t)c.processes * sizeof(*m->heap));
+    for (int p = 0; p < c.processes; ++p) {
+        m->procs[p].first = first.v[p];
+        m->procs[p].end = p + 1 < c.processes ? first.v[p + 1] : m->n_steps;
+        m->procs[p].loops = loops.v[p];
+    }
+    vec_free(&first);
+    vec_free(&loops);
+    return errors;
+}
+
+static void sim_free(struct sim_model *m) {
+    rag_destroy(m->g);
+    if (!m->borrowed) free(m->steps);
+    free(m->procs);
+    free(m->heap);
+    memset(m, 0, sizeof(*m));
+}
+
+static int sim_before(const struct sim_wake *a, const struct sim_wake *b) {
+    return a->t < b->t || (a->t == b->t && a->seq < b->seq);
+}
+
+static void sim_wake_at(struct sim_model *m, uint64_t t, int p) {
+    struct sim_wake w = { t, m->seq++, p };
+    int i = m->heap_n++;
+    while (i > 0 && sim_before(&w, &m->heap[(i - 1) / 2])) {
+        m->heap[i] = m->heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    m->heap[i] = w;
+}
+
+static struct sim_wake sim_next(struct sim_model *m) {
+    struct sim_wake top = m->heap[0], last = m->heap[--m->heap_n];
+    int i = 0;
+    for (;;) {
+        int c = 2 * i + 1;
+        if (c >= m->heap_n) break;
+        if (c + 1 < m->heap_n && sim_before(&m->heap[c + 1], &m->heap[c])) c++;
+        if (!sim_before(&m->heap[c], &last)) break;
+        m->heap[i] = m->heap[c];
+        i = c;
+    }
+    if (m->heap_n > 0) m->heap[i] = last;
+    return top;
+}
+
+/* Hand free units of r to its waiters; each one granted wakes at t.
+   An acquire that does not fit is RAG_EBUSY and changes nothing. */
+static void sim_grant(struct sim_model *m, int r, uint64_t t) {
+    rag_graph *g = m->g;
+    const int *wt;
+    for (int i = 0, n = rag_waiters(g, r, &wt); i < n;) {
+        int w = wt[i];
+        if (rag_apply(g, RAG_EV_ACQUIRE, w, r, rag_requested(g, w, r)) == RAG_EBUSY) { i++; continue; }
+        n = rag_waiters(g, r, &wt);  /* the last waiter moved into slot i */
+        m->procs[w].pc++;
+        sim_wake_at(m, t, w);
+    }
+}
+
+static void sim_release_all(struct sim_model *m, int p, uint64_t t) {
+    rag_graph *g = m->g;
+    const int *res, *units;
+    for (int n; (n = rag_holdings(g, p, &res, &units)) > 0;) {
+        int r = res[n - 1];
+        rag_release(g, r, p, 0);
+        sim_grant(m, r, t);
+    }
+}
+
+/* Run p from its next step until it holds, blocks or finishes */
+static void sim_step_proc(struct sim_model *m, int p, uint64_t t, struct sim_trial *tr) {
+    rag_graph *g = m->g;
+    struct sim_proc *pr = &m->procs[p];
+    for (;;) {
+        if (pr->pc == pr->end) {
+            if (pr->left > 0 && pr->first < pr->end) {
+                pr->left--;
+                pr->pc = pr->first;
+                continue;
+            }
+            sim_release_all(m, p, t);
+            tr->finished++;
+            return;
+        }
+        const struct sim_step *s = &m->steps[pr->pc];
+        tr->steps++;
+        if (s->op == SIM_HOLD) {
+            uint64_t d = (uint64_t)s->lo;
+            if (s->hi > s->lo) d += rng_next(&tr->rng) % (uint64_t)(s->hi - s->lo + 1);
+            pr->pc++;
+            sim_wake_at(m, t + d, p);
+            return;
+        }
+        if (s->op == SIM_UNLOCK) {
+            if (rag_release(g, s->r, p, s->k) > 0) sim_grant(m, s->r, t);   /* k 0: all held */
+            pr->pc++;
+            continue;
+        }
+        if (rag_apply(g, RAG_EV_ACQUIRE, p, s->r, s->k) != RAG_EBUSY) {
+            pr->pc++;
+            continue;
+        }
+        if (!m->avoid && m->pools > 0) {
+            /* detection with pools: a wait cycle is not proof, so only the
+               reduction's stuck set (or nobody left to wake) ends the trial
+               (the engine is the matrix reduction, see sim_fork) */
+            rag_apply(g, RAG_EV_REQUEST, p, s->r, s->k);
+            if (rag_detect(g) > 0) tr->deadlocked = 1;
+            return;
+        }
+        if (rag_check_request(g, p, s->r) > 0) {
+            if (!m->avoid) { tr->deadlocked = 1; return; }
+            /* back off: drop everything and redo this pass later */
+            tr->refusals++;
+            sim_release_all(m, p, t);
+            pr->pc = pr->first;
+            sim_wake_at(m, t + 1 + rng_next(&tr->rng) % (uint64_t)m->backoff, p);
+            return;
+        }
+        rag_apply(g, RAG_EV_REQUEST, p, s->r, s->k); /* blocked until sim_grant */
+        return;
+    }
+}
+
+/* Drop every edge left by the previous trial; the adjacency blocks stay in the pool */
+static void sim_clear(struct sim_model *m) {
+    rag_graph *g = m->g;
+    const int *res, *units;
+    for (int p = 0, np = rag_process_count(g); p < np; ++p) {
+        while (rag_requests(g, p, &res, &units) > 0) rag_cancel(g, p, res[0]);
+        while (rag_holdings(g, p, &res, &units) > 0) rag_release(g, res[0], p, 0);
+    }
+}
+
+static void sim_run_trial(struct sim_model *m, uint64_t seed, long long trial, struct sim_trial *tr) {
+    rag_graph *g = m->g;
+    int np = rag_process_count(g);
+    memset(tr, 0, sizeof(*tr));
+    tr->rng = (seed ^ (0x9E3779B97F4A7C15ULL * (uint64_t)(trial + 1))) | 1;
+    sim_clear(m);
+    m->heap_n = 0;
+    m->seq = 0;
+    for (int p = 0; p < np; ++p) {
+        m->procs[p].pc = m->procs[p].first;
+        m->procs[p].left = m->procs[p].loops;
+        sim_wake_at(m, 0, p);
+    }
+    while (m->heap_n > 0 && !tr->deadlocked) {
+        if (tr->steps >= m->limit) { tr->livelocked = 1; break; }
+        struct sim_wake w = sim_next(m);
+        tr->t = w.t;
+        sim_step_proc(m, w.p, w.t, tr);
+    }
+    /* nobody left to wake but someone unfinished: stuck without a check firing */
+    if (!tr->deadlocked && !tr->livelocked && tr->finished < np) tr->deadlocked = 1;
+    check_memory(g);
+}
+
+/* ---- Parallel Monte Carlo sweep ----
+   Only the hold times are random: every trial runs the same scripts in
+   the same lock order, so the sweep measures how often that order
+   deadlocks under timing noise, not which orders are safe.
+
+   Trials are independent (each has its own random stream), so a sweep
+   hands them out to worker threads in chunks of SIM_CHUNK through one
+   atomic counter - the only shared write, once per chunk. Every worker
+   owns a forked model (graph, process state, heap) and tallies into
+   locals; tallies are summed after the join. Integer sums make the
+   totals identical whatever the thread count.
+
+   The deadlock rate is reported with a 95% Wilson score interval, which
+   stays inside [0, 1] and is usable when a rate is near 0 or 1.
+*/
+#define SIM_CHUNK 256
+
+/* A worker's copy of a loaded model: its own graph with the same names
+   and pools, its own process state and heap; the steps are shared.
+   Avoidance keeps the order and index current for the cycle checks,
+   which detection with pools never makes (it runs the matrix reduction
+   instead). */
+static void sim_fork(struct sim_model *dst, const struct sim_model *src) {
+    const rag_graph *sg = src->g;
+    int np = rag_process_count(sg), nr = rag_resource_count(sg);
+    memset(dst, 0, sizeof(*dst));
+    if ((dst->g = rag_create()) == NULL) { fprintf(stderr, "Out of memory.\n"); exit(1); }
+    for (int p = 0; p < np; ++p) rag_process(dst->g, rag_process_name(sg, p));
+    for (int r = 0; r < nr; ++r) rag_set_units(dst->g, rag_resource(dst->g, rag_resource_name(sg, r)), rag_units(sg, r));
+    rag_set_engine(dst->g, RAG_ENGINE_BANKER);
+    rag_set_avoidance(dst->g, src->avoid || src->pools == 0);
+    check_memory(dst->g);
+    dst->pools = src->pools;
+    dst->steps = src->steps;
+    dst->n_steps = src->n_steps;
+    dst->borrowed = 1;
+    dst->procs = xrealloc(NULL, (size_t)np * sizeof(*dst->procs));
+    memcpy(dst->procs, src->procs, (size_t)np * sizeof(*dst->procs));
+    dst->heap = xrealloc(NULL, (size_t)np * sizeof(*dst->heap));
+    dst->limit = src->limit;
+    dst->backoff = src->backoff;
+    dst->avoid = src->avoid;
+}
+
+struct sim_tally {
+    long long trials;
+    long long deadlocked;
+    long long livelocked;
+    long long steps;
+    long long refusals;
+    uint64_t dead_t;    /* summed clock at the deadlock */
+    uint64_t done_t;    /* summed makespan of completed trials */
+};
+
+struct sim_sweep {
+    _Alignas(64) atomic_llong next;     /* first trial of the next chunk */
+    long long trials;
+    uint64_t seed;
+};
+
+struct sim_worker {
+    pthread_t thread;
+    struct sim_sweep *sw;
+    struct sim_model m;
+    struct sim_tally tally;
+};
+
+static void sim_tally_add(struct sim_tally *t, const struct sim_trial *tr) {
+    t->trials++;
+    t->steps += tr->steps;
+    t->refusals += tr->refusals;
+    if (tr->deadlocked) { t->deadlocked++; t->dead_t += tr->t; }
+    else if (tr->livelocked) t->livelocked++;
+    else t->done_t += tr->t;
+}
+
+static void *sim_worker_main(void *arg) {
+    struct sim_worker *w = arg;
+    struct sim_sweep *sw = w->sw;
+    struct sim_tally t;
+    memset(&t, 0, sizeof(t));
+    for (;;) {
+        long long i = atomic_fetch_add_explicit(&sw->next, SIM_CHUNK, memory_order_relaxed);
+        if (i >= sw->trials) break;
+        long long end = i + SIM_CHUNK < sw->trials ? i + SIM_CHUNK : sw->trials;
+        for (; i < end; ++i) {
+            struct sim_trial tr;
+            sim_run_trial(&w->m, sw->seed, i, &tr);
+            sim_tally_add(&t, &tr);
+        }
+    }
+    w->tally = t;
+    return NULL;
+}
+
+/* Square root by Newton's method, so the build needs no libm */
+static double sim_sqrt(double x) {
+    if (x <= 0) return 0;
+    double r = x > 1 ? x : 1;
+    for (int i = 0; i < 64; ++i) {
+        double nr = 0.5 * (r + x / r);
+        if (nr >= r) break;
+        r = nr;
+    }
+    return r;
+}
+
+/* 95% Wilson score interval for k successes in n trials */
+static void sim_wilson(long long k, long long n, double *lo, double *hi) {
+    const double z = 1.959964;
+    double p = (double)k / n, z2n = z * z / n;
+    double mid = (p + z2n / 2) / (1 + z2n);
+    double half = z * sim_sqrt(p * (1 - p) / n + z2n / (4.0 * n)) / (1 + z2n);
+    *lo = mid - half < 0 ? 0 : mid - half;
+    *hi = mid + half > 1 ? 1 : mid + half;
+}
+
+/* Load a script and run 'trials' trials on 'nthreads' workers (0: all
+   CPUs). Returns 0, or 1 if the script had errors. */
+int run_sim(FILE *f, long long trials, uint64_t seed, int avoid, int nthreads) {
+    static struct sim_model m;
+    int errors = sim_load(&m, f);
+    int np = rag_process_count(m.g);
+    if (errors || np == 0) {
+        fprintf(stderr, "sim: %d error(s) in the script%s\n", errors, np ? "" : ", no processes");
+        sim_free(&m);
+        return 1;
+    }
+    m.avoid = avoid;
+    if (nthreads <= 0) nthreads = rag_thread_count(m.g);
+    if ((long long)nthreads * SIM_CHUNK > trials) nthreads = (int)((trials + SIM_CHUNK - 1) / SIM_CHUNK);
+    struct sim_sweep sw;
+    atomic_init(&sw.next, 0);
+    sw.trials = trials;
+    sw.seed = seed;
+    struct sim_worker *w = xrealloc(NULL, (size_t)nthreads * sizeof(*w));
+    for (int i = 0; i < nthreads; ++i) {
+        w[i].sw = &sw;
+        sim_fork(&w[i].m, &m);
+    }
+    double t0 = rag_now_ms();
+    int started = 1;
+    for (; started < nthreads; ++started) {
+        if (pthread_create(&w[started].thread, NULL, sim_worker_main, &w[started]) != 0) break;
+    }
+    sim_worker_main(&w[0]); /* the calling thread is worker 0 */
+    struct sim_tally t;
+    memset(&t, 0, sizeof(t));
+    for (int i = 0; i < nthreads; ++i) {
+        if (i > 0 && i < started) pthread_join(w[i].thread, NULL);
+        if (i > 0 && i >= started) continue;
+        t.trials += w[i].tally.trials;
+        t.deadlocked += w[i].tally.deadlocked;
+        t.livelocked += w[i].tally.livelocked;
+        t.steps += w[i].tally.steps;
+        t.refusals += w[i].tally.refusals;
+        t.dead_t += w[i].tally.dead_t;
+        t.done_t += w[i].tally.done_t;
+    }
+    double ms = rag_now_ms() - t0;
+    long long done = t.trials - t.deadlocked - t.livelocked;
+    double lo, hi;
+    sim_wilson(t.deadlocked, t.trials, &lo, &hi);
+    printf("== sim: %d process(es), %d resource(s), %d step(s), %lld trial(s) on %d thread(s), %s\n",
+           np, rag_resource_count(m.g), m.n_steps, t.trials, started, avoid ? "avoidance" : "detection");
+    printf("  deadlocked  %lld (%.3f%%, 95%% CI %.3f%% - %.3f%%)", t.deadlocked,
+           100.0 * t.deadlocked / t.trials, 100 * lo, 100 * hi);
+    if (t.deadlocked) printf(", mean time to deadlock %.1f ticks", (double)t.dead_t / t.deadlocked);
+    printf("\n  completed   %lld", done);
+    if (done) printf(", mean makespan %.1f ticks", (double)t.done_t / done);
+    printf("\n");
+    if (avoid) printf("  refused     %lld lock(s), %lld trial(s) hit the %lld-step limit\n", t.refusals, t.livelocked, m.limit);
+    else if (t.livelocked) printf("  %lld trial(s) hit the %lld-step limit\n", t.livelocked, m.limit);
+    printf("  %lld steps in %.1f ms (%.2f M steps/s)\n", t.steps, ms, ms > 0 ? t.steps / ms / 1e3 : 0.0);
+    for (int i = 0; i < nthreads; ++i) sim_free(&w[i].m);
+    free(w);
+    sim_free(&m);
+    return 0;
+}
+
+/* ---- Main menu ---- */
+void print_menu(void) {
+    struct rag_settings set;
+    rag_settings(G, &set);
+    printf("\n===== RAG SIMULATOR (C) =====\n");
+    printf("1) Add Process\n");
+    printf("2) Add Resource\n");
+    printf("3) Add Request Edge (P -> R)\n");
+    printf("4) Add Allocation Edge (R -> P)\n");
+    printf("5) Remove an Edge\n");
+    printf("6) Display Graph\n");
+    printf("7) Detect Deadlock\n");
+    printf("8) Reset Graph\n");
+    printf("9) Load Sample Example (quick test)\n");
+    printf("10) Toggle Online Detection (%s)\n", set.online ? "on" : "off");
+    printf("11) Select Detection Engine (%s)\n", rag_engine_name(set.engine));
+    printf("12) Save Snapshot\n");
+    printf("13) Load Snapshot\n");
+    printf("14) Set Resource Instances\n");
+    printf("15) Detection Schedule (%s)\n", sched.enabled ? "on" : "off");
+    printf("16) Toggle Avoidance Mode (%s)\n", set.avoidance ? "on" : "off");
+    printf("17) Resolve Deadlocks (preempt victims)\n");
+    printf("18) Renumber Nodes for Locality (RCM)\n");
+    printf("19) Toggle Lock-Order Analysis (%s)\n", set.lockdep ? "on" : "off");
+    printf("0) Exit\n");
+    printf("=============================\n");
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "Usage: %s                 interactive menu\n"
+                    "       %s -b [FILE|-]     run a batch script (stdin by default)\n"
+                    "       %s --bench [KIND|all] [N] [SEED]\n"
+                    "                          time synthetic graphs (sparse, dense, chain, cycles, giant, dag, mesh)\n"
+                    "                          or live-monitor ingestion (ingest)\n"
+                    "       %s --replay FILE|- [N] [--metrics OUT] [--history] [--lockdep] [--format FMT]\n"
+                    "                          replay a JSONL or binary lock trace, detecting every N events\n"
+                    "                          (metrics as one JSON line per checkpoint to OUT; --history\n"
+                    "                          versions the graph and bisects a final deadlock to its event;\n"
+                    "                          --lockdep reports lock order inversions; deadlock reports as\n"
+                    "                          text, json, csv, dot or summary)\n"
+                    "       %s --convert IN.jsonl OUT.trace\n"
+                    "                          re-encode a JSONL trace in the compact binary format\n"
+                    "       %s --sim SCRIPT|- [TRIALS] [SEED] [--avoid] [--threads N]\n"
+                    "                          run the scripts with random hold times and estimate how often\n"
+                    "                          their lock order deadlocks\n"
+                    "                          (trials spread over N threads, default all CPUs)\n",
+            argv0, argv0, argv0, argv0, argv0, argv0);
+}
+
+int main(int argc, char **argv) {
+    G = rag_create();
+    if (G == NULL) { fprintf(stderr, "Out of memory.\n"); return 1; }
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0) {
+        return run_bench(argc - 2, argv + 2);
+    }
+    if (argc > 2 && strcmp(argv[1], "--replay") == 0) {
+        long long every = 0;
+        int history = 0, lockdep = 0, npos = 0;
+        for (int i = 3; i < argc; ++i) {
+            char *end;
+            if (strcmp(argv[i], "--history") == 0) { history = 1; continue; }
+            if (strcmp(argv[i], "--lockdep") == 0) { lockdep = 1; continue; }
+            if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+                out_format = out_format_parse(argv[++i]);
+                if (out_format < 0) { usage(argv[0]); return 2; }
+                continue;
+            }
+            if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc) {
+                FILE *m = strcmp(argv[++i], "-") ? fopen(argv[i], "w") : stdout;
+                if (m == NULL) { perror(argv[i]); return 1; }
+                metrics_every(m, 0); /* one JSON line per checkpoint */
+                continue;
+            }
+            if (npos++ == 1) { usage(argv[0]); return 2; }
+            every = strtoll(argv[i], &end, 10);
+            if (*end != '\0' || every < 0) { usage(argv[0]); return 2; }
+        }
+        FILE *f = stdin;
+        if (strcmp(argv[2], "-") != 0) {
+            f = fopen(argv[2], "rb");
+            if (f == NULL) { perror(argv[2]); return 1; }
+        }
+        long long bad = run_replay(f, every, history, lockdep);
+        int failed = ferror(f);
+        if (f != stdin) fclose(f);
+        metrics_every(NULL, 0);
+        rag_destroy(G);
+        return bad || failed ? 1 : 0;
+    }
+    if (argc > 2 && strcmp(argv[1], "--sim") == 0) {
+        long long num[2] = { 1000, 1 };  /* TRIALS, SEED */
+        int avoid = 0, nthreads = 0, npos = 0;
+        for (int i = 3; i < argc; ++i) {
+            char *end;
+            if (strcmp(argv[i], "--avoid") == 0) { avoid = 1; continue; }
+            if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+                long v = strtol(argv[++i], &end, 10);
+                if (*end != '\0' || v < 0 || v > 1024) { usage(argv[0]); return 2; }
+                nthreads = (int)v;
+                continue;
+            }
+            if (npos == 2) { usage(argv[0]); return 2; }
+            num[npos] = strtoll(argv[i], &end, 10);
+            if (*end != '\0' || num[npos] < (npos ? 0 : 1)) { usage(argv[0]); return 2; }
+            npos++;
+        }
+        FILE *f = strcmp(argv[2], "-") == 0 ? stdin : fopen(argv[2], "r");
+        if (f == NULL) { perror(argv[2]); return 1; }
+        int rc = run_sim(f, num[0], (uint64_t)num[1], avoid, nthreads);
+        if (f != stdin) fclose(f);
+        return rc;
+    }
+    if (argc > 3 && strcmp(argv[1], "--convert") == 0) {
+        FILE *in = strcmp(argv[2], "-") == 0 ? stdin : fopen(argv[2], "r");
+        if (in == NULL) { perror(argv[2]); return 1; }
+        FILE *out = fopen(argv[3], "wb");
+        if (out == NULL) { perror(argv[3]); if (in != stdin) fclose(in); return 1; }
+        long long bad = run_convert(in, out);
+        int failed = ferror(in) || fclose(out) != 0;
+        if (in != stdin) fclose(in);
+        if (failed) { perror(argv[3]); return 1; }
+        return bad ? 1 : 0;
+    }
+    if (argc > 1) {
+        if (strcmp(argv[1], "-b") != 0 && strcmp(argv[1], "--batch") != 0) {
+            usage(argv[0]);
+            return 2;
+        }
+        FILE *f = stdin;
+        if (argc > 2 && strcmp(argv[2], "-") != 0) {
+            f = fopen(argv[2], "r");
+            if (f == NULL) { perror(argv[2]); return 1; }
+        }
+        int errors = run_batch(f);
+        if (f != stdin) fclose(f);
+        rag_destroy(G);
+        return errors ? 1 : 0;
+    }
     while (1) {
         print_menu();
-        int ch = read_int("Enter choice: ", 0, 9);
+        int ch = read_int("Enter choice: ", 0, 19);
         switch (ch) {
             case 1: add_process(); break;
             case 2: add_resource(); break;
@@ -403,9 +3195,20 @@ int main(void) {
             case 7: detect_deadlock(); break;
             case 8: reset_graph(); break;
             case 9: sample_prefill(); break;
-            case 0: printf("Exiting. Bye.\n"); return 0;
+            case 10: toggle_online_detection(); break;
+            case 11: select_engine_menu(); break;
+            case 12: save_snapshot_menu(); break;
+            case 13: load_snapshot_menu(); break;
+            case 14: set_units_menu(); break;
+            case 15: schedule_menu(); break;
+            case 16: toggle_avoidance(); break;
+            case 17: resolve_menu(); break;
+            case 18: renumber_menu(); break;
+            case 19: toggle_lockdep(); break;
+            case 0: printf("Exiting. Bye.\n"); rag_destroy(G); return 0;
             default: printf("Invalid choice.\n"); break;
         }
+        if (sched.enabled) sched_tick(G);
     }
 
     return 0;
@@ -0,0 +1,4831 @@
+/*
+ * rag.c - Resource Allocation Graph library: the graph, its detection
+ * engines, resolution, online detection, avoidance, renumbering and
+ * snapshots. The interface is rag.h; the interactive front end, code.c,
+ * uses nothing else.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <setjmp.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "rag_internal.h"
+
+/* ---- Out of memory ----
+   Running out of memory must not take the host down, but threading a
+   status through every allocation site would touch most of this file.
+   Instead each rag.h call sets a guard, a jmp_buf of the calling thread
+   that a failed allocation unwinds to, as libpng and Lua do. The call
+   then marks its graph and returns RAG_ENOMEM. The change it was making
+   may be half applied (pointers stay valid, counts may not), so the
+   graph refuses further calls until rag_clear. Worker threads set
+   guards of their own.
+
+   Nothing may be lost on the way: scratch memory lives on the graph
+   (freed with it) or is taken back by a guard of its own that raises
+   again, and user callbacks run with the guard lifted, so an unwind never
+   crosses the host's frames (rag.h calls made from a callback set their
+   own). Every allocation is reached from a guarded rag.h call; one made
+   without a guard would see xrealloc return NULL as realloc does.
+*/
+static _Thread_local jmp_buf *oom_guard;
+
+static void oom_raise(void) {
+    if (oom_guard != NULL) longjmp(*oom_guard, 1);
+}
+
+/* Run 'expr' under a guard; if it runs out of memory, the statement
+   'fail' runs in its place */
+#define OOM_GUARD(fail, expr) do {                              \
+        jmp_buf guard_;                                         \
+        jmp_buf *volatile outer_ = oom_guard;                   \
+        if (setjmp(guard_) == 0) {                              \
+            oom_guard = &guard_;                                \
+            expr;                                               \
+            oom_guard = outer_;                                 \
+        } else {                                                \
+            oom_guard = outer_;                                 \
+            fail;                                               \
+        }                                                       \
+    } while (0)
+
+/* Run the statement 'call' into user code with no guard set */
+#define OOM_UNGUARDED(call) do {                                \
+        jmp_buf *outer_ = oom_guard;                            \
+        oom_guard = NULL;                                       \
+        call;                                                   \
+        oom_guard = outer_;                                     \
+    } while (0)
+
+/* ---- Growable adjacency lists ---- */
+static void *xrealloc(void *ptr, size_t sz) {
+    void *p = realloc(ptr, sz ? sz : 1);
+    if (p == NULL) oom_raise();
+    return p;
+}
+
+/* Grow an int array of n used entries to newcap, copying out of a
+   borrowed (cap == 0) block instead of reallocating it */
+static int *grow_ints(int *v, int n, int cap, int newcap) {
+    if (cap > 0 || v == NULL) return xrealloc(v, (size_t)newcap * sizeof(int));
+    int *nv = xrealloc(NULL, (size_t)newcap * sizeof(int));
+    memcpy(nv, v, (size_t)n * sizeof(int));
+    return nv;
+}
+
+static int next_cap(int n, int cap) {
+    return cap ? cap * 2 : (n > 2 ? 2 * n : 4);
+}
+
+static void edge_push(edge_list *l, int x) {
+    if (l->n >= l->cap) {
+        int cap = next_cap(l->n, l->cap);
+        l->v = grow_ints(l->v, l->n, l->cap, cap);
+        l->cap = cap;
+    }
+    l->v[l->n++] = x;
+}
+
+/* Make room for 'more' further pushes, so a hot loop can store directly */
+static void edge_reserve(edge_list *l, int more) {
+    if (l->n + more > l->cap) {
+        int cap = l->n + more;
+        l->v = grow_ints(l->v, l->n, l->cap, cap);
+        l->cap = cap;
+    }
+}
+
+static int edge_find(const edge_list *l, int x) {
+    for (int i = 0; i < l->n; ++i) {
+        if (l->v[i] == x) return i;
+    }
+    return -1;
+}
+
+/* unordered removal: swap the last edge into the hole */
+static int edge_remove(edge_list *l, int x) {
+    int i = edge_find(l, x);
+    if (i < 0) return 0;
+    l->v[i] = l->v[--l->n];
+    return 1;
+}
+
+static void edge_free(edge_list *l) {
+    if (l->cap > 0) free(l->v);
+    l->v = NULL;
+    l->n = l->cap = 0;
+}
+
+static int count_find(const count_list *l, int v) {
+    for (int i = 0; i < l->n; ++i) {
+        if (l->v[i] == v) return i;
+    }
+    return -1;
+}
+
+/* Subtract k; the edge goes away at zero. Returns the remaining count,
+   -1 if absent. */
+static int count_sub(count_list *l, int v, int k) {
+    int i = count_find(l, v);
+    if (i < 0) return -1;
+    if ((l->cnt[i] -= k) > 0) return l->cnt[i];
+    l->n--;
+    l->v[i] = l->v[l->n];
+    l->cnt[i] = l->cnt[l->n];
+    return 0;
+}
+
+/* Drop the edge whatever its count; returns the count it had (0 if absent) */
+static int count_remove(count_list *l, int v) {
+    int i = count_find(l, v);
+    if (i < 0) return 0;
+    int k = l->cnt[i];
+    count_sub(l, v, k);
+    return k;
+}
+
+static int count_of(const count_list *l, int v) {
+    int i = count_find(l, v);
+    return i < 0 ? 0 : l->cnt[i];
+}
+
+/* ---- Edge vector pool ---- */
+/* Smallest class holding 'want' ints, or -1 if it is too big for any */
+static int pool_class(int want) {
+    int c = 0;
+    while (c < POOL_CLASSES && (POOL_MIN_INTS << c) < want) c++;
+    return c < POOL_CLASSES ? c : -1;
+}
+
+static int *pool_alloc(struct int_pool *pl, int c) {
+    void *b = pl->free_list[c];
+    if (b != NULL) {
+        pl->free_list[c] = *(void **)b;
+        return b;
+    }
+    size_t bytes = (size_t)(POOL_MIN_INTS << c) * sizeof(int);
+    if (pl->slab == NULL || pl->slab_used + bytes > POOL_SLAB_BYTES) {
+        char *s = xrealloc(NULL, POOL_SLAB_BYTES);
+        *(char **)s = pl->slab;
+        pl->slab = s;
+        pl->slab_used = POOL_SLAB_HDR;
+    }
+    int *p = (int *)(void *)(pl->slab + pl->slab_used);
+    pl->slab_used += bytes;
+    return p;
+}
+
+/* Hand back a vector of capacity cap (borrowed ones, cap == 0, are ignored) */
+static void pool_release(struct int_pool *pl, int *v, int cap) {
+    if (cap == 0 || v == NULL) return;
+    if (cap > POOL_MAX_INTS) { free(v); return; }
+    int c = pool_class(cap);
+    *(void **)v = pl->free_list[c];
+    pl->free_list[c] = v;
+}
+
+/* Move the n used ints of v to a block of the next capacity */
+static int *pool_grow(struct int_pool *pl, int *v, int n, int cap, int *newcap) {
+    int want = next_cap(n, cap);
+    int c = pool_class(want);
+    int *nv;
+    if (c < 0) {
+        if (cap > POOL_MAX_INTS) nv = xrealloc(v, (size_t)want * sizeof(int));
+        else nv = xrealloc(NULL, (size_t)want * sizeof(int));
+        *newcap = want;
+    } else {
+        nv = pool_alloc(pl, c);
+        *newcap = POOL_MIN_INTS << c;
+    }
+    if (nv != v) {
+        if (n > 0) memcpy(nv, v, (size_t)n * sizeof(int));
+        pool_release(pl, v, cap);
+    }
+    return nv;
+}
+
+static void pool_push(struct int_pool *pl, edge_list *l, int x) {
+    if (l->n >= l->cap) l->v = pool_grow(pl, l->v, l->n, l->cap, &l->cap);
+    l->v[l->n++] = x;
+}
+
+/* Add k to the edge to v (appending it if absent); returns the new count */
+static int pool_count_add(struct int_pool *pl, count_list *l, int v, int k) {
+    int i = count_find(l, v);
+    if (i >= 0) return l->cnt[i] += k;
+    if (l->n >= l->cap) {
+        int cap;
+        l->v = pool_grow(pl, l->v, l->n, l->cap, &cap);
+        l->cnt = pool_grow(pl, l->cnt, l->n, l->cap, &cap);
+        l->cap = cap;
+    }
+    l->v[l->n] = v;
+    l->cnt[l->n] = k;
+    l->n++;
+    return k;
+}
+
+/* Free a vector that outgrew the pool; pooled ones go with their slab */
+static void pool_forget(int *v, int cap) {
+    if (cap > POOL_MAX_INTS) free(v);
+}
+
+static void pool_free(struct int_pool *pl) {
+    char *s = pl->slab;
+    while (s != NULL) {
+        char *older = *(char **)s;
+        free(s);
+        s = older;
+    }
+    memset(pl, 0, sizeof(*pl));
+}
+
+/* ---- Name index ---- */
+static size_t name_hash(const char *s) {
+    uint64_t h = 1469598103934665603ULL; /* FNV-1a */
+    for (; *s; ++s) {
+        h ^= (unsigned char)*s;
+        h *= 1099511628211ULL;
+    }
+    return (size_t)(h ^ (h >> 29));
+}
+
+/* ---- Data model ---- */
+static void graph_grow_proc(struct rag_graph *g, int need) {
+    if (need <= g->proc_cap) return;
+    int cap = g->proc_cap ? g->proc_cap : 16;
+    while (cap < need) cap *= 2;
+    g->p_name = xrealloc(g->p_name, (size_t)cap * sizeof(size_t));
+    g->req = xrealloc(g->req, (size_t)cap * sizeof(count_list));
+    g->held = xrealloc(g->held, (size_t)cap * sizeof(count_list));
+    g->wfg = xrealloc(g->wfg, (size_t)cap * sizeof(count_list));
+    g->wfg_mark = xrealloc(g->wfg_mark, (size_t)cap * sizeof(int));
+    g->wfg_slot = xrealloc(g->wfg_slot, (size_t)cap * sizeof(int));
+    g->wfg_in = xrealloc(g->wfg_in, (size_t)cap * sizeof(edge_list));
+    g->ord = xrealloc(g->ord, (size_t)cap * sizeof(int));
+    g->node_at = xrealloc(g->node_at, (size_t)cap * sizeof(int));
+    g->pk_mark = xrealloc(g->pk_mark, (size_t)cap * sizeof(int));
+    g->pk_parent = xrealloc(g->pk_parent, (size_t)cap * sizeof(int));
+    g->pk_iter = xrealloc(g->pk_iter, (size_t)cap * sizeof(int));
+    g->visited = xrealloc(g->visited, (size_t)cap * sizeof(int));
+    g->scc_index = xrealloc(g->scc_index, (size_t)cap * sizeof(int));
+    g->scc_low = xrealloc(g->scc_low, (size_t)cap * sizeof(int));
+    g->scc_iter = xrealloc(g->scc_iter, (size_t)cap * sizeof(int));
+    g->scc_call = xrealloc(g->scc_call, (size_t)cap * sizeof(int));
+    g->scc_comp = xrealloc(g->scc_comp, (size_t)cap * sizeof(int));
+    g->dirty_mark = xrealloc(g->dirty_mark, (size_t)cap);
+    g->par_color = xrealloc((void *)g->par_color, (size_t)cap * sizeof(*g->par_color));
+    g->par_mark = xrealloc(g->par_mark, (size_t)cap);
+    g->par_nodes = xrealloc(g->par_nodes, (size_t)cap * sizeof(int));
+    g->par_in = xrealloc(g->par_in, (size_t)cap * sizeof(int));
+    g->par_out = xrealloc(g->par_out, (size_t)cap * sizeof(int));
+    g->bk_need = xrealloc(g->bk_need, (size_t)cap * sizeof(int));
+    g->bk_done = xrealloc(g->bk_done, (size_t)cap * sizeof(int));
+    g->bk_queue = xrealloc(g->bk_queue, (size_t)cap * sizeof(int));
+    g->in_stack = xrealloc(g->in_stack, (size_t)cap * sizeof(int));
+    g->stack_nodes = xrealloc(g->stack_nodes, (size_t)cap * sizeof(int));
+    g->prio = xrealloc(g->prio, (size_t)cap * sizeof(int));
+    g->born = xrealloc(g->born, (size_t)cap * sizeof(unsigned long));
+    for (int p = g->proc_cap; p < cap; ++p) {
+        g->prio[p] = 0;
+        g->born[p] = 0;
+        memset(&g->req[p], 0, sizeof(count_list));
+        memset(&g->held[p], 0, sizeof(count_list));
+        memset(&g->wfg[p], 0, sizeof(count_list));
+        memset(&g->wfg_in[p], 0, sizeof(edge_list));
+        /* traversal marks start cleared and are kept that way by stamps */
+        g->pk_mark[p] = 0;
+        g->wfg_mark[p] = 0;
+        g->visited[p] = 0;
+        g->in_stack[p] = 0;
+        g->scc_index[p] = -1;
+        g->scc_comp[p] = -1;
+        g->par_mark[p] = 0;
+    }
+    g->proc_cap = cap;
+}
+
+static void graph_grow_res(struct rag_graph *g, int need) {
+    if (need <= g->res_cap) return;
+    int cap = g->res_cap ? g->res_cap : 16;
+    while (cap < need) cap *= 2;
+    g->r_name = xrealloc(g->r_name, (size_t)cap * sizeof(size_t));
+    g->waiters = xrealloc(g->waiters, (size_t)cap * sizeof(edge_list));
+    g->alloc_ = xrealloc(g->alloc_, (size_t)cap * sizeof(edge_list));
+    g->units = xrealloc(g->units, (size_t)cap * sizeof(int));
+    g->in_use = xrealloc(g->in_use, (size_t)cap * sizeof(int));
+    g->bk_work = xrealloc(g->bk_work, (size_t)cap * sizeof(int));
+    g->bk_start = xrealloc(g->bk_start, (size_t)(cap + 1) * sizeof(int));
+    g->bk_ptr = xrealloc(g->bk_ptr, (size_t)cap * sizeof(int));
+    for (int r = g->res_cap; r < cap; ++r) {
+        memset(&g->waiters[r], 0, sizeof(edge_list));
+        memset(&g->alloc_[r], 0, sizeof(edge_list));
+    }
+    g->res_cap = cap;
+}
+
+static void par_free(struct rag_graph *g);
+static void shard_free(struct rag_graph *g);
+static void history_free(struct rag_history *h);
+static void hist_touch_all(struct rag_history *h);
+enum hist_change { HIST_PROC, HIST_RES, HIST_REQ, HIST_HELD };
+static void hist_note(struct rag_history *h, int kind, int a, int b);
+
+/* Log a change for the next history version: a process added, a
+   resource added or resized, or the request or holding of p on r */
+static inline void hist_touch(struct rag_graph *g, int kind, int a, int b) {
+    if (g->hist) hist_note(g->hist, kind, a, b);
+}
+
+struct rag_lockdep;
+static void lockdep_note(struct rag_graph *g, int p, int r);
+static void lockdep_clear(struct rag_lockdep *ld);
+static void lockdep_free(struct rag_lockdep *ld);
+static void lockdep_remap(struct rag_lockdep *ld, int nr, const int *rnew, const int *pnew);
+static void reach_append(struct rag_graph *g, int p);
+
+/* p is about to wait for or take r: the lock order it follows */
+static inline void lockdep_touch(struct rag_graph *g, int p, int r) {
+    if (g->lockdep && g->held[p].n) lockdep_note(g, p, r);
+}
+
+static void graph_free(struct rag_graph *g) {
+    for (int p = 0; p < g->proc_cap; ++p) {
+        pool_forget(g->req[p].v, g->req[p].cap); pool_forget(g->req[p].cnt, g->req[p].cap);
+        pool_forget(g->held[p].v, g->held[p].cap); pool_forget(g->held[p].cnt, g->held[p].cap);
+        pool_forget(g->wfg[p].v, g->wfg[p].cap); pool_forget(g->wfg[p].cnt, g->wfg[p].cap);
+        pool_forget(g->wfg_in[p].v, g->wfg_in[p].cap);
+    }
+    for (int r = 0; r < g->res_cap; ++r) {
+        pool_forget(g->waiters[r].v, g->waiters[r].cap);
+        pool_forget(g->alloc_[r].v, g->alloc_[r].cap);
+    }
+    pool_free(&g->pool);
+    par_free(g);
+    shard_free(g);
+    if (g->names_cap > 0) free(g->names);
+    free(g->p_name); free(g->r_name);
+    free(g->p_index.slot); free(g->r_index.slot);
+    free(g->req); free(g->waiters);
+    free(g->alloc_); free(g->held);
+    free(g->units); free(g->in_use);
+    free(g->wfg); free(g->wfg_mark); free(g->wfg_slot); free(g->wfg_in);
+    free(g->ord); free(g->node_at);
+    free(g->pk_mark); free(g->pk_parent); free(g->pk_iter);
+    edge_free(&g->pk_fwd); edge_free(&g->pk_bwd); edge_free(&g->pk_pool);
+    free(g->reach); edge_free(&g->reach_work);
+    free(g->dense.req); free(g->dense.own); free(g->dense.wfg);
+    free(g->dense.unvisited); free(g->dense.on_stack); free(g->dense.cursor);
+    free(g->visited); free(g->in_stack); free(g->stack_nodes);
+    free(g->prio); free(g->born);
+    free(g->vheap); edge_free(&g->vtrim); edge_free(&g->victims);
+    free(g->scc_index); free(g->scc_low); free(g->scc_iter);
+    free(g->scc_call); free(g->scc_comp);
+    free((void *)g->par_color); free(g->par_mark); free(g->par_nodes); free(g->par_in); free(g->par_out);
+    free(g->bk_work); free(g->bk_start); free(g->bk_ptr);
+    free(g->bk_need); free(g->bk_done); free(g->bk_queue); free(g->bk_wait);
+    edge_free(&g->scc_members); edge_free(&g->scc_start);
+    free(g->dirty_mark);
+    edge_free(&g->dirty); edge_free(&g->scc_broken); edge_free(&g->scc_seen);
+    edge_free(&g->scc_old_members); edge_free(&g->scc_old_start);
+    if (g->map_base) munmap(g->map_base, g->map_len);
+    history_free(g->hist);
+    lockdep_free(g->lockdep);
+    free(g->met);
+    memset(g, 0, sizeof(*g));
+}
+
+/* Copy 'name' (NUL included) to the end of the arena; returns its offset */
+static size_t intern_name(struct rag_graph *g, const char *name) {
+    size_t len = strlen(name) + 1;
+    if (g->names_len + len > g->names_cap) {
+        size_t cap = g->names_cap ? g->names_cap : 256;
+        while (cap < g->names_len + len) cap *= 2;
+        if (g->names_cap == 0 && g->names_len > 0) {
+            /* borrowed from a snapshot: move to the heap */
+            char *nb = xrealloc(NULL, cap);
+            memcpy(nb, g->names, g->names_len);
+            g->names = nb;
+        } else {
+            g->names = xrealloc(g->names, cap);
+        }
+        g->names_cap = cap;
+    }
+    size_t off = g->names_len;
+    memcpy(g->names + off, name, len);
+    g->names_len += len;
+    return off;
+}
+
+static const char *pname(const struct rag_graph *g, int p) {
+    return g->names + g->p_name[p];
+}
+
+static const char *rname(const struct rag_graph *g, int r) {
+    return g->names + g->r_name[r];
+}
+
+/* Look 'name' up among the nodes whose arena offsets are 'off'; -1 if absent */
+static int name_index_find(const struct name_index *ix, const struct rag_graph *g,
+                           const size_t *off, const char *name) {
+    if (ix->slot == NULL) return -1;
+    for (size_t h = name_hash(name) & ix->mask; ix->slot[h]; h = (h + 1) & ix->mask) {
+        int i = ix->slot[h] - 1;
+        if (strcmp(g->names + off[i], name) == 0) return i;
+    }
+    return -1;
+}
+
+static void name_index_place(struct name_index *ix, const char *name, int i) {
+    size_t h = name_hash(name) & ix->mask;
+    while (ix->slot[h]) h = (h + 1) & ix->mask;
+    ix->slot[h] = i + 1;
+}
+
+/* Register node i (its name must already be interned); grows the table
+   by rehashing every node when it would become more than half full */
+static void name_index_insert(struct name_index *ix, const struct rag_graph *g,
+                              const size_t *off, int i) {
+    if (2 * (ix->used + 1) > (ix->slot ? ix->mask + 1 : 0)) {
+        size_t cap = ix->slot ? 2 * (ix->mask + 1) : 64;
+        int *slot = xrealloc(NULL, cap * sizeof(int));   /* before the free: a failure leaves ix whole */
+        free(ix->slot);
+        ix->slot = slot;
+        memset(ix->slot, 0, cap * sizeof(int));
+        ix->mask = cap - 1;
+        for (size_t j = 0; j < ix->used; ++j) name_index_place(ix, g->names + off[j], (int)j);
+    }
+    name_index_place(ix, g->names + off[i], i);
+    ix->used++;
+}
+
+/* Append a node; the caller has already validated the name.
+   Returns the new dense index. */
+static int graph_add_process(struct rag_graph *g, const char *name) {
+    graph_grow_proc(g, g->n_proc + 1);
+    int p = g->n_proc++;
+    g->p_name[p] = intern_name(g, name);
+    name_index_insert(&g->p_index, g, g->p_name, p);
+    g->req[p].n = 0;
+    g->held[p].n = 0;
+    g->wfg[p].n = 0;
+    g->wfg_in[p].n = 0;
+    /* an isolated node can go last in the topological order */
+    g->ord[p] = p;
+    g->node_at[p] = p;
+    g->scc_index[p] = -1;
+    g->scc_comp[p] = -1;
+    g->dirty_mark[p] = 0;
+    g->prio[p] = 0;
+    g->born[p] = g->epoch;
+    if (g->reach_valid) reach_append(g, p);
+    hist_touch(g, HIST_PROC, p, 0);
+    return p;
+}
+
+static int graph_add_resource(struct rag_graph *g, const char *name) {
+    graph_grow_res(g, g->n_res + 1);
+    int r = g->n_res++;
+    g->r_name[r] = intern_name(g, name);
+    name_index_insert(&g->r_index, g, g->r_name, r);
+    g->waiters[r].n = 0;
+    g->alloc_[r].n = 0;
+    g->units[r] = 1;
+    g->in_use[r] = 0;
+    hist_touch(g, HIST_RES, r, 0);
+    return r;
+}
+
+static int graph_has_request(const struct rag_graph *g, int p, int r) {
+    return count_find(&g->req[p], r) >= 0;
+}
+
+static int graph_has_allocation(const struct rag_graph *g, int r, int p) {
+    return edge_find(&g->alloc_[r], p) >= 0;
+}
+
+static void online_wait_added(struct rag_graph *g, int p, int p2);
+static int online_check_edge(struct rag_graph *g, int x, int y);
+static void reach_link(struct rag_graph *g, int p, int p2);
+
+/* WFG maintenance: a P -> P2 wait edge is supported once per resource
+   r with p -> r requested and r -> p2 allocated. */
+static void wfg_link(struct rag_graph *g, int p, int p2) {
+    if (pool_count_add(&g->pool, &g->wfg[p], p2, 1) != 1) return;
+    pool_push(&g->pool, &g->wfg_in[p2], p);
+    g->wait_edges++;
+    if (g->scc_base && !g->dirty_mark[p]) {
+        /* any cycle this edge closes runs through p */
+        g->dirty_mark[p] = 1;
+        edge_push(&g->dirty, p);
+    }
+    if (g->online) online_wait_added(g, p, p2);
+    else if (g->avoid) online_check_edge(g, p, p2); /* keep the order current */
+    if (g->reach_valid) reach_link(g, p, p2);
+}
+
+static void wfg_unlink(struct rag_graph *g, int p, int p2) {
+    if (count_sub(&g->wfg[p], p2, 1) != 0) return;
+    edge_remove(&g->wfg_in[p2], p);
+    g->wait_edges--;
+    g->reach_churn++;
+    if (g->scc_base && g->scc_comp[p] >= 0 && g->scc_comp[p] == g->scc_comp[p2]) {
+        edge_push(&g->scc_broken, g->scc_comp[p]);
+        if (g->scc_broken.n > g->n_proc) g->scc_base = 0; /* next run is a full pass */
+    }
+    if (!g->topo_valid) g->topo_retry = 1;
+}
+
+/* Edge mutators return 1 if the graph changed, 0 otherwise.
+   Each one touches only the wait edges through the affected resource.
+   Wait edges follow edge presence, not unit counts. */
+static int graph_add_request_units(struct rag_graph *g, int p, int r, int k) {
+    if (k <= 0 || graph_has_request(g, p, r)) return 0;
+    pool_count_add(&g->pool, &g->req[p], r, k);
+    pool_push(&g->pool, &g->waiters[r], p);
+    g->req_edges++;
+    g->epoch++;
+    hist_touch(g, HIST_REQ, p, r);
+    lockdep_touch(g, p, r);
+    const edge_list *own = &g->alloc_[r];
+    for (int i = 0; i < own->n; ++i) wfg_link(g, p, own->v[i]);
+    return 1;
+}
+
+static int graph_remove_request(struct rag_graph *g, int p, int r) {
+    if (!count_remove(&g->req[p], r)) return 0;
+    edge_remove(&g->waiters[r], p);
+    g->req_edges--;
+    g->epoch++;
+    hist_touch(g, HIST_REQ, p, r);
+    const edge_list *own = &g->alloc_[r];
+    for (int i = 0; i < own->n; ++i) wfg_unlink(g, p, own->v[i]);
+    return 1;
+}
+
+/* Grant k more units of r to p; fails if fewer than k are free */
+static int graph_add_allocation_units(struct rag_graph *g, int r, int p, int k) {
+    if (k <= 0 || g->in_use[r] + k > g->units[r]) return 0;
+    g->in_use[r] += k;
+    g->epoch++;
+    hist_touch(g, HIST_HELD, p, r);
+    lockdep_touch(g, p, r);
+    if (pool_count_add(&g->pool, &g->held[p], r, k) > k) return 1; /* p already held some */
+    pool_push(&g->pool, &g->alloc_[r], p);
+    g->alloc_edges++;
+    const edge_list *wt = &g->waiters[r];
+    for (int i = 0; i < wt->n; ++i) wfg_link(g, wt->v[i], p);
+    return 1;
+}
+
+static int graph_add_allocation(struct rag_graph *g, int r, int p) {
+    if (graph_has_allocation(g, r, p)) return 0;
+    return graph_add_allocation_units(g, r, p, 1);
+}
+
+/* Release every unit of r held by p */
+static int graph_remove_allocation(struct rag_graph *g, int r, int p) {
+    int k = count_remove(&g->held[p], r);
+    if (!k) return 0;
+    g->in_use[r] -= k;
+    g->epoch++;
+    hist_touch(g, HIST_HELD, p, r);
+    edge_remove(&g->alloc_[r], p);
+    g->alloc_edges--;
+    const edge_list *wt = &g->waiters[r];
+    for (int i = 0; i < wt->n; ++i) wfg_unlink(g, wt->v[i], p);
+    return 1;
+}
+
+/* Release k units of r held by p (all of them if k covers the holding) */
+static int graph_release_units(struct rag_graph *g, int r, int p, int k) {
+    int held = count_of(&g->held[p], r);
+    if (k <= 0 || held == 0) return 0;
+    if (k >= held) return graph_remove_allocation(g, r, p);
+    count_sub(&g->held[p], r, k);
+    g->in_use[r] -= k;
+    g->epoch++;
+    hist_touch(g, HIST_HELD, p, r);
+    return 1;
+}
+
+/* Set the instance count of r; it cannot drop below the units in use */
+static int graph_set_units(struct rag_graph *g, int r, int n) {
+    if (n < 1 || n < g->in_use[r]) return 0;
+    g->multi_res += (n > 1) - (g->units[r] > 1);
+    g->units[r] = n;
+    g->epoch++;
+    hist_touch(g, HIST_RES, r, 0);
+    return 1;
+}
+
+/* Drop every node and edge; the detection and avoidance modes, the
+   engine settings and the version history survive a reset */
+static void graph_reset(struct rag_graph *g) {
+    int online = g->online, avoid = g->avoid;
+    int engine = g->engine, threads = g->threads, shards = g->shards, scc_full = g->scc_full;
+    rag_cycle_fn on_cycle = g->on_cycle;
+    void *on_cycle_arg = g->on_cycle_arg;
+    rag_inversion_fn on_inversion = g->on_inversion;
+    void *on_inversion_arg = g->on_inversion_arg;
+    struct rag_history *hist = g->hist;
+    struct rag_lockdep *lockdep = g->lockdep;
+    struct rag_metrics *met = g->met;
+    g->hist = NULL;
+    g->lockdep = NULL;
+    g->met = NULL;
+    graph_free(g);
+    g->hist = hist;
+    g->lockdep = lockdep;
+    g->met = met;
+    if (lockdep) lockdep_clear(lockdep);
+    g->on_inversion = on_inversion;
+    g->on_inversion_arg = on_inversion_arg;
+    g->online = online;
+    g->avoid = avoid;
+    g->engine = engine;
+    g->threads = threads;
+    g->shards = shards;
+    g->scc_full = scc_full;
+    g->on_cycle = on_cycle;
+    g->on_cycle_arg = on_cycle_arg;
+    g->topo_valid = 1;
+}
+
+/* Grant r to p under the single-owner model, revoking any current owner.
+   Returns the previous owner, or -1 if r was free. */
+static int graph_assign(struct rag_graph *g, int r, int p) {
+    int prev = -1;
+    while (g->alloc_[r].n > 0) {
+        prev = g->alloc_[r].v[0];
+        graph_remove_allocation(g, r, prev);
+    }
+    graph_add_allocation(g, r, p);
+    return prev;
+}
+
+/* ---- Utility ---- */
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int cmp_int(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t rng_next(uint64_t *s) {
+    /* xorshift64* */
+    uint64_t x = *s;
+    x ^= x >> 12; x ^= x << 25; x ^= x >> 27;
+    *s = x;
+    return x * 2685821657736338717ULL;
+}
+
+/* ---- Metrics ---- */
+static const struct metric_def metric_defs[MET_COUNT] = {
+    { "rag_wfg_builds_total", MK_COUNTER, "Full wait-for graph rebuilds" },
+    { "rag_wfg_build_seconds_total", MK_SECONDS, "Time spent in build_wfg" },
+    { "rag_wfg_edges_built_total", MK_COUNTER, "Wait edges produced by build_wfg" },
+    { "rag_dfs_runs_total", MK_COUNTER, "Sparse DFS detection passes" },
+    { "rag_dfs_seconds_total", MK_SECONDS, "Time spent in DFS passes" },
+    { "rag_dfs_nodes_visited_total", MK_COUNTER, "Processes entered by dfs_cycle" },
+    { "rag_dfs_edges_visited_total", MK_COUNTER, "Wait edges scanned by dfs_cycle" },
+    { "rag_dfs_cycles_found_total", MK_COUNTER, "DFS passes that found a cycle" },
+    { "rag_detect_runs_total", MK_COUNTER, "Detection runs (any engine)" },
+    { "rag_detect_seconds_total", MK_SECONDS, "Time spent in detection runs" },
+    { "rag_detect_deadlocks_total", MK_COUNTER, "Detection runs that found a deadlock" },
+    { "rag_ingest_events_total", MK_COUNTER, "Lock events applied or rejected" },
+    { "rag_ingest_rejected_total", MK_COUNTER, "Lock events inconsistent with the graph" },
+    { "rag_ingest_batches_total", MK_COUNTER, "Monitor drain rounds that consumed events" },
+    { "rag_ingest_seconds_total", MK_SECONDS, "Time spent applying monitor events" },
+    { "rag_ingest_queue_depth", MK_GAUGE, "Events waiting in monitor rings at the last drain" },
+    { "rag_ingest_queue_depth_max", MK_MAX, "Most events ever seen waiting at a drain" },
+    { "rag_avoid_checks_total", MK_COUNTER, "Avoidance checks on requests and grants" },
+    { "rag_avoid_searches_total", MK_COUNTER, "Avoidance checks the index could not settle" },
+    { "rag_reach_builds_total", MK_COUNTER, "Reachability index rebuilds" },
+};
+
+static void met_snapshot(const struct rag_graph *g, uint64_t *v) {
+    for (int i = 0; i < MET_COUNT; ++i) v[i] = atomic_load_explicit(&g->met->c[i], memory_order_relaxed);
+}
+
+/* ---- Core operations ---- */
+static int find_process(const struct rag_graph *g, const char *name) {
+    return name_index_find(&g->p_index, g, g->p_name, name);
+}
+
+static int find_resource(const struct rag_graph *g, const char *name) {
+    return name_index_find(&g->r_index, g, g->r_name, name);
+}
+
+/* ---- Build Wait-For Graph (P -> P) ----
+   For every request edge P -> R, if R is allocated to P2, add edge P -> P2 in WFG.
+   The edge mutators already keep wfg (and its support counts) current, so this
+   full recomputation is only needed when the edge lists were filled in bulk.
+   Work is proportional to the number of request/allocation edges; wfg_mark
+   stamps (base + p) on each P2 already added to wfg[p], wfg_slot remembers
+   where. Each call moves the base past the previous call's stamps, so the
+   marks are only cleared when the counter would wrap.
+*/
+static void build_wfg(struct rag_graph *g) {
+    uint64_t t0 = met_ticks();
+    for (int p = 0; p < g->n_proc; ++p) {
+        g->wfg[p].n = 0;
+        g->wfg_in[p].n = 0;
+    }
+    if (g->wfg_stamp > INT_MAX - 2 * g->n_proc - 1) {
+        for (int p = 0; p < g->proc_cap; ++p) g->wfg_mark[p] = 0;
+        g->wfg_stamp = 0;
+    }
+    int base = g->wfg_stamp + 1;
+    g->wfg_stamp += g->n_proc;
+    g->wait_edges = 0;
+    for (int p = 0; p < g->n_proc; ++p) {
+        const count_list *rq = &g->req[p];
+        count_list *out = &g->wfg[p];
+        for (int i = 0; i < rq->n; ++i) {
+            const edge_list *own = &g->alloc_[rq->v[i]];
+            for (int j = 0; j < own->n; ++j) {
+                int p2 = own->v[j];
+                if (g->wfg_mark[p2] == base + p) {
+                    out->cnt[g->wfg_slot[p2]]++;
+                } else {
+                    g->wfg_mark[p2] = base + p;
+                    g->wfg_slot[p2] = out->n;
+                    pool_count_add(&g->pool, out, p2, 1); /* appends: p2 is not in wfg[p] yet */
+                    pool_push(&g->pool, &g->wfg_in[p2], p);
+                    g->wait_edges++;
+                }
+            }
+        }
+    }
+    g->topo_valid = 0;
+    g->topo_retry = 1;
+    g->reach_valid = 0;
+    met_add(g, MET_WFG_BUILDS, 1);
+    met_add(g, MET_WFG_EDGES, (uint64_t)g->wait_edges);
+    met_time(g, MET_WFG_TICKS, t0);
+}
+
+/* For reconstructing full P->R->P link for a pair (p -> p2),
+   find a resource r such that p requests r and r is allocated to p2.
+   Returns index r or -1 if none found.
+*/
+static int find_blocking_resource(const struct rag_graph *g, int p, int p2) {
+    const count_list *rq = &g->req[p];
+    for (int i = 0; i < rq->n; ++i) {
+        if (graph_has_allocation(g, rq->v[i], p2)) return rq->v[i];
+    }
+    return -1;
+}
+
+/* DFS cycle detection on wfg with stack to reconstruct cycle.
+   The path from the root is kept on stack_nodes, with the next edge of
+   each process in scc_iter (Tarjan's scratch), so a long wait chain costs
+   no host stack. return 1 if any cycle found, 0 otherwise */
+static int dfs_cycle(struct rag_graph *g, int root) {
+    int stamp = g->dfs_stamp, *it = g->scc_iter;
+    int base = g->stack_top;
+    g->visited[root] = stamp;
+    g->in_stack[root] = stamp;
+    g->stack_nodes[++g->stack_top] = root;
+    it[root] = 0;
+    g->dfs_nodes++;
+
+    while (g->stack_top > base) {
+        int u = g->stack_nodes[g->stack_top];
+        const count_list *out = &g->wfg[u];
+        if (it[u] < out->n) {
+            int v = out->v[it[u]++];
+            g->dfs_edges++;
+            if (g->visited[v] != stamp) {
+                g->visited[v] = stamp;
+                g->in_stack[v] = stamp;
+                g->stack_nodes[++g->stack_top] = v;
+                it[v] = 0;
+                g->dfs_nodes++;
+            } else if (g->in_stack[v] == stamp) {
+                /* found back-edge u -> v; the cycle starts at v on the stack */
+                g->cycle_at = v;
+                return 1; /* early exit on first cycle */
+            }
+            continue;
+        }
+        g->in_stack[u] = 0;
+        --g->stack_top;
+    }
+    return 0;
+}
+
+/* Sparse engine: DFS from every unvisited root over the adjacency lists.
+   A fresh stamp stands in for clearing visited/in_stack. in_stack is shared
+   with Tarjan, which only reads it for processes it has visited itself. */
+static int detect_dfs(struct rag_graph *g) {
+    uint64_t t0 = met_ticks();
+    if (++g->dfs_stamp == INT_MAX) {
+        for (int p = 0; p < g->proc_cap; ++p) g->visited[p] = g->in_stack[p] = 0;
+        g->dfs_stamp = 1;
+    }
+    g->stack_top = -1;
+    g->dfs_nodes = g->dfs_edges = 0;
+    int found = 0;
+    for (int i = 0; i < g->n_proc && !found; ++i) {
+        if (g->visited[i] != g->dfs_stamp) found = dfs_cycle(g, i); /* report first cycle only */
+    }
+    met_add(g, MET_DFS_RUNS, 1);
+    met_add(g, MET_DFS_NODES, g->dfs_nodes);
+    met_add(g, MET_DFS_EDGES, g->dfs_edges);
+    met_add(g, MET_DFS_CYCLES, (uint64_t)found);
+    met_time(g, MET_DFS_TICKS, t0);
+    return found;
+}
+
+/* ---- Dense engine: bit-packed WFG ---- */
+
+/* dst |= src over nw words */
+static void bits_or(uint64_t *dst, const uint64_t *src, int nw) {
+    int i = 0;
+#if defined(__AVX2__)
+    for (; i + 4 <= nw; i += 4) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(dst + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(src + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_or_si256(a, b));
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 2 <= nw; i += 2) {
+        vst1q_u64(dst + i, vorrq_u64(vld1q_u64(dst + i), vld1q_u64(src + i)));
+    }
+#endif
+    for (; i < nw; ++i) dst[i] |= src[i];
+}
+
+/* first index set in (a & b), or -1 */
+static int bits_first_and(const uint64_t *a, const uint64_t *b, int nw) {
+    for (int i = 0; i < nw; ++i) {
+        uint64_t w = a[i] & b[i];
+        if (w) return i * 64 + __builtin_ctzll(w);
+    }
+    return -1;
+}
+
+static void dense_reserve(struct dense_wfg *d, int n_proc, int n_res) {
+    d->n_proc = n_proc;
+    d->n_res = n_res;
+    d->pw = (n_proc + 63) / 64;
+    d->rw = (n_res + 63) / 64;
+    size_t need = (size_t)n_proc * d->rw;
+    if ((size_t)n_res * d->pw > need) need = (size_t)n_res * d->pw;
+    if ((size_t)n_proc * d->pw > need) need = (size_t)n_proc * d->pw;
+    if (need > d->cap_words) {
+        d->req = xrealloc(d->req, need * sizeof(uint64_t));
+        d->own = xrealloc(d->own, need * sizeof(uint64_t));
+        d->wfg = xrealloc(d->wfg, need * sizeof(uint64_t));
+        d->unvisited = xrealloc(d->unvisited, (size_t)d->pw * sizeof(uint64_t));
+        d->on_stack = xrealloc(d->on_stack, (size_t)d->pw * sizeof(uint64_t));
+        d->cursor = xrealloc(d->cursor, (size_t)n_proc * sizeof(int));
+        d->cap_words = need;
+    }
+}
+
+/* Pack req/alloc_ into bit rows, then wfg[p] |= own[r] for each r requested by p */
+static void dense_build_wfg(struct rag_graph *g) {
+    struct dense_wfg *d = &g->dense;
+    dense_reserve(d, g->n_proc, g->n_res);
+    memset(d->req, 0, (size_t)d->n_proc * d->rw * sizeof(uint64_t));
+    memset(d->own, 0, (size_t)d->n_res * d->pw * sizeof(uint64_t));
+    memset(d->wfg, 0, (size_t)d->n_proc * d->pw * sizeof(uint64_t));
+    for (int p = 0; p < g->n_proc; ++p) {
+        uint64_t *row = d->req + (size_t)p * d->rw;
+        for (int i = 0; i < g->req[p].n; ++i) {
+            int r = g->req[p].v[i];
+            row[r >> 6] |= 1ULL << (r & 63);
+        }
+    }
+    for (int r = 0; r < g->n_res; ++r) {
+        uint64_t *row = d->own + (size_t)r * d->pw;
+        for (int i = 0; i < g->alloc_[r].n; ++i) {
+            int p = g->alloc_[r].v[i];
+            row[p >> 6] |= 1ULL << (p & 63);
+        }
+    }
+    for (int p = 0; p < g->n_proc; ++p) {
+        const uint64_t *rq = d->req + (size_t)p * d->rw;
+        uint64_t *out = d->wfg + (size_t)p * d->pw;
+        for (int w = 0; w < d->rw; ++w) {
+            for (uint64_t bits = rq[w]; bits; bits &= bits - 1) {
+                int r = w * 64 + __builtin_ctzll(bits);
+                bits_or(out, d->own + (size_t)r * d->pw, d->pw);
+            }
+        }
+    }
+}
+
+/* Iterative DFS over the bit rows. A back edge is found with one AND of the
+   row against on_stack when a node is entered (the stack only shrinks back
+   to the same set while that node is on it); tree edges come from
+   row & unvisited, scanned with ctz from a per-node word cursor. */
+static int detect_dense(struct rag_graph *g) {
+    struct dense_wfg *d = &g->dense;
+    dense_build_wfg(g);
+    int pw = d->pw;
+    for (int w = 0; w < pw; ++w) {
+        d->unvisited[w] = ~0ULL;
+        d->on_stack[w] = 0;
+    }
+    if (g->n_proc & 63) d->unvisited[pw - 1] = (1ULL << (g->n_proc & 63)) - 1;
+    g->stack_top = -1;
+    for (int root = bits_first_and(d->unvisited, d->unvisited, pw); root >= 0;
+         root = bits_first_and(d->unvisited, d->unvisited, pw)) {
+        int u = root;
+        for (;;) {
+            /* enter u */
+            const uint64_t *row = d->wfg + (size_t)u * pw;
+            d->unvisited[u >> 6] &= ~(1ULL << (u & 63));
+            d->on_stack[u >> 6] |= 1ULL << (u & 63);
+            g->stack_nodes[++g->stack_top] = u;
+            d->cursor[u] = 0;
+            int back = bits_first_and(row, d->on_stack, pw);
+            if (back >= 0) {
+                g->cycle_at = back;
+                return 1;
+            }
+            /* advance to the next unvisited neighbour, popping finished nodes */
+            int next = -1;
+            while (g->stack_top >= 0) {
+                int t = g->stack_nodes[g->stack_top];
+                const uint64_t *trow = d->wfg + (size_t)t * pw;
+                while (d->cursor[t] < pw) {
+                    uint64_t w = trow[d->cursor[t]] & d->unvisited[d->cursor[t]];
+                    if (w) { next = d->cursor[t] * 64 + __builtin_ctzll(w); break; }
+                    d->cursor[t]++;
+                }
+                if (next >= 0) break;
+                d->on_stack[t >> 6] &= ~(1ULL << (t & 63));
+                --g->stack_top;
+            }
+            if (next < 0) break;
+            u = next;
+        }
+    }
+    return 0;
+}
+
+/* ---- SCC engine: iterative Tarjan ----
+   One O(V + E) pass with an explicit call stack (no recursion depth limit).
+   Every strongly connected component with more than one process, or a
+   single process waiting on itself, is a deadlocked set. Results go to
+   scc_members/scc_start/scc_comp; returns the number of deadlocked sets.
+   After one full pass, scc_detect_dirty revisits only what changed.
+*/
+/* Tarjan from one unvisited root; deadlocked sets are appended to the
+   result. Discovered processes are recorded in 'seen' if it is given. */
+static void scc_visit(struct rag_graph *g, int root, int *next_index, edge_list *seen) {
+    int top = -1, call_top = -1;
+    int *idx = g->scc_index, *low = g->scc_low, *it = g->scc_iter;
+    int *call = g->scc_call, *stk = g->stack_nodes;
+    idx[root] = low[root] = (*next_index)++;
+    it[root] = 0;
+    stk[++top] = root;
+    g->in_stack[root] = 1;
+    call[++call_top] = root;
+    if (seen) edge_push(seen, root);
+    while (call_top >= 0) {
+        int u = call[call_top];
+        const count_list *out = &g->wfg[u];
+        if (it[u] < out->n) {
+            int v = out->v[it[u]++];
+            if (idx[v] < 0) {
+                idx[v] = low[v] = (*next_index)++;
+                it[v] = 0;
+                stk[++top] = v;
+                g->in_stack[v] = 1;
+                call[++call_top] = v;
+                if (seen) edge_push(seen, v);
+            } else if (g->in_stack[v] && idx[v] < low[u]) {
+                low[u] = idx[v];
+            }
+            continue;
+        }
+        /* u is finished: propagate lowlink, pop a component at its root */
+        if (--call_top >= 0) {
+            int parent = call[call_top];
+            if (low[u] < low[parent]) low[parent] = low[u];
+        }
+        if (low[u] != idx[u]) continue;
+        int first = top;
+        while (stk[first] != u) --first;
+        int size = top - first + 1;
+        int deadlocked = size > 1;
+        if (!deadlocked) {
+            for (int i = 0; i < out->n; ++i) {
+                if (out->v[i] == u) { deadlocked = 1; break; }
+            }
+        }
+        if (deadlocked) edge_push(&g->scc_start, g->scc_members.n);
+        for (int i = first; i <= top; ++i) {
+            int w = stk[i];
+            g->in_stack[w] = 0;
+            if (deadlocked) {
+                g->scc_comp[w] = g->scc_count;
+                edge_push(&g->scc_members, w);
+            }
+        }
+        if (deadlocked) g->scc_count++;
+        top = first - 1;
+    }
+}
+
+/* The result now describes the current graph: start a new dirty region */
+static void scc_clear_dirty(struct rag_graph *g) {
+    for (int i = 0; i < g->dirty.n; ++i) g->dirty_mark[g->dirty.v[i]] = 0;
+    g->dirty.n = 0;
+    g->scc_broken.n = 0;
+    g->scc_base = 1;
+}
+
+/* Forget the previous result: only its members have scc_comp set */
+static void scc_clear_result(struct rag_graph *g) {
+    for (int i = 0; i < g->scc_members.n; ++i) g->scc_comp[g->scc_members.v[i]] = -1;
+    g->scc_members.n = 0;
+    g->scc_start.n = 0;
+    g->scc_count = 0;
+}
+
+static int scc_detect(struct rag_graph *g) {
+    int n = g->n_proc, next_index = 0;
+    scc_clear_result(g);
+    for (int root = 0; root < n; ++root) {
+        if (g->scc_index[root] < 0) scc_visit(g, root, &next_index, NULL);
+    }
+    edge_push(&g->scc_start, g->scc_members.n);
+    for (int p = 0; p < n; ++p) g->scc_index[p] = -1; /* every process was visited */
+    scc_clear_dirty(g);
+    return g->scc_count;
+}
+
+/* Incremental SCC: same result as scc_detect, searching only the dirty
+   region. A cycle that is new since the last run uses a new wait edge, so
+   Tarjan from that edge's tail finds it; a cycle made of old edges only
+   lay inside an old deadlocked set. The search therefore starts from dirty
+   processes and from every member of an old set that lost an internal
+   edge. Any other old set is still strongly connected and is kept as is,
+   unless the search ran into it (an SCC is visited whole or not at all),
+   in which case the search already reported it, possibly merged. */
+static int scc_detect_dirty(struct rag_graph *g) {
+    if (!g->scc_base || g->dirty.n > g->n_proc / 4) return scc_detect(g);
+    edge_list t = g->scc_old_members; g->scc_old_members = g->scc_members; g->scc_members = t;
+    t = g->scc_old_start; g->scc_old_start = g->scc_start; g->scc_start = t;
+    const edge_list *om = &g->scc_old_members, *os = &g->scc_old_start;
+    int old_count = g->scc_count, next_index = 0;
+    g->scc_members.n = 0;
+    g->scc_start.n = 0;
+    g->scc_count = 0;
+    g->scc_seen.n = 0;
+    for (int i = 0; i < om->n; ++i) g->scc_comp[om->v[i]] = -1;
+
+    /* a set loses many edges at once (a victim drops them all): scan each once */
+    if (g->scc_broken.n > 1) qsort(g->scc_broken.v, (size_t)g->scc_broken.n, sizeof(int), cmp_int);
+    for (int b = 0; b < g->scc_broken.n; ++b) {
+        int s = g->scc_broken.v[b];
+        if (b > 0 && s == g->scc_broken.v[b - 1]) continue;
+        for (int i = os->v[s]; i < os->v[s + 1]; ++i) {
+            int p = om->v[i];
+            if (g->scc_index[p] < 0) scc_visit(g, p, &next_index, &g->scc_seen);
+        }
+    }
+    for (int i = 0; i < g->dirty.n; ++i) {
+        int p = g->dirty.v[i];
+        if (g->scc_index[p] < 0) scc_visit(g, p, &next_index, &g->scc_seen);
+    }
+    for (int s = 0; s < old_count; ++s) {
+        int from = os->v[s], to = os->v[s + 1];
+        if (g->scc_index[om->v[from]] >= 0) continue; /* searched again */
+        edge_push(&g->scc_start, g->scc_members.n);
+        for (int i = from; i < to; ++i) {
+            g->scc_comp[om->v[i]] = g->scc_count;
+            edge_push(&g->scc_members, om->v[i]);
+        }
+        g->scc_count++;
+    }
+    edge_push(&g->scc_start, g->scc_members.n);
+    for (int i = 0; i < g->scc_seen.n; ++i) g->scc_index[g->scc_seen.v[i]] = -1;
+    scc_clear_dirty(g);
+    return g->scc_count;
+}
+
+/* ---- Small-graph kernel: one word per process ----
+   With at most 64 processes the whole WFG fits in 64 machine words: fw[i]
+   has bit j set when i waits on j, bw[j] the same edge seen from j. The
+   engine is Kosaraju's two passes with every neighbour scan reduced to an
+   AND and a ctz. A DFS over fw records finishing order (the next child of
+   u is ctz(fw[u] & unseen), so each process is entered and left once) and
+   notes any edge back into its own stack; without one the WFG is acyclic
+   and the run ends there. Otherwise, in reverse finishing order, each
+   unclaimed process takes as its set its backward reach through bw among
+   the unclaimed ones. That is O(n) word operations after the O(E)
+   packing, with no index/lowlink arrays to reset; the stack lives on the
+   C stack and the result lists are reserved once and filled by direct
+   stores. A set is deadlocked when it has two or more members or its only
+   member waits on itself. Results go to the same fields as scc_detect's.
+*/
+static int small_detect(struct rag_graph *g) {
+    uint64_t fw[SMALL_MAX_PROC], bw[SMALL_MAX_PROC];
+    int order[SMALL_MAX_PROC], stk[SMALL_MAX_PROC];
+    int n = g->n_proc, done = 0;
+    for (int p = 0; p < n; ++p) fw[p] = bw[p] = 0;
+    for (int p = 0; p < n; ++p) {
+        const count_list *out = &g->wfg[p];
+        for (int i = 0; i < out->n; ++i) {
+            int v = out->v[i];
+            fw[p] |= 1ULL << v;
+            bw[v] |= 1ULL << p;
+        }
+    }
+    uint64_t all = n == 64 ? ~0ULL : (1ULL << n) - 1, unseen = all, on = 0, back = 0;
+    while (unseen) {
+        int top = 0;
+        stk[0] = __builtin_ctzll(unseen);
+        unseen &= unseen - 1;
+        on = 1ULL << stk[0];
+        back |= fw[stk[0]] & on;
+        while (top >= 0) {
+            int u = stk[top];
+            uint64_t w = fw[u] & unseen;
+            if (w) {
+                uint64_t bit = w & -w;
+                stk[++top] = __builtin_ctzll(w);
+                unseen &= ~bit;
+                on |= bit;
+                back |= fw[stk[top]] & on;
+            } else {
+                order[done++] = u;
+                on &= ~(1ULL << u);
+                --top;
+            }
+        }
+    }
+    scc_clear_result(g);
+    if (!back) { /* no edge into the DFS stack: acyclic, nothing to collect */
+        edge_push(&g->scc_start, 0);
+        scc_clear_dirty(g);
+        return 0;
+    }
+    edge_reserve(&g->scc_members, n);
+    edge_reserve(&g->scc_start, n + 1);
+    int *members = g->scc_members.v, *start = g->scc_start.v, m = 0, sets = 0;
+    unseen = all;
+    for (int k = n - 1; k >= 0; --k) {
+        int v = order[k];
+        if (!((unseen >> v) & 1)) continue;
+        uint64_t set = 1ULL << v, todo;
+        unseen &= ~set;
+        todo = bw[v] & unseen;
+        unseen &= ~todo;
+        while (todo) {
+            uint64_t bit = todo & -todo, more = bw[__builtin_ctzll(todo)] & unseen;
+            set |= bit;
+            unseen &= ~more;
+            todo = (todo ^ bit) | more;
+        }
+        if (!(set & (set - 1)) && !((fw[v] >> v) & 1)) continue;
+        start[sets] = m;
+        for (; set; set &= set - 1) {
+            int j = __builtin_ctzll(set);
+            g->scc_comp[j] = sets;
+            members[m++] = j;
+        }
+        sets++;
+    }
+    start[sets] = m;
+    g->scc_members.n = m;
+    g->scc_start.n = sets + 1;
+    g->scc_count = sets;
+    scc_clear_dirty(g);
+    return g->scc_count;
+}
+
+/* ---- Parallel SCC engine: forward-backward with trimming ----
+   Each task is a set of processes sharing a colour. A task first trims
+   members with no in- or no out-edge inside the colour (they are trivial
+   SCCs), then picks a pivot: FW(pivot) & BW(pivot) within the colour is one
+   SCC, and FW \ SCC, BW \ SCC and the rest become three independent tasks
+   with fresh colours. Tasks touch disjoint processes, so workers share no
+   writes except colours read across task borders (atomics) and the task
+   counter. Workers keep a mutex-guarded deque each, pop their own newest
+   task and steal the oldest from a random victim when empty. Subtasks are
+   disjoint slices of one process array, rearranged in place, so a run
+   allocates nothing once the buffers have grown. The result
+   uses the same scc_members/scc_start/scc_comp layout as scc_detect, with
+   sets ordered by their smallest process so runs are reproducible.
+*/
+#define PAR_DONE (-1)
+
+struct par_task {
+    int *nodes;         /* a slice of g->par_nodes owned by this task */
+    int n;
+    int color;
+};
+
+struct par_deque {
+    pthread_mutex_t lock;
+    struct par_task *t;
+    int head;           /* thieves take from here */
+    int tail;           /* owner pushes and pops here */
+    int cap;
+};
+
+struct par_ctx;
+
+struct par_worker {
+    struct par_ctx *ctx;
+    int id;
+    uint64_t seed;
+    edge_list members;  /* deadlocked sets found by this worker */
+    edge_list start;
+    edge_list queue;    /* trim / BFS scratch */
+    edge_list order;    /* new layout of the task slice */
+    edge_list bounds;   /* sub-slice boundaries in 'order' */
+};
+
+struct par_set_ref {
+    int min;
+    int worker;
+    int idx;
+};
+
+/* Worker pool cached in the graph, so a steady stream of detections does
+   not allocate: every buffer keeps its capacity between runs */
+struct par_ctx {
+    struct rag_graph *g;
+    int nthreads;
+    int cap;                /* workers allocated */
+    struct par_deque *dq;
+    struct par_worker *w;
+    pthread_t *tid;
+    struct par_set_ref *refs;
+    int refs_cap;
+    atomic_int pending;     /* tasks queued or running */
+    atomic_int oom;         /* a worker ran out of memory: all stop */
+    atomic_int next_color;
+};
+
+/* Worker threads for g: g->threads, or one per online CPU if 0 */
+static int par_thread_count(const struct rag_graph *g) {
+    if (g->threads > 0) return g->threads;
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+static void par_free(struct rag_graph *g) {
+    struct par_ctx *ctx = g->par;
+    if (ctx == NULL) return;
+    for (int i = 0; i < ctx->cap; ++i) {
+        pthread_mutex_destroy(&ctx->dq[i].lock);
+        free(ctx->dq[i].t);
+        edge_free(&ctx->w[i].members);
+        edge_free(&ctx->w[i].start);
+        edge_free(&ctx->w[i].queue);
+        edge_free(&ctx->w[i].order);
+        edge_free(&ctx->w[i].bounds);
+    }
+    free(ctx->dq);
+    free(ctx->w);
+    free(ctx->tid);
+    free(ctx->refs);
+    free(ctx);
+    g->par = NULL;
+}
+
+static struct par_ctx *par_prepare(struct rag_graph *g, int nthreads) {
+    if (g->par != NULL && g->par->cap < nthreads) par_free(g);
+    if (g->par == NULL) {
+        struct par_ctx *ctx = calloc(1, sizeof(*ctx));
+        if (ctx == NULL) oom_raise();
+        g->par = ctx;   /* par_free takes a half-built one apart: cap stays 0 until the end */
+        ctx->dq = calloc((size_t)nthreads, sizeof(*ctx->dq));
+        ctx->w = calloc((size_t)nthreads, sizeof(*ctx->w));
+        ctx->tid = calloc((size_t)nthreads, sizeof(pthread_t));
+        if (ctx->dq == NULL || ctx->w == NULL || ctx->tid == NULL) oom_raise();
+        for (int i = 0; i < nthreads; ++i) {
+            pthread_mutex_init(&ctx->dq[i].lock, NULL);
+            ctx->w[i].ctx = ctx;
+            ctx->w[i].id = i;
+        }
+        ctx->cap = nthreads;
+    }
+    struct par_ctx *ctx = g->par;
+    ctx->g = g;
+    ctx->nthreads = nthreads;
+    atomic_init(&ctx->pending, 1);
+    atomic_init(&ctx->oom, 0);
+    atomic_init(&ctx->next_color, 1);
+    for (int i = 0; i < nthreads; ++i) {
+        struct par_worker *w = &ctx->w[i];
+        w->seed = 0x9e3779b97f4a7c15ULL * (uint64_t)(i + 1);
+        w->members.n = w->start.n = 0;
+        ctx->dq[i].head = ctx->dq[i].tail = 0;
+    }
+    return ctx;
+}
+
+static void par_push(struct par_deque *d, struct par_task t) {
+    pthread_mutex_lock(&d->lock);
+    if (d->tail == d->cap) {
+        if (d->head > 0) {
+            memmove(d->t, d->t + d->head, (size_t)(d->tail - d->head) * sizeof(*d->t));
+            d->tail -= d->head;
+            d->head = 0;
+        }
+        if (d->tail == d->cap) {
+            int cap = d->cap ? d->cap * 2 : 16;
+            struct par_task *t2 = realloc(d->t, (size_t)cap * sizeof(*d->t));
+            if (t2 == NULL) {   /* unlock first: the guard unwinds past us */
+                pthread_mutex_unlock(&d->lock);
+                oom_raise();
+            }
+            d->t = t2;
+            d->cap = cap;
+        }
+    }
+    d->t[d->tail++] = t;
+    pthread_mutex_unlock(&d->lock);
+}
+
+static int par_take(struct par_deque *d, struct par_task *out, int steal) {
+    int got = 0;
+    pthread_mutex_lock(&d->lock);
+    if (d->head < d->tail) {
+        *out = steal ? d->t[d->head++] : d->t[--d->tail];
+        got = 1;
+        if (d->head == d->tail) d->head = d->tail = 0;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return got;
+}
+
+static int par_color_of(const struct rag_graph *g, int v) {
+    return atomic_load_explicit(&g->par_color[v], memory_order_relaxed);
+}
+
+static void par_set_color(struct rag_graph *g, int v, int c) {
+    atomic_store_explicit(&g->par_color[v], c, memory_order_relaxed);
+}
+
+/* BFS from the pivot inside colour c, or-ing 'bit' into par_mark */
+static void par_reach(struct rag_graph *g, struct par_worker *w, int pivot, int c,
+                      int forward, unsigned char bit) {
+    edge_list *q = &w->queue;
+    q->n = 0;
+    g->par_mark[pivot] |= bit;
+    edge_push(q, pivot);
+    for (int h = 0; h < q->n; ++h) {
+        int u = q->v[h];
+        int deg = forward ? g->wfg[u].n : g->wfg_in[u].n;
+        const int *adj = forward ? g->wfg[u].v : g->wfg_in[u].v;
+        for (int i = 0; i < deg; ++i) {
+            int x = adj[i];
+            /* colour first: x may belong to another thread's task, whose marks are not ours to read */
+            if (par_color_of(g, x) != c || (g->par_mark[x] & bit)) continue;
+            g->par_mark[x] |= bit;
+            edge_push(q, x);
+        }
+    }
+}
+
+/* Copy w->order back over the task slice and queue every sub-slice listed
+   in w->bounds as a new task */
+static void par_split(struct par_worker *w, int *nodes) {
+    memcpy(nodes, w->order.v, (size_t)w->order.n * sizeof(int));
+    for (int b = 0; b + 1 < w->bounds.n; ++b) {
+        int from = w->bounds.v[b], to = w->bounds.v[b + 1];
+        if (from == to) continue;
+        struct par_task nt = { nodes + from, to - from, par_color_of(w->ctx->g, nodes[from]) };
+        atomic_fetch_add(&w->ctx->pending, 1);
+        par_push(&w->ctx->dq[w->id], nt);
+    }
+}
+
+static void par_run_task(struct par_worker *w, struct par_task t) {
+    struct par_ctx *ctx = w->ctx;
+    struct rag_graph *g = ctx->g;
+    int c = t.color;
+
+    /* trim: in/out degree restricted to the colour */
+    edge_list *q = &w->queue;
+    q->n = 0;
+    for (int i = 0; i < t.n; ++i) {
+        int v = t.nodes[i], din = 0, dout = 0;
+        for (int j = 0; j < g->wfg[v].n; ++j) dout += par_color_of(g, g->wfg[v].v[j]) == c;
+        for (int j = 0; j < g->wfg_in[v].n; ++j) din += par_color_of(g, g->wfg_in[v].v[j]) == c;
+        g->par_in[v] = din;
+        g->par_out[v] = dout;
+        if (din == 0 || dout == 0) edge_push(q, v);
+    }
+    for (int h = 0; h < q->n; ++h) {
+        int v = q->v[h];
+        if (par_color_of(g, v) != c) continue; /* queued twice */
+        par_set_color(g, v, PAR_DONE);
+        for (int j = 0; j < g->wfg[v].n; ++j) {
+            int x = g->wfg[v].v[j];
+            if (par_color_of(g, x) == c && --g->par_in[x] == 0) edge_push(q, x);
+        }
+        for (int j = 0; j < g->wfg_in[v].n; ++j) {
+            int x = g->wfg_in[v].v[j];
+            if (par_color_of(g, x) == c && --g->par_out[x] == 0) edge_push(q, x);
+        }
+    }
+    /* weak components: independent tasks, so disjoint cycles do not get
+       peeled one pivot at a time. Recolouring doubles as the visited mark;
+       the components are laid out back to back over the slice. */
+    edge_list *order = &w->order;
+    order->n = 0;
+    w->bounds.n = 0;
+    for (int i = 0; i < t.n; ++i) {
+        int s = t.nodes[i];
+        if (par_color_of(g, s) != c) continue;
+        int nc = atomic_fetch_add(&ctx->next_color, 1);
+        edge_push(&w->bounds, order->n);
+        par_set_color(g, s, nc);
+        edge_push(order, s);
+        for (int h = order->n - 1; h < order->n; ++h) {
+            int u = order->v[h];
+            for (int dir = 0; dir < 2; ++dir) {
+                int deg = dir ? g->wfg_in[u].n : g->wfg[u].n;
+                const int *adj = dir ? g->wfg_in[u].v : g->wfg[u].v;
+                for (int j = 0; j < deg; ++j) {
+                    int x = adj[j];
+                    if (par_color_of(g, x) != c) continue;
+                    par_set_color(g, x, nc);
+                    edge_push(order, x);
+                }
+            }
+        }
+    }
+    edge_push(&w->bounds, order->n);
+    if (order->n == 0) return;
+    if (w->bounds.n > 2) { par_split(w, t.nodes); return; }
+    /* a single component stays in this task */
+    memcpy(t.nodes, order->v, (size_t)order->n * sizeof(int));
+    t.n = order->n;
+    int pivot = t.nodes[0];
+    c = par_color_of(g, pivot);
+
+    par_reach(g, w, pivot, c, 1, 1);
+    par_reach(g, w, pivot, c, 0, 2);
+
+    /* split: SCC (both marks) is recorded, FW-only, BW-only and the rest
+       become up to three tasks over the same slice */
+    int scc_from = w->members.n, cnt[3] = { 0, 0, 0 };
+    for (int i = 0; i < t.n; ++i) {
+        int v = t.nodes[i];
+        unsigned char m = g->par_mark[v];
+        if (m == 3) {
+            par_set_color(g, v, PAR_DONE);
+            edge_push(&w->members, v);
+        } else {
+            cnt[m == 1 ? 0 : m == 2 ? 1 : 2]++;
+        }
+    }
+    int size = w->members.n - scc_from;
+    if (size > 1 || count_find(&g->wfg[pivot], pivot) >= 0) edge_push(&w->start, scc_from);
+    else w->members.n = scc_from; /* trivial component */
+
+    int col[3], pos[3];
+    w->bounds.n = 0;
+    pos[0] = 0;
+    pos[1] = cnt[0];
+    pos[2] = cnt[0] + cnt[1];
+    for (int k = 0; k < 3; ++k) {
+        edge_push(&w->bounds, pos[k]);
+        col[k] = cnt[k] ? atomic_fetch_add(&ctx->next_color, 1) : 0;
+    }
+    edge_push(&w->bounds, pos[2] + cnt[2]);
+    order->n = pos[2] + cnt[2];
+    for (int i = 0; i < t.n; ++i) {
+        int v = t.nodes[i];
+        unsigned char m = g->par_mark[v];
+        g->par_mark[v] = 0;
+        if (m == 3) continue;
+        int k = m == 1 ? 0 : m == 2 ? 1 : 2;
+        par_set_color(g, v, col[k]);
+        order->v[pos[k]++] = v;
+    }
+    par_split(w, t.nodes);
+}
+
+static void par_work(struct par_worker *w) {
+    struct par_ctx *ctx = w->ctx;
+    struct par_task t;
+    while (atomic_load(&ctx->pending) > 0 && !atomic_load(&ctx->oom)) {
+        int got = par_take(&ctx->dq[w->id], &t, 0);
+        for (int tries = 0; !got && tries < ctx->nthreads; ++tries) {
+            int victim = (int)(rng_next(&w->seed) % (uint64_t)ctx->nthreads);
+            if (victim != w->id) got = par_take(&ctx->dq[victim], &t, 1);
+        }
+        if (!got) { sched_yield(); continue; }
+        par_run_task(w, t);
+        atomic_fetch_sub(&ctx->pending, 1);
+    }
+}
+
+/* Every worker, the caller included, traps its own allocation failure:
+   the caller's guard is on another thread's stack, or would skip the
+   join. A failure stops all workers and is raised again after the join. */
+static void *par_worker_main(void *arg) {
+    struct par_worker *w = arg;
+    OOM_GUARD(atomic_store(&w->ctx->oom, 1), par_work(w));
+    return NULL;
+}
+
+static int cmp_par_set(const void *a, const void *b) {
+    const struct par_set_ref *x = a, *y = b;
+    return (x->min > y->min) - (x->min < y->min);
+}
+
+static int parallel_scc_detect(struct rag_graph *g, int nthreads) {
+    int n = g->n_proc;
+    scc_clear_result(g);
+    /* par_mark is all zero between runs; colours and the slice array are
+       the run's input and have to be laid out afresh */
+    for (int p = 0; p < n; ++p) {
+        par_set_color(g, p, 0);
+        g->par_nodes[p] = p;
+    }
+    if (n == 0) { edge_push(&g->scc_start, 0); return 0; }
+    if (nthreads < 1) nthreads = 1;
+
+    struct par_ctx *ctx = par_prepare(g, nthreads);
+    struct par_task root = { g->par_nodes, n, 0 };
+    par_push(&ctx->dq[0], root);
+
+    int started = 1;
+    for (int i = 1; i < nthreads; ++i) {
+        if (pthread_create(&ctx->tid[i], NULL, par_worker_main, &ctx->w[i]) != 0) break;
+        started++;
+    }
+    par_worker_main(&ctx->w[0]); /* the caller works too */
+    for (int i = 1; i < started; ++i) pthread_join(ctx->tid[i], NULL);
+    if (atomic_load(&ctx->oom)) oom_raise();
+
+    /* merge: sets sorted internally and ordered by smallest member */
+    int total = 0;
+    for (int i = 0; i < nthreads; ++i) total += ctx->w[i].start.n;
+    if (total > ctx->refs_cap) {
+        ctx->refs_cap = total;
+        ctx->refs = xrealloc(ctx->refs, (size_t)total * sizeof(*ctx->refs));
+    }
+    struct par_set_ref *refs = ctx->refs;
+    int k = 0;
+    for (int i = 0; i < nthreads; ++i) {
+        struct par_worker *w = &ctx->w[i];
+        edge_push(&w->start, w->members.n);
+        for (int s = 0; s + 1 < w->start.n; ++s) {
+            int from = w->start.v[s], to = w->start.v[s + 1];
+            qsort(w->members.v + from, (size_t)(to - from), sizeof(int), cmp_int);
+            refs[k].min = w->members.v[from];
+            refs[k].worker = i;
+            refs[k].idx = s;
+            k++;
+        }
+    }
+    if (total > 1) qsort(refs, (size_t)total, sizeof(*refs), cmp_par_set);
+    for (int s = 0; s < total; ++s) {
+        struct par_worker *w = &ctx->w[refs[s].worker];
+        int from = w->start.v[refs[s].idx], to = w->start.v[refs[s].idx + 1];
+        edge_push(&g->scc_start, g->scc_members.n);
+        for (int i = from; i < to; ++i) {
+            g->scc_comp[w->members.v[i]] = s;
+            edge_push(&g->scc_members, w->members.v[i]);
+        }
+    }
+    edge_push(&g->scc_start, g->scc_members.n);
+    g->scc_count = total;
+    scc_clear_dirty(g); /* same sets as Tarjan: a valid incremental base */
+    return total;
+}
+
+/* ---- Sharded SCC engine: local Tarjan plus a boundary graph ----
+   Models detection over a lock graph spread across hosts. Each process
+   has a home shard (see shard_home); a shard owns its processes and their
+   outgoing wait edges, and everything below is computed by a shard from
+   its own data, except the coordinator step, which sees only what the
+   shards send it.
+
+   1. Each shard runs Tarjan over its local wait edges (both ends at
+      home). A local component that is a cycle and touches no cross-shard
+      edge is a deadlocked set already; nothing is sent for it.
+   2. A local component holding a boundary process (one with a cross-shard
+      wait edge) becomes a coordinator node. The shard sends its outgoing
+      cross edges, one record per entry process (which component it
+      joined), and summary edges A -> B for every boundary component B
+      that A reaches through interior components only. Reachability via
+      other boundary components follows from the summary edges of those.
+   3. The coordinator runs Tarjan over this condensed boundary graph. The
+      local condensations are acyclic, so each of its components with
+      two or more nodes is a deadlock that crosses shards.
+   4. The coordinator announces each such set to the shards it touches
+      (one record per member node). A process belongs to the set iff,
+      inside its own shard, it is reachable from and reaches one of the
+      set's boundary components: a path leaving the shard does so through
+      a boundary component that then belongs to the set itself.
+
+   Traffic is therefore the cross-shard edges, the entry processes and
+   the summary edges, never the interior of a shard. The number of
+   summary edges is bounded by (boundary components)^2 per shard, and in
+   practice stays close to the number of boundary components. Shards run
+   one after the other here; the counts in shard_ctx.stats are what a
+   networked deployment would send. The result uses the SCC layout and
+   matches scc_detect set for set.
+*/
+struct shard_ctx {
+    int cap;                /* processes the per-process arrays hold */
+    int *home;              /* shard of each process */
+    int *order;             /* processes grouped by shard */
+    edge_list first;        /* shard s owns order[first[s] .. first[s+1]) */
+    unsigned char *border;  /* 1: has a cross out-edge, 2: a cross in-edge */
+    int *loff, *roff;       /* local wait edges, forward and reverse (CSR) */
+    int *ladj, *radj;
+    int adj_cap;
+    int *comp;              /* local component of each process */
+    edge_list members;      /* local components, grouped (mstart offsets) */
+    edge_list mstart;
+    int *bnode;             /* per component: coordinator node or -1 */
+    edge_list bcomp;        /* coordinator node -> component */
+    edge_list esrc, edst;   /* coordinator edges */
+    int *coff, *cadj;
+    int cadj_cap;
+    int *ccomp;             /* coordinator component of each node */
+    edge_list cmembers;
+    edge_list cmstart;
+    int *idx, *low, *it, *call, *stk;   /* Tarjan scratch; idx is -1 between runs */
+    unsigned char *onstk;
+    int *mark, *mark2, *cmark;          /* search stamps */
+    int stamp;
+    edge_list queue;
+    struct rag_shard_stats stats;   /* traffic of the last run */
+};
+
+static void shard_free(struct rag_graph *g) {
+    struct shard_ctx *sh = g->shard;
+    if (sh == NULL) return;
+    free(sh->home); free(sh->order); free(sh->border);
+    free(sh->loff); free(sh->roff); free(sh->ladj); free(sh->radj);
+    free(sh->comp); free(sh->bnode); free(sh->coff); free(sh->cadj); free(sh->ccomp);
+    free(sh->idx); free(sh->low); free(sh->it); free(sh->call); free(sh->stk); free(sh->onstk);
+    free(sh->mark); free(sh->mark2); free(sh->cmark);
+    edge_free(&sh->first); edge_free(&sh->members); edge_free(&sh->mstart);
+    edge_free(&sh->bcomp); edge_free(&sh->esrc); edge_free(&sh->edst);
+    edge_free(&sh->cmembers); edge_free(&sh->cmstart); edge_free(&sh->queue);
+    free(sh);
+    g->shard = NULL;
+}
+
+/* Per-process arrays (components and coordinator nodes never outnumber
+   processes) grow with the graph and keep their size between runs */
+static struct shard_ctx *shard_prepare(struct rag_graph *g) {
+    if (g->shard == NULL) {
+        g->shard = xrealloc(NULL, sizeof(*g->shard));
+        memset(g->shard, 0, sizeof(*g->shard));
+    }
+    struct shard_ctx *sh = g->shard;
+    int n = g->n_proc;
+    if (n > sh->cap) {
+        int cap = n > 2 * sh->cap ? n : 2 * sh->cap;
+        size_t ints = (size_t)cap * sizeof(int), ints1 = (size_t)(cap + 1) * sizeof(int);
+        sh->home = xrealloc(sh->home, ints);
+        sh->order = xrealloc(sh->order, ints);
+        sh->border = xrealloc(sh->border, (size_t)cap);
+        sh->loff = xrealloc(sh->loff, ints1);
+        sh->roff = xrealloc(sh->roff, ints1);
+        sh->comp = xrealloc(sh->comp, ints);
+        sh->bnode = xrealloc(sh->bnode, ints);
+        sh->coff = xrealloc(sh->coff, ints1);
+        sh->ccomp = xrealloc(sh->ccomp, ints);
+        sh->idx = xrealloc(sh->idx, ints);
+        sh->low = xrealloc(sh->low, ints);
+        sh->it = xrealloc(sh->it, ints);
+        sh->call = xrealloc(sh->call, ints);
+        sh->stk = xrealloc(sh->stk, ints);
+        sh->onstk = xrealloc(sh->onstk, (size_t)cap);
+        sh->mark = xrealloc(sh->mark, ints);
+        sh->mark2 = xrealloc(sh->mark2, ints);
+        sh->cmark = xrealloc(sh->cmark, ints);
+        for (int i = sh->cap; i < cap; ++i) {
+            sh->idx[i] = -1;
+            sh->onstk[i] = 0;
+            sh->mark[i] = sh->mark2[i] = sh->cmark[i] = 0;
+        }
+        sh->cap = cap;
+    }
+    return sh;
+}
+
+static int shard_next_stamp(struct shard_ctx *sh) {
+    if (sh->stamp == INT_MAX) {
+        for (int i = 0; i < sh->cap; ++i) sh->mark[i] = sh->mark2[i] = sh->cmark[i] = 0;
+        sh->stamp = 0;
+    }
+    return ++sh->stamp;
+}
+
+/* Home shard of p: names of the form HOST:THREAD are placed by HOST, so
+   all threads of one host share a shard; other names are dealt round
+   robin */
+static int shard_home(const struct rag_graph *g, int p, int nshards) {
+    const char *name = pname(g, p), *colon = strchr(name, ':');
+    if (colon == NULL) return p % nshards;
+    uint64_t h = 1469598103934665603ULL; /* FNV-1a, as name_hash */
+    for (; name < colon; ++name) {
+        h ^= (unsigned char)*name;
+        h *= 1099511628211ULL;
+    }
+    return (int)(h % (uint64_t)nshards);
+}
+
+/* Iterative Tarjan over a CSR graph from each root (NULL: nodes 0 ..
+   nroots-1). Every node reached gets comp[] = its component's index in
+   mstart; members are appended grouped by component. */
+static void shard_tarjan(struct shard_ctx *sh, const int *roots, int nroots, const int *off, const int *adj,
+                         int *comp, edge_list *members, edge_list *mstart) {
+    int *idx = sh->idx, *low = sh->low, *it = sh->it, *call = sh->call, *stk = sh->stk;
+    int next = 0, top = -1, from = members->n;
+    for (int i = 0; i < nroots; ++i) {
+        int root = roots ? roots[i] : i, call_top = -1;
+        if (idx[root] >= 0) continue;
+        idx[root] = low[root] = next++;
+        it[root] = off[root];
+        stk[++top] = root;
+        sh->onstk[root] = 1;
+        call[++call_top] = root;
+        while (call_top >= 0) {
+            int u = call[call_top];
+            if (it[u] < off[u + 1]) {
+                int v = adj[it[u]++];
+                if (idx[v] < 0) {
+                    idx[v] = low[v] = next++;
+                    it[v] = off[v];
+                    stk[++top] = v;
+                    sh->onstk[v] = 1;
+                    call[++call_top] = v;
+                } else if (sh->onstk[v] && idx[v] < low[u]) {
+                    low[u] = idx[v];
+                }
+                continue;
+            }
+            if (--call_top >= 0 && low[u] < low[call[call_top]]) low[call[call_top]] = low[u];
+            if (low[u] != idx[u]) continue;
+            int c = mstart->n, w;
+            edge_push(mstart, members->n);
+            do {
+                w = stk[top--];
+                sh->onstk[w] = 0;
+                comp[w] = c;
+                edge_push(members, w);
+            } while (w != u);
+        }
+    }
+    for (int i = from; i < members->n; ++i) idx[members->v[i]] = -1;
+}
+
+/* Split p's wait edges into local ones (CSR) and cross-shard ones */
+static void shard_local_edges(struct rag_graph *g, struct shard_ctx *sh) {
+    int n = g->n_proc, local = 0;
+    memset(sh->border, 0, (size_t)n);
+    for (int p = 0; p <= n; ++p) sh->loff[p] = sh->roff[p] = 0;
+    for (int p = 0; p < n; ++p) {
+        const count_list *out = &g->wfg[p];
+        for (int j = 0; j < out->n; ++j) {
+            int p2 = out->v[j];
+            if (sh->home[p2] == sh->home[p]) {
+                sh->loff[p + 1]++;
+                sh->roff[p2 + 1]++;
+                local++;
+            } else {
+                sh->border[p] |= 1;
+                sh->border[p2] |= 2;
+                sh->stats.cross++;
+            }
+        }
+    }
+    if (local > sh->adj_cap) {
+        sh->adj_cap = local;
+        sh->ladj = xrealloc(sh->ladj, (size_t)local * sizeof(int));
+        sh->radj = xrealloc(sh->radj, (size_t)local * sizeof(int));
+    }
+    for (int p = 0; p < n; ++p) {
+        sh->loff[p + 1] += sh->loff[p];
+        sh->roff[p + 1] += sh->roff[p];
+    }
+    /* fill: it[] holds the next free slot of each reverse row */
+    for (int p = 0; p < n; ++p) sh->it[p] = sh->roff[p];
+    for (int p = 0; p < n; ++p) {
+        const count_list *out = &g->wfg[p];
+        int k = sh->loff[p];
+        for (int j = 0; j < out->n; ++j) {
+            int p2 = out->v[j];
+            if (sh->home[p2] != sh->home[p]) continue;
+            sh->ladj[k++] = p2;
+            sh->radj[sh->it[p2]++] = p;
+        }
+    }
+}
+
+/* Summary edges of boundary component node b: the boundary components
+   reached from it through interior components of its shard */
+static void shard_summarize(struct shard_ctx *sh, int b) {
+    int k = sh->bcomp.v[b], stamp = shard_next_stamp(sh);
+    edge_list *q = &sh->queue;
+    q->n = 0;
+    for (int i = sh->mstart.v[k]; i < sh->mstart.v[k + 1]; ++i) {
+        sh->mark[sh->members.v[i]] = stamp;
+        edge_push(q, sh->members.v[i]);
+    }
+    sh->cmark[k] = stamp;
+    while (q->n > 0) {
+        int u = q->v[--q->n];
+        for (int j = sh->loff[u]; j < sh->loff[u + 1]; ++j) {
+            int v = sh->ladj[j], c = sh->comp[v];
+            if (sh->mark[v] == stamp) continue;
+            if (sh->bnode[c] >= 0) {
+                if (sh->cmark[c] != stamp) {
+                    sh->cmark[c] = stamp;
+                    edge_push(&sh->esrc, b);
+                    edge_push(&sh->edst, sh->bnode[c]);
+                    sh->stats.summary++;
+                }
+                continue;
+            }
+            sh->mark[v] = stamp;
+            edge_push(q, v);
+        }
+    }
+}
+
+/* Inside each shard: processes reachable from, and reaching, the boundary
+   components of coordinator component c. Appended as one deadlocked set. */
+static void shard_expand(struct rag_graph *g, struct shard_ctx *sh, int c) {
+    int fw = shard_next_stamp(sh), bw = shard_next_stamp(sh);
+    edge_list *q = &sh->queue;
+    for (int pass = 0; pass < 2; ++pass) {
+        int *mark = pass ? sh->mark2 : sh->mark, stamp = pass ? bw : fw;
+        const int *off = pass ? sh->roff : sh->loff, *adj = pass ? sh->radj : sh->ladj;
+        q->n = 0;
+        for (int i = sh->cmstart.v[c]; i < sh->cmstart.v[c + 1]; ++i) {
+            int k = sh->bcomp.v[sh->cmembers.v[i]];
+            for (int m = sh->mstart.v[k]; m < sh->mstart.v[k + 1]; ++m) {
+                mark[sh->members.v[m]] = stamp;
+                edge_push(q, sh->members.v[m]);
+            }
+        }
+        /* q is used as a list: everything pushed stays for the second pass */
+        for (int h = 0; h < q->n; ++h) {
+            int u = q->v[h];
+            for (int j = off[u]; j < off[u + 1]; ++j) {
+                int v = adj[j];
+                if (mark[v] == stamp) continue;
+                mark[v] = stamp;
+                edge_push(q, v);
+            }
+        }
+    }
+    /* q now holds the backward closure: keep what the forward pass saw */
+    edge_push(&g->scc_start, g->scc_members.n);
+    for (int h = 0; h < q->n; ++h) {
+        int v = q->v[h];
+        if (sh->mark[v] != fw) continue;
+        g->scc_comp[v] = g->scc_count;
+        edge_push(&g->scc_members, v);
+    }
+    g->scc_count++;
+}
+
+static int sharded_detect(struct rag_graph *g, int nshards) {
+    int n = g->n_proc;
+    struct shard_ctx *sh = shard_prepare(g);
+    if (nshards < 1) nshards = 1;
+    memset(&sh->stats, 0, sizeof(sh->stats));
+    sh->stats.shards = nshards;
+    scc_clear_result(g);
+    if (n == 0) { edge_push(&g->scc_start, 0); return 0; }
+
+    /* partition: order[] groups processes by home shard */
+    sh->first.n = 0;
+    for (int s = 0; s <= nshards; ++s) edge_push(&sh->first, 0);
+    for (int p = 0; p < n; ++p) {
+        sh->home[p] = shard_home(g, p, nshards);
+        sh->first.v[sh->home[p] + 1]++;
+    }
+    for (int s = 0; s < nshards; ++s) sh->first.v[s + 1] += sh->first.v[s];
+    sh->queue.n = 0; /* fill cursor per shard */
+    for (int s = 0; s < nshards; ++s) edge_push(&sh->queue, sh->first.v[s]);
+    for (int p = 0; p < n; ++p) sh->order[sh->queue.v[sh->home[p]]++] = p;
+    shard_local_edges(g, sh);
+
+    /* 1-2: local components; those on the boundary become coordinator nodes */
+    sh->members.n = sh->mstart.n = 0;
+    for (int s = 0; s < nshards; ++s) {
+        int from = sh->first.v[s];
+        shard_tarjan(sh, sh->order + from, sh->first.v[s + 1] - from, sh->loff, sh->ladj,
+                     sh->comp, &sh->members, &sh->mstart);
+    }
+    int ncomp = sh->mstart.n;
+    edge_push(&sh->mstart, sh->members.n);
+    sh->bcomp.n = 0;
+    for (int k = 0; k < ncomp; ++k) {
+        int on_border = 0;
+        for (int i = sh->mstart.v[k]; i < sh->mstart.v[k + 1] && !on_border; ++i) {
+            on_border = sh->border[sh->members.v[i]] != 0;
+        }
+        sh->bnode[k] = on_border ? sh->bcomp.n : -1;
+        if (on_border) edge_push(&sh->bcomp, k);
+    }
+    int nb = sh->bcomp.n;
+    sh->esrc.n = sh->edst.n = 0;
+    for (int b = 0; b < nb; ++b) shard_summarize(sh, b);
+    for (int p = 0; p < n; ++p) {
+        if (sh->border[p] & 2) sh->stats.entries++;
+        if (!(sh->border[p] & 1)) continue;
+        const count_list *out = &g->wfg[p];
+        for (int j = 0; j < out->n; ++j) {
+            int p2 = out->v[j];
+            if (sh->home[p2] == sh->home[p]) continue;
+            edge_push(&sh->esrc, sh->bnode[sh->comp[p]]);
+            edge_push(&sh->edst, sh->bnode[sh->comp[p2]]);
+        }
+    }
+
+    /* 3: the coordinator's condensed boundary graph */
+    int ne = sh->esrc.n;
+    if (ne > sh->cadj_cap) {
+        sh->cadj_cap = ne;
+        sh->cadj = xrealloc(sh->cadj, (size_t)ne * sizeof(int));
+    }
+    for (int b = 0; b <= nb; ++b) sh->coff[b] = 0;
+    for (int e = 0; e < ne; ++e) sh->coff[sh->esrc.v[e] + 1]++;
+    for (int b = 0; b < nb; ++b) sh->coff[b + 1] += sh->coff[b];
+    for (int b = 0; b < nb; ++b) sh->it[b] = sh->coff[b];
+    for (int e = 0; e < ne; ++e) sh->cadj[sh->it[sh->esrc.v[e]]++] = sh->edst.v[e];
+    sh->cmembers.n = sh->cmstart.n = 0;
+    shard_tarjan(sh, NULL, nb, sh->coff, sh->cadj, sh->ccomp, &sh->cmembers, &sh->cmstart);
+    int ncc = sh->cmstart.n;
+    edge_push(&sh->cmstart, sh->cmembers.n);
+
+    /* 4: cross-shard sets, expanded back in their shards */
+    for (int c = 0; c < ncc; ++c) {
+        int size = sh->cmstart.v[c + 1] - sh->cmstart.v[c];
+        if (size < 2) continue;
+        sh->stats.announced += size;
+        shard_expand(g, sh, c);
+    }
+    /* local deadlocks not already inside a cross-shard set */
+    for (int k = 0; k < ncomp; ++k) {
+        int from = sh->mstart.v[k], to = sh->mstart.v[k + 1], u = sh->members.v[from];
+        if (g->scc_comp[u] >= 0) continue;
+        int deadlocked = to - from > 1;
+        for (int j = sh->loff[u]; j < sh->loff[u + 1] && !deadlocked; ++j) deadlocked = sh->ladj[j] == u;
+        if (!deadlocked) continue;
+        edge_push(&g->scc_start, g->scc_members.n);
+        for (int i = from; i < to; ++i) {
+            g->scc_comp[sh->members.v[i]] = g->scc_count;
+            edge_push(&g->scc_members, sh->members.v[i]);
+        }
+        g->scc_count++;
+    }
+    edge_push(&g->scc_start, g->scc_members.n);
+    scc_clear_dirty(g); /* same sets as Tarjan: a valid incremental base */
+    return g->scc_count;
+}
+
+/* Traffic of the last sharded_detect run (NULL before the first) */
+static const struct rag_shard_stats *shard_last_stats(const struct rag_graph *g) {
+    return g->shard != NULL ? &g->shard->stats : NULL;
+}
+
+/* ---- Multi-instance engine: Available/Allocation/Request reduction ----
+   A WFG cycle only proves deadlock when every resource has one instance.
+   With pools, process p can finish once every request fits in the
+   available units (Work); finishing returns its allocation. Instead of
+   rescanning all processes per pass, each resource keeps its waiters sorted
+   by amount with a pointer to the first one that does not fit yet; when Work
+   grows the pointer advances, and a process joins the worklist when its
+   last unsatisfied request is covered. Each process is finished at most
+   once and each request is passed once: O(E log d) for the sort, O(E) after.
+   Returns the number of processes that can never finish.
+*/
+static int cmp_bk_waiter(const void *a, const void *b) {
+    const struct bk_waiter *x = a, *y = b;
+    return (x->amt > y->amt) - (x->amt < y->amt);
+}
+
+static int banker_detect(struct rag_graph *g) {
+    int n = g->n_proc, m = g->n_res, head = 0, tail = 0;
+    if (g->req_edges > g->bk_wait_cap) {
+        g->bk_wait_cap = g->req_edges;
+        g->bk_wait = xrealloc(g->bk_wait, (size_t)g->bk_wait_cap * sizeof(*g->bk_wait));
+    }
+    int *work = g->bk_work, *start = g->bk_start, *ptr = g->bk_ptr;
+    int *need = g->bk_need, *done = g->bk_done, *queue = g->bk_queue;
+
+    start[0] = 0;
+    for (int r = 0; r < m; ++r) {
+        work[r] = g->units[r] - g->in_use[r];
+        start[r + 1] = start[r] + g->waiters[r].n;
+        ptr[r] = start[r]; /* fill cursor for now */
+    }
+    for (int p = 0; p < n; ++p) {
+        const count_list *rq = &g->req[p];
+        for (int i = 0; i < rq->n; ++i) {
+            struct bk_waiter *w = &g->bk_wait[ptr[rq->v[i]]++];
+            w->amt = rq->cnt[i];
+            w->p = p;
+        }
+        need[p] = 0;
+        done[p] = g->held[p].n == 0; /* holds nothing: cannot be part of a deadlock */
+    }
+    for (int r = 0; r < m; ++r) {
+        int len = start[r + 1] - start[r];
+        if (len > 1) qsort(g->bk_wait + start[r], (size_t)len, sizeof(*g->bk_wait), cmp_bk_waiter);
+        int i = start[r];
+        while (i < start[r + 1] && g->bk_wait[i].amt <= work[r]) ++i;
+        ptr[r] = i;
+        for (; i < start[r + 1]; ++i) need[g->bk_wait[i].p]++;
+    }
+    for (int p = 0; p < n; ++p) {
+        if (!done[p] && need[p] == 0) queue[tail++] = p;
+    }
+    while (head < tail) {
+        int p = queue[head++];
+        done[p] = 1;
+        const count_list *hl = &g->held[p];
+        for (int i = 0; i < hl->n; ++i) {
+            int r = hl->v[i];
+            work[r] += hl->cnt[i];
+            while (ptr[r] < start[r + 1] && g->bk_wait[ptr[r]].amt <= work[r]) {
+                int q = g->bk_wait[ptr[r]++].p;
+                if (--need[q] == 0 && !done[q]) queue[tail++] = q;
+            }
+        }
+    }
+    int stuck = 0;
+    for (int p = 0; p < n; ++p) stuck += !done[p];
+    return stuck;
+}
+
+/* ---- Detection engine selection ---- */
+static const char *const engine_names[] = { "auto", "sparse DFS", "dense bitset", "Tarjan SCC",
+                                            "matrix reduction", "parallel SCC", "sharded SCC",
+                                            "small-graph kernel" };
+
+const char *rag_engine_name(int engine) {
+    return engine >= 0 && engine < RAG_ENGINES ? engine_names[engine] : NULL;
+}
+
+static int pick_engine(const struct rag_graph *g) {
+    if (g->engine != RAG_ENGINE_AUTO) return g->engine;
+    if (g->multi_res > 0) return RAG_ENGINE_BANKER;
+    long long n = g->n_proc;
+    if (n <= SMALL_MAX_PROC) return RAG_ENGINE_SMALL;
+    if (n <= DENSE_MAX_PROC && (long long)g->wait_edges * 64 >= n * n)
+        return RAG_ENGINE_DENSE;
+    return RAG_ENGINE_SCC;
+}
+
+/* Run one engine without printing. Returns the deadlocked sets (SCC
+   engines), stuck processes (banker) or 1 for a cycle (DFS/dense);
+   0 means no deadlock. */
+static int detect_run(struct rag_graph *g, int engine) {
+    uint64_t t0 = met_ticks();
+    int found;
+    switch (engine) {
+        case RAG_ENGINE_BANKER: found = banker_detect(g); break;
+        case RAG_ENGINE_PARALLEL: found = parallel_scc_detect(g, par_thread_count(g)); break;
+        case RAG_ENGINE_SHARDED: found = sharded_detect(g, g->shards > 0 ? g->shards : SHARD_DEFAULT); break;
+        case RAG_ENGINE_DENSE: found = detect_dense(g); break;
+        case RAG_ENGINE_SMALL:
+            if (g->n_proc <= SMALL_MAX_PROC) { found = small_detect(g); break; }
+            /* forced on a larger graph: fall back to Tarjan */
+            /* fall through */
+        case RAG_ENGINE_SCC: found = g->scc_full ? scc_detect(g) : scc_detect_dirty(g); break;
+        default: found = detect_dfs(g); break;
+    }
+    met_add(g, MET_DETECT_RUNS, 1);
+    met_add(g, MET_DETECT_FOUND, found > 0);
+    met_time(g, MET_DETECT_TICKS, t0);
+    return found;
+}
+
+/* ---- Deadlock resolution ----
+   Breaks every wait cycle by preempting victims: a victim gives up all
+   its allocations (its requests stay, so it waits to re-acquire, as after
+   a rollback), which removes every wait edge into it. Victims are picked
+   by lowest cost per cycle edge broken:
+
+     cost(p)  = held * units held + prio * priority + age * mutations since p was added
+     score(p) = cost(p) / (wait edges into p * wait edges out of p)
+
+   counting only edges between members still in play. One SCC pass finds
+   all deadlocked sets, then they are peeled at once, greedily: a member
+   left with no in- or no out-edge lies on no cycle and is trimmed (its
+   neighbours' degrees drop); otherwise the lowest score is preempted. A
+   set in which every member keeps both kinds of edge has a cycle, so
+   when nothing is left no cycle is. Degrees are updated edge by edge and
+   scores kept in a lazy heap (they only grow as degrees fall, since
+   rag.h refuses negative weights and priorities), so nothing is
+   re-detected per victim. A final scc_detect_dirty, searching only the
+   sets that lost edges, confirms the result and refreshes the report.
+
+   Minimum-cost victim selection is a weighted feedback vertex set, which
+   is NP-hard; the greedy choice is cheap and usually close. With pools a
+   WFG cycle need not be a deadlock, so the policy is conservative there.
+*/
+
+static const struct rag_cost victim_default = { 1.0, 1.0, 0.01 };
+
+struct victim_entry {
+    double score;
+    int p;
+};
+
+/* Lazy min-heap over g->vheap. It never holds more than the deadlocked
+   processes: after the initial pushes, every push follows a pop. */
+struct victim_heap {
+    struct victim_entry *e;
+    int n;
+};
+
+static void vheap_push(struct victim_heap *h, double score, int p) {
+    int i = h->n++;
+    while (i > 0 && h->e[(i - 1) / 2].score > score) {
+        h->e[i] = h->e[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    h->e[i].score = score;
+    h->e[i].p = p;
+}
+
+static struct victim_entry vheap_pop(struct victim_heap *h) {
+    struct victim_entry top = h->e[0], last = h->e[--h->n];
+    int i = 0;
+    for (;;) {
+        int c = 2 * i + 1;
+        if (c >= h->n) break;
+        if (c + 1 < h->n && h->e[c + 1].score < h->e[c].score) c++;
+        if (h->e[c].score >= last.score) break;
+        h->e[i] = h->e[c];
+        i = c;
+    }
+    if (h->n > 0) h->e[i] = last;
+    return top;
+}
+
+static double victim_cost(const struct rag_graph *g, const struct rag_cost *pol, int p) {
+    long long units = 0;
+    for (int i = 0; i < g->held[p].n; ++i) units += g->held[p].cnt[i];
+    return pol->held * (double)units + pol->prio * g->prio[p] +
+           pol->age * (double)(g->epoch - g->born[p]);
+}
+
+/* Take p out of play (par_mark cleared), queueing neighbours whose
+   in- or out-degree drops to zero */
+static void victim_drop(struct rag_graph *g, int p, edge_list *trim) {
+    g->par_mark[p] = 0;
+    const count_list *out = &g->wfg[p];
+    for (int j = 0; j < out->n; ++j) {
+        int x = out->v[j];
+        if (g->par_mark[x] && g->scc_comp[x] == g->scc_comp[p] && --g->par_in[x] == 0) edge_push(trim, x);
+    }
+    const edge_list *in = &g->wfg_in[p];
+    for (int j = 0; j < in->n; ++j) {
+        int x = in->v[j];
+        if (g->par_mark[x] && g->scc_comp[x] == g->scc_comp[p] && --g->par_out[x] == 0) edge_push(trim, x);
+    }
+}
+
+/* Peel the deadlocked sets of the last SCC run; victims go to g->victims */
+static void victim_select(struct rag_graph *g, const struct rag_cost *pol) {
+    const edge_list *m = &g->scc_members;
+    if (m->n > g->vheap_cap) {
+        g->vheap = xrealloc(g->vheap, (size_t)m->n * sizeof(*g->vheap));
+        g->vheap_cap = m->n;
+    }
+    struct victim_heap heap = { g->vheap, 0 };
+    edge_list *trim = &g->vtrim;
+    trim->n = 0;
+    for (int i = 0; i < m->n; ++i) g->par_mark[m->v[i]] = 1;
+    for (int i = 0; i < m->n; ++i) {
+        int p = m->v[i], din = 0, dout = 0;
+        /* wait edges between different sets lie on no cycle */
+        for (int j = 0; j < g->wfg[p].n; ++j) dout += g->scc_comp[g->wfg[p].v[j]] == g->scc_comp[p];
+        for (int j = 0; j < g->wfg_in[p].n; ++j) din += g->scc_comp[g->wfg_in[p].v[j]] == g->scc_comp[p];
+        g->par_in[p] = din;
+        g->par_out[p] = dout;
+    }
+    for (int i = 0; i < m->n; ++i) {
+        int p = m->v[i];
+        vheap_push(&heap, victim_cost(g, pol, p) / ((double)g->par_in[p] * g->par_out[p]), p);
+    }
+    while (heap.n > 0) {
+        while (trim->n > 0) {
+            int x = trim->v[--trim->n];
+            if (g->par_mark[x]) victim_drop(g, x, trim);
+        }
+        if (heap.n == 0) break;
+        struct victim_entry e = vheap_pop(&heap);
+        int p = e.p;
+        if (!g->par_mark[p]) continue;
+        double score = victim_cost(g, pol, p) / ((double)g->par_in[p] * g->par_out[p]);
+        if (score > e.score) { vheap_push(&heap, score, p); continue; } /* stale */
+        edge_push(&g->victims, p);
+        victim_drop(g, p, trim);
+    }
+    for (int i = 0; i < m->n; ++i) g->par_mark[m->v[i]] = 0;
+}
+
+/* One SCC pass, left as the graph's last result so that rag_set_members
+   and rag_deadlocked name the sets a round is breaking */
+static int resolve_sets(struct rag_graph *g) {
+    g->last_found = scc_detect_dirty(g);
+    g->last_engine = RAG_ENGINE_SCC;
+    g->last_n = g->n_proc;
+    g->last_nr = g->n_res;
+    return g->last_found;
+}
+
+/* Preempt victims until the WFG has no cycle, costed by 'pol'. Each victim is passed to 'fn' (may be NULL) before its
+   allocations go, and so is p = -1 at the start of each round, when the
+   SCC result holds the sets being broken. Returns the number of victims;
+   *cost (may be NULL) gets their total cost. */
+static int resolve_deadlocks(struct rag_graph *g, const struct rag_cost *pol, rag_victim_fn fn, void *arg,
+                             double *cost) {
+    const edge_list *victims = &g->victims;
+    int total = 0;
+    double spent = 0;
+    for (int sets = resolve_sets(g); sets > 0; sets = resolve_sets(g)) {
+        if (fn) OOM_UNGUARDED(fn(g, -1, 0, arg));
+        g->victims.n = 0;
+        victim_select(g, pol);
+        for (int i = 0; i < victims->n; ++i) {
+            int p = victims->v[i];
+            double c = victim_cost(g, pol, p);
+            if (fn) OOM_UNGUARDED(fn(g, p, c, arg));
+            spent += c;
+            total++;
+        }
+        /* release after costing every victim: units held feed the cost */
+        for (int i = 0; i < victims->n; ++i) {
+            int p = victims->v[i];
+            while (g->held[p].n > 0) graph_remove_allocation(g, g->held[p].v[g->held[p].n - 1], p);
+        }
+    }
+    if (cost) *cost = spent;
+    return total;
+}
+
+/* ---- Online cycle detection (Pearce-Kelly) ----
+   While the WFG is acyclic, ord[] keeps a topological order: every wait edge
+   p -> p2 has ord[p] < ord[p2]. A new edge x -> y that already respects the
+   order is accepted in O(1). Otherwise only the affected region
+   ord[y]..ord[x] is searched: forward from y (cycle if x is reached) and
+   backward from x, and the two sets are re-slotted into their old positions.
+*/
+
+/* Kahn's algorithm over the current WFG. Returns 1 and installs a fresh order
+   if the graph is acyclic, 0 otherwise. */
+static int topo_rebuild(struct rag_graph *g) {
+    int n = g->n_proc, head = 0, tail = 0;
+    int *indeg = g->pk_iter, *queue = g->pk_parent;
+    for (int p = 0; p < n; ++p) indeg[p] = g->wfg_in[p].n;
+    for (int p = 0; p < n; ++p) if (indeg[p] == 0) queue[tail++] = p;
+    while (head < tail) {
+        int u = queue[head++];
+        const count_list *out = &g->wfg[u];
+        for (int i = 0; i < out->n; ++i) {
+            if (--indeg[out->v[i]] == 0) queue[tail++] = out->v[i];
+        }
+    }
+    g->topo_retry = 0;
+    if (tail < n) { g->topo_valid = 0; return 0; }
+    for (int i = 0; i < n; ++i) {
+        g->ord[queue[i]] = i;
+        g->node_at[i] = queue[i];
+    }
+    g->topo_valid = 1;
+    return 1;
+}
+
+/* Iterative DFS from 'start' along wfg (forward) or wfg_in (backward),
+   visiting only nodes whose order lies in [lo, hi]. Visited nodes are
+   appended to 'out'. A forward search stops early and returns 1 when it
+   reaches 'target'; pk_parent then holds the path back to 'start'. */
+static int pk_search(struct rag_graph *g, int start, int target, int forward,
+                     int lo, int hi, edge_list *out) {
+    edge_list *stk = &g->pk_pool;
+    stk->n = 0;
+    g->pk_mark[start] = g->pk_stamp;
+    g->pk_parent[start] = -1;
+    g->pk_iter[start] = 0;
+    edge_push(out, start);
+    edge_push(stk, start);
+    while (stk->n > 0) {
+        int u = stk->v[stk->n - 1];
+        int deg = forward ? g->wfg[u].n : g->wfg_in[u].n;
+        if (g->pk_iter[u] == deg) { stk->n--; continue; }
+        int w = forward ? g->wfg[u].v[g->pk_iter[u]] : g->wfg_in[u].v[g->pk_iter[u]];
+        g->pk_iter[u]++;
+        if (forward && w == target) { g->pk_parent[w] = u; return 1; }
+        if (g->pk_mark[w] == g->pk_stamp) continue;
+        if (g->ord[w] < lo || g->ord[w] > hi) continue;
+        g->pk_mark[w] = g->pk_stamp;
+        g->pk_parent[w] = u;
+        g->pk_iter[w] = 0;
+        edge_push(out, w);
+        edge_push(stk, w);
+    }
+    return 0;
+}
+
+static void pk_next_stamp(struct rag_graph *g) {
+    if (++g->pk_stamp == INT_MAX) {
+        for (int p = 0; p < g->proc_cap; ++p) g->pk_mark[p] = 0;
+        g->pk_stamp = 1;
+    }
+}
+
+/* Replace the node list 'l' by its order positions, sorted ascending */
+static void pk_sorted_ords(struct rag_graph *g, edge_list *l) {
+    for (int i = 0; i < l->n; ++i) l->v[i] = g->ord[l->v[i]];
+    qsort(l->v, (size_t)l->n, sizeof(int), cmp_int);
+}
+
+/* Re-slot the affected region: backward set first, then forward set, each
+   keeping its relative order, into the union of their old positions. */
+static void pk_reorder(struct rag_graph *g) {
+    edge_list *fw = &g->pk_fwd, *bw = &g->pk_bwd, *pool = &g->pk_pool;
+    pk_sorted_ords(g, bw);
+    pk_sorted_ords(g, fw);
+    pool->n = 0;
+    int i = 0, j = 0;
+    while (i < bw->n || j < fw->n) {
+        if (j == fw->n || (i < bw->n && bw->v[i] < fw->v[j])) edge_push(pool, bw->v[i++]);
+        else edge_push(pool, fw->v[j++]);
+    }
+    /* map order slots back to nodes before node_at is overwritten */
+    for (i = 0; i < bw->n; ++i) bw->v[i] = g->node_at[bw->v[i]];
+    for (j = 0; j < fw->n; ++j) fw->v[j] = g->node_at[fw->v[j]];
+    int k = 0;
+    for (i = 0; i < bw->n; ++i, ++k) {
+        g->ord[bw->v[i]] = pool->v[k];
+        g->node_at[pool->v[k]] = bw->v[i];
+    }
+    for (j = 0; j < fw->n; ++j, ++k) {
+        g->ord[fw->v[j]] = pool->v[k];
+        g->node_at[pool->v[k]] = fw->v[j];
+    }
+}
+
+/* Put the cycle x -> y -> ... -> x (from pk_parent) on stack_nodes and
+   hand it to g->on_cycle */
+static void pk_report_cycle(struct rag_graph *g, int x, int y) {
+    int len = 0;
+    for (int u = x; u != y; u = g->pk_parent[u]) g->pk_iter[len++] = u;
+    g->stack_top = -1;
+    g->stack_nodes[++g->stack_top] = y;
+    for (int i = len - 1; i >= 0; --i) g->stack_nodes[++g->stack_top] = g->pk_iter[i];
+    g->cycle_at = y;
+    OOM_UNGUARDED(g->on_cycle(g, x, y, g->on_cycle_arg));
+}
+
+/* Called when wait edge x -> y appears. Returns 1 if it closed a cycle. */
+static int online_check_edge(struct rag_graph *g, int x, int y) {
+    if (x == y) {
+        g->pk_parent[x] = x;
+        g->topo_valid = 0;
+        return 1;
+    }
+    if (!g->topo_valid && g->topo_retry) topo_rebuild(g);
+    pk_next_stamp(g);
+    g->pk_fwd.n = 0;
+    if (!g->topo_valid) {
+        /* an older cycle is still present: plain reachability y ~> x */
+        return pk_search(g, y, x, 1, INT_MIN, INT_MAX, &g->pk_fwd);
+    }
+    int lb = g->ord[y], ub = g->ord[x];
+    if (ub < lb) return 0; /* already consistent with the order */
+    if (pk_search(g, y, x, 1, lb, ub, &g->pk_fwd)) {
+        g->topo_valid = 0;
+        return 1;
+    }
+    g->pk_bwd.n = 0;
+    pk_search(g, x, -1, 0, lb, ub, &g->pk_bwd);
+    pk_reorder(g);
+    return 0;
+}
+
+static void online_wait_added(struct rag_graph *g, int p, int p2) {
+    if (online_check_edge(g, p, p2) && g->on_cycle) pk_report_cycle(g, p, p2);
+}
+
+/* Switch online detection on or off. Returns 0 if it was switched on while
+   the WFG already holds a cycle, 1 otherwise. */
+static int set_online_detection(struct rag_graph *g, int on) {
+    g->online = on;
+    return on ? topo_rebuild(g) : 1;
+}
+
+/* ---- Reachability index (GRAIL) ----
+   Over an acyclic WFG each process gets REACH_K intervals [low, post],
+   one per randomized DFS: post is the post-order rank and low the
+   smallest rank below it. If u reaches v, every interval of v nests in
+   the matching interval of u, so one non-nested pair proves "v is not
+   reachable from u" in O(REACH_K). A nested pair only means "maybe", and
+   then a search runs. Avoidance checks use this to drop targets that
+   cannot close a cycle, and to prune their searches.
+
+   The index is built lazily by the first query after it was invalidated,
+   in O(REACH_K (V + E)). A new wait edge u -> v keeps it sound by
+   widening u's intervals over v's and pushing the widening up to u's
+   ancestors while it keeps changing something. A removed edge leaves
+   it sound but looser. After enough churn the next query rebuilds it,
+   which restores the tight labels. A new process has no edges yet, so it
+   is appended with a fresh post rank in every label and low = post.
+*/
+#define REACH_K 5
+
+static int reach_usable(const struct rag_graph *g) {
+    return g->reach_valid && g->reach_n == g->n_proc && g->topo_valid;
+}
+
+/* Enough wait edges came and went since the build that the intervals have
+   grown too loose to prune much (removals only ever leave them wider) */
+static int reach_churned(const struct rag_graph *g) {
+    return g->reach_churn > g->wait_edges / 2 + 64;
+}
+
+/* Could u reach v? 0 is definite; requires reach_usable(g). */
+static int reach_maybe(const struct rag_graph *g, int u, int v) {
+    if (u == v) return 1;
+    if (g->ord[u] > g->ord[v]) return 0;
+    const int *a = &g->reach[(size_t)u * 2 * REACH_K], *b = &g->reach[(size_t)v * 2 * REACH_K];
+    for (int k = 0; k < 2 * REACH_K; k += 2) {
+        if (b[k] < a[k] || b[k + 1] > a[k + 1]) return 0;
+    }
+    return 1;
+}
+
+/* One randomized DFS labelling pass into slot k of every process */
+static void reach_label(struct rag_graph *g, int k, int *perm) {
+    int n = g->n_proc, post = 0;
+    edge_list *stk = &g->pk_pool;
+    pk_next_stamp(g);
+    for (int i = n - 1; i > 0; --i) {
+        int j = (int)(rng_next(&g->reach_seed) % (uint64_t)(i + 1)), t = perm[i];
+        perm[i] = perm[j];
+        perm[j] = t;
+    }
+    uint32_t rot = (uint32_t)rng_next(&g->reach_seed);
+    for (int i = 0; i < n; ++i) {
+        int root = perm[i];
+        if (g->pk_mark[root] == g->pk_stamp) continue;
+        g->pk_mark[root] = g->pk_stamp;
+        g->pk_iter[root] = 0;
+        stk->n = 0;
+        edge_push(stk, root);
+        while (stk->n > 0) {
+            int u = stk->v[stk->n - 1];
+            const count_list *out = &g->wfg[u];
+            if (g->pk_iter[u] < out->n) {
+                /* children in a rotated order, different for each pass; the
+                   start is reduced first so the walk cannot wrap mod 2^32
+                   partway and skip some children */
+                int base = (int)(((uint32_t)u * 2654435761u + rot) % (uint32_t)out->n);
+                int w = out->v[(base + g->pk_iter[u]++) % out->n];
+                if (g->pk_mark[w] == g->pk_stamp) continue;
+                g->pk_mark[w] = g->pk_stamp;
+                g->pk_iter[w] = 0;
+                edge_push(stk, w);
+                continue;
+            }
+            /* acyclic: every child is finished before u */
+            int *lab = &g->reach[(size_t)u * 2 * REACH_K + 2 * k];
+            lab[1] = ++post;
+            lab[0] = post;
+            for (int j = 0; j < out->n; ++j) {
+                int low = g->reach[(size_t)out->v[j] * 2 * REACH_K + 2 * k];
+                if (low < lab[0]) lab[0] = low;
+            }
+            stk->n--;
+        }
+    }
+}
+
+/* Make the index usable if the WFG is acyclic. Returns reach_usable(g). */
+static int reach_prepare(struct rag_graph *g) {
+    if (!g->topo_valid && g->topo_retry) topo_rebuild(g);
+    if (!g->topo_valid) return 0;
+    if (reach_usable(g) && !reach_churned(g)) return 1;
+    int n = g->n_proc;
+    if ((size_t)n * 2 * REACH_K > g->reach_cap) {
+        g->reach_cap = (size_t)g->proc_cap * 2 * REACH_K;
+        g->reach = xrealloc(g->reach, g->reach_cap * sizeof(int));
+    }
+    if (g->reach_seed == 0) g->reach_seed = 0x9e3779b97f4a7c15ULL;
+    int *perm = g->pk_parent;
+    for (int p = 0; p < n; ++p) perm[p] = p;
+    for (int k = 0; k < REACH_K; ++k) reach_label(g, k, perm);
+    g->reach_valid = 1;
+    g->reach_n = n;
+    g->reach_post = n;  /* each pass ranks every process once */
+    g->reach_churn = 0;
+    met_add(g, MET_REACH_BUILDS, 1);
+    return 1;
+}
+
+/* Process p was just added: label it without rebuilding the index */
+static void reach_append(struct rag_graph *g, int p) {
+    if (p != g->reach_n) { g->reach_valid = 0; return; }
+    if ((size_t)(p + 1) * 2 * REACH_K > g->reach_cap) {
+        g->reach_cap = (size_t)g->proc_cap * 2 * REACH_K;
+        g->reach = xrealloc(g->reach, g->reach_cap * sizeof(int));
+    }
+    int post = ++g->reach_post, *lab = &g->reach[(size_t)p * 2 * REACH_K];
+    for (int k = 0; k < 2 * REACH_K; ++k) lab[k] = post;
+    g->reach_n = p + 1;
+}
+
+/* Wait edge p -> p2 was added: widen p and its ancestors until every
+   edge's head interval nests in its tail's again */
+static void reach_link(struct rag_graph *g, int p, int p2) {
+    if (p >= g->reach_n || p2 >= g->reach_n) { g->reach_valid = 0; return; }
+    g->reach_churn++;
+    if (reach_churned(g)) { g->reach_valid = 0; return; }
+    edge_list *stk = &g->reach_work;
+    stk->n = 0;
+    int from = p2, to = p;
+    for (;;) {
+        const int *b = &g->reach[(size_t)from * 2 * REACH_K];
+        int *a = &g->reach[(size_t)to * 2 * REACH_K], grew = 0;
+        for (int k = 0; k < 2 * REACH_K; k += 2) {
+            if (b[k] < a[k]) { a[k] = b[k]; grew = 1; }
+            if (b[k + 1] > a[k + 1]) { a[k + 1] = b[k + 1]; grew = 1; }
+        }
+        if (grew) {
+            const edge_list *in = &g->wfg_in[to];
+            for (int i = 0; i < in->n; ++i) {
+                edge_push(stk, in->v[i]);
+                edge_push(stk, to);
+            }
+        }
+        if (stk->n == 0) break;
+        from = stk->v[--stk->n];
+        to = stk->v[--stk->n];
+    }
+}
+
+/* ---- Deadlock avoidance ----
+   With g->avoid set, menu and batch requests and grants are committed only
+   if none of the wait edges they add closes a cycle. An edge a -> b closes
+   one iff b already reaches a. The Pearce-Kelly order (kept current in
+   avoidance mode even without online reporting) settles most queries in
+   O(1): if ord[a] < ord[b], b cannot reach a. Otherwise the search is
+   confined to the order window between them, as in online_check_edge, but
+   nothing is reordered, so a refused edge leaves no trace. A request adds
+   p -> every owner of r; a grant adds every waiter of r -> p: all the new
+   edges share an endpoint, so one search covers them.
+
+   The check is conservative for pools (a wait cycle through a
+   multi-instance resource need not deadlock) and for an overriding
+   single-owner grant (the old owner's wait edges still count). Events
+   from the live monitor and trace replay report what already happened,
+   so they are never refused.
+*/
+
+/* Search from 'start' along wfg (forward) or wfg_in inside the order window
+   [lo, hi] for a node stamped 'target' in pk_mark. Returns it, or -1;
+   pk_parent holds the path back to 'start'. With a single target 'only'
+   (else -1) and a usable index, nodes that cannot lie on a path between
+   start and it are not entered. */
+static int avoid_search(struct rag_graph *g, int start, int forward, int lo, int hi, int target, int only) {
+    if (g->pk_mark[start] == target) return start;
+    edge_list *stk = &g->pk_pool;
+    int seen = g->pk_stamp;
+    stk->n = 0;
+    g->pk_mark[start] = seen;
+    g->pk_parent[start] = -1;
+    g->pk_iter[start] = 0;
+    edge_push(stk, start);
+    while (stk->n > 0) {
+        int u = stk->v[stk->n - 1];
+        int deg = forward ? g->wfg[u].n : g->wfg_in[u].n;
+        if (g->pk_iter[u] == deg) { stk->n--; continue; }
+        int w = forward ? g->wfg[u].v[g->pk_iter[u]] : g->wfg_in[u].v[g->pk_iter[u]];
+        g->pk_iter[u]++;
+        if (g->pk_mark[w] == target) { g->pk_parent[w] = u; return w; }
+        if (g->pk_mark[w] == seen || g->ord[w] < lo || g->ord[w] > hi) continue;
+        g->pk_mark[w] = seen;
+        if (only >= 0 && !(forward ? reach_maybe(g, w, only) : reach_maybe(g, only, w))) continue;
+        g->pk_parent[w] = u;
+        g->pk_iter[w] = 0;
+        edge_push(stk, w);
+    }
+    return -1;
+}
+
+/* Two fresh pk_mark stamps: returns the target stamp, pk_stamp is the other */
+static int avoid_stamps(struct rag_graph *g) {
+    if (g->pk_stamp > INT_MAX - 3) {
+        for (int p = 0; p < g->proc_cap; ++p) g->pk_mark[p] = 0;
+        g->pk_stamp = 0;
+    }
+    g->pk_stamp += 2;
+    return g->pk_stamp - 1;
+}
+
+/* Would request p -> r close a wait cycle? If so returns 1 and leaves the
+   cycle p -> owner -> ... on stack_nodes. */
+static int avoid_request_unsafe(struct rag_graph *g, int p, int r) {
+    const edge_list *own = &g->alloc_[r];
+    if (own->n == 0 || graph_has_request(g, p, r)) return 0;
+    met_add(g, MET_AVOID_CHECKS, 1);
+    int indexed = reach_prepare(g);
+    int target = avoid_stamps(g), lo = INT_MAX, hi = g->topo_valid ? g->ord[p] : INT_MAX, only = -1, left = 0;
+    for (int i = 0; i < own->n; ++i) {
+        int o = own->v[i];
+        if (g->topo_valid && g->ord[o] > g->ord[p]) continue; /* o cannot reach p */
+        if (indexed && !reach_maybe(g, o, p)) continue;
+        g->pk_mark[o] = target;
+        if (g->ord[o] < lo) lo = g->ord[o];
+        only = o;
+        left++;
+    }
+    if (left == 0) return 0;
+    if (!g->topo_valid) lo = INT_MIN;
+    if (!indexed || left > 1) only = -1;
+    met_add(g, MET_AVOID_SEARCHES, 1);
+    /* backward from p: parents lead from the owner found back toward p */
+    int o = avoid_search(g, p, 0, lo, hi, target, only);
+    if (o < 0) return 0;
+    g->stack_top = -1;
+    g->stack_nodes[++g->stack_top] = p;
+    for (int u = o; u != p; u = g->pk_parent[u]) g->stack_nodes[++g->stack_top] = u;
+    g->cycle_at = p;
+    return 1;
+}
+
+/* Would granting r to p close a wait cycle? If so returns 1 and leaves the
+   cycle waiter -> p -> ... on stack_nodes. */
+static int avoid_grant_unsafe(struct rag_graph *g, int r, int p) {
+    const edge_list *wt = &g->waiters[r];
+    if (wt->n == 0 || graph_has_allocation(g, r, p)) return 0;
+    met_add(g, MET_AVOID_CHECKS, 1);
+    int indexed = reach_prepare(g);
+    int target = avoid_stamps(g), lo = g->topo_valid ? g->ord[p] : INT_MIN, hi = INT_MIN, only = -1, left = 0;
+    for (int i = 0; i < wt->n; ++i) {
+        int w = wt->v[i];
+        if (g->topo_valid && g->ord[w] < g->ord[p]) continue; /* p cannot reach w */
+        if (indexed && !reach_maybe(g, p, w)) continue;
+        g->pk_mark[w] = target;
+        if (g->ord[w] > hi) hi = g->ord[w];
+        only = w;
+        left++;
+    }
+    if (left == 0) return 0;
+    if (!g->topo_valid) hi = INT_MAX;
+    if (!indexed || left > 1) only = -1;
+    met_add(g, MET_AVOID_SEARCHES, 1);
+    int w = avoid_search(g, p, 1, lo, hi, target, only);
+    if (w < 0) return 0;
+    int len = 0;
+    for (int u = w; u != p; u = g->pk_parent[u]) g->pk_iter[len++] = u;
+    g->stack_top = -1;
+    g->stack_nodes[++g->stack_top] = w;
+    if (w != p) {
+        g->stack_nodes[++g->stack_top] = p;
+        for (int i = len - 1; i > 0; --i) g->stack_nodes[++g->stack_top] = g->pk_iter[i];
+    }
+    g->cycle_at = w;
+    return 1;
+}
+
+/* Switch avoidance on or off. Returns 0 if it was switched on while the
+   WFG already holds a cycle (checks then search without the order window
+   until the cycle is broken), 1 otherwise. */
+static int set_avoidance(struct rag_graph *g, int on) {
+    g->avoid = on;
+    return on ? topo_rebuild(g) : 1;
+}
+
+/* ---- Lock-order analysis (lockdep) ----
+   Cycle detection sees a deadlock only once it has happened. Like the
+   Linux kernel's lockdep, this mode learns the order in which resources
+   are taken instead: whenever a process holding h requests r, or is
+   granted it, the order edge h -> r goes into a resource-to-resource
+   graph that accumulates over the whole run (edges stay after the locks
+   are released). An edge that would close a cycle there is an order
+   inversion: the same resources taken in opposite orders, which can
+   deadlock under another interleaving even if this run never did. Each
+   one is reported once, to g->on_inversion, and left out, so the order
+   graph stays acyclic.
+
+   That keeps the check incremental, as in online detection: a
+   Pearce-Kelly topological order of the resources accepts an edge that
+   respects it in O(1) and otherwise searches only the affected region.
+   In front of it an open-addressing set of every (h, r) pair examined so
+   far makes the common case, a pair the trace has taken before, cost a
+   single probe. The multi-instance caveat of avoidance applies: an
+   inversion through a pool is a hazard, not necessarily a deadlock.
+*/
+struct rag_lockdep {
+    int n, cap;                 /* resources covered (grown on first use) */
+    edge_list *out;             /* out[h]: r taken while holding h */
+    edge_list *by;              /* by[h]: the process that first took each out[h] edge */
+    edge_list *in;              /* in[r]: the reverse */
+    int *ord, *node_at;         /* topological order and its inverse */
+    int *mark, *parent, *iter;  /* search stamps, tree and explicit DFS stack */
+    int stamp;
+    edge_list fwd, bwd, stk, pool;
+    uint64_t *seen;             /* pairs examined: h << 32 | r; 0 is empty since h != r */
+    size_t seen_mask, seen_used;
+    edge_list path;             /* last inversion: order path wanted -> ... -> held */
+    struct rag_lockdep_stats st;
+};
+
+static void ld_reserve(struct rag_lockdep *ld, int n) {
+    if (n <= ld->n) return;
+    if (n > ld->cap) {
+        int cap = ld->cap ? 2 * ld->cap : 16;
+        while (cap < n) cap *= 2;
+        ld->out = xrealloc(ld->out, (size_t)cap * sizeof(edge_list));
+        ld->by = xrealloc(ld->by, (size_t)cap * sizeof(edge_list));
+        ld->in = xrealloc(ld->in, (size_t)cap * sizeof(edge_list));
+        memset(ld->out + ld->cap, 0, (size_t)(cap - ld->cap) * sizeof(edge_list));
+        memset(ld->by + ld->cap, 0, (size_t)(cap - ld->cap) * sizeof(edge_list));
+        memset(ld->in + ld->cap, 0, (size_t)(cap - ld->cap) * sizeof(edge_list));
+        ld->ord = xrealloc(ld->ord, (size_t)cap * sizeof(int));
+        ld->node_at = xrealloc(ld->node_at, (size_t)cap * sizeof(int));
+        ld->mark = xrealloc(ld->mark, (size_t)cap * sizeof(int));
+        ld->parent = xrealloc(ld->parent, (size_t)cap * sizeof(int));
+        ld->iter = xrealloc(ld->iter, (size_t)cap * sizeof(int));
+        memset(ld->mark + ld->cap, 0, (size_t)(cap - ld->cap) * sizeof(int));
+        ld->cap = cap;
+    }
+    for (int r = ld->n; r < n; ++r) { /* no edges yet: any free slot will do */
+        ld->ord[r] = r;
+        ld->node_at[r] = r;
+    }
+    ld->n = n;
+    ld->st.resources = n;
+}
+
+static void ld_seen_place(struct rag_lockdep *ld, uint64_t key) {
+    size_t i = (size_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) & ld->seen_mask;
+    while (ld->seen[i]) i = (i + 1) & ld->seen_mask;
+    ld->seen[i] = key;
+}
+
+/* 1 if the pair h -> r was examined before; otherwise records it */
+static int ld_seen(struct rag_lockdep *ld, int h, int r) {
+    uint64_t key = (uint64_t)h << 32 | (uint32_t)r;
+    if (ld->seen != NULL) {
+        for (size_t i = (size_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) & ld->seen_mask; ld->seen[i];
+             i = (i + 1) & ld->seen_mask) {
+            if (ld->seen[i] == key) return 1;
+        }
+    }
+    if (2 * (ld->seen_used + 1) > (ld->seen ? ld->seen_mask + 1 : 0)) {
+        size_t cap = ld->seen ? 2 * (ld->seen_mask + 1) : 1024;
+        uint64_t *old = ld->seen;
+        size_t old_cap = old ? ld->seen_mask + 1 : 0;
+        ld->seen = xrealloc(NULL, cap * sizeof(uint64_t));
+        memset(ld->seen, 0, cap * sizeof(uint64_t));
+        ld->seen_mask = cap - 1;
+        for (size_t i = 0; i < old_cap; ++i) if (old[i]) ld_seen_place(ld, old[i]);
+        free(old);
+    }
+    ld_seen_place(ld, key);
+    ld->seen_used++;
+    return 0;
+}
+
+/* As pk_search, over the order graph */
+static int ld_search(struct rag_lockdep *ld, int start, int target, int forward, int lo, int hi, edge_list *out) {
+    edge_list *stk = &ld->stk;
+    stk->n = 0;
+    ld->mark[start] = ld->stamp;
+    ld->parent[start] = -1;
+    ld->iter[start] = 0;
+    edge_push(out, start);
+    edge_push(stk, start);
+    while (stk->n > 0) {
+        int u = stk->v[stk->n - 1];
+        const edge_list *adj = forward ? &ld->out[u] : &ld->in[u];
+        if (ld->iter[u] == adj->n) { stk->n--; continue; }
+        int w = adj->v[ld->iter[u]++];
+        if (forward && w == target) { ld->parent[w] = u; return 1; }
+        if (ld->mark[w] == ld->stamp || ld->ord[w] < lo || ld->ord[w] > hi) continue;
+        ld->mark[w] = ld->stamp;
+        ld->parent[w] = u;
+        ld->iter[w] = 0;
+        edge_push(out, w);
+        edge_push(stk, w);
+    }
+    return 0;
+}
+
+/* As pk_sorted_ords and pk_reorder: the backward set, then the forward
+   set, into the union of their old slots */
+static void ld_sorted_ords(struct rag_lockdep *ld, edge_list *l) {
+    for (int i = 0; i < l->n; ++i) l->v[i] = ld->ord[l->v[i]];
+    qsort(l->v, (size_t)l->n, sizeof(int), cmp_int);
+}
+
+static void ld_reorder(struct rag_lockdep *ld) {
+    edge_list *fw = &ld->fwd, *bw = &ld->bwd, *pool = &ld->pool;
+    ld_sorted_ords(ld, bw);
+    ld_sorted_ords(ld, fw);
+    pool->n = 0;
+    int i = 0, j = 0;
+    while (i < bw->n || j < fw->n) {
+        if (j == fw->n || (i < bw->n && bw->v[i] < fw->v[j])) edge_push(pool, bw->v[i++]);
+        else edge_push(pool, fw->v[j++]);
+    }
+    for (i = 0; i < bw->n; ++i) bw->v[i] = ld->node_at[bw->v[i]];
+    for (j = 0; j < fw->n; ++j) fw->v[j] = ld->node_at[fw->v[j]];
+    int k = 0;
+    for (i = 0; i < bw->n; ++i, ++k) {
+        ld->ord[bw->v[i]] = pool->v[k];
+        ld->node_at[pool->v[k]] = bw->v[i];
+    }
+    for (j = 0; j < fw->n; ++j, ++k) {
+        ld->ord[fw->v[j]] = pool->v[k];
+        ld->node_at[pool->v[k]] = fw->v[j];
+    }
+}
+
+/* Order edge h -> r: 1 if r already reaches h (parent[] then holds the
+   path), else reorders as needed and returns 0 */
+static int ld_closes_cycle(struct rag_lockdep *ld, int h, int r) {
+    int lb = ld->ord[r], ub = ld->ord[h];
+    if (ub < lb) return 0;
+    if (++ld->stamp == INT_MAX) {
+        memset(ld->mark, 0, (size_t)ld->cap * sizeof(int));
+        ld->stamp = 1;
+    }
+    ld->st.searches++;
+    ld->fwd.n = 0;
+    if (ld_search(ld, r, h, 1, lb, ub, &ld->fwd)) return 1;
+    ld->bwd.n = 0;
+    ld_search(ld, h, -1, 0, lb, ub, &ld->bwd);
+    ld_reorder(ld);
+    return 0;
+}
+
+static void ld_add_edge(struct rag_lockdep *ld, int h, int r, int p) {
+    edge_push(&ld->out[h], r);
+    edge_push(&ld->by[h], p);
+    edge_push(&ld->in[r], h);
+    ld->st.edges++;
+}
+
+/* p, holding what it holds, is about to wait for or take r */
+static void lockdep_note(struct rag_graph *g, int p, int r) {
+    struct rag_lockdep *ld = g->lockdep;
+    const count_list *hl = &g->held[p];
+    ld_reserve(ld, g->n_res);
+    for (int i = 0; i < hl->n; ++i) {
+        int h = hl->v[i];
+        if (h == r) continue;
+        ld->st.checks++;
+        if (ld_seen(ld, h, r)) { ld->st.hits++; continue; }
+        if (!ld_closes_cycle(ld, h, r)) { ld_add_edge(ld, h, r, p); continue; }
+        ld->st.inversions++;
+        ld->path.n = 0;
+        for (int u = h; u != -1; u = ld->parent[u]) edge_push(&ld->path, u);
+        for (int a = 0, b = ld->path.n - 1; a < b; ++a, --b) {
+            int t = ld->path.v[a];
+            ld->path.v[a] = ld->path.v[b];
+            ld->path.v[b] = t;
+        }
+        if (g->on_inversion) OOM_UNGUARDED(g->on_inversion(g, p, h, r, g->on_inversion_arg));
+    }
+}
+
+/* Forget everything learned (ids are about to mean something else) */
+static void lockdep_clear(struct rag_lockdep *ld) {
+    for (int r = 0; r < ld->n; ++r) ld->out[r].n = ld->by[r].n = ld->in[r].n = 0;
+    if (ld->seen) memset(ld->seen, 0, (ld->seen_mask + 1) * sizeof(uint64_t));
+    ld->seen_used = 0;
+    ld->n = 0;
+    ld->path.n = 0;
+    memset(&ld->st, 0, sizeof(ld->st));
+}
+
+static void lockdep_free(struct rag_lockdep *ld) {
+    if (ld == NULL) return;
+    for (int r = 0; r < ld->cap; ++r) {
+        edge_free(&ld->out[r]);
+        edge_free(&ld->by[r]);
+        edge_free(&ld->in[r]);
+    }
+    free(ld->out); free(ld->by); free(ld->in);
+    free(ld->ord); free(ld->node_at);
+    free(ld->mark); free(ld->parent); free(ld->iter);
+    edge_free(&ld->fwd); edge_free(&ld->bwd); edge_free(&ld->stk); edge_free(&ld->pool);
+    edge_free(&ld->path);
+    free(ld->seen);
+    free(ld);
+}
+
+/* Carry what was learned over a renumbering: resource r becomes rnew[r]
+   (for all nr of them), process p becomes pnew[p] */
+static void lockdep_remap(struct rag_lockdep *ld, int nr, const int *rnew, const int *pnew) {
+    ld_reserve(ld, nr);
+    edge_list *e = &ld->pool;   /* (h, r, p) triples in the new ids; no search is running */
+    e->n = 0;
+    for (int h = 0; h < ld->n; ++h) {
+        for (int i = 0; i < ld->out[h].n; ++i) {
+            edge_push(e, rnew[h]);
+            edge_push(e, rnew[ld->out[h].v[i]]);
+            edge_push(e, pnew[ld->by[h].v[i]]);
+        }
+        ld->out[h].n = ld->by[h].n = ld->in[h].n = 0;
+    }
+    for (int r = 0; r < ld->n; ++r) ld->iter[rnew[r]] = ld->ord[r];
+    for (int r = 0; r < ld->n; ++r) {
+        ld->ord[r] = ld->iter[r];
+        ld->node_at[ld->ord[r]] = r;
+    }
+    for (int i = 0; i < e->n; i += 3) {
+        edge_push(&ld->out[e->v[i]], e->v[i + 1]);
+        edge_push(&ld->by[e->v[i]], e->v[i + 2]);
+        edge_push(&ld->in[e->v[i + 1]], e->v[i]);
+    }
+    e->n = 0;
+    /* rehash the examined pairs into a table of the same size; the old
+       one stays with ld until the new one is allocated */
+    uint64_t *old = ld->seen;
+    if (old != NULL) {
+        size_t cap = ld->seen_mask + 1;
+        ld->seen = xrealloc(NULL, cap * sizeof(uint64_t));
+        memset(ld->seen, 0, cap * sizeof(uint64_t));
+        for (size_t i = 0; i < cap; ++i) {
+            if (old[i]) ld_seen_place(ld, (uint64_t)rnew[old[i] >> 32] << 32 | (uint32_t)rnew[(uint32_t)old[i]]);
+        }
+        free(old);
+    }
+    ld->path.n = 0;
+}
+
+/* Start or stop lock-order analysis. Off forgets the order learned. */
+static void lockdep_enable(struct rag_graph *g, int on) {
+    if (!on) {
+        lockdep_free(g->lockdep);
+        g->lockdep = NULL;
+    } else if (g->lockdep == NULL) {
+        g->lockdep = xrealloc(NULL, sizeof(*g->lockdep));
+        memset(g->lockdep, 0, sizeof(*g->lockdep));
+    }
+}
+
+static const struct rag_lockdep_stats *lockdep_stats(const struct rag_graph *g) {
+    return g->lockdep ? &g->lockdep->st : NULL;
+}
+
+/* The order path of the last inversion: from the resource wanted to the
+   one held, each taken while holding the one before */
+static const int *lockdep_path(const struct rag_graph *g, int *n) {
+    *n = g->lockdep ? g->lockdep->path.n : 0;
+    return *n ? g->lockdep->path.v : NULL;
+}
+
+/* The process that first took b while holding a, or -1 */
+static int lockdep_witness(const struct rag_graph *g, int a, int b) {
+    const struct rag_lockdep *ld = g->lockdep;
+    if (ld == NULL || a < 0 || a >= ld->n) return -1;
+    for (int i = 0; i < ld->out[a].n; ++i) {
+        if (ld->out[a].v[i] == b) return ld->by[a].v[i];
+    }
+    return -1;
+}
+
+/* ---- Locality renumbering (reverse Cuthill-McKee) ----
+   Node numbers are creation order, so a traversal of a large graph jumps
+   between distant rows of the per-node arrays (visited, scc_index,
+   scc_low, ... - each its own array, so a pass streams only the fields it
+   touches) and between distant adjacency blocks. graph_renumber lays
+   processes and resources out in reverse Cuthill-McKee order of the RAG
+   taken as an undirected graph: breadth-first from a lowest-degree node,
+   neighbours in increasing degree, the whole sequence reversed. The two
+   kinds are numbered separately along that sequence, so processes that
+   share resources end up next to each other and next to those resources.
+
+   The graph is rebuilt in the new order (names, pool sizes, priorities,
+   then every edge through the mutators), so the adjacency vectors are
+   also carved from the pool in the order a traversal visits them. The
+   P<n>/R<n> indices change, names do not; the topological order and the
+   incremental detection state start afresh.
+*/
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Mean |p - r| over request and allocation edges: how far apart in the
+   node arrays the two ends of an edge live */
+static double graph_edge_span(const struct rag_graph *g) {
+    double sum = 0;
+    long long n = 0;
+    for (int p = 0; p < g->n_proc; ++p) {
+        for (int i = 0; i < g->req[p].n; ++i) sum += abs(g->req[p].v[i] - p);
+        for (int i = 0; i < g->held[p].n; ++i) sum += abs(g->held[p].v[i] - p);
+        n += g->req[p].n + g->held[p].n;
+    }
+    return n ? sum / n : 0;
+}
+
+/* RAG degree of node x: ids below n_proc are processes, the rest
+   resources (x - n_proc) */
+static int rcm_degree(const struct rag_graph *g, int x) {
+    int np = g->n_proc;
+    return x < np ? g->req[x].n + g->held[x].n : g->waiters[x - np].n + g->alloc_[x - np].n;
+}
+
+/* Scratch of one graph_renumber, kept off the stack so that a failed
+   allocation can still find and free it */
+struct renumber_work {
+    int *seq;               /* RCM order of every node id */
+    int *rnew;              /* resources: old -> new */
+    int *pold;              /* processes: new -> old */
+    unsigned char *seen;    /* rcm_order */
+    uint64_t *by_deg;
+    uint64_t *nb;
+    struct rag_graph ng;    /* the renumbered graph until it replaces g */
+};
+
+/* Reverse Cuthill-McKee sequence of every node id into w->seq */
+static void rcm_order(const struct rag_graph *g, struct renumber_work *w) {
+    int np = g->n_proc, n = np + g->n_res, head = 0, tail = 0;
+    int *seq = w->seq;
+    unsigned char *seen = w->seen = xrealloc(NULL, (size_t)n);
+    uint64_t *by_deg = w->by_deg = xrealloc(NULL, (size_t)n * sizeof(uint64_t));
+    uint64_t *nb = NULL;    /* (degree, id) of the node's new neighbours */
+    size_t nb_cap = 0;
+    memset(seen, 0, (size_t)n);
+    for (int x = 0; x < n; ++x) by_deg[x] = (uint64_t)rcm_degree(g, x) << 32 | (uint32_t)x;
+    qsort(by_deg, (size_t)n, sizeof(uint64_t), cmp_u64);
+    for (int s = 0; s < n; ++s) {
+        int start = (int)(uint32_t)by_deg[s];
+        if (seen[start]) continue;
+        seen[start] = 1;
+        seq[tail++] = start;
+        while (head < tail) {
+            int u = seq[head++];
+            const int *a, *b;
+            int na, nb2, base = u < np ? np : 0; /* neighbours are of the other kind */
+            if (u < np) {
+                a = g->req[u].v; na = g->req[u].n;
+                b = g->held[u].v; nb2 = g->held[u].n;
+            } else {
+                a = g->waiters[u - np].v; na = g->waiters[u - np].n;
+                b = g->alloc_[u - np].v; nb2 = g->alloc_[u - np].n;
+            }
+            if ((size_t)(na + nb2) > nb_cap) {
+                nb_cap = (size_t)(na + nb2) * 2;
+                nb = w->nb = xrealloc(nb, nb_cap * sizeof(uint64_t));
+            }
+            int k = 0;
+            for (int i = 0; i < na + nb2; ++i) {
+                int v = (i < na ? a[i] : b[i - na]) + base;
+                if (seen[v]) continue;
+                seen[v] = 1;
+                nb[k++] = (uint64_t)rcm_degree(g, v) << 32 | (uint32_t)v;
+            }
+            if (k > 1) qsort(nb, (size_t)k, sizeof(uint64_t), cmp_u64);
+            for (int i = 0; i < k; ++i) seq[tail++] = (int)(uint32_t)nb[i];
+        }
+    }
+    for (int i = 0, j = n - 1; i < j; ++i, --j) {
+        int t = seq[i];
+        seq[i] = seq[j];
+        seq[j] = t;
+    }
+}
+
+static void renumber_free(struct renumber_work *w) {
+    free(w->seq);
+    free(w->rnew);
+    free(w->pold);
+    free(w->seen);
+    free(w->by_deg);
+    free(w->nb);
+    free(w);
+}
+
+/* Out of memory half way: what had moved to ng goes back to g, which the
+   caller marks, and the rest of ng is freed */
+static void renumber_abort(struct rag_graph *g, struct renumber_work *w) {
+    if (w->ng.hist) g->hist = w->ng.hist;
+    if (w->ng.lockdep) g->lockdep = w->ng.lockdep;
+    w->ng.hist = NULL;
+    w->ng.lockdep = NULL;
+    graph_free(&w->ng);
+    renumber_free(w);
+}
+
+static void renumber_run(struct rag_graph *g, struct renumber_work *w) {
+    int np = g->n_proc, nr = g->n_res, n = np + nr;
+    int *seq = w->seq = xrealloc(NULL, (size_t)n * sizeof(int));
+    int *rnew = w->rnew = xrealloc(NULL, (size_t)(nr > 0 ? nr : 1) * sizeof(int));
+    int *pold = w->pold = xrealloc(NULL, (size_t)(np > 0 ? np : 1) * sizeof(int));
+    rcm_order(g, w);
+    int kp = 0, kr = 0;
+    for (int i = 0; i < n; ++i) {
+        if (seq[i] < np) pold[kp++] = seq[i];
+        else rnew[seq[i] - np] = kr++;
+    }
+    struct rag_graph *ng = &w->ng;
+    ng->topo_valid = 1;
+    for (int i = 0; i < n; ++i) {
+        int x = seq[i];
+        if (x < np) {
+            int p = graph_add_process(ng, pname(g, x));
+            ng->prio[p] = g->prio[x];
+            ng->born[p] = g->born[x];
+        } else {
+            int r = graph_add_resource(ng, rname(g, x - np));
+            graph_set_units(ng, r, g->units[x - np]);
+        }
+    }
+    /* holdings before requests, each process's edges together */
+    for (int q = 0; q < np; ++q) {
+        const count_list *h = &g->held[pold[q]];
+        for (int i = 0; i < h->n; ++i) graph_add_allocation_units(ng, rnew[h->v[i]], q, h->cnt[i]);
+    }
+    for (int q = 0; q < np; ++q) {
+        const count_list *rq = &g->req[pold[q]];
+        for (int i = 0; i < rq->n; ++i) graph_add_request_units(ng, q, rnew[rq->v[i]], rq->cnt[i]);
+    }
+    ng->epoch = g->epoch + 1;
+    ng->reach_seed = g->reach_seed;
+    ng->engine = g->engine;
+    ng->threads = g->threads;
+    ng->shards = g->shards;
+    ng->scc_full = g->scc_full;
+    ng->on_cycle = g->on_cycle;
+    ng->on_cycle_arg = g->on_cycle_arg;
+    ng->hist = g->hist;  /* every id moves: the next version rewrites all rows */
+    if (ng->hist) hist_touch_all(ng->hist);
+    g->hist = NULL;
+    ng->on_inversion = g->on_inversion;
+    ng->on_inversion_arg = g->on_inversion_arg;
+    ng->lockdep = g->lockdep;
+    if (ng->lockdep) {
+        for (int q = 0; q < np; ++q) seq[pold[q]] = q; /* seq is free again: old -> new process */
+        lockdep_remap(ng->lockdep, nr, rnew, seq);
+    }
+    g->lockdep = NULL;
+    ng->met = g->met;
+    g->met = NULL;
+    int online = g->online, avoid = g->avoid;
+    graph_free(g);
+    *g = *ng;
+    memset(ng, 0, sizeof(*ng));
+    if (online) set_online_detection(g, 1);
+    if (avoid) set_avoidance(g, 1);
+}
+
+/* Renumber g in RCM order; a graph mapped from a snapshot is copied to
+   the heap on the way */
+static void graph_renumber(struct rag_graph *g) {
+    if (g->n_proc + g->n_res == 0) return;
+    struct renumber_work *w = calloc(1, sizeof(*w));
+    if (w == NULL) oom_raise();
+    OOM_GUARD(renumber_abort(g, w); oom_raise(), renumber_run(g, w));
+    renumber_free(w);
+}
+
+/* ---- Binary snapshots ----
+   Layout (native byte order, every section 8-byte aligned):
+     header | names arena | process/resource name offsets (u64) |
+     CSR blocks for req (+ units), waiters, alloc_, held (+ units),
+     wfg (+ counts), wfg_in | resource units and units in use (i32)
+   Each CSR block is start[n + 1] (u64) followed by the i32 targets (and
+   i32 counts for counted lists), so loading only points the edge lists
+   into the private mapping: no edge or name is copied. Loading checks
+   the bounds and the invariants the mutators keep before g trusts the
+   arrays, which reads every edge once.
+*/
+#define SNAP_MAGIC      "RAGSNAP"
+#define SNAP_VERSION    2
+#define SNAP_BYTE_ORDER 0x01020304u
+
+enum snap_section {
+    S_NAMES, S_PNAME, S_RNAME,
+    S_REQ_START, S_REQ, S_REQ_CNT, S_WAITERS_START, S_WAITERS,
+    S_ALLOC_START, S_ALLOC, S_HELD_START, S_HELD, S_HELD_CNT,
+    S_WFG_START, S_WFG, S_WFG_CNT, S_WFGIN_START, S_WFGIN,
+    S_UNITS, S_IN_USE,
+    SNAP_SECTIONS
+};
+
+struct snap_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t n_proc;
+    uint32_t n_res;
+    uint64_t names_len;
+    uint64_t n_req;     /* request edges (= waiters entries) */
+    uint64_t n_alloc;   /* allocation edges (= held entries) */
+    uint64_t n_wait;    /* wait edges (= wfg_in entries) */
+    uint64_t off[SNAP_SECTIONS];
+};
+
+_Static_assert(sizeof(int) == 4, "snapshots store edge targets as 32-bit ints");
+
+struct snap_writer {
+    FILE *f;
+    uint64_t off;
+    int failed;
+};
+
+static void snap_put(struct snap_writer *w, const void *p, size_t len) {
+    if (len && fwrite(p, 1, len, w->f) != len) w->failed = 1;
+    w->off += len;
+}
+
+static uint64_t snap_align(struct snap_writer *w) {
+    static const char zero[8];
+    snap_put(w, zero, (size_t)(-w->off & 7));
+    return w->off;
+}
+
+/* Row i has deg(i) targets at tgt(i) and, if 'cnt' is given, counts at cnt(i).
+   Edge lists and counted lists share the v/n layout, so both are written
+   through these accessors. */
+static void snap_put_csr(struct snap_writer *w, struct snap_header *h, int sec_start, int n,
+                         int (*deg)(const void *, int), const int *(*tgt)(const void *, int),
+                         const int *(*cnt)(const void *, int), const void *lists) {
+    uint64_t pos = 0;
+    h->off[sec_start] = snap_align(w);
+    snap_put(w, &pos, sizeof(pos));
+    for (int i = 0; i < n; ++i) {
+        pos += (uint64_t)deg(lists, i);
+        snap_put(w, &pos, sizeof(pos));
+    }
+    h->off[sec_start + 1] = snap_align(w);
+    for (int i = 0; i < n; ++i) snap_put(w, tgt(lists, i), (size_t)deg(lists, i) * sizeof(int));
+    if (cnt == NULL) return;
+    h->off[sec_start + 2] = snap_align(w);
+    for (int i = 0; i < n; ++i) snap_put(w, cnt(lists, i), (size_t)deg(lists, i) * sizeof(int));
+}
+
+static int el_deg(const void *l, int i) { return ((const edge_list *)l)[i].n; }
+static const int *el_tgt(const void *l, int i) { return ((const edge_list *)l)[i].v; }
+static int cl_deg(const void *l, int i) { return ((const count_list *)l)[i].n; }
+static const int *cl_tgt(const void *l, int i) { return ((const count_list *)l)[i].v; }
+static const int *cl_cnt(const void *l, int i) { return ((const count_list *)l)[i].cnt; }
+
+/* Returns NULL on success, otherwise a short reason */
+static const char *snapshot_save(const struct rag_graph *g, const char *path) {
+    struct snap_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SNAP_MAGIC, sizeof(SNAP_MAGIC));
+    h.version = SNAP_VERSION;
+    h.byte_order = SNAP_BYTE_ORDER;
+    h.n_proc = (uint32_t)g->n_proc;
+    h.n_res = (uint32_t)g->n_res;
+    h.names_len = g->names_len;
+    h.n_req = (uint64_t)g->req_edges;
+    h.n_alloc = (uint64_t)g->alloc_edges;
+    h.n_wait = (uint64_t)g->wait_edges;
+
+    struct snap_writer w = { fopen(path, "wb"), 0, 0 };
+    if (w.f == NULL) return "cannot open file for writing";
+    snap_put(&w, &h, sizeof(h)); /* rewritten once the offsets are known */
+    h.off[S_NAMES] = snap_align(&w);
+    snap_put(&w, g->names, g->names_len);
+    h.off[S_PNAME] = snap_align(&w);
+    for (int p = 0; p < g->n_proc; ++p) {
+        uint64_t o = g->p_name[p];
+        snap_put(&w, &o, sizeof(o));
+    }
+    h.off[S_RNAME] = snap_align(&w);
+    for (int r = 0; r < g->n_res; ++r) {
+        uint64_t o = g->r_name[r];
+        snap_put(&w, &o, sizeof(o));
+    }
+    snap_put_csr(&w, &h, S_REQ_START, g->n_proc, cl_deg, cl_tgt, cl_cnt, g->req);
+    snap_put_csr(&w, &h, S_WAITERS_START, g->n_res, el_deg, el_tgt, NULL, g->waiters);
+    snap_put_csr(&w, &h, S_ALLOC_START, g->n_res, el_deg, el_tgt, NULL, g->alloc_);
+    snap_put_csr(&w, &h, S_HELD_START, g->n_proc, cl_deg, cl_tgt, cl_cnt, g->held);
+    snap_put_csr(&w, &h, S_WFG_START, g->n_proc, cl_deg, cl_tgt, cl_cnt, g->wfg);
+    snap_put_csr(&w, &h, S_WFGIN_START, g->n_proc, el_deg, el_tgt, NULL, g->wfg_in);
+    h.off[S_UNITS] = snap_align(&w);
+    snap_put(&w, g->units, (size_t)g->n_res * sizeof(int));
+    h.off[S_IN_USE] = snap_align(&w);
+    snap_put(&w, g->in_use, (size_t)g->n_res * sizeof(int));
+    snap_align(&w);
+
+    if (!w.failed && (fseek(w.f, 0, SEEK_SET) != 0 || fwrite(&h, sizeof(h), 1, w.f) != 1)) w.failed = 1;
+    if (fclose(w.f) != 0) w.failed = 1;
+    return w.failed ? "write failed" : NULL;
+}
+
+/* Check that an i32 array of m entries at 'off' lies in the file with
+   every value in [lo, hi) */
+static int snap_check_ints(const char *base, size_t len, uint64_t off, uint64_t m,
+                           int64_t lo, int64_t hi) {
+    if (off % 8 || off > len || (len - off) / 4 < m) return 0;
+    const int32_t *v = (const int32_t *)(base + off);
+    for (uint64_t i = 0; i < m; ++i) {
+        if (v[i] < lo || v[i] >= hi) return 0;
+    }
+    return 1;
+}
+
+/* Check one CSR block of n rows / m entries with targets below 'limit'
+   (and positive counts if the block has them) */
+static int snap_check_csr(const char *base, size_t len, const uint64_t *off, int sec_start,
+                          uint64_t n, uint64_t m, uint64_t limit, int counted) {
+    uint64_t os = off[sec_start];
+    if (os % 8 || os > len || (len - os) / 8 < n + 1) return 0;
+    const uint64_t *start = (const uint64_t *)(base + os);
+    if (start[0] != 0 || start[n] != m) return 0;
+    for (uint64_t i = 0; i < n; ++i) {
+        if (start[i] > start[i + 1]) return 0;
+    }
+    if (!snap_check_ints(base, len, off[sec_start + 1], m, 0, (int64_t)limit)) return 0;
+    return !counted || snap_check_ints(base, len, off[sec_start + 2], m, 1, INT_MAX);
+}
+
+/* The rows of one CSR block in the mapping (cnt is NULL for plain lists) */
+struct snap_rows {
+    const uint64_t *start;
+    const int *v;
+    const int *cnt;
+};
+
+static struct snap_rows snap_rows(const char *base, const uint64_t *off, int sec_start, int counted) {
+    struct snap_rows s;
+    s.start = (const uint64_t *)(base + off[sec_start]);
+    s.v = (const int *)(base + off[sec_start + 1]);
+    s.cnt = counted ? (const int *)(base + off[sec_start + 2]) : NULL;
+    return s;
+}
+
+/* Is b (m rows over [0, n)) the transpose of f (n rows over [0, m)), with
+   no target twice in a row? Both hold e entries. 'at' (m + 1), 'tv' (e)
+   and 'mark' (n) are scratch. */
+static int snap_mirrors(struct snap_rows f, int n, struct snap_rows b, int m, uint64_t e,
+                        uint64_t *at, int *tv, int *mark) {
+    memset(at, 0, ((size_t)m + 1) * sizeof(*at));
+    for (uint64_t j = 0; j < e; ++j) at[f.v[j] + 1]++;
+    for (int t = 0; t < m; ++t) at[t + 1] += at[t];
+    for (int i = 0; i < n; ++i) {
+        for (uint64_t j = f.start[i]; j < f.start[i + 1]; ++j) tv[at[f.v[j]]++] = i;
+    }
+    /* at[t] now ends row t of the transpose; mark[i] == t: i is in it,
+       ~t: b row t has i as well */
+    for (int i = 0; i < n; ++i) mark[i] = INT_MAX;
+    for (int t = 0; t < m; ++t) {
+        uint64_t lo = t > 0 ? at[t - 1] : 0;
+        if (at[t] - lo != b.start[t + 1] - b.start[t]) return 0;
+        for (uint64_t j = lo; j < at[t]; ++j) {
+            if (mark[tv[j]] == t) return 0;
+            mark[tv[j]] = t;
+        }
+        for (uint64_t j = b.start[t]; j < b.start[t + 1]; ++j) {
+            if (mark[b.v[j]] != t) return 0;
+            mark[b.v[j]] = ~t;
+        }
+    }
+    return 1;
+}
+
+/* Check the invariants the mutators keep, which the bounds checks cannot
+   see: units in use add up to the units held and fit the resource,
+   waiters / alloc_ / wfg_in mirror req / held / wfg, and wfg[p] counts,
+   per p2, the resources p requests that p2 holds. O(V + E + W). */
+static const char *snap_check_rows(const char *base, const uint64_t *off, const struct snap_header *h,
+                                   uint64_t *at, int *tv, int *mark) {
+    int n_proc = (int)h->n_proc, n_res = (int)h->n_res;
+    struct snap_rows req = snap_rows(base, off, S_REQ_START, 1), waiters = snap_rows(base, off, S_WAITERS_START, 0);
+    struct snap_rows alloc = snap_rows(base, off, S_ALLOC_START, 0), held = snap_rows(base, off, S_HELD_START, 1);
+    struct snap_rows wfg = snap_rows(base, off, S_WFG_START, 1), wfg_in = snap_rows(base, off, S_WFGIN_START, 0);
+    const int *units = (const int *)(base + off[S_UNITS]);
+    const int *in_use = (const int *)(base + off[S_IN_USE]);
+
+    memset(at, 0, (size_t)n_res * sizeof(*at));
+    for (uint64_t j = 0; j < h->n_alloc; ++j) at[held.v[j]] += (uint64_t)held.cnt[j];
+    for (int r = 0; r < n_res; ++r) {
+        if (in_use[r] > units[r] || at[r] != (uint64_t)in_use[r]) return "corrupt resource units";
+    }
+    if (!snap_mirrors(req, n_proc, waiters, n_res, h->n_req, at, tv, mark) ||
+        !snap_mirrors(held, n_proc, alloc, n_res, h->n_alloc, at, tv, mark))
+        return "corrupt edge arrays";
+    if (!snap_mirrors(wfg, n_proc, wfg_in, n_proc, h->n_wait, at, tv, mark)) return "corrupt wait-for graph";
+    /* mark[p2]: resources p requests that p2 holds, zeroed as wfg[p] matches them */
+    memset(mark, 0, (size_t)n_proc * sizeof(*mark));
+    for (int p = 0; p < n_proc; ++p) {
+        int open = 0;
+        for (uint64_t j = req.start[p]; j < req.start[p + 1]; ++j) {
+            int r = req.v[j];
+            for (uint64_t k = alloc.start[r]; k < alloc.start[r + 1]; ++k) {
+                if (mark[alloc.v[k]]++ == 0) open++;
+            }
+        }
+        for (uint64_t j = wfg.start[p]; j < wfg.start[p + 1]; ++j) {
+            if (mark[wfg.v[j]] != wfg.cnt[j]) return "corrupt wait-for graph";
+            mark[wfg.v[j]] = 0;
+            open--;
+        }
+        if (open != 0) return "corrupt wait-for graph";
+    }
+    return NULL;
+}
+
+static const char *snap_check_graph(const char *base, const uint64_t *off, const struct snap_header *h) {
+    size_t n = h->n_proc > h->n_res ? h->n_proc : h->n_res;
+    uint64_t e = h->n_req;
+    if (h->n_alloc > e) e = h->n_alloc;
+    if (h->n_wait > e) e = h->n_wait;
+    uint64_t *at = malloc((n + 1) * sizeof(*at));
+    int *tv = malloc(((size_t)e + 1) * sizeof(*tv));
+    int *mark = malloc(((size_t)h->n_proc + 1) * sizeof(*mark));
+    const char *why = at && tv && mark ? snap_check_rows(base, off, h, at, tv, mark) : "out of memory";
+    free(at);
+    free(tv);
+    free(mark);
+    return why;
+}
+
+static void snap_borrow(edge_list *lists, int n, char *base, const uint64_t *off, int sec_start) {
+    const uint64_t *start = (const uint64_t *)(base + off[sec_start]);
+    int *idx = (int *)(base + off[sec_start + 1]);
+    for (int i = 0; i < n; ++i) {
+        lists[i].v = idx + start[i];
+        lists[i].n = (int)(start[i + 1] - start[i]);
+        lists[i].cap = 0;
+    }
+}
+
+static void snap_borrow_counted(count_list *lists, int n, char *base, const uint64_t *off, int sec_start) {
+    const uint64_t *start = (const uint64_t *)(base + off[sec_start]);
+    int *idx = (int *)(base + off[sec_start + 1]);
+    int *cnt = (int *)(base + off[sec_start + 2]);
+    for (int i = 0; i < n; ++i) {
+        lists[i].v = idx + start[i];
+        lists[i].cnt = cnt + start[i];
+        lists[i].n = (int)(start[i + 1] - start[i]);
+        lists[i].cap = 0;
+    }
+}
+
+/* Replace g with the snapshot at 'path'. Returns NULL on success,
+   otherwise a short reason (g is left untouched). */
+static const char *snapshot_load(struct rag_graph *g, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return "cannot open file";
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct snap_header)) {
+        close(fd);
+        return "not a snapshot (too short)";
+    }
+    size_t len = (size_t)st.st_size;
+    char *base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return "mmap failed";
+
+    const struct snap_header *h = (const struct snap_header *)base;
+    const uint64_t *off = h->off;
+    const char *why = NULL;
+    if (memcmp(h->magic, SNAP_MAGIC, sizeof(SNAP_MAGIC)) != 0) why = "not a snapshot (bad magic)";
+    else if (h->byte_order != SNAP_BYTE_ORDER) why = "snapshot written with a different byte order";
+    else if (h->version != SNAP_VERSION) why = "unsupported snapshot version";
+    else if (h->n_proc > INT_MAX || h->n_res > INT_MAX || h->n_req > INT_MAX ||
+             h->n_alloc > INT_MAX || h->n_wait > INT_MAX) why = "snapshot too large";
+    else if (off[S_NAMES] > len || len - off[S_NAMES] < h->names_len ||
+             (h->names_len > 0 && base[off[S_NAMES] + h->names_len - 1] != '\0'))
+        why = "corrupt name arena";
+    else if (off[S_PNAME] % 8 || off[S_PNAME] > len || (len - off[S_PNAME]) / 8 < h->n_proc ||
+             off[S_RNAME] % 8 || off[S_RNAME] > len || (len - off[S_RNAME]) / 8 < h->n_res)
+        why = "corrupt name offsets";
+    else if (!snap_check_csr(base, len, off, S_REQ_START, h->n_proc, h->n_req, h->n_res, 1) ||
+             !snap_check_csr(base, len, off, S_WAITERS_START, h->n_res, h->n_req, h->n_proc, 0) ||
+             !snap_check_csr(base, len, off, S_ALLOC_START, h->n_res, h->n_alloc, h->n_proc, 0) ||
+             !snap_check_csr(base, len, off, S_HELD_START, h->n_proc, h->n_alloc, h->n_res, 1) ||
+             !snap_check_csr(base, len, off, S_WFG_START, h->n_proc, h->n_wait, h->n_proc, 1) ||
+             !snap_check_csr(base, len, off, S_WFGIN_START, h->n_proc, h->n_wait, h->n_proc, 0))
+        why = "corrupt edge arrays";
+    else if (!snap_check_ints(base, len, off[S_UNITS], h->n_res, 1, INT_MAX) ||
+             !snap_check_ints(base, len, off[S_IN_USE], h->n_res, 0, INT_MAX))
+        why = "corrupt resource units";
+    if (why == NULL) {
+        const uint64_t *po = (const uint64_t *)(base + off[S_PNAME]);
+        const uint64_t *ro = (const uint64_t *)(base + off[S_RNAME]);
+        for (uint64_t i = 0; i < h->n_proc && why == NULL; ++i) if (po[i] >= h->names_len) why = "corrupt name offsets";
+        for (uint64_t i = 0; i < h->n_res && why == NULL; ++i) if (ro[i] >= h->names_len) why = "corrupt name offsets";
+    }
+    if (why == NULL) why = snap_check_graph(base, off, h);
+    if (why) {
+        munmap(base, len);
+        return why;
+    }
+
+    graph_reset(g);
+    g->map_base = base;     /* owned by g before anything can fail */
+    g->map_len = len;
+    int n_proc = (int)h->n_proc, n_res = (int)h->n_res;
+    graph_grow_proc(g, n_proc);
+    graph_grow_res(g, n_res);
+    g->names = base + off[S_NAMES];
+    g->names_len = h->names_len;
+    g->names_cap = 0;
+    const uint64_t *po = (const uint64_t *)(base + off[S_PNAME]);
+    const uint64_t *ro = (const uint64_t *)(base + off[S_RNAME]);
+    const int *units = (const int *)(base + off[S_UNITS]);
+    const int *in_use = (const int *)(base + off[S_IN_USE]);
+    for (int p = 0; p < n_proc; ++p) {
+        g->p_name[p] = (size_t)po[p];
+        name_index_insert(&g->p_index, g, g->p_name, p);
+        g->ord[p] = g->node_at[p] = p;
+    }
+    for (int r = 0; r < n_res; ++r) {
+        g->r_name[r] = (size_t)ro[r];
+        name_index_insert(&g->r_index, g, g->r_name, r);
+        g->units[r] = units[r];
+        g->in_use[r] = in_use[r];
+        if (units[r] > 1) g->multi_res++;
+    }
+    g->n_proc = n_proc;
+    g->n_res = n_res;
+    snap_borrow_counted(g->req, n_proc, base, off, S_REQ_START);
+    snap_borrow(g->waiters, n_res, base, off, S_WAITERS_START);
+    snap_borrow(g->alloc_, n_res, base, off, S_ALLOC_START);
+    snap_borrow_counted(g->held, n_proc, base, off, S_HELD_START);
+    snap_borrow_counted(g->wfg, n_proc, base, off, S_WFG_START);
+    snap_borrow(g->wfg_in, n_proc, base, off, S_WFGIN_START);
+    g->req_edges = (int)h->n_req;
+    g->alloc_edges = (int)h->n_alloc;
+    g->wait_edges = (int)h->n_wait;
+    if (g->hist) hist_touch_all(g->hist);
+    /* the topological order is not stored; online and avoidance modes rebuild it */
+    if (g->online || g->avoid) topo_rebuild(g);
+    else g->topo_valid = 0;
+    g->topo_retry = 1;
+    return NULL;
+}
+
+/* ---- Version history (copy-on-write) ----
+   Keeps every committed state of the graph for post-mortems: run an
+   engine against the graph as it stood at version V or at time T, or
+   bisect for the first version that held a deadlock.
+
+   A version is a persistent radix tree over the process ids and one over
+   the resource ids, with HIST_FAN-way nodes. A process row holds its name
+   and two more such trees, resource -> units requested and resource ->
+   units held; a resource row holds its name and instance count. The
+   mutators log what they change (hist_touch) and a commit writes just
+   those entries, copying the nodes on their paths, so a version costs
+   O(log n) small nodes per changed edge and shares everything else with
+   its predecessor. Each node and row records the version that created
+   it: the open (not yet committed) version edits its own in place and
+   copies older ones on first write, so changes that land in the same
+   version share their copies.
+
+   Nodes, rows and names come from a bump arena freed only with the
+   history. Checking a version out rebuilds an ordinary graph in
+   O(V + E), and bisection does that O(log versions) times. Priorities
+   and engine settings are not versioned.
+*/
+#define HIST_BITS       4
+#define HIST_FAN        (1 << HIST_BITS)
+#define HIST_MAX_DEPTH  (32 / HIST_BITS)    /* covers every non-negative int */
+#define HIST_SLAB_BYTES ((size_t)256 * 1024)
+#define HIST_SLAB_HDR   16                  /* slab link, keeps blocks 16-byte aligned */
+
+/* Every block starts with the version that created it */
+struct hist_node {
+    int ver;
+    void *slot[HIST_FAN];       /* children, or rows at the bottom of an id tree */
+};
+
+struct hist_leaf {
+    int ver;
+    int units[HIST_FAN];        /* bottom of a unit map: 0 means no edge */
+};
+
+struct hist_tree {
+    void *root;
+    int depth;                  /* levels: ids below HIST_FAN^depth fit */
+};
+
+struct hist_proc {
+    int ver;
+    const char *name;
+    struct hist_tree req;       /* resource -> units requested */
+    struct hist_tree held;      /* resource -> units held */
+};
+
+struct hist_res {
+    int ver;
+    int units;
+    const char *name;
+};
+
+struct hist_version {
+    double ts;
+    long long tag;
+    int n_proc, n_res;
+    struct hist_tree proc, res;
+};
+
+struct rag_history {
+    struct hist_version *ver;   /* committed versions, ts non-decreasing */
+    int n_ver, ver_cap;
+    struct hist_version open;   /* the version being built: number n_ver */
+    edge_list log;              /* (kind, a, b) changes since the last commit */
+    int all;                    /* ids were reassigned: rewrite everything */
+    char *slab;                 /* current slab; its first word links the previous one */
+    size_t slab_used, slab_size;
+    size_t bytes;               /* arena bytes handed out */
+};
+
+static void *hist_alloc(struct rag_history *h, size_t sz) {
+    sz = (sz + 15) & ~(size_t)15;
+    if (h->slab == NULL || h->slab_used + sz > h->slab_size) {
+        size_t size = sz + HIST_SLAB_HDR > HIST_SLAB_BYTES ? sz + HIST_SLAB_HDR : HIST_SLAB_BYTES;
+        char *s = xrealloc(NULL, size);
+        *(char **)s = h->slab;
+        h->slab = s;
+        h->slab_used = HIST_SLAB_HDR;
+        h->slab_size = size;
+    }
+    void *p = h->slab + h->slab_used;
+    h->slab_used += sz;
+    h->bytes += sz;
+    return p;
+}
+
+static const char *hist_name(struct rag_history *h, const char *name) {
+    size_t len = strlen(name) + 1;
+    return memcpy(hist_alloc(h, len), name, len);
+}
+
+static void history_free(struct rag_history *h) {
+    if (h == NULL) return;
+    while (h->slab != NULL) {
+        char *prev = *(char **)h->slab;
+        free(h->slab);
+        h->slab = prev;
+    }
+    free(h->ver);
+    edge_free(&h->log);
+    free(h);
+}
+
+static void hist_note(struct rag_history *h, int kind, int a, int b) {
+    if (h->all) return; /* everything is rewritten anyway */
+    edge_push(&h->log, kind);
+    edge_push(&h->log, a);
+    edge_push(&h->log, b);
+}
+
+static void hist_touch_all(struct rag_history *h) {
+    h->all = 1;
+    h->log.n = 0;
+}
+
+/* Block b (sz bytes) if the open version created it, else a copy of it
+   (a zeroed block for NULL) */
+static void *hist_own(struct rag_history *h, void *b, size_t sz) {
+    if (b != NULL && *(int *)b == h->n_ver) return b;
+    void *c = hist_alloc(h, sz);
+    if (b != NULL) memcpy(c, b, sz);
+    else memset(c, 0, sz);
+    *(int *)c = h->n_ver;
+    return c;
+}
+
+static int hist_fits(const struct hist_tree *t, int id) {
+    return t->depth >= HIST_MAX_DEPTH || (t->depth > 0 && ((unsigned)id >> (HIST_BITS * t->depth)) == 0);
+}
+
+/* Bottom block holding id, or NULL */
+static const void *hist_find(const struct hist_tree *t, int id) {
+    if (!hist_fits(t, id)) return NULL;
+    const struct hist_node *n = t->root;
+    for (int level = t->depth - 1; n != NULL && level > 0; --level)
+        n = n->slot[((unsigned)id >> (HIST_BITS * level)) & (HIST_FAN - 1)];
+    return n;
+}
+
+/* Bottom block holding id in the open version, copying the path to it;
+   'leaf' selects unit-map bottoms over row-pointer bottoms */
+static void *hist_path(struct rag_history *h, struct hist_tree *t, int id, int leaf) {
+    size_t bottom = leaf ? sizeof(struct hist_leaf) : sizeof(struct hist_node);
+    if (t->depth == 0) t->depth = 1;
+    while (!hist_fits(t, id)) {
+        struct hist_node *top = hist_own(h, NULL, sizeof(*top));
+        top->slot[0] = t->root;
+        t->root = top;
+        t->depth++;
+    }
+    if (t->depth == 1) return t->root = hist_own(h, t->root, bottom);
+    struct hist_node *n = t->root = hist_own(h, t->root, sizeof(*n));
+    for (int level = t->depth - 1; level > 1; --level) {
+        void **slot = &n->slot[((unsigned)id >> (HIST_BITS * level)) & (HIST_FAN - 1)];
+        n = *slot = hist_own(h, *slot, sizeof(*n));
+    }
+    void **slot = &n->slot[((unsigned)id >> HIST_BITS) & (HIST_FAN - 1)];
+    return *slot = hist_own(h, *slot, bottom);
+}
+
+static const void *hist_row(const struct hist_tree *t, int id) {
+    const struct hist_node *n = hist_find(t, id);
+    return n != NULL ? n->slot[id & (HIST_FAN - 1)] : NULL;
+}
+
+static int hist_units(const struct hist_tree *t, int r) {
+    const struct hist_leaf *l = hist_find(t, r);
+    return l != NULL ? l->units[r & (HIST_FAN - 1)] : 0;
+}
+
+/* Re-add process p's edges from one of its unit maps into out */
+static void hist_add_edges(struct rag_graph *out, int p, const void *n, int depth, int base, int held) {
+    if (n == NULL) return;
+    if (depth == 1) {
+        const struct hist_leaf *l = n;
+        for (int i = 0; i < HIST_FAN; ++i) {
+            if (l->units[i] == 0) continue;
+            if (held) graph_add_allocation_units(out, base + i, p, l->units[i]);
+            else graph_add_request_units(out, p, base + i, l->units[i]);
+        }
+        return;
+    }
+    const struct hist_node *in = n;
+    int span = 1 << (HIST_BITS * (depth - 1));
+    for (int i = 0; i < HIST_FAN; ++i) hist_add_edges(out, p, in->slot[i], depth - 1, base + i * span, held);
+}
+
+/* Process p's row in the open version, ready for edits */
+static struct hist_proc *hist_proc_own(struct rag_history *h, int p) {
+    struct hist_node *n = hist_path(h, &h->open.proc, p, 0);
+    void **slot = &n->slot[p & (HIST_FAN - 1)];
+    return *slot = hist_own(h, *slot, sizeof(struct hist_proc));
+}
+
+static void hist_write_proc(struct rag_history *h, const struct rag_graph *g, int p) {
+    const struct hist_proc *old = hist_row(&h->open.proc, p);
+    const char *name = pname(g, p);
+    const char *keep = old != NULL && !strcmp(old->name, name) ? old->name : hist_name(h, name);
+    struct hist_proc *row = hist_proc_own(h, p);
+    memset(&row->req, 0, sizeof(row->req));
+    memset(&row->held, 0, sizeof(row->held));
+    row->name = keep;
+}
+
+static void hist_write_res(struct rag_history *h, const struct rag_graph *g, int r) {
+    const struct hist_res *old = hist_row(&h->open.res, r);
+    const char *name = rname(g, r);
+    const char *keep = old != NULL && !strcmp(old->name, name) ? old->name : hist_name(h, name);
+    struct hist_node *n = hist_path(h, &h->open.res, r, 0);
+    void **slot = &n->slot[r & (HIST_FAN - 1)];
+    struct hist_res *row = *slot = hist_own(h, *slot, sizeof(struct hist_res));
+    row->name = keep;
+    row->units = g->units[r];
+}
+
+static void hist_write_edge(struct rag_history *h, const struct rag_graph *g, int kind, int p, int r) {
+    const count_list *l = kind == HIST_REQ ? &g->req[p] : &g->held[p];
+    int k = count_of(l, r);
+    const struct hist_proc *old = hist_row(&h->open.proc, p);
+    if (hist_units(kind == HIST_REQ ? &old->req : &old->held, r) == k) return;
+    struct hist_proc *row = hist_proc_own(h, p);
+    struct hist_leaf *leaf = hist_path(h, kind == HIST_REQ ? &row->req : &row->held, r, 1);
+    leaf->units[r & (HIST_FAN - 1)] = k;
+}
+
+/* Start or stop recording. Off drops every version. The first commit
+   after switching on records the whole graph. */
+static void history_enable(struct rag_graph *g, int on) {
+    if (!on) {
+        history_free(g->hist);
+        g->hist = NULL;
+    } else if (g->hist == NULL) {
+        g->hist = xrealloc(NULL, sizeof(*g->hist));
+        memset(g->hist, 0, sizeof(*g->hist));
+        g->hist->all = 1;
+    }
+}
+
+/* Record the graph as a new version stamped (ts, tag); ts is clamped so
+   versions stay in time order. Returns its number, the previous version's
+   if nothing changed, or -1 when not recording. */
+static int history_commit(struct rag_graph *g, double ts, long long tag) {
+    struct rag_history *h = g->hist;
+    if (h == NULL) return -1;
+    struct hist_version *o = &h->open;
+    if (h->n_ver > 0 && !h->all && h->log.n == 0 && o->n_proc == g->n_proc && o->n_res == g->n_res)
+        return h->n_ver - 1;
+    if (h->all) {
+        memset(&o->proc, 0, sizeof(o->proc));
+        memset(&o->res, 0, sizeof(o->res));
+        for (int r = 0; r < g->n_res; ++r) hist_write_res(h, g, r);
+        for (int p = 0; p < g->n_proc; ++p) {
+            hist_write_proc(h, g, p);
+            for (int i = 0; i < g->req[p].n; ++i) hist_write_edge(h, g, HIST_REQ, p, g->req[p].v[i]);
+            for (int i = 0; i < g->held[p].n; ++i) hist_write_edge(h, g, HIST_HELD, p, g->held[p].v[i]);
+        }
+        h->all = 0;
+    }
+    /* Replayed in order; entries about ids a reset has since dropped are
+       skipped, and a re-added id starts from a fresh row (HIST_PROC) */
+    for (int i = 0; i < h->log.n; i += 3) {
+        int kind = h->log.v[i], a = h->log.v[i + 1], b = h->log.v[i + 2];
+        if (kind == HIST_RES) { if (a < g->n_res) hist_write_res(h, g, a); continue; }
+        if (a >= g->n_proc) continue;
+        if (kind == HIST_PROC) hist_write_proc(h, g, a);
+        else if (b < g->n_res) hist_write_edge(h, g, kind, a, b);
+    }
+    h->log.n = 0;
+    if (h->n_ver > 0 && ts < h->ver[h->n_ver - 1].ts) ts = h->ver[h->n_ver - 1].ts;
+    o->ts = ts;
+    o->tag = tag;
+    o->n_proc = g->n_proc;
+    o->n_res = g->n_res;
+    if (h->n_ver == h->ver_cap) {
+        h->ver_cap = h->ver_cap ? 2 * h->ver_cap : 64;
+        h->ver = xrealloc(h->ver, (size_t)h->ver_cap * sizeof(*h->ver));
+    }
+    h->ver[h->n_ver++] = *o; /* its blocks now belong to an older version */
+    return h->n_ver - 1;
+}
+
+static int history_count(const struct rag_graph *g) {
+    return g->hist ? g->hist->n_ver : 0;
+}
+
+/* Stamp of version v; returns 0 if there is no such version */
+static int history_version(const struct rag_graph *g, int v, double *ts, long long *tag) {
+    if (v < 0 || v >= history_count(g)) return 0;
+    *ts = g->hist->ver[v].ts;
+    *tag = g->hist->ver[v].tag;
+    return 1;
+}
+
+/* The last version stamped at or before ts, -1 if none */
+static int history_at(const struct rag_graph *g, double ts) {
+    int lo = 0, hi = history_count(g);
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (g->hist->ver[mid].ts <= ts) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo - 1;
+}
+
+/* Arena and version table bytes */
+static size_t history_bytes(const struct rag_graph *g) {
+    const struct rag_history *h = g->hist;
+    return h ? h->bytes + (size_t)h->ver_cap * sizeof(*h->ver) : 0;
+}
+
+/* Rebuild version v in 'out' (which may be g itself: the checkout then
+   becomes the next version when committed). Returns 0 if there is no
+   such version. */
+static int history_checkout(const struct rag_graph *g, int v, struct rag_graph *out) {
+    if (v < 0 || v >= history_count(g)) return 0;
+    const struct hist_version ver = g->hist->ver[v]; /* out's reset may be g's */
+    graph_reset(out);
+    struct rag_lockdep *lockdep = out->lockdep; /* rebuilding is not taking locks */
+    out->lockdep = NULL;
+    for (int p = 0; p < ver.n_proc; ++p) {
+        const struct hist_proc *row = hist_row(&ver.proc, p);
+        graph_add_process(out, row->name);
+    }
+    for (int r = 0; r < ver.n_res; ++r) {
+        const struct hist_res *row = hist_row(&ver.res, r);
+        graph_add_resource(out, row->name);
+        if (row->units > 1) graph_set_units(out, r, row->units);
+    }
+    for (int p = 0; p < ver.n_proc; ++p) {
+        const struct hist_proc *row = hist_row(&ver.proc, p);
+        hist_add_edges(out, p, row->held.root, row->held.depth, 0, 1);
+        hist_add_edges(out, p, row->req.root, row->req.depth, 0, 0);
+    }
+    out->lockdep = lockdep;
+    return 1;
+}
+
+/* Does version v hold a deadlock (involving 'proc' if not NULL)? */
+static int hist_deadlocked(const struct rag_graph *g, int v, const char *proc, struct rag_graph *s) {
+    history_checkout(g, v, s);
+    int p = proc != NULL ? find_process(s, proc) : -1;
+    if (proc != NULL && p < 0) return 0;
+    if (s->multi_res > 0) return banker_detect(s) > 0 && (p < 0 || !s->bk_done[p]);
+    return scc_detect(s) > 0 && (p < 0 || s->scc_comp[p] >= 0);
+}
+
+/* First version in [lo, hi] holding a deadlock (with 'proc' in it, if
+   given), by bisection. As with git bisect the versions are taken to be
+   clean up to that point: if deadlocks come and go in between, this is
+   one of the versions where one appeared. Returns -1 if hi is clean.
+   scratch (not g) is left holding the version returned. */
+static int history_bisect(const struct rag_graph *g, int lo, int hi, const char *proc, struct rag_graph *scratch) {
+    if (lo < 0 || hi >= history_count(g) || lo > hi) return -1;
+    if (!hist_deadlocked(g, hi, proc, scratch)) return -1;
+    if (lo == hi || hist_deadlocked(g, lo, proc, scratch)) return lo;
+    while (hi - lo > 1) {
+        int mid = lo + (hi - lo) / 2;
+        if (hist_deadlocked(g, mid, proc, scratch)) hi = mid;
+        else lo = mid;
+    }
+    history_checkout(g, hi, scratch);
+    return hi;
+}
+
+/* ---- Library API (rag.h) ----
+   Thin checks over the graph operations above: index and count
+   validation, and RAG_EUNSAFE from avoidance. Calls that
+   can allocate run under the out-of-memory guard; on a graph marked out
+   of memory, changes return RAG_ENOMEM and queries see an empty graph. */
+#define RAG_HAS_P(g, p) ((p) >= 0 && (p) < (g)->n_proc)
+#define RAG_HAS_R(g, r) ((r) >= 0 && (r) < (g)->n_res)
+#define RAG_LIVE(g) do { if ((g)->oom) return RAG_ENOMEM; } while (0)
+
+static int rag_oom(rag_graph *g) {
+    g->oom = 1;
+    return RAG_ENOMEM;
+}
+
+/* return the int 'expr', or RAG_ENOMEM if it runs out of memory */
+#define RAG_RETURN(g, expr) do {                                \
+        int ret_ = 0;                                           \
+        OOM_GUARD(return rag_oom(g), ret_ = (expr));            \
+        return ret_;                                            \
+    } while (0)
+
+static int rag_name_ok(const char *name) {
+    return name != NULL && name[0] != '\0' && strlen(name) < NAMELEN;
+}
+
+rag_graph *rag_create(void) {
+    struct rag_graph *g = calloc(1, sizeof(*g));
+    struct rag_metrics *met = calloc(1, sizeof(*met));
+    if (g == NULL || met == NULL) {
+        free(g);
+        free(met);
+        return NULL;
+    }
+    for (int i = 0; i < MET_COUNT; ++i) atomic_init(&met->c[i], 0);
+    met->tsc0 = met_ticks();
+    met->ms0 = now_ms();
+    g->met = met;
+    g->topo_valid = 1;
+    return g;
+}
+
+void rag_destroy(rag_graph *g) {
+    if (g == NULL) return;
+    graph_free(g);
+    free(g);
+}
+
+void rag_clear(rag_graph *g) {
+    if (g->oom) {
+        /* the failed call may have left these half updated too */
+        history_free(g->hist);
+        lockdep_free(g->lockdep);
+        g->hist = NULL;
+        g->lockdep = NULL;
+        g->on_inversion = NULL;
+        g->on_inversion_arg = NULL;
+    }
+    graph_reset(g);
+    g->last_engine = RAG_ENGINE_AUTO;
+}
+
+int rag_error(const rag_graph *g) { return g->oom ? RAG_ENOMEM : 0; }
+
+double rag_now_ms(void) { return now_ms(); }
+
+int rag_process(rag_graph *g, const char *name) {
+    RAG_LIVE(g);
+    if (!rag_name_ok(name)) return RAG_EINVAL;
+    int p = find_process(g, name);
+    if (p >= 0) return p;
+    RAG_RETURN(g, graph_add_process(g, name));
+}
+
+int rag_resource(rag_graph *g, const char *name) {
+    RAG_LIVE(g);
+    if (!rag_name_ok(name)) return RAG_EINVAL;
+    int r = find_resource(g, name);
+    if (r >= 0) return r;
+    RAG_RETURN(g, graph_add_resource(g, name));
+}
+
+int rag_find_process(const rag_graph *g, const char *name) {
+    return !g->oom && rag_name_ok(name) ? find_process(g, name) : -1;
+}
+
+int rag_find_resource(const rag_graph *g, const char *name) {
+    return !g->oom && rag_name_ok(name) ? find_resource(g, name) : -1;
+}
+
+int rag_process_count(const rag_graph *g) { return g->oom ? 0 : g->n_proc; }
+int rag_resource_count(const rag_graph *g) { return g->oom ? 0 : g->n_res; }
+
+const char *rag_process_name(const rag_graph *g, int p) {
+    return !g->oom && RAG_HAS_P(g, p) ? pname(g, p) : NULL;
+}
+
+const char *rag_resource_name(const rag_graph *g, int r) {
+    return !g->oom && RAG_HAS_R(g, r) ? rname(g, r) : NULL;
+}
+
+/* The edge list l of a node, or none (*v = NULL) */
+static int rag_list(const edge_list *l, const int **v) {
+    *v = l != NULL ? l->v : NULL;
+    return l != NULL ? l->n : 0;
+}
+
+static int rag_counted(const count_list *l, const int **v, const int **cnt) {
+    *v = l != NULL ? l->v : NULL;
+    *cnt = l != NULL ? l->cnt : NULL;
+    return l != NULL ? l->n : 0;
+}
+
+int rag_units(const rag_graph *g, int r) {
+    return !g->oom && RAG_HAS_R(g, r) ? g->units[r] : RAG_EINVAL;
+}
+
+int rag_in_use(const rag_graph *g, int r) {
+    return !g->oom && RAG_HAS_R(g, r) ? g->in_use[r] : RAG_EINVAL;
+}
+
+int rag_priority(const rag_graph *g, int p) {
+    return !g->oom && RAG_HAS_P(g, p) ? g->prio[p] : RAG_EINVAL;
+}
+
+int rag_requested(const rag_graph *g, int p, int r) {
+    return !g->oom && RAG_HAS_P(g, p) && RAG_HAS_R(g, r) ? count_of(&g->req[p], r) : RAG_EINVAL;
+}
+
+int rag_held(const rag_graph *g, int p, int r) {
+    return !g->oom && RAG_HAS_P(g, p) && RAG_HAS_R(g, r) ? count_of(&g->held[p], r) : RAG_EINVAL;
+}
+
+int rag_requests(const rag_graph *g, int p, const int **res, const int **units) {
+    return rag_counted(!g->oom && RAG_HAS_P(g, p) ? &g->req[p] : NULL, res, units);
+}
+
+int rag_holdings(const rag_graph *g, int p, const int **res, const int **units) {
+    return rag_counted(!g->oom && RAG_HAS_P(g, p) ? &g->held[p] : NULL, res, units);
+}
+
+int rag_holders(const rag_graph *g, int r, const int **procs) {
+    return rag_list(!g->oom && RAG_HAS_R(g, r) ? &g->alloc_[r] : NULL, procs);
+}
+
+int rag_waiters(const rag_graph *g, int r, const int **procs) {
+    return rag_list(!g->oom && RAG_HAS_R(g, r) ? &g->waiters[r] : NULL, procs);
+}
+
+int rag_wait_edges(const rag_graph *g, int p, const int **procs) {
+    const int *cnt;
+    return rag_counted(!g->oom && RAG_HAS_P(g, p) ? &g->wfg[p] : NULL, procs, &cnt);
+}
+
+int rag_blocker(const rag_graph *g, int p, int q) {
+    return !g->oom && RAG_HAS_P(g, p) && RAG_HAS_P(g, q) ? find_blocking_resource(g, p, q) : -1;
+}
+
+void rag_counts(const rag_graph *g, struct rag_counts *c) {
+    memset(c, 0, sizeof(*c));
+    if (g->oom) return;
+    c->processes = g->n_proc;
+    c->resources = g->n_res;
+    c->requests = g->req_edges;
+    c->allocations = g->alloc_edges;
+    c->wait_edges = g->wait_edges;
+    c->pools = g->multi_res;
+    c->changes = g->epoch;
+}
+
+int rag_set_units(rag_graph *g, int r, int units) {
+    RAG_LIVE(g);
+    if (!RAG_HAS_R(g, r) || units < 1 || units < g->in_use[r]) return RAG_EINVAL;
+    if (units == g->units[r]) return 0;
+    RAG_RETURN(g, graph_set_units(g, r, units));
+}
+
+int rag_request(rag_graph *g, int p, int r, int units) {
+    RAG_LIVE(g);
+    if (!RAG_HAS_P(g, p) || !RAG_HAS_R(g, r) || units < 1 || units > g->units[r]) return RAG_EINVAL;
+    RAG_RETURN(g, g->avoid && avoid_request_unsafe(g, p, r) ? RAG_EUNSAFE
+                                                          : graph_add_request_units(g, p, r, units));
+}
+
+int rag_cancel(rag_graph *g, int p, int r) {
+    RAG_LIVE(g);
+    if (!RAG_HAS_P(g, p) || !RAG_HAS_R(g, r)) return RAG_EINVAL;
+    RAG_RETURN(g, graph_remove_request(g, p, r));
+}
+
+int rag_grant(rag_graph *g, int r, int p, int units) {
+    RAG_LIVE(g);
+    if (!RAG_HAS_P(g, p) || !RAG_HAS_R(g, r) || units < 1 || g->in_use[r] + units > g->units[r])
+        return RAG_EINVAL;
+    RAG_RETURN(g, g->avoid && avoid_grant_unsafe(g, r, p) ? RAG_EUNSAFE
+                                                        : graph_add_allocation_units(g, r, p, units));
+}
+
+int rag_release(rag_graph *g, int r, int p, int units) {
+    RAG_LIVE(g);
+    if (!RAG_HAS_P(g, p) || !RAG_HAS_R(g, r)) return RAG_EINVAL;
+    RAG_RETURN(g, units <= 0 ? graph_remove_allocation(g, r, p) : graph_release_units(g, r, p, units));
+}
+
+int rag_set_priority(rag_graph *g, int p, int prio) {
+    RAG_LIVE(g);
+    if (!RAG_HAS_P(g, p) || prio < 0) return RAG_EINVAL;
+    if (g->prio[p] == prio) return 0;
+    g->prio[p] = prio;
+    return 1;
+}
+
+int rag_assign(rag_graph *g, int r, int p) {
+    RAG_LIVE(g);
+    if (!RAG_HAS_P(g, p) || !RAG_HAS_R(g, r) || g->units[r] != 1) return RAG_EINVAL;
+    if (g->alloc_[r].n == 1 && g->alloc_[r].v[0] == p) return 0;
+    RAG_RETURN(g, g->avoid && avoid_grant_unsafe(g, r, p) ? RAG_EUNSAFE : (graph_assign(g, r, p), 1));
+}
+
+int rag_check_request(rag_graph *g, int p, int r) {
+    RAG_LIVE(g);
+    if (!RAG_HAS_P(g, p) || !RAG_HAS_R(g, r)) return RAG_EINVAL;
+    if (!g->avoid) return 0;
+    RAG_RETURN(g, avoid_request_unsafe(g, p, r));
+}
+
+int rag_check_grant(rag_graph *g, int r, int p) {
+    RAG_LIVE(g);
+    if (!RAG_HAS_P(g, p) || !RAG_HAS_R(g, r)) return RAG_EINVAL;
+    if (!g->avoid) return 0;
+    RAG_RETURN(g, avoid_grant_unsafe(g, r, p));
+}
+
+/* rag_apply without the checks the monitor does not need (shared with
+   the monitor's drain) */
+static int event_apply(struct rag_graph *g, int kind, int p, int r, int k) {
+    if (!RAG_HAS_P(g, p) || !RAG_HAS_R(g, r)) return RAG_EINVAL;
+    switch (kind) {
+        case RAG_EV_REQUEST:
+            return graph_add_request_units(g, p, r, k);
+        case RAG_EV_ACQUIRE:
+            if (k <= 0 || k > g->units[r]) break;
+            if (g->in_use[r] + k > g->units[r]) return RAG_EBUSY;
+            graph_remove_request(g, p, r);
+            return graph_add_allocation_units(g, r, p, k);
+        case RAG_EV_RELEASE:
+            if (k <= 0 ? graph_remove_allocation(g, r, p) : graph_release_units(g, r, p, k)) return 1;
+            break;
+        case RAG_EV_CANCEL:
+            if (graph_remove_request(g, p, r)) return 1;
+            break;
+    }
+    return RAG_EINVAL;
+}
+
+int rag_apply(rag_graph *g, int kind, int p, int r, int units) {
+    RAG_LIVE(g);
+    int rc = 0;
+    OOM_GUARD(return rag_oom(g), rc = event_apply(g, kind, p, r, units));
+    met_add(g, MET_INGEST_EVENTS, 1);
+    if (rc < 0) met_add(g, MET_INGEST_REJECTED, 1);
+    return rc;
+}
+
+int rag_set_engine(rag_graph *g, int engine) {
+    RAG_LIVE(g);
+    if (engine < 0 || engine >= RAG_ENGINES) return RAG_EINVAL;
+    g->engine = engine;
+    return 1;
+}
+
+int rag_set_threads(rag_graph *g, int threads) {
+    RAG_LIVE(g);
+    if (threads < 0) return RAG_EINVAL;
+    g->threads = threads;
+    return 1;
+}
+
+int rag_set_shards(rag_graph *g, int shards) {
+    RAG_LIVE(g);
+    if (shards < 0) return RAG_EINVAL;
+    g->shards = shards;
+    return 1;
+}
+
+int rag_set_online(rag_graph *g, int on, rag_cycle_fn fn, void *arg) {
+    RAG_LIVE(g);
+    g->on_cycle = on ? fn : NULL;
+    g->on_cycle_arg = on ? arg : NULL;
+    RAG_RETURN(g, set_online_detection(g, on != 0));
+}
+
+int rag_set_avoidance(rag_graph *g, int on) {
+    RAG_LIVE(g);
+    RAG_RETURN(g, set_avoidance(g, on != 0));
+}
+
+int rag_set_incremental(rag_graph *g, int on) {
+    RAG_LIVE(g);
+    g->scc_full = !on;
+    return 1;
+}
+
+void rag_settings(const rag_graph *g, struct rag_settings *s) {
+    s->engine = g->engine;
+    s->threads = g->threads;
+    s->shards = g->shards;
+    s->incremental = !g->scc_full;
+    s->online = g->online;
+    s->avoidance = g->avoid;
+    s->lockdep = g->lockdep != NULL;
+    s->history = g->hist != NULL;
+}
+
+int rag_thread_count(const rag_graph *g) { return par_thread_count(g); }
+
+int rag_renumber(rag_graph *g) {
+    RAG_LIVE(g);
+    if (g->n_proc + g->n_res == 0) return 0;
+    OOM_GUARD(return rag_oom(g), graph_renumber(g));
+    return 1;
+}
+
+double rag_edge_span(const rag_graph *g) { return g->oom ? 0 : graph_edge_span(g); }
+
+int rag_rebuild(rag_graph *g) {
+    RAG_LIVE(g);
+    OOM_GUARD(return rag_oom(g), build_wfg(g));
+    return g->wait_edges;
+}
+
+static int rag_detect_run(rag_graph *g) {
+    int engine = pick_engine(g);
+    if (engine == RAG_ENGINE_DFS || engine == RAG_ENGINE_DENSE) g->cycle_at = -1; /* the stack is reused */
+    g->last_found = detect_run(g, engine);
+    g->last_engine = engine;
+    g->last_n = g->n_proc;
+    g->last_nr = g->n_res;
+    return g->last_found;
+}
+
+int rag_detect(rag_graph *g) {
+    RAG_LIVE(g);
+    RAG_RETURN(g, rag_detect_run(g));
+}
+
+int rag_pick_engine(const rag_graph *g) { return g->oom ? RAG_ENGINE_AUTO : pick_engine(g); }
+int rag_last_engine(const rag_graph *g) { return g->oom ? RAG_ENGINE_AUTO : g->last_engine; }
+
+/* Engines whose result is the SCC layout (scc_members/scc_start) */
+static int rag_last_scc(const rag_graph *g) {
+    if (g->oom) return 0;
+    switch (g->last_engine) {
+        case RAG_ENGINE_SCC: case RAG_ENGINE_PARALLEL: case RAG_ENGINE_SHARDED: case RAG_ENGINE_SMALL:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+int rag_set_count(const rag_graph *g) {
+    return rag_last_scc(g) ? g->scc_count : 0;
+}
+
+const int *rag_set_members(const rag_graph *g, int set, int *n) {
+    if (!rag_last_scc(g) || set < 0 || set >= g->scc_count) {
+        *n = 0;
+        return NULL;
+    }
+    *n = g->scc_start.v[set + 1] - g->scc_start.v[set];
+    return g->scc_members.v + g->scc_start.v[set];
+}
+
+int rag_deadlocked(const rag_graph *g, int p) {
+    if (g->oom || !RAG_HAS_P(g, p) || p >= g->last_n || g->last_found <= 0) return -1;
+    if (rag_last_scc(g)) return g->scc_comp[p];
+    if (g->last_engine == RAG_ENGINE_BANKER) return g->bk_done[p] ? -1 : 0;
+    int n;
+    const int *cyc = rag_cycle(g, &n);
+    for (int i = 0; i < n; ++i)
+        if (cyc[i] == p) return 0;
+    return -1;
+}
+
+const int *rag_cycle(const rag_graph *g, int *n) {
+    for (int i = 0; !g->oom && g->stack_nodes != NULL && i <= g->stack_top; ++i) {
+        if (g->stack_nodes[i] == g->cycle_at) {
+            *n = g->stack_top - i + 1;
+            return g->stack_nodes + i;
+        }
+    }
+    *n = 0;
+    return NULL;
+}
+
+int rag_available(const rag_graph *g, int r) {
+    if (g->oom || g->last_engine != RAG_ENGINE_BANKER || !RAG_HAS_R(g, r) || r >= g->last_nr) return RAG_EINVAL;
+    return g->bk_work[r];
+}
+
+const struct rag_shard_stats *rag_shard_stats(const rag_graph *g) {
+    return g->oom ? NULL : shard_last_stats(g);
+}
+
+int rag_resolve(rag_graph *g, const struct rag_cost *cost, rag_victim_fn fn, void *arg) {
+    RAG_LIVE(g);
+    if (cost != NULL && !(cost->held >= 0 && cost->prio >= 0 && cost->age >= 0)) return RAG_EINVAL;
+    RAG_RETURN(g, resolve_deadlocks(g, cost != NULL ? cost : &victim_default, fn, arg, NULL));
+}
+
+static const char rag_nomem_msg[] = "out of memory";
+
+const char *rag_save(const rag_graph *g, const char *path) {
+    if (g->oom) return rag_nomem_msg;
+    const char *err = NULL;
+    OOM_GUARD(return rag_nomem_msg, err = snapshot_save(g, path));   /* g is only read */
+    return err;
+}
+
+const char *rag_load(rag_graph *g, const char *path) {
+    if (g->oom) return rag_nomem_msg;
+    const char *err = NULL;
+    OOM_GUARD(g->oom = 1; return rag_nomem_msg, err = snapshot_load(g, path));
+    if (err == NULL) g->last_engine = RAG_ENGINE_AUTO;
+    return err;
+}
+
+int rag_set_history(rag_graph *g, int on) {
+    RAG_LIVE(g);
+    OOM_GUARD(return rag_oom(g), history_enable(g, on != 0));
+    return 1;
+}
+
+int rag_history_commit(rag_graph *g, double ts, long long tag) {
+    RAG_LIVE(g);
+    if (g->hist == NULL) return RAG_EINVAL;
+    RAG_RETURN(g, history_commit(g, ts, tag));
+}
+
+int rag_history_count(const rag_graph *g) { return g->oom ? 0 : history_count(g); }
+int rag_history_at(const rag_graph *g, double ts) { return g->oom ? -1 : history_at(g, ts); }
+
+int rag_history_version(const rag_graph *g, int version, double *ts, long long *tag) {
+    return g->oom ? 0 : history_version(g, version, ts, tag);
+}
+
+size_t rag_history_bytes(const rag_graph *g) { return g->oom ? 0 : history_bytes(g); }
+
+int rag_history_checkout(const rag_graph *g, int version, rag_graph *out) {
+    if (g->oom || out->oom) return RAG_ENOMEM;
+    RAG_RETURN(out, history_checkout(g, version, out) ? 1 : RAG_EINVAL);
+}
+
+int rag_history_bisect(const rag_graph *g, const char *proc, rag_graph *scratch) {
+    if (scratch == g) return RAG_EINVAL;
+    if (g->oom || scratch->oom) return RAG_ENOMEM;
+    RAG_RETURN(scratch, history_bisect(g, 0, history_count(g) - 1, proc, scratch));
+}
+
+int rag_set_lockdep(rag_graph *g, int on, rag_inversion_fn fn, void *arg) {
+    RAG_LIVE(g);
+    g->on_inversion = on ? fn : NULL;
+    g->on_inversion_arg = on ? arg : NULL;
+    OOM_GUARD(return rag_oom(g), lockdep_enable(g, on != 0));
+    return 1;
+}
+
+int rag_lockdep_inversions(const rag_graph *g) {
+    const struct rag_lockdep_stats *st = g->oom ? NULL : lockdep_stats(g);
+    return st ? (int)st->inversions : 0;
+}
+
+const int *rag_lockdep_path(const rag_graph *g, int *n) {
+    if (g->oom) {
+        *n = 0;
+        return NULL;
+    }
+    return lockdep_path(g, n);
+}
+
+int rag_lockdep_witness(const rag_graph *g, int a, int b) {
+    return g->oom ? -1 : lockdep_witness(g, a, b);
+}
+
+const struct rag_lockdep_stats *rag_lockdep_stats(const rag_graph *g) {
+    return g->oom ? NULL : lockdep_stats(g);
+}
+
+/* ---- Metrics export (rag.h) ---- */
+/* Ticks per second: the TSC rate is measured against the monotonic
+   clock since rag_create, refined on every export. Nothing waits for the
+   interval to grow: right after rag_create the rate is rough, but then so
+   little has been timed that it hardly matters. */
+static double met_tick_rate(const struct rag_graph *g) {
+#ifdef MET_TICKS_TSC
+    uint64_t ticks = met_ticks() - g->met->tsc0;
+    double ms = now_ms() - g->met->ms0;
+    return ms > 0 && ticks > 0 ? (double)ticks / (ms / 1e3) : 1e9;
+#else
+    return 1e9;
+#endif
+}
+
+/* Prometheus text exposition format */
+void rag_metrics_prometheus(FILE *f, const rag_graph *g) {
+    uint64_t v[MET_COUNT];
+    met_snapshot(g, v);
+    double rate = met_tick_rate(g);
+    for (int i = 0; i < MET_COUNT; ++i) {
+        const struct metric_def *d = &metric_defs[i];
+        fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", d->name, d->help, d->name,
+                d->kind == MK_COUNTER || d->kind == MK_SECONDS ? "counter" : "gauge");
+        if (d->kind == MK_SECONDS) fprintf(f, "%s %.9f\n", d->name, v[i] / rate);
+        else fprintf(f, "%s %llu\n", d->name, (unsigned long long)v[i]);
+    }
+    struct rag_counts c;
+    rag_counts(g, &c);
+    fprintf(f, "# HELP rag_processes Processes in the graph\n# TYPE rag_processes gauge\n"
+               "rag_processes %d\n", c.processes);
+    fprintf(f, "# HELP rag_resources Resources in the graph\n# TYPE rag_resources gauge\n"
+               "rag_resources %d\n", c.resources);
+    fprintf(f, "# HELP rag_wait_edges Wait-for edges in the graph\n# TYPE rag_wait_edges gauge\n"
+               "rag_wait_edges %d\n", c.wait_edges);
+}
+
+/* One JSON object on one line. ingest_rate is events per second since the
+   previous JSON export (since the first event for the first one). */
+void rag_metrics_json(FILE *f, const rag_graph *g) {
+    struct rag_metrics *met = g->met;
+    uint64_t v[MET_COUNT];
+    met_snapshot(g, v);
+    double rate = met_tick_rate(g), now = now_ms();
+    double dt = met->json_ms > 0 ? (now - met->json_ms) / 1e3 : 0;
+    fprintf(f, "{\"t_ms\":%.3f", now);
+    for (int i = 0; i < MET_COUNT; ++i) {
+        const struct metric_def *d = &metric_defs[i];
+        const char *key = d->name + 4;  /* drop "rag_" */
+        if (d->kind == MK_SECONDS) fprintf(f, ",\"%s\":%.9f", key, v[i] / rate);
+        else fprintf(f, ",\"%s\":%llu", key, (unsigned long long)v[i]);
+    }
+    fprintf(f, ",\"ingest_rate\":%.1f", dt > 0 ? (v[MET_INGEST_EVENTS] - met->json_events) / dt : 0.0);
+    struct rag_counts c;
+    rag_counts(g, &c);
+    fprintf(f, ",\"processes\":%d,\"resources\":%d,\"wait_edges\":%d", c.processes, c.resources, c.wait_edges);
+    fprintf(f, "}\n");
+    fflush(f);
+    met->json_ms = now;
+    met->json_events = v[MET_INGEST_EVENTS];
+}
+
+unsigned long long rag_metric(const rag_graph *g, const char *name) {
+    for (int i = 0; i < MET_COUNT; ++i) {
+        if (strcmp(name, metric_defs[i].name) != 0) continue;
+        uint64_t v = atomic_load_explicit(&g->met->c[i], memory_order_relaxed);
+        return metric_defs[i].kind == MK_SECONDS ? (unsigned long long)(v / met_tick_rate(g) * 1e9) : v;
+    }
+    return 0;
+}
+
+/* ---- Live monitor: concurrent event ingestion ----
+   rag_monitor_start puts a detector thread on a graph and returns its
+   handle; instrumented application threads report lock traffic through
+   it with rag_monitor_request/acquire/release/cancel. Each posting thread
+   owns one single-producer ring per monitor (registered lazily, then
+   found through the monitor's own thread-specific key), so posting is a
+   key lookup, one store and one release store - no lock, no shared cache
+   line. The
+   detector drains the rings in batches, applies the events to the graph
+   under m->lock and checks its detection triggers after every round.
+
+   Rings are drained in order, so each thread's own events are applied in
+   the order it posted them. Across threads there is no order: an acquire
+   can reach the detector before the release that made it possible. Such
+   an acquire leaves its ring parked at that event until enough units are
+   free, which is exactly what the real lock did to the calling thread.
+
+   Detection runs every period_ms, or once 'mutations' graph changes have
+   piled up, whichever comes first. Every mutator bumps g->epoch; while it
+   still equals the epoch the last run saw, a round costs one comparison,
+   so an idle system never re-runs an engine.
+
+   Only the slow paths (registering names, start/stop) take the mutex;
+   producers must stop posting before rag_monitor_stop. A thread's key
+   value is only followed while the monitor runs, so the rings freed by
+   rag_monitor_stop are never reached: later posts are counted as rejected
+   and dropped. The handle, and its key, stay valid until
+   rag_monitor_free. fn is called after the round drops the mutex, so it
+   may register names itself. The detector runs under an out-of-memory guard of its own; once it trips,
+   the graph is marked and every later event is rejected.
+*/
+#define MON_RING_SIZE 4096      /* events per producer ring, power of two */
+#define MON_BATCH     256       /* events taken from one ring per round */
+#define MON_IDLE_MAX_US 1000    /* detector back-off ceiling when idle */
+
+struct mon_event {
+    int kind;   /* enum rag_event */
+    int p, r, k;
+};
+
+struct mon_ring {
+    _Alignas(64) atomic_size_t tail;    /* written by the producer */
+    size_t head_cache;                  /* producer's last view of head */
+    _Alignas(64) atomic_size_t head;    /* written by the detector */
+    struct mon_ring *next;
+    pthread_t owner;                    /* the posting thread */
+    struct mon_event ev[MON_RING_SIZE];
+};
+
+struct rag_monitor {
+    struct rag_graph *g;
+    pthread_mutex_t lock;       /* guards g */
+    pthread_t thread;
+    _Atomic(struct mon_ring *) rings;   /* push-only list */
+    atomic_int running;
+    pthread_key_t key;          /* each posting thread's ring */
+    int period_ms;              /* 0: no time trigger */
+    int mutations;              /* 0: no count trigger */
+    rag_deadlock_fn fn;
+    void *arg;
+    int ran;                    /* detector thread only: a run happened */
+    unsigned long epoch;        /* ... g->epoch at the last run */
+    double last_ms;             /* ... and its time */
+    atomic_int found;           /* result of the last detection */
+    int notify;                 /* detector thread only: a result fn has yet to hear */
+    atomic_ulong rounds;        /* completed drain rounds */
+    atomic_ullong applied;
+    atomic_ullong rejected;     /* release/cancel with nothing to undo, oversized acquire */
+    atomic_ullong stalls;       /* producer found its ring full */
+};
+
+/* The calling thread's ring on m, or NULL once m is stopped (or if a new
+   ring cannot be allocated) */
+static struct mon_ring *mon_my_ring(struct rag_monitor *m) {
+    if (!atomic_load_explicit(&m->running, memory_order_relaxed)) return NULL;
+    struct mon_ring *q = pthread_getspecific(m->key);
+    if (q != NULL) return q;
+    /* the first post from this thread: a new ring, or one left by an
+       exited thread that had the same id */
+    pthread_t self = pthread_self();
+    q = atomic_load(&m->rings);
+    while (q != NULL && !pthread_equal(q->owner, self)) q = q->next;
+    if (q == NULL) {
+        q = aligned_alloc(64, sizeof(*q));
+        if (q == NULL) return NULL;
+        atomic_init(&q->tail, 0);
+        atomic_init(&q->head, 0);
+        q->head_cache = 0;
+        q->owner = self;
+        q->next = atomic_load(&m->rings);
+        while (!atomic_compare_exchange_weak(&m->rings, &q->next, q)) { /* retry */ }
+    }
+    pthread_setspecific(m->key, q); /* on failure the next post looks again */
+    return q;
+}
+
+static void mon_post(struct rag_monitor *m, int kind, int p, int r, int k) {
+    struct mon_ring *q = mon_my_ring(m);
+    if (q == NULL) {
+        atomic_fetch_add_explicit(&m->rejected, 1, memory_order_relaxed);
+        return;
+    }
+    size_t t = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    if (t - q->head_cache == MON_RING_SIZE) {
+        q->head_cache = atomic_load_explicit(&q->head, memory_order_acquire);
+        while (t - q->head_cache == MON_RING_SIZE) {
+            atomic_fetch_add_explicit(&m->stalls, 1, memory_order_relaxed);
+            sched_yield();
+            q->head_cache = atomic_load_explicit(&q->head, memory_order_acquire);
+        }
+    }
+    struct mon_event *e = &q->ev[t & (MON_RING_SIZE - 1)];
+    e->kind = kind;
+    e->p = p;
+    e->r = r;
+    e->k = k;
+    atomic_store_explicit(&q->tail, t + 1, memory_order_release);
+}
+
+void rag_monitor_request(rag_monitor *m, int p, int r, int units) { mon_post(m, RAG_EV_REQUEST, p, r, units); }
+void rag_monitor_acquire(rag_monitor *m, int r, int p, int units) { mon_post(m, RAG_EV_ACQUIRE, p, r, units); }
+void rag_monitor_release(rag_monitor *m, int r, int p, int units) { mon_post(m, RAG_EV_RELEASE, p, r, units); }
+void rag_monitor_cancel(rag_monitor *m, int p, int r) { mon_post(m, RAG_EV_CANCEL, p, r, 0); }
+
+int rag_monitor_process(rag_monitor *m, const char *name) {
+    pthread_mutex_lock(&m->lock);
+    int p = rag_process(m->g, name);
+    pthread_mutex_unlock(&m->lock);
+    return p;
+}
+
+int rag_monitor_resource(rag_monitor *m, const char *name, int units) {
+    if (units < 1) return RAG_EINVAL;
+    pthread_mutex_lock(&m->lock);
+    int r = rag_resource(m->g, name);
+    if (r >= 0 && units != m->g->units[r]) {
+        int rc = rag_set_units(m->g, r, units);
+        if (rc < 0) r = rc;
+    }
+    pthread_mutex_unlock(&m->lock);
+    return r;
+}
+
+/* event_apply for a ring: 1 changed, 0 nothing to do, -1 park the ring */
+static int mon_apply(struct rag_monitor *m, const struct mon_event *e) {
+    int rc = m->g->oom ? RAG_EINVAL : event_apply(m->g, e->kind, e->p, e->r, e->k);
+    if (rc == RAG_EBUSY) return -1;
+    if (rc >= 0) return rc;
+    atomic_fetch_add_explicit(&m->rejected, 1, memory_order_relaxed);
+    met_add(m->g, MET_INGEST_REJECTED, 1);
+    return 0;
+}
+
+/* Drain one round over every ring. Returns the number of events consumed. */
+static long mon_drain(struct rag_monitor *m) {
+    uint64_t t0 = met_ticks();
+    long used = 0;
+    size_t depth = 0;
+    for (struct mon_ring *q = atomic_load(&m->rings); q != NULL; q = q->next) {
+        size_t h = atomic_load_explicit(&q->head, memory_order_relaxed);
+        size_t t = atomic_load_explicit(&q->tail, memory_order_acquire);
+        depth += t - h;
+        size_t stop = t - h > MON_BATCH ? h + MON_BATCH : t;
+        for (; h < stop; ++h) {
+            if (mon_apply(m, &q->ev[h & (MON_RING_SIZE - 1)]) < 0) break; /* parked until another ring releases */
+            used++;
+        }
+        atomic_store_explicit(&q->head, h, memory_order_release);
+    }
+    atomic_fetch_add_explicit(&m->applied, (unsigned long long)used, memory_order_relaxed);
+    met_set(m->g, MET_QUEUE_DEPTH, depth);
+    met_max(m->g, MET_QUEUE_MAX, depth);
+    if (used > 0) {
+        met_add(m->g, MET_INGEST_EVENTS, (uint64_t)used);
+        met_add(m->g, MET_INGEST_BATCHES, 1);
+        met_time(m->g, MET_INGEST_TICKS, t0);
+    }
+    return used;
+}
+
+/* Run detection if a trigger is due and the graph changed since the last
+   run; fn hears of a result that differs from the previous one */
+static void mon_tick(struct rag_monitor *m) {
+    struct rag_graph *g = m->g;
+    if (g->oom) return;
+    double now = now_ms();
+    int timed = m->period_ms > 0 && now - m->last_ms >= m->period_ms;
+    if (m->ran && g->epoch == m->epoch) {
+        if (timed) m->last_ms = now;
+        return;
+    }
+    int counted = m->mutations > 0 && g->epoch - m->epoch >= (unsigned long)m->mutations;
+    if (!timed && !counted && m->ran) return;
+    m->ran = 1;
+    m->epoch = g->epoch;
+    m->last_ms = now;
+    int prev = atomic_load(&m->found), found = 0;
+    /* runs with online detection on too: that only reports the edge that
+       closes a cycle, not whether one is still there */
+    if (g->n_proc > 0) found = rag_detect_run(g);
+    atomic_store(&m->found, found);
+    if (found && found != prev && m->fn != NULL) m->notify = found;
+}
+
+/* One drain and trigger check. Running out of memory marks the graph;
+   the round then counts as busy, so the next one rejects the rest. */
+static long mon_round(struct rag_monitor *m) {
+    long used = 0;
+    OOM_GUARD(m->g->oom = 1; return 1, used = mon_drain(m); mon_tick(m));
+    return used;
+}
+
+static void *mon_main(void *arg) {
+    struct rag_monitor *m = arg;
+    int idle_us = 1;
+    for (;;) {
+        int running = atomic_load(&m->running);
+        pthread_mutex_lock(&m->lock);
+        long used = mon_round(m);
+        pthread_mutex_unlock(&m->lock);
+        /* outside the lock, so fn may call back into the monitor */
+        if (m->notify) {
+            int found = m->notify;
+            m->notify = 0;
+            m->fn(m->g, found, m->arg);
+        }
+        atomic_fetch_add(&m->rounds, 1);
+        if (used > 0) { idle_us = 1; continue; }
+        if (!running) break; /* stopped and nothing left that can be applied */
+        struct timespec ts = { 0, idle_us * 1000L };
+        nanosleep(&ts, NULL);
+        if (idle_us < MON_IDLE_MAX_US) idle_us *= 2;
+    }
+    return NULL;
+}
+
+rag_monitor *rag_monitor_start(rag_graph *g, int period_ms, int mutations, rag_deadlock_fn fn, void *arg) {
+    if (g->oom || period_ms < 0 || mutations < 0) return NULL;
+    struct rag_monitor *m = calloc(1, sizeof(*m));
+    if (m == NULL) return NULL;
+    if (pthread_key_create(&m->key, NULL) != 0) {
+        free(m);
+        return NULL;
+    }
+    pthread_mutex_init(&m->lock, NULL);
+    m->g = g;
+    m->period_ms = period_ms;
+    m->mutations = mutations;
+    m->fn = fn;
+    m->arg = arg;
+    atomic_store(&m->running, 1);
+    if (pthread_create(&m->thread, NULL, mon_main, m) != 0) {
+        pthread_key_delete(m->key);
+        pthread_mutex_destroy(&m->lock);
+        free(m);
+        return NULL;
+    }
+    return m;
+}
+
+void rag_monitor_flush(rag_monitor *m) {
+    while (atomic_load(&m->running)) {
+        unsigned long long before = atomic_load(&m->applied);
+        unsigned long r = atomic_load(&m->rounds);
+        int pending = 0;
+        for (struct mon_ring *q = atomic_load(&m->rings); q != NULL && !pending; q = q->next) {
+            pending = atomic_load_explicit(&q->head, memory_order_acquire) !=
+                      atomic_load_explicit(&q->tail, memory_order_acquire);
+        }
+        if (!pending) return;
+        /* two rounds: at least one full drain started after the check */
+        while (atomic_load(&m->rounds) < r + 2 && atomic_load(&m->running)) sched_yield();
+        if (atomic_load(&m->applied) == before) return; /* the rest is parked */
+    }
+}
+
+/* Events still parked after the final drain are discarded, and so is
+   anything posted later */
+void rag_monitor_stop(rag_monitor *m) {
+    if (!atomic_load(&m->running)) return;
+    atomic_store(&m->running, 0);
+    pthread_join(m->thread, NULL);
+    struct mon_ring *q = atomic_exchange(&m->rings, NULL);
+    while (q != NULL) {
+        struct mon_ring *next = q->next;
+        free(q);
+        q = next;
+    }
+}
+
+void rag_monitor_free(rag_monitor *m) {
+    if (m == NULL) return;
+    rag_monitor_stop(m);
+    pthread_key_delete(m->key);
+    pthread_mutex_destroy(&m->lock);
+    free(m);
+}
+
+int rag_monitor_deadlocks(const rag_monitor *m) { return atomic_load(&m->found); }
+
+void rag_monitor_stats(const rag_monitor *m, struct rag_monitor_stats *st) {
+    st->applied = atomic_load(&m->applied);
+    st->rejected = atomic_load(&m->rejected);
+    st->stalls = atomic_load(&m->stalls);
+}
@@ -0,0 +1,308 @@
+/*
+ * rag.h - embeddable deadlock detection library
+ *
+ * The Resource Allocation Graph, its detection engines, avoidance and
+ * deadlock resolution, without the interactive front end. Everything hangs
+ * off an opaque graph handle: no global state is shared between graphs,
+ * and the library never reads stdin, writes anywhere but to a FILE it is
+ * handed, or exits (running out of memory is an error code, RAG_ENOMEM).
+ * Calls on one graph must not overlap; different graphs can be used from
+ * different threads at the same time.
+ *
+ * Build as a static library and link it into the host:
+ *   gcc -std=c11 -O2 -Wall -Wextra -pthread -c rag.c -o rag.o
+ *   ar rcs librag.a rag.o
+ *   gcc -std=c11 -O2 -pthread host.c librag.a -o host
+ *
+ * Processes and resources are numbered densely from 0 in creation order
+ * and looked up by name. Functions that take an index return RAG_EINVAL
+ * for one that does not exist.
+ */
+#ifndef RAG_H
+#define RAG_H
+
+#include <stdio.h>
+
+typedef struct rag_graph rag_graph;
+
+enum rag_status {
+    RAG_EINVAL = -1,    /* bad index, name or count */
+    RAG_EUNSAFE = -2,   /* refused by avoidance: it would close a wait cycle */
+    RAG_ENOMEM = -3,    /* out of memory (see rag_clear) */
+    RAG_EBUSY = -4,     /* rag_apply: an acquire finds too few free units */
+};
+
+/* Detection engines (rag_set_engine). Auto picks matrix reduction with
+   multi-instance resources, the small-graph kernel up to RAG_SMALL_MAX
+   processes, the dense bitset for small dense graphs (up to RAG_DENSE_MAX
+   processes, at least one wait edge per 64-bit word of a row) and Tarjan
+   otherwise. */
+#define RAG_SMALL_MAX      64
+#define RAG_DENSE_MAX      8192
+#define RAG_SHARDS_DEFAULT 4    /* sharded engine without rag_set_shards */
+
+enum rag_engine {
+    RAG_ENGINE_AUTO, RAG_ENGINE_DFS, RAG_ENGINE_DENSE, RAG_ENGINE_SCC, RAG_ENGINE_BANKER,
+    RAG_ENGINE_PARALLEL, RAG_ENGINE_SHARDED, RAG_ENGINE_SMALL,
+    RAG_ENGINES
+};
+
+/* Victim cost weights for rag_resolve, none negative:
+   cost = held * units held + prio * priority + age * mutations since added */
+struct rag_cost {
+    double held;
+    double prio;
+    double age;
+};
+
+/* rag_resolve: called for each victim p before its allocations are
+   released, and with p = -1 when a round of resolution starts */
+typedef void (*rag_victim_fn)(const rag_graph *g, int p, double cost, void *arg);
+
+/* Online detection: wait edge x -> y has just closed a cycle; rag_cycle
+   returns it */
+typedef void (*rag_cycle_fn)(rag_graph *g, int x, int y, void *arg);
+
+/* Lock-order analysis: process p holds 'held' and is about to wait for or
+   take 'wanted', the reverse of an order seen before; rag_lockdep_path
+   returns that order */
+typedef void (*rag_inversion_fn)(rag_graph *g, int p, int held, int wanted, void *arg);
+
+/* Lifetime. rag_create returns NULL only if out of memory. A call that
+   runs out of memory part way returns RAG_ENOMEM (rag_save and rag_load:
+   "out of memory") and leaves the graph marked: until rag_clear, changes
+   return RAG_ENOMEM and queries see an empty graph. Clearing such a graph
+   also turns history and lock-order analysis off. */
+rag_graph *rag_create(void);
+void rag_destroy(rag_graph *g);
+void rag_clear(rag_graph *g);   /* drop all nodes and edges, keep the settings */
+int rag_error(const rag_graph *g);  /* RAG_ENOMEM while marked, else 0 */
+
+/* Nodes: the index of the node with this name, created if new. Names are
+   non-empty and shorter than RAG_NAME_MAX bytes. */
+#define RAG_NAME_MAX 32
+
+int rag_process(rag_graph *g, const char *name);
+int rag_resource(rag_graph *g, const char *name);
+int rag_find_process(const rag_graph *g, const char *name);    /* -1 if none */
+int rag_find_resource(const rag_graph *g, const char *name);
+int rag_process_count(const rag_graph *g);
+int rag_resource_count(const rag_graph *g);
+const char *rag_process_name(const rag_graph *g, int p);       /* NULL if none */
+const char *rag_resource_name(const rag_graph *g, int r);
+
+/* Structure, read in place. The arrays returned stay valid until the
+   graph next changes and are in no particular order (removing an edge
+   moves the last one into its place); each call returns their length
+   (0 with NULL arrays for an unknown node). */
+int rag_units(const rag_graph *g, int r);               /* pool size */
+int rag_in_use(const rag_graph *g, int r);              /* units held */
+int rag_priority(const rag_graph *g, int p);
+int rag_requested(const rag_graph *g, int p, int r);    /* units p waits for, 0 if none */
+int rag_held(const rag_graph *g, int p, int r);         /* units of r p holds */
+int rag_requests(const rag_graph *g, int p, const int **res, const int **units);
+int rag_holdings(const rag_graph *g, int p, const int **res, const int **units);
+int rag_holders(const rag_graph *g, int r, const int **procs);
+int rag_waiters(const rag_graph *g, int r, const int **procs);
+int rag_wait_edges(const rag_graph *g, int p, const int **procs);   /* the processes p waits for */
+int rag_blocker(const rag_graph *g, int p, int q);      /* a resource p waits for and q holds, or -1 */
+
+struct rag_counts {
+    int processes;
+    int resources;
+    int requests;           /* request edges */
+    int allocations;        /* allocation edges */
+    int wait_edges;         /* distinct P -> P edges of the Wait-For Graph */
+    int pools;              /* resources with more than one unit */
+    unsigned long changes;  /* mutations so far: unchanged, nothing to re-detect */
+};
+void rag_counts(const rag_graph *g, struct rag_counts *c);
+
+/* Edges. Each returns 1 if the graph changed, 0 if there was nothing to
+   do, or a negative rag_status. */
+int rag_set_units(rag_graph *g, int r, int units);          /* pool size, >= units in use */
+int rag_request(rag_graph *g, int p, int r, int units);     /* p waits for units of r */
+int rag_cancel(rag_graph *g, int p, int r);                 /* withdraw p's request */
+int rag_grant(rag_graph *g, int r, int p, int units);       /* p now holds units of r */
+int rag_release(rag_graph *g, int r, int p, int units);     /* units <= 0: all held */
+int rag_set_priority(rag_graph *g, int p, int prio);        /* >= 0, higher: costlier victim */
+/* A single-unit resource changes hands: p becomes its only holder */
+int rag_assign(rag_graph *g, int r, int p);
+/* With avoidance on, 1 if rag_request / rag_grant (rag_assign) would be
+   refused, leaving the cycle it would close on rag_cycle; else 0 */
+int rag_check_request(rag_graph *g, int p, int r);
+int rag_check_grant(rag_graph *g, int r, int p);
+
+/* Lock events, applied as they happened (never refused by avoidance).
+   An acquire also satisfies p's pending request for r; a release of
+   units <= 0 gives up all p holds of r, as rag_release. Returns 1 if the
+   graph changed, 0 for a repeated request, RAG_EBUSY if an acquire finds
+   too few free units, RAG_EINVAL if the event cannot apply (unknown node,
+   nothing to release or cancel, more units than exist). */
+enum rag_event { RAG_EV_REQUEST, RAG_EV_ACQUIRE, RAG_EV_RELEASE, RAG_EV_CANCEL };
+int rag_apply(rag_graph *g, int kind, int p, int r, int units);
+
+/* Lay processes and resources out again in reverse Cuthill-McKee order
+   (neighbours get nearby indices; names, edges and settings are kept, the
+   last detection result is dropped). Returns 1, or 0 for an empty graph.
+   rag_edge_span is the mean index distance of an edge, which it lowers. */
+int rag_renumber(rag_graph *g);
+double rag_edge_span(const rag_graph *g);
+/* Recompute the Wait-For Graph from scratch (it is always kept current;
+   this is for measuring). Returns its edge count. */
+int rag_rebuild(rag_graph *g);
+
+/* Settings */
+int rag_set_engine(rag_graph *g, int engine);
+int rag_set_threads(rag_graph *g, int threads);     /* parallel engine, 0: all CPUs */
+int rag_set_shards(rag_graph *g, int shards);       /* sharded engine, 0: default */
+/* The SCC engine (and the small-graph kernel past its limit) re-searches
+   only what changed since its last run; off, every run is a full pass.
+   On by default. */
+int rag_set_incremental(rag_graph *g, int on);
+/* Online detection checks every new wait edge as it appears and reports
+   a closed cycle to fn (may be NULL). Avoidance makes rag_request and
+   rag_grant refuse what would close a cycle. Both return 0 if switched
+   on while the graph already holds a cycle, 1 otherwise. */
+int rag_set_online(rag_graph *g, int on, rag_cycle_fn fn, void *arg);
+int rag_set_avoidance(rag_graph *g, int on);
+const char *rag_engine_name(int engine);
+
+struct rag_settings {
+    int engine;
+    int threads;
+    int shards;
+    int incremental;
+    int online;
+    int avoidance;
+    int lockdep;
+    int history;
+};
+void rag_settings(const rag_graph *g, struct rag_settings *s);
+int rag_thread_count(const rag_graph *g);   /* parallel engine workers, 0 resolved */
+
+/* Detection with the configured engine: 0 if there is no deadlock. The
+   SCC engines (auto without pools, scc, parallel, sharded, small) return
+   the number of deadlocked sets, read back with rag_set_members; the
+   matrix reduction returns the number of stuck processes; DFS and dense
+   return 1 for the first cycle found, read back with rag_cycle. */
+int rag_detect(rag_graph *g);
+int rag_pick_engine(const rag_graph *g);    /* the engine rag_detect runs, auto resolved */
+int rag_last_engine(const rag_graph *g);    /* ... ran last, RAG_ENGINE_AUTO if none */
+int rag_set_count(const rag_graph *g);
+const int *rag_set_members(const rag_graph *g, int set, int *n);
+int rag_deadlocked(const rag_graph *g, int p);      /* set of p, or -1 */
+/* Processes on the last cycle reported (DFS/dense detection, online
+   detection, or the one an RAG_EUNSAFE refusal would have closed) */
+const int *rag_cycle(const rag_graph *g, int *n);
+/* After a matrix reduction: units of r left free once every process that
+   can finish has (a stuck request asks for more); RAG_EINVAL if the last
+   run was another engine */
+int rag_available(const rag_graph *g, int r);
+
+/* Traffic of the last sharded run (NULL before the first) */
+struct rag_shard_stats {
+    int shards;
+    long long cross;        /* cross-shard wait edges */
+    long long entries;      /* entry process records */
+    long long summary;      /* summary edges */
+    long long announced;    /* coordinator -> shard records */
+};
+const struct rag_shard_stats *rag_shard_stats(const rag_graph *g);
+
+/* Preempt victims (their allocations are released; their requests stay)
+   until no wait cycle is left. cost may be NULL for the default weights,
+   fn may be NULL; when fn hears p = -1 the sets being broken are those of
+   rag_set_members. Returns the number of victims. */
+int rag_resolve(rag_graph *g, const struct rag_cost *cost, rag_victim_fn fn, void *arg);
+
+/* Binary snapshots: NULL on success, else the reason */
+const char *rag_save(const rag_graph *g, const char *path);
+const char *rag_load(rag_graph *g, const char *path);
+
+/* Version history. While recording, rag_history_commit stores the graph
+   as a new version, copying only the edges changed since the previous one,
+   and returns its number. A version can be checked out into any graph
+   (g itself included), looked up by time stamp, or searched by bisection
+   for the first one holding a deadlock (involving proc, unless NULL);
+   that leaves the version found in scratch, which must not be g. */
+int rag_set_history(rag_graph *g, int on);                          /* off: drop every version */
+int rag_history_commit(rag_graph *g, double ts, long long tag);     /* ts never goes back */
+int rag_history_count(const rag_graph *g);
+int rag_history_version(const rag_graph *g, int version, double *ts, long long *tag);  /* 0 if none */
+size_t rag_history_bytes(const rag_graph *g);                       /* memory held by the versions */
+int rag_history_at(const rag_graph *g, double ts);                  /* last at or before ts, or -1 */
+int rag_history_checkout(const rag_graph *g, int version, rag_graph *out);
+int rag_history_bisect(const rag_graph *g, const char *proc, rag_graph *scratch);   /* or -1 */
+
+/* Lock-order analysis (after the Linux kernel's lockdep). Learns the order
+   in which resources are taken: a process holding h that requests or is
+   granted r establishes h -> r, and the order persists after the locks are
+   released. Taking two resources against the order already learned is a
+   potential deadlock even if no wait cycle ever forms; each such pair is
+   reported once, to fn (may be NULL). Off forgets the order learned, and
+   so does rag_clear or rag_load. */
+int rag_set_lockdep(rag_graph *g, int on, rag_inversion_fn fn, void *arg);
+int rag_lockdep_inversions(const rag_graph *g);     /* found so far */
+/* The order behind the last inversion, from the resource wanted to the one
+   held: each resource was taken while holding the one before it */
+const int *rag_lockdep_path(const rag_graph *g, int *n);
+int rag_lockdep_witness(const rag_graph *g, int a, int b);  /* who first took b holding a, or -1 */
+
+struct rag_lockdep_stats {
+    long long checks;       /* (held, wanted) pairs examined */
+    long long hits;         /* ... already seen before */
+    long long searches;     /* order-window searches */
+    long long inversions;
+    int edges;              /* order edges learned */
+    int resources;          /* resources in the order graph */
+};
+const struct rag_lockdep_stats *rag_lockdep_stats(const rag_graph *g);  /* NULL if off */
+
+/* Metrics: counters and timers of the hot paths (WFG builds, DFS work,
+   detection runs, event ingestion, avoidance checks) on g since
+   rag_create, plus its size. Written as Prometheus text or as one JSON
+   object per line whose ingest_rate covers the time since the previous
+   JSON export of g; that export remembers its sample in g. rag_metric
+   reads one metric by its Prometheus name (timers in nanoseconds, 0 if
+   unknown). */
+void rag_metrics_prometheus(FILE *f, const rag_graph *g);
+void rag_metrics_json(FILE *f, const rag_graph *g);
+unsigned long long rag_metric(const rag_graph *g, const char *name);
+double rag_now_ms(void);    /* the monotonic clock behind the timers and t_ms, in ms */
+
+/* Live monitor: a detector thread that owns g while it runs. Application
+   threads report lock traffic through the handle from any thread at once
+   (each posts to rings of its own, without locking); the detector applies
+   the events in batches, in posting order per thread, as rag_apply would.
+   It runs detection once 'mutations' changes have piled up or period_ms
+   has passed (0: no such trigger) and the graph changed since the last
+   run; fn (may be NULL) hears of a result that differs from the previous
+   one and shows a deadlock, on the detector thread and outside the
+   monitor's lock: it may call rag_monitor_* (not stop or free), but reads
+   of g race with concurrent rag_monitor_process/resource calls. Only the
+   name lookups and start/stop lock. Producers must stop posting before
+   rag_monitor_stop; anything posted later is counted as rejected. */
+typedef struct rag_monitor rag_monitor;
+typedef void (*rag_deadlock_fn)(rag_graph *g, int found, void *arg);
+
+rag_monitor *rag_monitor_start(rag_graph *g, int period_ms, int mutations, rag_deadlock_fn fn, void *arg);
+int rag_monitor_process(rag_monitor *m, const char *name);              /* like rag_process */
+int rag_monitor_resource(rag_monitor *m, const char *name, int units);  /* like rag_resource + rag_set_units */
+void rag_monitor_request(rag_monitor *m, int p, int r, int units);
+void rag_monitor_acquire(rag_monitor *m, int r, int p, int units);
+void rag_monitor_release(rag_monitor *m, int r, int p, int units);
+void rag_monitor_cancel(rag_monitor *m, int p, int r);
+void rag_monitor_flush(rag_monitor *m);     /* wait until posted events are applied or parked */
+void rag_monitor_stop(rag_monitor *m);      /* final drain, then g is the caller's again */
+void rag_monitor_free(rag_monitor *m);      /* stops m if it still runs */
+int rag_monitor_deadlocks(const rag_monitor *m);    /* result of the last detection */
+
+struct rag_monitor_stats {
+    unsigned long long applied;
+    unsigned long long rejected;    /* inconsistent with the graph, or posted after stop */
+    unsigned long long stalls;      /* a producer found its ring full */
+};
+void rag_monitor_stats(const rag_monitor *m, struct rag_monitor_stats *st);
+
+#endif
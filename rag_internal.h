@@ -0,0 +1,417 @@
+/*
+ * rag_internal.h - data layouts of the library
+ *
+ * rag.h is the interface, for embedding programs and for code.c alike;
+ * this header is rag.c's own. Nothing here is stable.
+ */
+#ifndef RAG_INTERNAL_H
+#define RAG_INTERNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>      /* __rdtsc for the metrics timers */
+#endif
+
+#include "rag.h"
+
+#define NAMELEN  RAG_NAME_MAX
+
+/* Auto engine: use the bitset path up to this many processes, and only when
+   the WFG averages at least one wait edge per 64-bit word of a row */
+#define DENSE_MAX_PROC RAG_DENSE_MAX
+/* ... and the word-per-row kernel up to this many (one 64-bit row each) */
+#define SMALL_MAX_PROC RAG_SMALL_MAX
+
+/* ---- Growable adjacency lists ----
+   Every node keeps its own edge vector, so memory scales with the number of
+   edges rather than with (processes x resources).
+   cap == 0 with n > 0 means the edges are borrowed from a mapped snapshot:
+   they may be edited in place (the mapping is private) and are copied to
+   the heap the first time the list has to grow.
+*/
+typedef struct {
+    int *v;     /* neighbour indices */
+    int n;      /* number of edges in use */
+    int cap;    /* allocated slots */
+} edge_list;
+
+/* Counted adjacency: like edge_list, but each edge carries a multiplicity.
+   Used for wait edges (number of resources supporting p -> p2), requests
+   (units of r wanted by p) and holdings (units of r held by p).
+   The edge exists while cnt > 0. */
+typedef struct {
+    int *v;     /* targets */
+    int *cnt;   /* multiplicity per target */
+    int n;
+    int cap;
+} count_list;
+
+/* ---- Edge vector pool ----
+   A graph's adjacency vectors come from its own size classes (4, 8, ...
+   POOL_MAX_INTS ints) carved out of large slabs. Growing a list moves it to
+   the next class and pushes the old block on its class free list, so lock
+   churn keeps recycling the same blocks instead of going through malloc
+   and free. pool_free drops every slab at once; only vectors longer than
+   the largest class live on the heap and are freed one by one.
+*/
+#define POOL_MIN_INTS   4
+#define POOL_CLASSES    11      /* 4 .. 4096 ints */
+#define POOL_MAX_INTS   (POOL_MIN_INTS << (POOL_CLASSES - 1))
+#define POOL_SLAB_BYTES ((size_t)256 * 1024)
+#define POOL_SLAB_HDR   16      /* slab link, keeps blocks 16-byte aligned */
+
+struct int_pool {
+    void *free_list[POOL_CLASSES];  /* a free block's first word links the next */
+    char *slab;                     /* newest slab; its first word links the older one */
+    size_t slab_used;
+};
+
+/* ---- Bit-packed dense representation ----
+   One bit per (p, r) / (r, p) / (p, p2) pair, in rows of 64-bit words.
+   Rebuilt from the adjacency lists for each dense detection run.
+*/
+struct dense_wfg {
+    int n_proc;
+    int n_res;
+    int pw;             /* words per row indexed by process */
+    int rw;             /* words per row indexed by resource */
+    size_t cap_words;   /* allocated words in each of req/own/wfg */
+    uint64_t *req;      /* n_proc rows x rw: bit r set if p requests r */
+    uint64_t *own;      /* n_res rows x pw:  bit p set if r is allocated to p */
+    uint64_t *wfg;      /* n_proc rows x pw: bit p2 set if p waits for p2 */
+    uint64_t *unvisited;    /* pw words */
+    uint64_t *on_stack;     /* pw words */
+    int *cursor;        /* per process: next wfg word to scan */
+};
+
+/* ---- Name index ----
+   Open addressing with linear probing; slot holds (node index + 1), 0 is
+   empty. Kept at most half full. Nodes are never deleted individually
+   (only by a full reset), so no tombstones are needed.
+*/
+struct name_index {
+    int *slot;
+    size_t mask;        /* capacity - 1 (capacity is a power of two) */
+    size_t used;
+};
+
+/* ---- Data model ---- */
+struct rag_graph {
+    int n_proc;
+    int n_res;
+    int proc_cap;
+    int res_cap;
+
+    /* Names: interned back to back in one arena, found through the
+       open-addressing indexes below */
+    char *names;
+    size_t names_len;
+    size_t names_cap;   /* 0 while names are borrowed from a snapshot */
+    size_t *p_name;     /* arena offset of each process name */
+    size_t *r_name;     /* arena offset of each resource name */
+    struct name_index p_index;
+    struct name_index r_index;
+
+    /* req[p] lists resources r that Process p requests (P -> R) with the
+       number of units wanted, waiters[r] is the reverse index */
+    count_list *req;
+    edge_list *waiters;
+    /* alloc_[r] lists processes p holding Resource r (R -> P),
+       held[p] is the reverse index with the number of units held */
+    edge_list *alloc_;
+    count_list *held;
+
+    struct int_pool pool;   /* backs all of the adjacency vectors above */
+
+    /* Multi-instance resources: units[r] instances, in_use[r] allocated */
+    int *units;
+    int *in_use;
+    int multi_res;      /* resources with more than one instance */
+
+    /* Wait-For Graph: wfg[p1] lists p2 when p1 waits for p2. Kept current
+       by the edge mutators below; build_wfg only recomputes it from scratch. */
+    count_list *wfg;
+    int *wfg_mark;      /* build_wfg de-duplication stamps */
+    int wfg_stamp;      /* base of the stamps used by the last build_wfg */
+    int *wfg_slot;      /* build_wfg: position of p2 in wfg[p] */
+    edge_list *wfg_in;  /* reverse WFG: wfg_in[p2] lists p waiting for p2 */
+
+    /* Online detection (Pearce-Kelly): ord[] is a topological order of the
+       WFG while topo_valid; node_at[] is its inverse. Once a cycle forms the
+       order is dropped and rebuilt after a wait edge goes away. */
+    int online;
+    int avoid;          /* avoidance mode: see "Deadlock avoidance" */
+    int engine;         /* detection engine (RAG_ENGINE_AUTO: see pick_engine) */
+    int threads;        /* parallel engine workers, 0: one per online CPU */
+    int shards;         /* sharded engine, 0: SHARD_DEFAULT */
+    int scc_full;       /* rag_set_incremental(g, 0): no dirty-region runs */
+    /* Online detection found wait edge x -> y closing a cycle, which is
+       on stack_nodes[0..stack_top] starting at y (see pk_report_cycle) */
+    rag_cycle_fn on_cycle;
+    void *on_cycle_arg;
+    int topo_valid;
+    int topo_retry;     /* a wait edge was removed since the last failed rebuild */
+    int *ord;
+    int *node_at;
+    int *pk_mark;       /* search stamps (== pk_stamp means visited) */
+    int *pk_parent;     /* forward search tree, for cycle reconstruction */
+    int *pk_iter;       /* explicit DFS stack: next edge to scan */
+    int pk_stamp;
+    edge_list pk_fwd;   /* affected region found forward from the edge head */
+    edge_list pk_bwd;   /* affected region found backward from the edge tail */
+    edge_list pk_pool;  /* scratch: DFS stack, then merged order slots */
+
+    /* Reachability index over the acyclic WFG (see "Reachability index") */
+    int reach_valid;
+    int reach_n;        /* processes labelled */
+    int reach_post;     /* post ranks handed out, the same in every label */
+    int reach_churn;    /* wait edges added or removed since the build */
+    size_t reach_cap;
+    int *reach;         /* REACH_K (low, post) pairs per process */
+    edge_list reach_work;
+    uint64_t reach_seed;
+
+    /* DFS scratch, sized with the process count. visited[] and in_stack[]
+       hold dfs_stamp for the current pass, so a new pass clears nothing. */
+    int *visited;
+    int *in_stack;
+    int dfs_stamp;
+    int *stack_nodes;
+    int stack_top;
+    int cycle_at;       /* start of the cycle on stack_nodes (DFS/dense, online, avoidance) */
+    int last_engine;    /* rag_detect: engine of the last run (RAG_ENGINE_AUTO: none) */
+    int last_found;
+    int last_n;         /* processes at the last run */
+    int last_nr;        /* ... and resources */
+    int oom;            /* a rag.h call ran out of memory: refused until rag_clear */
+    struct rag_metrics *met;    /* operation counters, kept across rag_clear */
+    unsigned long dfs_nodes;    /* work of the current pass, for the metrics */
+    unsigned long dfs_edges;
+
+    int wait_edges;     /* number of distinct P -> P wait edges */
+    int req_edges;
+    int alloc_edges;
+
+    /* Victim selection inputs (see "Deadlock resolution") */
+    int *prio;              /* higher: costlier to preempt */
+    unsigned long *born;    /* epoch when the process was added */
+    struct victim_entry *vheap; /* victim_select: its heap ... */
+    int vheap_cap;
+    edge_list vtrim;        /* ... and trim queue */
+    edge_list victims;      /* resolve_deadlocks: the current round's victims */
+
+    /* Change tracking: epoch counts mutations (the age of a victim, and
+       "nothing changed" for scheduled detection) */
+    unsigned long epoch;
+
+    /* Version history, NULL unless recording (see "Version history") */
+    struct rag_history *hist;
+    /* Lock-order analysis, NULL unless on (see "Lock-order analysis");
+       on_inversion hears of each order inversion found */
+    struct rag_lockdep *lockdep;
+    rag_inversion_fn on_inversion;
+    void *on_inversion_arg;
+
+    /* Mapped snapshot backing borrowed edge lists and names, if any */
+    void *map_base;
+    size_t map_len;
+    struct dense_wfg dense;
+
+    /* Iterative Tarjan SCC scratch and result */
+    int *scc_index;     /* DFS discovery index, -1 if unvisited */
+    int *scc_low;       /* lowlink */
+    int *scc_iter;      /* next wfg edge to scan */
+    int *scc_call;      /* explicit call stack */
+    int *scc_comp;      /* deadlocked set id of each process, -1 if none */
+    /* Matrix reduction (multi-instance) scratch */
+    int *bk_work;       /* per resource: available units during reduction */
+    int *bk_start;      /* per resource (+1): waiters sorted by amount, CSR */
+    int *bk_ptr;        /* per resource: first waiter not yet satisfied */
+    int *bk_need;       /* per process: requests not yet satisfiable */
+    int *bk_done;       /* per process: finished (can run to completion) */
+    int *bk_queue;
+    struct bk_waiter { int amt; int p; } *bk_wait;
+    int bk_wait_cap;
+
+    /* Parallel SCC scratch: subproblem colour, FW/BW marks, trim degrees,
+       the process array that tasks partition in place, and the worker
+       pool kept between runs */
+    _Atomic int *par_color;
+    int *par_nodes;
+    struct par_ctx *par;
+    struct shard_ctx *shard;    /* sharded engine scratch, see shard_prepare */
+    unsigned char *par_mark;
+    int *par_in;
+    int *par_out;
+
+    edge_list scc_members;  /* processes of every deadlocked set, grouped */
+    edge_list scc_start;    /* scc_start[i]: offset of set i (plus end sentinel) */
+    int scc_count;
+
+    /* Dirty region since the last full Tarjan pass (valid while scc_base):
+       tails of wait edges added since, and deadlocked sets that lost an
+       internal wait edge. scc_index is all -1 between runs. */
+    int scc_base;
+    unsigned char *dirty_mark;
+    edge_list dirty;
+    edge_list scc_broken;   /* set ids, may repeat */
+    edge_list scc_seen;     /* processes an incremental run visited */
+    edge_list scc_old_members;
+    edge_list scc_old_start;
+};
+
+/* ---- Metrics ----
+   Counters and timers for the hot paths: build_wfg, the DFS engine,
+   detect_run and event ingestion (live monitor and rag_apply). They live
+   on the graph (g->met, allocated by rag_create and kept across
+   rag_clear), and since calls on one graph never overlap, collecting is an
+   unshared add with no atomic read-modify-write (the slots are atomic so
+   that rag_metric may read them while a live monitor writes). Timers
+   count raw ticks (rdtsc on x86, the monotonic clock elsewhere) and are
+   converted to seconds at export time against now_ms.
+
+   Exported by rag_metrics_prometheus and rag_metrics_json (code.c: batch
+   "metrics", "metrics json", "metrics every MS FILE|-", --replay ...
+   --metrics FILE). The JSON exporter keeps its previous sample in g->met.
+*/
+#if defined(__x86_64__) || defined(__i386__)
+#define MET_TICKS_TSC 1
+#endif
+
+enum metric_id {
+    MET_WFG_BUILDS, MET_WFG_TICKS, MET_WFG_EDGES,
+    MET_DFS_RUNS, MET_DFS_TICKS, MET_DFS_NODES, MET_DFS_EDGES, MET_DFS_CYCLES,
+    MET_DETECT_RUNS, MET_DETECT_TICKS, MET_DETECT_FOUND,
+    MET_INGEST_EVENTS, MET_INGEST_REJECTED, MET_INGEST_BATCHES, MET_INGEST_TICKS,
+    MET_QUEUE_DEPTH, MET_QUEUE_MAX,
+    MET_AVOID_CHECKS, MET_AVOID_SEARCHES, MET_REACH_BUILDS,
+    MET_COUNT
+};
+
+enum metric_kind { MK_COUNTER, MK_SECONDS, MK_GAUGE, MK_MAX };
+
+struct rag_metrics {
+    _Atomic uint64_t c[MET_COUNT];  /* written by the thread holding the graph */
+    uint64_t tsc0;      /* ticks ... */
+    double ms0;         /* ... and now_ms at rag_create, for the tick rate */
+    double json_ms;     /* rag_metrics_json: time of the previous export */
+    uint64_t json_events;   /* ... and MET_INGEST_EVENTS then */
+};
+
+struct metric_def {
+    const char *name;
+    int kind;
+    const char *help;
+};
+
+static const struct metric_def metric_defs[MET_COUNT];
+
+static inline uint64_t met_ticks(void) {
+#ifdef MET_TICKS_TSC
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+/* Owner-only update: a relaxed load and store, not a locked add */
+static inline void met_add(const struct rag_graph *g, enum metric_id id, uint64_t d) {
+    _Atomic uint64_t *c = &g->met->c[id];
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + d, memory_order_relaxed);
+}
+
+static inline void met_set(const struct rag_graph *g, enum metric_id id, uint64_t v) {
+    atomic_store_explicit(&g->met->c[id], v, memory_order_relaxed);
+}
+
+static inline void met_max(const struct rag_graph *g, enum metric_id id, uint64_t v) {
+    _Atomic uint64_t *c = &g->met->c[id];
+    if (v > atomic_load_explicit(c, memory_order_relaxed)) atomic_store_explicit(c, v, memory_order_relaxed);
+}
+
+/* Add the ticks since t0 to timer 'id' */
+static inline void met_time(const struct rag_graph *g, enum metric_id id, uint64_t t0) {
+    met_add(g, id, met_ticks() - t0);
+}
+
+/* ---- Sharded SCC engine ---- */
+#define SHARD_DEFAULT RAG_SHARDS_DEFAULT    /* shards when g->shards is 0 */
+
+/* ---- Library internals ----
+   The graph operations behind rag.h, without its checks or the
+   out-of-memory guard. Mutators return 1 if the graph changed, 0 if not.
+   All static: the library exports the rag_* names of rag.h and nothing
+   else, so a host is free to use these names itself. */
+static void *xrealloc(void *ptr, size_t sz);      /* unwinds to the rag.h call, else NULL */
+static void edge_push(edge_list *l, int x);
+static void edge_free(edge_list *l);
+static int count_of(const count_list *l, int v);
+static double now_ms(void);
+static uint64_t rng_next(uint64_t *s);
+static void met_snapshot(const struct rag_graph *g, uint64_t *v);
+
+static const char *pname(const struct rag_graph *g, int p);
+static const char *rname(const struct rag_graph *g, int r);
+static int find_process(const struct rag_graph *g, const char *name);
+static int find_resource(const struct rag_graph *g, const char *name);
+static int graph_add_process(struct rag_graph *g, const char *name);
+static int graph_add_resource(struct rag_graph *g, const char *name);
+static int graph_has_request(const struct rag_graph *g, int p, int r);
+static int graph_has_allocation(const struct rag_graph *g, int r, int p);
+static int graph_add_request_units(struct rag_graph *g, int p, int r, int k);
+static int graph_remove_request(struct rag_graph *g, int p, int r);
+static int graph_add_allocation_units(struct rag_graph *g, int r, int p, int k);
+static int graph_add_allocation(struct rag_graph *g, int r, int p);
+static int graph_remove_allocation(struct rag_graph *g, int r, int p);
+static int graph_release_units(struct rag_graph *g, int r, int p, int k);
+static int graph_set_units(struct rag_graph *g, int r, int n);
+static int graph_assign(struct rag_graph *g, int r, int p);
+static void graph_reset(struct rag_graph *g);
+static void graph_free(struct rag_graph *g);
+
+static void build_wfg(struct rag_graph *g);
+static int find_blocking_resource(const struct rag_graph *g, int p, int p2);
+static int detect_dfs(struct rag_graph *g);
+static int detect_dense(struct rag_graph *g);
+static int scc_detect(struct rag_graph *g);
+static int scc_detect_dirty(struct rag_graph *g);
+static int small_detect(struct rag_graph *g);
+static int par_thread_count(const struct rag_graph *g);
+static int parallel_scc_detect(struct rag_graph *g, int nthreads);
+static int sharded_detect(struct rag_graph *g, int nshards);
+static const struct rag_shard_stats *shard_last_stats(const struct rag_graph *g);
+static int banker_detect(struct rag_graph *g);
+static int pick_engine(const struct rag_graph *g);
+static int detect_run(struct rag_graph *g, int engine);
+
+static int resolve_deadlocks(struct rag_graph *g, const struct rag_cost *pol, rag_victim_fn fn, void *arg,
+                             double *cost);
+static int topo_rebuild(struct rag_graph *g);
+static int set_online_detection(struct rag_graph *g, int on);
+static int avoid_request_unsafe(struct rag_graph *g, int p, int r);
+static int avoid_grant_unsafe(struct rag_graph *g, int r, int p);
+static int set_avoidance(struct rag_graph *g, int on);
+static double graph_edge_span(const struct rag_graph *g);
+static void graph_renumber(struct rag_graph *g);
+static const char *snapshot_save(const struct rag_graph *g, const char *path);
+static const char *snapshot_load(struct rag_graph *g, const char *path);
+static void lockdep_enable(struct rag_graph *g, int on);
+static const struct rag_lockdep_stats *lockdep_stats(const struct rag_graph *g);  /* NULL if off */
+static const int *lockdep_path(const struct rag_graph *g, int *n);
+static int lockdep_witness(const struct rag_graph *g, int a, int b);
+
+static void history_enable(struct rag_graph *g, int on);
+static int history_commit(struct rag_graph *g, double ts, long long tag);
+static int history_count(const struct rag_graph *g);
+static int history_version(const struct rag_graph *g, int v, double *ts, long long *tag);
+static int history_at(const struct rag_graph *g, double ts);
+static size_t history_bytes(const struct rag_graph *g);
+static int history_checkout(const struct rag_graph *g, int v, struct rag_graph *out);
+static int history_bisect(const struct rag_graph *g, int lo, int hi, const char *proc, struct rag_graph *scratch);
+
+#endif